@@ -1,18 +1,50 @@
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <sstream>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <atomic>
+#include <functional>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <new>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SFML/Graphics.hpp>
+#include <SFML/Network.hpp>
 #include <SFML/System/Time.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/weak_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
-#include <boost/range/join.hpp>
 #include <boost/algorithm/algorithm.hpp>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NODERUSH_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NODERUSH_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
-inline int round(double x) {
+//Rounds halves up; not std::round(), which rounds them away from zero
+inline int roundToInt(double x) {
 	return floor(x + 0.5);
 }
 
@@ -29,26 +61,36 @@ const int BUILDINGTYPE_GENERATOR = 2;
 const int BUILDINGTYPE_MINER = 3;
 const int BUILDINGTYPE_ENERGYCANNON = 4;
 
+const int NEXUS_WIDTH = 3; // Grid cells
 const int NEXUS_MAXHEALTH = 2000;
 const int NEXUS_MASSCOST = 100000;
 const float NEXUS_BUILD_MASSDRAW = 10;
 const float NEXUS_BUILD_ENERGYDRAW = 20;
 const float NEXUS_ENERGY_PROVIDED = 20;
 
+const int NODE_WIDTH = 1;
 const int NODE_MAXHEALTH = 150;
 const float NODE_MASSCOST = 2000;
 const float NODE_BUILD_MASSDRAW = 10;
 const float NODE_BUILD_ENERGYDRAW = 3;
 
+const int GENERATOR_WIDTH = 2;
 const int GENERATOR_MAXHEALTH = 500;
 const int GENERATOR_MASSCOST = 10000;
 const float GENERATOR_BUILD_MASSDRAW = 10;
 const float GENERATOR_BUILD_ENERGYDRAW = 10;
 const float GENERATOR_ENERGY_PROVIDED = 10;
 
+const int MINER_WIDTH = 2;
+const int MINER_MAXHEALTH = 300;
+const int MINER_MASSCOST = 2000;
+const float MINER_BUILD_MASSDRAW = 10;
+const float MINER_BUILD_ENERGYDRAW = 5;
+const float MINER_ENERGYDRAW = 2; // Only while it has a mass pile to mine
 const float MINER_RANGE = 200;
 const float MINER_MINE_RATE = 1;
 
+const int ENERGYCANNON_WIDTH = 2;
 const int ENERGYCANNON_MAXHEALTH = 800;
 const float ENERGYCANNON_MASSCOST = 4000;
 const float ENERGYCANNON_BUILD_MASSDRAW = 10;
@@ -63,12 +105,319 @@ const int ENERGYBULLET_DAMAGE = 50;
 
 const int NODE_CONNECTION_MAXLENGTH = 300;
 
+const unsigned short SHARD_DEFAULT_PORT = 28700;
+const int SHARD_WORLD_WIDTH = 320; // Grid cells across the sharded benchmark world
+const int SHARD_WORLD_HEIGHT = 80;
+const int SHARD_BUILDINGS = 3000;
+const int SHARD_TICKS = 600;
+const int SHARD_GHOST_WIDTH = (ENERGYCANNON_ATTACKRANGE > NODE_CONNECTION_MAXLENGTH) ? ENERGYCANNON_ATTACKRANGE : NODE_CONNECTION_MAXLENGTH; // Furthest anything interacts across a region border
+
+const int FRAMEARENA_INITIAL_SIZE = 64 * 1024; // Bytes in a thread's first frame arena block
+
+const int MEMTAG_OTHER = 0; // Subsystems heap memory is charged to
+const int MEMTAG_BUILDINGS = 1;
+const int MEMTAG_NODEGRAPH = 2;
+const int MEMTAG_NETWORKS = 3;
+const int MEMTAG_MOBS = 4;
+const int MEMTAG_MASSPILES = 5;
+const int MEMTAG_RENDERING = 6;
+const int MEMTAG_TEMPORARIES = 7;
+const int MEMTAG_COUNT = 8;
+const int MEMORY_STATS_THREADS = 64; // Threads that get allocation counters of their own; any more share one set
+
+const int TELEMETRY_BLOCK_TICKS = 4096; // Ticks per block of a telemetry file; each column's values for them are contiguous
+const int TELEMETRY_MAP_ALIGNMENT = 64 * 1024; // The header and blocks start at multiples of this, the coarsest alignment a mapping's offset may need (Windows')
+const int TELEMETRY_NAME_LENGTH = 48;
+const int TELEMETRY_STAGED_TICKS = 64; // Ticks staged as rows in memory before they're written out to the columns; divides TELEMETRY_BLOCK_TICKS
+const int TELEMETRY_BATCHES = 8; // Batches of staged ticks; the simulation waits if the writer falls this far behind
+
+const int TICKPHASE_BUILDINGS = 0; // The parts of go() a profiled tick's time is broken down into
+const int TICKPHASE_NETWORKS = 1;
+const int TICKPHASE_MOBS = 2;
+const int TICKPHASE_BULLETS = 3;
+const int TICKPHASE_MASSPILES = 4;
+const int TICKPHASE_CLEANUP = 5;
+const int TICKPHASE_COUNT = 6;
+
+const int WATCHDOG_RECENT_TICKS = 120; // Ticks whose timings go in a slow tick's bundle
+const int WATCHDOG_MAX_BUNDLES = 8; // Bundles written in one run, so a slow stretch doesn't flood the disk
+const int WATCHDOG_REPLAY_RUNS = 20; // Times a replayed slow tick is run, each from a fresh copy of the world before it
+const int WATCHDOG_CHECKPOINT_TICKS = 600; // Ticks between the copies of the world that slow ticks are replayed from
+const int WATCHDOG_MAX_COMMANDS = 10000; // Commands kept since the last checkpoint before the next is taken early
+const int SAVEDWORLD_MAX_COUNT = 100000000; // Longest list a saved world is read with, so a corrupt count fails instead of allocating
+
+const int CHUNK_CELLS = 64; // Width in grid cells of the chunks the world is split into
+const int CHUNK_ACTIVE_RANGE = (ENERGYCANNON_ATTACKRANGE > NODE_CONNECTION_MAXLENGTH) ? ENERGYCANNON_ATTACKRANGE : NODE_CONNECTION_MAXLENGTH; // Chunks this close to a building are active; further than MINER_RANGE too
+
+const unsigned int DISTANCESCORE_UNREACHABLE = 0xFFFFFFFF; // Not connected to a nexus
+const int DISTANCESCORE_RESCORE_DIVISOR = 8; // Removals affecting more than 1/this of a network's graph re-score it all with a BFS
+
+const int WAKETICK_NEVER = 0x7FFFFFFF; // Asleep until an event wakes it
+
+const int ECONOMY_IDLE_TICK_INTERVAL = 10; // Ticks between economy steps of a network where nothing is changing
+const int CONSTRUCTION_MAX_ACTIVE_BUILDS = 4; // Buildings a network builds at once unless told otherwise; the rest wait their turn
+
+const unsigned short LOCKSTEP_DEFAULT_PORT = 28500;
+const int LOCKSTEP_INPUT_DELAY = 4; // Ticks between issuing a command and every peer running it
+const int LOCKSTEP_HASH_HISTORY = 256; // Ticks of local state hashes kept for comparing with peers'
+const float LOCKSTEP_TIMEOUT_SECONDS = 10; // Time spent waiting on a peer's commands before the match is ended
+
+const unsigned short SPECTATOR_DEFAULT_PORT = 28600;
+const int SPECTATOR_SEND_INTERVAL = 3; // Ticks between snapshots sent to each spectator
+const int SPECTATOR_HISTORY = 32; // Unacknowledged snapshots kept per spectator before it gets a full one
+const int SPECTATOR_CELL_WIDTH = 256; // Size of the cells entities are bucketed into for view culling
+const float SPECTATOR_PAN_SPEED = 10; // Pixels per frame while an arrow key is held
+
+const float HASH_FIXED_POINT_SCALE = 1024; // Steps per unit that floats are rounded to before hashing
+const int CHECK_TICKS = 600; // Default length of a divergence check
+
+const int MICROBENCH_WARMUP_SAMPLES = 2; // Samples of each microbenchmark thrown away before timing
+const int MICROBENCH_MIN_SAMPLES = 5;
+const int MICROBENCH_MAX_SAMPLES = 31; // Samples kept of each microbenchmark, time allowing
+const double MICROBENCH_SAMPLE_MILLISECONDS = 5; // Repeatable operations are repeated in a sample until it takes about this long
+const double MICROBENCH_CASE_MILLISECONDS = 2000; // Sampling stops after this once there are MICROBENCH_MIN_SAMPLES
+
+const int BOT_THINK_INTERVAL = 30; // Ticks between a bot's decisions
+const int BOT_MAX_UNBUILT = 3; // Unfinished buildings a bot waits on before placing more
+const int BOT_CANNONS_PER_BORDER = 3; // Cannons a bot puts in range of the enemy building nearest its network
+const int BOT_PLACEMENT_ATTEMPTS = 8; // Spots tried round the one a bot wants before it gives up
+const float BOT_EXPANSION_DISTANCE = NODE_CONNECTION_MAXLENGTH * 0.8f; // How far a new node is from the one it extends
+const float BOT_MASS_SEARCH_RANGE = NODE_CONNECTION_MAXLENGTH * 4; // How far from its network a bot looks for mass piles
+const float BOT_STARTING_MASS = 200000;
+const float BOT_MASS_PILE_SPACING = 0.3f; // Least distance between mass piles in a headless world, as a fraction of the spacing between bases
+const float BOT_MASS_PILE_MASS = 20000;
+const int HEADLESS_DEFAULT_BOTS = 8;
+const int HEADLESS_DEFAULT_TICKS = 18000; // Five minutes of play
+const int HEADLESS_DEFAULT_SPACING = 60; // Grid cells between bots' bases; smaller is denser
+const int HEADLESS_REPORT_INTERVAL = 600; // Ticks between progress lines
+
+const int MAP_DEFAULT_WIDTH = 120; // Grid cells; a 1920x1080 screen
+const int MAP_DEFAULT_HEIGHT = 67;
+const float MAP_MASSPILE_SPACING = 12; // Least distance between mass piles, in grid cells
+const float MAP_MASSPILE_MASS = 1000;
+const int MAP_CHUNK_CELLS = 32; // Width in spacing cells of the chunks the map generator fills in parallel
+const int MAP_PLACEMENT_ATTEMPTS = 8; // Random spots tried for a mass pile in each spacing cell
+const float MAP_START_PILE_DISTANCE = 9; // Grid cells from a nexus site to each of the mass piles every site gets
+const int MAP_START_PILES = 4; // Mass piles round each nexus site
+
 float getMagnitude(sf::Vector2f v) {
 	return sqrt((v.x*v.x) + (v.y*v.y));
 }
 float getMagnitude(sf::Vector2i v) {
 	return getMagnitude(sf::Vector2f(v));
 }
+float getMagnitudeSquared(sf::Vector2f v) {
+	return (v.x*v.x) + (v.y*v.y);
+}
+
+//FNV-1a, for hashing simulation state
+const unsigned int HASH_SEED = 2166136261u;
+unsigned int hashBytes(unsigned int hash, const void *data, int size) {
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (int i=0; i<size; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+template <class T>
+unsigned int hashValue(unsigned int hash, T value) {
+	return hashBytes(hash, &value, sizeof(value));
+}
+//Floats are hashed in fixed point, so differences too small to matter (from summing in another order,
+//say) don't count as divergence
+unsigned int hashFixedPoint(unsigned int hash, float value) {
+	return hashValue(hash, (long long)floor(value * HASH_FIXED_POINT_SCALE + 0.5f));
+}
+
+//Batch kernels over structure-of-arrays positions. Each has an AVX2 or SSE2 body, picked at compile
+//time, and a scalar loop that handles the leftover elements (or everything, without SIMD). Distances
+//are compared squared, so there's no sqrt.
+
+inline int countTrailingZeros(unsigned int mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+//Writes the indices of the points closer to pos than range into indices (which needs room for count)
+//and returns how many there are
+int findPointsWithinRange(const float *xs, const float *ys, int count, sf::Vector2f pos, float range, int *indices) {
+	float rangeSquared = range*range;
+	int found = 0;
+	int i = 0;
+#if defined(NODERUSH_AVX2)
+	__m256 posX = _mm256_set1_ps(pos.x), posY = _mm256_set1_ps(pos.y), maxDistance = _mm256_set1_ps(rangeSquared);
+	for (; i+8 <= count; i+=8) {
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs+i), posX);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys+i), posY);
+		__m256 distance = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+		unsigned int mask = _mm256_movemask_ps(_mm256_cmp_ps(distance, maxDistance, _CMP_LT_OQ));
+		while (mask) {
+			indices[found++] = i + countTrailingZeros(mask);
+			mask &= mask-1;
+		}
+	}
+#elif defined(NODERUSH_SSE2)
+	__m128 posX = _mm_set1_ps(pos.x), posY = _mm_set1_ps(pos.y), maxDistance = _mm_set1_ps(rangeSquared);
+	for (; i+4 <= count; i+=4) {
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(xs+i), posX);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(ys+i), posY);
+		__m128 distance = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+		unsigned int mask = _mm_movemask_ps(_mm_cmplt_ps(distance, maxDistance));
+		while (mask) {
+			indices[found++] = i + countTrailingZeros(mask);
+			mask &= mask-1;
+		}
+	}
+#endif
+	for (; i<count; i++) {
+		float dx = xs[i] - pos.x;
+		float dy = ys[i] - pos.y;
+		if (dx*dx + dy*dy < rangeSquared)
+			indices[found++] = i;
+	}
+	return found;
+}
+
+//Index of the point closest to pos within range (or exactly at range, if inclusive), skipping points
+//whose owner is excludedOwner if owners is given. Ties go to the lowest index. -1 if there's none.
+int findNearestPointWithinRange(const float *xs, const float *ys, const int *owners, int excludedOwner, int count, sf::Vector2f pos, float range, bool inclusive) {
+	float rangeSquared = range*range;
+	float bestDistance = 0;
+	int bestIndex = -1;
+	int i = 0;
+#if defined(NODERUSH_AVX2) || defined(NODERUSH_SSE2)
+	float laneDistances[8];
+	int laneIndices[8];
+	int lanes;
+#endif
+#if defined(NODERUSH_AVX2)
+	lanes = 8;
+	__m256 posX = _mm256_set1_ps(pos.x), posY = _mm256_set1_ps(pos.y), maxDistance = _mm256_set1_ps(rangeSquared);
+	__m256 best = _mm256_set1_ps(HUGE_VALF);
+	__m256i bestIndices = _mm256_set1_epi32(-1);
+	__m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i excluded = _mm256_set1_epi32(excludedOwner);
+	for (; i+8 <= count; i+=8) {
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs+i), posX);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys+i), posY);
+		__m256 distance = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+		__m256 candidate = inclusive ? _mm256_cmp_ps(distance, maxDistance, _CMP_LE_OQ) : _mm256_cmp_ps(distance, maxDistance, _CMP_LT_OQ);
+		if (owners) {
+			__m256 sameOwner = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(owners+i)), excluded));
+			candidate = _mm256_andnot_ps(sameOwner, candidate);
+		}
+		__m256 better = _mm256_and_ps(candidate, _mm256_cmp_ps(distance, best, _CMP_LT_OQ));
+		best = _mm256_blendv_ps(best, distance, better);
+		bestIndices = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndices), _mm256_castsi256_ps(_mm256_add_epi32(laneIndex, _mm256_set1_epi32(i))), better));
+	}
+	_mm256_storeu_ps(laneDistances, best);
+	_mm256_storeu_si256((__m256i*)laneIndices, bestIndices);
+#elif defined(NODERUSH_SSE2)
+	lanes = 4;
+	__m128 posX = _mm_set1_ps(pos.x), posY = _mm_set1_ps(pos.y), maxDistance = _mm_set1_ps(rangeSquared);
+	__m128 best = _mm_set1_ps(HUGE_VALF);
+	__m128i bestIndices = _mm_set1_epi32(-1);
+	__m128i laneIndex = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i excluded = _mm_set1_epi32(excludedOwner);
+	for (; i+4 <= count; i+=4) {
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(xs+i), posX);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(ys+i), posY);
+		__m128 distance = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+		__m128 candidate = inclusive ? _mm_cmple_ps(distance, maxDistance) : _mm_cmplt_ps(distance, maxDistance);
+		if (owners) {
+			__m128 sameOwner = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(owners+i)), excluded));
+			candidate = _mm_andnot_ps(sameOwner, candidate);
+		}
+		__m128 better = _mm_and_ps(candidate, _mm_cmplt_ps(distance, best));
+		best = _mm_or_ps(_mm_and_ps(better, distance), _mm_andnot_ps(better, best));
+		__m128i indices = _mm_add_epi32(laneIndex, _mm_set1_epi32(i));
+		__m128i betterMask = _mm_castps_si128(better);
+		bestIndices = _mm_or_si128(_mm_and_si128(betterMask, indices), _mm_andnot_si128(betterMask, bestIndices));
+	}
+	_mm_storeu_ps(laneDistances, best);
+	_mm_storeu_si128((__m128i*)laneIndices, bestIndices);
+#endif
+#if defined(NODERUSH_AVX2) || defined(NODERUSH_SSE2)
+	for (int lane=0; lane<lanes; lane++) {
+		if (laneIndices[lane] < 0)
+			continue;
+		if (bestIndex < 0 || laneDistances[lane] < bestDistance || (laneDistances[lane] == bestDistance && laneIndices[lane] < bestIndex)) {
+			bestDistance = laneDistances[lane];
+			bestIndex = laneIndices[lane];
+		}
+	}
+#endif
+	for (; i<count; i++) {
+		if (owners && owners[i] == excludedOwner)
+			continue;
+		float dx = xs[i] - pos.x;
+		float dy = ys[i] - pos.y;
+		float distance = dx*dx + dy*dy;
+		if (inclusive ? (distance > rangeSquared) : (distance >= rangeSquared))
+			continue;
+		if (bestIndex < 0 || distance < bestDistance) {
+			bestDistance = distance;
+			bestIndex = i;
+		}
+	}
+	return bestIndex;
+}
+
+//For each point, writes the index of the first box strictly containing it whose owner isn't the
+//point's owner to hits (-1 if none)
+void findFirstBoxesContainingPoints(const float *pointXs, const float *pointYs, const int *pointOwners, int pointCount,
+									const float *lefts, const float *tops, const float *rights, const float *bottoms, const int *boxOwners, int boxCount,
+									int *hits) {
+	for (int p=0; p<pointCount; p++) {
+		float x = pointXs[p];
+		float y = pointYs[p];
+		int hit = -1;
+		int i = 0;
+#if defined(NODERUSH_AVX2)
+		__m256 pointX = _mm256_set1_ps(x), pointY = _mm256_set1_ps(y);
+		__m256i owner = _mm256_set1_epi32(pointOwners[p]);
+		for (; i+8 <= boxCount; i+=8) {
+			__m256 inside = _mm256_and_ps(
+				_mm256_and_ps(_mm256_cmp_ps(pointX, _mm256_loadu_ps(lefts+i), _CMP_GT_OQ), _mm256_cmp_ps(pointX, _mm256_loadu_ps(rights+i), _CMP_LT_OQ)),
+				_mm256_and_ps(_mm256_cmp_ps(pointY, _mm256_loadu_ps(tops+i), _CMP_GT_OQ), _mm256_cmp_ps(pointY, _mm256_loadu_ps(bottoms+i), _CMP_LT_OQ)));
+			__m256 sameOwner = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(boxOwners+i)), owner));
+			unsigned int mask = _mm256_movemask_ps(_mm256_andnot_ps(sameOwner, inside));
+			if (mask) {
+				hit = i + countTrailingZeros(mask);
+				break;
+			}
+		}
+#elif defined(NODERUSH_SSE2)
+		__m128 pointX = _mm_set1_ps(x), pointY = _mm_set1_ps(y);
+		__m128i owner = _mm_set1_epi32(pointOwners[p]);
+		for (; i+4 <= boxCount; i+=4) {
+			__m128 inside = _mm_and_ps(
+				_mm_and_ps(_mm_cmpgt_ps(pointX, _mm_loadu_ps(lefts+i)), _mm_cmplt_ps(pointX, _mm_loadu_ps(rights+i))),
+				_mm_and_ps(_mm_cmpgt_ps(pointY, _mm_loadu_ps(tops+i)), _mm_cmplt_ps(pointY, _mm_loadu_ps(bottoms+i))));
+			__m128 sameOwner = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(boxOwners+i)), owner));
+			unsigned int mask = _mm_movemask_ps(_mm_andnot_ps(sameOwner, inside));
+			if (mask) {
+				hit = i + countTrailingZeros(mask);
+				break;
+			}
+		}
+#endif
+		if (hit < 0) {
+			for (; i<boxCount; i++) {
+				if (boxOwners[i] != pointOwners[p] && x > lefts[i] && x < rights[i] && y > tops[i] && y < bottoms[i]) {
+					hit = i;
+					break;
+				}
+			}
+		}
+		hits[p] = hit;
+	}
+}
 
 sf::Font font;
 
@@ -80,7 +429,7 @@ public:
 	}
 	sf::Vector2i getClosestGridPoint(sf::Vector2f realPos) {
 		sf::Vector2f divided = realPos/(float)cellWidth;
-		return sf::Vector2i(round(divided.x), round(divided.y));
+		return sf::Vector2i(roundToInt(divided.x), roundToInt(divided.y));
 	}
 	sf::Vector2i getClosestGridPoint(sf::Vector2i realPos) {
 		return getClosestGridPoint(sf::Vector2f(realPos));
@@ -88,32 +437,956 @@ public:
 	sf::Vector2f getRealPos(sf::Vector2i gridPoint) {
 		return sf::Vector2f(gridPoint*cellWidth);
 	}
+	int getCellWidth() {
+		return cellWidth;
+	}
 } grid;
 
 sf::Vector2f toDrawPos(sf::Vector2f realPos) {
 	return realPos + sf::Vector2f(0.375,0.375);
 }
 
+//A value shared by copies of whatever holds it until one of them changes it, so forking a world (see forkWorld)
+//only copies the pieces of the map held this way (occupancy tiles, dormant chunks) that are changed afterwards. Until something is stored it's a default T, without
+//allocating one. Only the thread that owns a copy changes it, so nothing can start sharing it while edit() is
+//deciding whether it's shared.
+template <class T>
+class CopyOnWrite {
+	boost::shared_ptr<T> value;
+public:
+	const T &get() const {
+		static const T empty;
+		return value ? *value : empty;
+	}
+	T &edit() {
+		if (!value)
+			value = boost::shared_ptr<T>(new T());
+		else if (value.use_count() > 1)
+			value = boost::shared_ptr<T>(new T(*value));
+		return *value;
+	}
+	void clear() {
+		value.reset();
+	}
+};
+
+//A map from tile or chunk keys (x << 32 | y, as getKey() packs them everywhere) to T, kept in copy-on-write
+//pages of PAGE_WIDTH x PAGE_WIDTH keys. Copying one copies a pointer per page, and a page is only copied
+//when one of the maps sharing it changes something in it.
+template <class T>
+class PagedMap {
+	static const int PAGE_WIDTH = 16;
+	typedef unordered_map<long long, T> Page;
+	unordered_map<long long, CopyOnWrite<Page>> pages;
+	int count;
+
+	static int getPage(int coordinate) {
+		return (coordinate >= 0) ? coordinate / PAGE_WIDTH : (coordinate + 1) / PAGE_WIDTH - 1;
+	}
+	static long long getPageKey(long long key) {
+		return ((long long)getPage((int)(key >> 32)) << 32) | (unsigned int)getPage((int)key);
+	}
+public:
+	PagedMap() {
+		count = 0;
+	}
+	//NULL if there's nothing at key
+	const T *find(long long key) const {
+		typename unordered_map<long long, CopyOnWrite<Page>>::const_iterator page = pages.find(getPageKey(key));
+		if (page == pages.end())
+			return NULL;
+		typename Page::const_iterator it = page->second.get().find(key);
+		return (it == page->second.get().end()) ? NULL : &it->second;
+	}
+	//As find(), but the page is unshared so the value can be changed
+	T *edit(long long key) {
+		if (!find(key))
+			return NULL;
+		return &pages[getPageKey(key)].edit()[key];
+	}
+	//Makes a default T if there's nothing at key
+	T &operator[](long long key) {
+		Page &page = pages[getPageKey(key)].edit();
+		typename Page::iterator it = page.find(key);
+		if (it != page.end())
+			return it->second;
+		count++;
+		return page[key];
+	}
+	int size() const {
+		return count;
+	}
+	void clear() {
+		pages.clear();
+		count = 0;
+	}
+	//Calls f(key, value) for everything in the map, in no particular order
+	template <class Function>
+	void forEach(Function f) const {
+		for (typename unordered_map<long long, CopyOnWrite<Page>>::const_iterator page = pages.begin(); page != pages.end(); page++) {
+			for (typename Page::const_iterator it = page->second.get().begin(); it != page->second.get().end(); it++) {
+				f(it->first, it->second);
+			}
+		}
+	}
+};
+
+class WorldArchive;
+
+//A bit per grid cell, set where there's a building, a ghost or a mass pile. The grid has no edges, so the
+//bits are kept in tiles of TILE_CELLS x TILE_CELLS cells, made as they're needed, with a word per row of a
+//tile: checking a building's footprint takes a mask test per row (two where it crosses a tile edge).
+class OccupancyMap {
+	static const int TILE_CELLS = 64;
+	struct Tile {
+		unsigned long long rows[TILE_CELLS];
+		Tile() {
+			for (int i=0; i<TILE_CELLS; i++) {
+				rows[i] = 0;
+			}
+		}
+	};
+	PagedMap<Tile> tiles;
+
+	static int getTile(int cell) {
+		return (cell >= 0) ? cell / TILE_CELLS : (cell + 1) / TILE_CELLS - 1;
+	}
+	static long long getKey(int tileX, int tileY) {
+		return ((long long)tileX << 32) | (unsigned int)tileY;
+	}
+	//Calls f with the tile key, row within the tile and mask of each run of cells x..x+width-1 of row y that
+	//lies in one tile
+	template <class Function>
+	static void forRuns(int x, int y, int width, Function f) {
+		int tileY = getTile(y);
+		while (width > 0) {
+			int tileX = getTile(x);
+			int offset = x - tileX*TILE_CELLS;
+			int count = min(width, TILE_CELLS - offset);
+			unsigned long long mask = ((count == TILE_CELLS) ? ~0ULL : ((1ULL << count) - 1)) << offset;
+			f(getKey(tileX, tileY), y - tileY*TILE_CELLS, mask);
+			x += count;
+			width -= count;
+		}
+	}
+public:
+	//Whether the width x width cells from gridPoint are all empty
+	bool isFree(sf::Vector2i gridPoint, int width) const {
+		bool fits = true;
+		for (int y=gridPoint.y; y<gridPoint.y+width && fits; y++) {
+			forRuns(gridPoint.x, y, width, [&](long long key, int row, unsigned long long mask) {
+				const Tile *tile = tiles.find(key);
+				if (tile && (tile->rows[row] & mask))
+					fits = false;
+			});
+		}
+		return fits;
+	}
+	void fill(sf::Vector2i gridPoint, int width) {
+		for (int y=gridPoint.y; y<gridPoint.y+width; y++) {
+			forRuns(gridPoint.x, y, width, [this](long long key, int row, unsigned long long mask) {
+				tiles[key].rows[row] |= mask;
+			});
+		}
+	}
+	void empty(sf::Vector2i gridPoint, int width) {
+		for (int y=gridPoint.y; y<gridPoint.y+width; y++) {
+			forRuns(gridPoint.x, y, width, [this](long long key, int row, unsigned long long mask) {
+				if (Tile *tile = tiles.edit(key))
+					tile->rows[row] &= ~mask;
+			});
+		}
+	}
+	void clear() {
+		tiles.clear();
+	}
+	//Copies the tiles overlapping the cells from topLeft to bottomRight (inclusive) into copy
+	void copyRegion(sf::Vector2i topLeft, sf::Vector2i bottomRight, OccupancyMap &copy) const {
+		for (int tileY=getTile(topLeft.y); tileY<=getTile(bottomRight.y); tileY++) {
+			for (int tileX=getTile(topLeft.x); tileX<=getTile(bottomRight.x); tileX++) {
+				if (const Tile *tile = tiles.find(getKey(tileX, tileY)))
+					copy.tiles[getKey(tileX, tileY)] = *tile;
+			}
+		}
+	}
+	void transfer(WorldArchive &archive);
+};
+
+//The points a building can be centred on: the grid points, and the centres of grid cells, as the building's
+//width is even or odd. They're half a grid cell apart, so any two are a whole number of pixels apart. Maps
+//over them keep the points in tiles of TILE_POINTS x TILE_POINTS, made as they're needed.
+struct CentrePoints {
+	static const int TILE_POINTS = 32;
+
+	static int getTile(int point) {
+		return (point >= 0) ? point / TILE_POINTS : (point + 1) / TILE_POINTS - 1;
+	}
+	static long long getKey(int tileX, int tileY) {
+		return ((long long)tileX << 32) | (unsigned int)tileY;
+	}
+	static long long getKey(sf::Vector2i point) {
+		return getKey(getTile(point.x), getTile(point.y));
+	}
+	//Within its tile
+	static int getIndex(sf::Vector2i point) {
+		return (point.y - getTile(point.y)*TILE_POINTS)*TILE_POINTS + point.x - getTile(point.x)*TILE_POINTS;
+	}
+	static int getSpacing() {
+		return grid.getCellWidth() / 2;
+	}
+	static sf::Vector2i getPoint(sf::Vector2f pos) {
+		return sf::Vector2i(roundToInt(pos.x / getSpacing()), roundToInt(pos.y / getSpacing()));
+	}
+	//Gives the same answer as comparing the squared distance between the points' positions in floats
+	static bool isInRange(sf::Vector2i a, sf::Vector2i b, int range) {
+		long long dx = (long long)(a.x - b.x) * getSpacing(), dy = (long long)(a.y - b.y) * getSpacing();
+		return dx*dx + dy*dy < (long long)range*range;
+	}
+	//The furthest a point in range can be from the centre along either axis, in points
+	static int getRangeInPoints(int range) {
+		return (range - 1) / getSpacing();
+	}
+	//The points of one tile within range of a centre
+	struct PointsInTile {
+		sf::Vector2i centre;
+		int range, tileX, tileY, left, top, right, bottom;
+
+		long long getKey() const {
+			return CentrePoints::getKey(tileX, tileY);
+		}
+		//Calls f(index) for each
+		template <class Function>
+		void forEach(Function f) const {
+			for (int y=top; y<=bottom; y++) {
+				for (int x=left; x<=right; x++) {
+					if (isInRange(sf::Vector2i(x, y), centre, range))
+						f((y - tileY*TILE_POINTS)*TILE_POINTS + x - tileX*TILE_POINTS);
+				}
+			}
+		}
+	};
+	//Calls f(points) for each tile with a point within range of centre
+	template <class Function>
+	static void forTilesInRange(sf::Vector2i centre, int range, Function f) {
+		int extent = getRangeInPoints(range);
+		for (int tileY=getTile(centre.y - extent); tileY<=getTile(centre.y + extent); tileY++) {
+			for (int tileX=getTile(centre.x - extent); tileX<=getTile(centre.x + extent); tileX++) {
+				PointsInTile points;
+				points.centre = centre;
+				points.range = range;
+				points.tileX = tileX;
+				points.tileY = tileY;
+				points.top = max(centre.y - extent, tileY*TILE_POINTS);
+				points.bottom = min(centre.y + extent, (tileY+1)*TILE_POINTS - 1);
+				points.left = max(centre.x - extent, tileX*TILE_POINTS);
+				points.right = min(centre.x + extent, (tileX+1)*TILE_POINTS - 1);
+				//The nearest point of the tile's part of the square round the centre must be in range
+				sf::Vector2i nearest(min(max(centre.x, points.left), points.right), min(max(centre.y, points.top), points.bottom));
+				if (isInRange(nearest, centre, range))
+					f(points);
+			}
+		}
+	}
+};
+
+class Building;
+class NodeBaseClass;
+class WorldCopier;
+
+//Which of a player's active nodes are within connection range (NODE_CONNECTION_MAXLENGTH) of each centre
+//point. Each tile has a count per point of the nodes covering it and a list of the nodes that reach into the
+//tile. A node is added when it becomes active and removed when it dies, touching only the points in its
+//range, so whether a spot is powered is one lookup, and which nodes power it only needs the distances to
+//the tile's few nodes.
+class CoverageMap : CentrePoints {
+	struct TileNode {
+		boost::shared_ptr<NodeBaseClass> node;
+		sf::Vector2i point;
+		unsigned int simOrder;
+	};
+	struct Tile {
+		unsigned short counts[TILE_POINTS*TILE_POINTS];
+		vector<TileNode> nodes;
+		Tile() {
+			memset(counts, 0, sizeof(counts));
+		}
+	};
+	unordered_map<long long, Tile> tiles;
+
+	static bool isInRange(sf::Vector2i a, sf::Vector2i b) {
+		return CentrePoints::isInRange(a, b, NODE_CONNECTION_MAXLENGTH);
+	}
+	const Tile *findTile(sf::Vector2i point) const {
+		unordered_map<long long, Tile>::const_iterator tile = tiles.find(getKey(point));
+		return (tile == tiles.end()) ? NULL : &tile->second;
+	}
+	//Adds (change 1) or removes (change -1) a node's coverage
+	void update(const TileNode &tileNode, int change) {
+		forTilesInRange(tileNode.point, NODE_CONNECTION_MAXLENGTH, [&](const PointsInTile &points) {
+			Tile &tile = tiles[points.getKey()];
+			points.forEach([&](int index) {
+				tile.counts[index] += change;
+			});
+			if (change > 0)
+				tile.nodes.push_back(tileNode);
+			for (int i=0; i<tile.nodes.size() && change < 0; i++) {
+				if (tile.nodes[i].node == tileNode.node) {
+					tile.nodes[i] = tile.nodes.back();
+					tile.nodes.pop_back();
+					break;
+				}
+			}
+			if (tile.nodes.empty())
+				tiles.erase(points.getKey());
+		});
+	}
+public:
+	//Whether a building centred at pos would be powered
+	bool isCovered(sf::Vector2f pos) const {
+		sf::Vector2i point = getPoint(pos);
+		const Tile *tile = findTile(point);
+		return tile && tile->counts[getIndex(point)] > 0;
+	}
+	//Appends the nodes that would power a building centred at pos to nodes, in simOrder (the order of the
+	//buildings list)
+	template <class NodeVector>
+	void findCoveringNodes(sf::Vector2f pos, NodeVector &nodes) const {
+		sf::Vector2i point = getPoint(pos);
+		const Tile *tile = findTile(point);
+		if (!tile || tile->counts[getIndex(point)] == 0)
+			return;
+		int first = nodes.size();
+		for (int i=0; i<tile->nodes.size(); i++) {
+			if (isInRange(tile->nodes[i].point, point))
+				nodes.push_back(tile->nodes[i].node);
+		}
+		sort(nodes.begin() + first, nodes.end(), [](const typename NodeVector::value_type &a, const typename NodeVector::value_type &b) {
+			return a->getSimOrder() < b->getSimOrder();
+		});
+	}
+	//For a node that has just become active
+	void add(const boost::shared_ptr<NodeBaseClass> &node);
+	//Does nothing if the node was never added
+	void remove(NodeBaseClass *node, sf::Vector2f pos) {
+		const Tile *tile = findTile(getPoint(pos));
+		for (int i=0; tile && i<tile->nodes.size(); i++) {
+			if (tile->nodes[i].node.get() == node) {
+				TileNode tileNode = tile->nodes[i];
+				update(tileNode, -1);
+				return;
+			}
+		}
+	}
+	void clear() {
+		tiles.clear();
+	}
+	//Copies the counts (but not the nodes) of the tiles overlapping topLeft to bottomRight into copy, which
+	//can then only answer isCovered()
+	void copyRegion(sf::Vector2f topLeft, sf::Vector2f bottomRight, CoverageMap &copy) const {
+		sf::Vector2i topLeftPoint = getPoint(topLeft), bottomRightPoint = getPoint(bottomRight);
+		for (int tileY=getTile(topLeftPoint.y); tileY<=getTile(bottomRightPoint.y); tileY++) {
+			for (int tileX=getTile(topLeftPoint.x); tileX<=getTile(bottomRightPoint.x); tileX++) {
+				unordered_map<long long, Tile>::const_iterator tile = tiles.find(getKey(tileX, tileY));
+				if (tile != tiles.end())
+					memcpy(copy.tiles[tile->first].counts, tile->second.counts, sizeof(tile->second.counts));
+			}
+		}
+	}
+	void remapReferences(WorldCopier &copier);
+	void transfer(WorldArchive &archive);
+};
+
+//Where each player is under enemy cannon fire. For each centre point it counts the active cannons in range
+//and how many of those are charged enough to shoot, once over every cannon and once per owner, so the
+//threat to a player is the whole minus its own: two lookups. Each tile also counts the cannons reaching into
+//it, a coarser summary that lets region queries skip tiles no enemy cannon reaches. Cannons keep it up to
+//date themselves (see AttackerBaseClass::updateThreat), touching only the points in their range.
+class ThreatField : CentrePoints {
+	struct Tile {
+		unsigned short cannons[TILE_POINTS*TILE_POINTS];
+		unsigned short chargedCannons[TILE_POINTS*TILE_POINTS];
+		int reachingCannons, reachingChargedCannons;
+		Tile() {
+			memset(cannons, 0, sizeof(cannons));
+			memset(chargedCannons, 0, sizeof(chargedCannons));
+			reachingCannons = reachingChargedCannons = 0;
+		}
+	};
+	typedef unordered_map<long long, Tile> Layer;
+	Layer all;
+	vector<Layer> owners;//indexed by owner id
+
+	static void update(Layer &layer, sf::Vector2i centre, int range, int cannonChange, int chargedChange) {
+		forTilesInRange(centre, range, [&](const PointsInTile &points) {
+			Tile &tile = layer[points.getKey()];
+			points.forEach([&](int index) {
+				tile.cannons[index] += cannonChange;
+				tile.chargedCannons[index] += chargedChange;
+			});
+			tile.reachingCannons += cannonChange;
+			tile.reachingChargedCannons += chargedChange;
+			if (tile.reachingCannons == 0)
+				layer.erase(points.getKey());
+		});
+	}
+	static const Tile *findTile(const Layer &layer, long long key) {
+		Layer::const_iterator tile = layer.find(key);
+		return (tile == layer.end()) ? NULL : &tile->second;
+	}
+	const Layer *getOwnerLayer(int ownerId) const {
+		return (ownerId >= 0 && ownerId < owners.size()) ? &owners[ownerId] : NULL;
+	}
+	//The enemy cannons (or charged ones) reaching a tile, or covering one of its points if index isn't -1
+	int countEnemies(int playerId, long long key, int index, bool chargedOnly) const {
+		int count = 0;
+		const Layer *own = getOwnerLayer(playerId);
+		const Tile *tiles[2] = {findTile(all, key), own ? findTile(*own, key) : NULL};
+		for (int i=0; i<2; i++) {
+			int tileCount = 0;
+			if (tiles[i] && index < 0)
+				tileCount = chargedOnly ? tiles[i]->reachingChargedCannons : tiles[i]->reachingCannons;
+			else if (tiles[i])
+				tileCount = chargedOnly ? tiles[i]->chargedCannons[index] : tiles[i]->cannons[index];
+			count += (i == 0) ? tileCount : -tileCount;
+		}
+		return count;
+	}
+	static bool layersEqual(const Layer &a, const Layer &b) {
+		if (a.size() != b.size())
+			return false;
+		for (Layer::const_iterator tile = a.begin(); tile != a.end(); tile++) {
+			const Tile *other = findTile(b, tile->first);
+			if (!other || other->reachingCannons != tile->second.reachingCannons || other->reachingChargedCannons != tile->second.reachingChargedCannons ||
+				memcmp(other->cannons, tile->second.cannons, sizeof(other->cannons)) != 0 ||
+				memcmp(other->chargedCannons, tile->second.chargedCannons, sizeof(other->chargedCannons)) != 0)
+				return false;
+		}
+		return true;
+	}
+public:
+	//Adds (1) or removes (-1) a cannon centred at pos, and/or its being charged
+	void update(int ownerId, sf::Vector2f pos, int range, int cannonChange, int chargedChange) {
+		sf::Vector2i centre = getPoint(pos);
+		update(all, centre, range, cannonChange, chargedChange);
+		if (ownerId >= owners.size())
+			owners.resize(ownerId + 1);
+		if (ownerId >= 0)
+			update(owners[ownerId], centre, range, cannonChange, chargedChange);
+	}
+	//How many enemy cannons (or only charged ones) could hit a building of playerId's centred at pos
+	int getThreat(int playerId, sf::Vector2f pos, bool chargedOnly) const {
+		sf::Vector2i point = getPoint(pos);
+		return countEnemies(playerId, getKey(point), getIndex(point), chargedOnly);
+	}
+	//Whether an enemy cannon (or a charged one) could hit a building of playerId's centred anywhere from
+	//topLeft to bottomRight
+	bool isRegionThreatened(int playerId, sf::Vector2f topLeft, sf::Vector2f bottomRight, bool chargedOnly) const {
+		sf::Vector2i topLeftPoint = getPoint(topLeft), bottomRightPoint = getPoint(bottomRight);
+		for (int tileY=getTile(topLeftPoint.y); tileY<=getTile(bottomRightPoint.y); tileY++) {
+			for (int tileX=getTile(topLeftPoint.x); tileX<=getTile(bottomRightPoint.x); tileX++) {
+				long long key = getKey(tileX, tileY);
+				if (countEnemies(playerId, key, -1, chargedOnly) == 0)
+					continue;
+				for (int y=max(topLeftPoint.y, tileY*TILE_POINTS); y<=min(bottomRightPoint.y, (tileY+1)*TILE_POINTS - 1); y++) {
+					for (int x=max(topLeftPoint.x, tileX*TILE_POINTS); x<=min(bottomRightPoint.x, (tileX+1)*TILE_POINTS - 1); x++) {
+						if (countEnemies(playerId, key, getIndex(sf::Vector2i(x, y)), chargedOnly) > 0)
+							return true;
+					}
+				}
+			}
+		}
+		return false;
+	}
+	void clear() {
+		all.clear();
+		owners.clear();
+	}
+	//Recomputes the field from the cannons in buildings, building the layers on up to threadCount threads
+	void rebuild(const vector<boost::shared_ptr<Building>> &buildings, int threadCount);
+	bool operator==(const ThreatField &other) const {
+		int ownerCount = max(owners.size(), other.owners.size());
+		for (int i=0; i<ownerCount; i++) {
+			const Layer *layer = getOwnerLayer(i), *otherLayer = other.getOwnerLayer(i);
+			if (!layersEqual(layer ? *layer : Layer(), otherLayer ? *otherLayer : Layer()))
+				return false;
+		}
+		return layersEqual(all, other.all);
+	}
+};
+
+//One frame's worth of drawing, recorded by the simulation thread and replayed on the render thread, so
+//the renderer never touches the entities. Entities draw into it with the same calls they'd make on a
+//window; consecutive vertex lists of the same (non-strip) primitive type are merged into one draw call.
+class RenderSnapshot {
+	static const int ITEM_VERTICES = 0;
+	static const int ITEM_LABEL = 1;
+	static const int ITEM_CIRCLE = 2;
+	struct Item {
+		int kind;
+		sf::PrimitiveType primitiveType;
+		int first;//into vertices, or the index into labels/circles
+		int count;
+	};
+	struct Label {
+		string text;
+		sf::Vector2f pos;
+		sf::Color color;
+	};
+	struct Circle {
+		sf::Vector2f pos;
+		float radius;
+		sf::Color color;
+	};
+	vector<Item> items;
+	vector<sf::Vertex> vertices;
+	vector<Label> labels;
+	vector<Circle> circles;
+public:
+	string hudText;
+	int tick;
+	OccupancyMap occupancy;//round the view, for showing whether the cursor building fits
+	CoverageMap coverage;//the selected player's round the view, for showing whether it would be powered
+
+	void clear() {
+		items.clear();
+		vertices.clear();
+		labels.clear();
+		circles.clear();
+		hudText.clear();
+		occupancy.clear();
+		coverage.clear();
+	}
+	void draw(const sf::Vertex *newVertices, unsigned int count, sf::PrimitiveType primitiveType) {
+		bool mergeable = (primitiveType == sf::Lines || primitiveType == sf::Triangles || primitiveType == sf::Quads);
+		if (mergeable && items.size() > 0 && items.back().kind == ITEM_VERTICES && items.back().primitiveType == primitiveType) {
+			items.back().count += count;
+		}
+		else {
+			Item item;
+			item.kind = ITEM_VERTICES;
+			item.primitiveType = primitiveType;
+			item.first = vertices.size();
+			item.count = count;
+			items.push_back(item);
+		}
+		vertices.insert(vertices.end(), newVertices, newVertices + count);
+	}
+	void drawLabel(string text, sf::Vector2f pos, sf::Color color) {
+		Item item;
+		item.kind = ITEM_LABEL;
+		item.first = labels.size();
+		items.push_back(item);
+
+		Label label;
+		label.text = text;
+		label.pos = pos;
+		label.color = color;
+		labels.push_back(label);
+	}
+	void drawCircle(sf::Vector2f pos, float radius, sf::Color color) {
+		Item item;
+		item.kind = ITEM_CIRCLE;
+		item.first = circles.size();
+		items.push_back(item);
+
+		Circle circle;
+		circle.pos = pos;
+		circle.radius = radius;
+		circle.color = color;
+		circles.push_back(circle);
+	}
+	void render(sf::RenderWindow *window) {
+		for (int i=0; i<items.size(); i++) {
+			if (items[i].kind == ITEM_VERTICES) {
+				window->draw(&vertices[items[i].first], items[i].count, items[i].primitiveType);
+			}
+			else if (items[i].kind == ITEM_LABEL) {
+				const Label &label = labels[items[i].first];
+				sf::Text text;
+				text.setFont(font);
+				text.setCharacterSize(12);
+				text.setColor(label.color);
+				text.setPosition(label.pos.x, label.pos.y);
+				text.setString(label.text);
+				window->draw(text);
+			}
+			else if (items[i].kind == ITEM_CIRCLE) {
+				const Circle &circle = circles[items[i].first];
+				sf::CircleShape shape(circle.radius);
+				shape.setFillColor(circle.color);
+				shape.setPosition(circle.pos);
+				window->draw(shape);
+			}
+		}
+	}
+};
+
+//Lock-free triple buffer. The writer fills the back buffer and publishes it by swapping it with the
+//middle one; the reader swaps its front buffer with the middle one whenever something new has been
+//published. Neither side ever waits for the other.
+template <class T>
+class TripleBuffer {
+	static const int FRESH = 4;//flag on middle: published since the reader last took it
+	T buffers[3];
+	atomic<int> middle;
+	int back;
+	int front;
+public:
+	TripleBuffer() : middle(1) {
+		back = 0;
+		front = 2;
+	}
+	T &getBack() {
+		return buffers[back];
+	}
+	void publish() {
+		back = middle.exchange(back | FRESH) & ~FRESH;
+	}
+	//Returns true if there was a new buffer to take
+	bool takeLatest() {
+		if (!(middle.load() & FRESH))
+			return false;
+		front = middle.exchange(front) & ~FRESH;
+		return true;
+	}
+	T &getFront() {
+		return buffers[front];
+	}
+};
+
+//Lock-free queue for one producer thread and one consumer thread
+template <class T, int CAPACITY>
+class SpscQueue {
+	T items[CAPACITY];
+	atomic<unsigned int> head;//next to pop, only written by the consumer
+	atomic<unsigned int> tail;//next to push, only written by the producer
+public:
+	SpscQueue() : head(0), tail(0) {}
+	//Returns false (dropping item) if the queue is full
+	bool push(const T &item) {
+		unsigned int currentTail = tail.load(memory_order_relaxed);
+		if (currentTail - head.load(memory_order_acquire) == CAPACITY)
+			return false;
+		items[currentTail % CAPACITY] = item;
+		tail.store(currentTail + 1, memory_order_release);
+		return true;
+	}
+	bool pop(T &item) {
+		unsigned int currentHead = head.load(memory_order_relaxed);
+		if (currentHead == tail.load(memory_order_acquire))
+			return false;
+		item = items[currentHead % CAPACITY];
+		head.store(currentHead + 1, memory_order_release);
+		return true;
+	}
+};
+
+//Memory accounting. Every heap allocation is charged to a subsystem: buildings, mobs, mass piles and
+//networks to their own, through their class operator new, and everything else to the subsystem the
+//allocating thread is working for, set with a MemoryTagScope. Each allocation carries its size and tag in
+//a header, so freeing it credits the same subsystem whichever thread does it.
+//
+//Each thread counts into its own cache line aligned counters, which no other thread writes, so counting
+//takes plain loads and stores; reading the stats sums every thread's. The thread that frees is the one
+//that counts it, so one thread's live bytes can go below zero, but the sums are right. Peaks are of the
+//sums, so they can only be sampled: whenever the stats are read, and at the end of every tick.
+//
+//Replacing the global operator new puts this on every allocation in the program, so it's only done when
+//built with NODERUSH_MEMORY_TAGS; otherwise just the class operator news and the frame arena are counted.
+
+const char *MEMTAG_NAMES[MEMTAG_COUNT] = {"other", "buildings", "node graph", "networks", "mobs", "mass piles", "rendering", "temporaries"};
+
+//One thread's counters, per tag
+struct alignas(64) ThreadMemoryStats {
+	atomic<long long> liveBytes[MEMTAG_COUNT];
+	atomic<long long> liveAllocations[MEMTAG_COUNT];
+	atomic<long long> allocations[MEMTAG_COUNT];//ever
+};
+
+//Merged over the threads
+struct MemoryStats {
+	long long liveBytes;
+	long long peakBytes;
+	long long liveAllocations;
+	long long allocations;
+};
+
+//Zero initialised before any constructor runs, so allocations made during static initialisation count too.
+//The last set is shared by threads past the first MEMORY_STATS_THREADS.
+ThreadMemoryStats memoryStatsByThread[MEMORY_STATS_THREADS+1];
+atomic<int> memoryStatsThreadCount;
+atomic<long long> memoryPeakBytes[MEMTAG_COUNT];
+thread_local ThreadMemoryStats *threadMemoryStats = 0;
+thread_local int currentMemoryTag = MEMTAG_OTHER;
+
+ThreadMemoryStats &getThreadMemoryStats() {
+	if (!threadMemoryStats)
+		threadMemoryStats = &memoryStatsByThread[min(memoryStatsThreadCount.fetch_add(1, memory_order_relaxed), MEMORY_STATS_THREADS)];
+	return *threadMemoryStats;
+}
+
+//Only the shared set needs a read-modify-write
+inline void addToMemoryCounter(ThreadMemoryStats &stats, atomic<long long> &counter, long long amount) {
+	if (&stats == &memoryStatsByThread[MEMORY_STATS_THREADS])
+		counter.fetch_add(amount, memory_order_relaxed);
+	else
+		counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+long long getLiveHeapBytes(int tag) {
+	long long liveBytes = 0;
+	int threads = min(memoryStatsThreadCount.load(memory_order_relaxed), MEMORY_STATS_THREADS+1);
+	for (int i=0; i<threads; i++) {
+		liveBytes += memoryStatsByThread[i].liveBytes[tag].load(memory_order_relaxed);
+	}
+	return liveBytes;
+}
+
+void raiseMemoryPeak(int tag, long long liveBytes) {
+	long long peak = memoryPeakBytes[tag].load(memory_order_relaxed);
+	while (liveBytes > peak && !memoryPeakBytes[tag].compare_exchange_weak(peak, liveBytes, memory_order_relaxed)) {}
+}
+
+//Called once a tick, so the peaks are at least those at tick ends
+void sampleMemoryPeaks() {
+	for (int tag=0; tag<MEMTAG_COUNT; tag++) {
+		raiseMemoryPeak(tag, getLiveHeapBytes(tag));
+	}
+}
+
+MemoryStats getMemoryStats(int tag) {
+	MemoryStats stats = {};
+	int threads = min(memoryStatsThreadCount.load(memory_order_relaxed), MEMORY_STATS_THREADS+1);
+	for (int i=0; i<threads; i++) {
+		stats.liveBytes += memoryStatsByThread[i].liveBytes[tag].load(memory_order_relaxed);
+		stats.liveAllocations += memoryStatsByThread[i].liveAllocations[tag].load(memory_order_relaxed);
+		stats.allocations += memoryStatsByThread[i].allocations[tag].load(memory_order_relaxed);
+	}
+	raiseMemoryPeak(tag, stats.liveBytes);
+	stats.peakBytes = memoryPeakBytes[tag].load(memory_order_relaxed);
+	return stats;
+}
+
+struct AllocationHeader {
+	size_t size;
+	int tag;
+};
+const size_t ALLOCATION_HEADER_SIZE = 16;//a multiple of the alignment malloc gives, so the header doesn't spoil it
+
+void *allocateTagged(size_t size, int tag) {
+	AllocationHeader *header = (AllocationHeader*)malloc(size + ALLOCATION_HEADER_SIZE);
+	if (!header)
+		throw bad_alloc();
+	header->size = size;
+	header->tag = tag;
+
+	ThreadMemoryStats &stats = getThreadMemoryStats();
+	addToMemoryCounter(stats, stats.liveBytes[tag], size);
+	addToMemoryCounter(stats, stats.liveAllocations[tag], 1);
+	addToMemoryCounter(stats, stats.allocations[tag], 1);
+	return (char*)header + ALLOCATION_HEADER_SIZE;
+}
+
+void freeTagged(void *memory) {
+	if (!memory)
+		return;
+	AllocationHeader *header = (AllocationHeader*)((char*)memory - ALLOCATION_HEADER_SIZE);
+	ThreadMemoryStats &stats = getThreadMemoryStats();
+	addToMemoryCounter(stats, stats.liveBytes[header->tag], -(long long)header->size);
+	addToMemoryCounter(stats, stats.liveAllocations[header->tag], -1);
+	free(header);
+}
+
+#ifdef NODERUSH_MEMORY_TAGS
+void *operator new(size_t size) {
+	return allocateTagged(size, currentMemoryTag);
+}
+void *operator new[](size_t size) {
+	return allocateTagged(size, currentMemoryTag);
+}
+void *operator new(size_t size, const nothrow_t&) noexcept {
+	try {
+		return allocateTagged(size, currentMemoryTag);
+	}
+	catch (const bad_alloc&) {
+		return NULL;
+	}
+}
+void *operator new[](size_t size, const nothrow_t&) noexcept {
+	return operator new(size, nothrow);
+}
+void operator delete(void *memory) noexcept {
+	freeTagged(memory);
+}
+void operator delete[](void *memory) noexcept {
+	freeTagged(memory);
+}
+void operator delete(void *memory, const nothrow_t&) noexcept {
+	freeTagged(memory);
+}
+void operator delete[](void *memory, const nothrow_t&) noexcept {
+	freeTagged(memory);
+}
+#endif
+
+//Charges what this thread allocates to a subsystem until the scope ends or set() moves it to another
+class MemoryTagScope {
+	int previousTag;
+	MemoryTagScope(const MemoryTagScope&);
+	MemoryTagScope &operator=(const MemoryTagScope&);
+public:
+	MemoryTagScope(int tag) {
+		previousTag = currentMemoryTag;
+		currentMemoryTag = tag;
+	}
+	~MemoryTagScope() {
+		currentMemoryTag = previousTag;
+	}
+	void set(int tag) {
+		currentMemoryTag = tag;
+	}
+};
+
+//One line per subsystem that has allocated anything
+void describeMemoryUsage(ostream &s) {
+	for (int i=0; i<MEMTAG_COUNT; i++) {
+		MemoryStats stats = getMemoryStats(i);
+		if (stats.allocations == 0)
+			continue;
+		s << MEMTAG_NAMES[i] << ": " << stats.liveBytes/1024 << " KB live, " << stats.peakBytes/1024 << " KB peak, "
+		  << stats.liveAllocations << " allocations live of " << stats.allocations << endl;
+	}
+#ifndef NODERUSH_MEMORY_TAGS
+	s << "(other allocations are only counted when built with NODERUSH_MEMORY_TAGS)" << endl;
+#endif
+}
+
+//Bump allocator for temporaries that don't outlive a tick: reset() at the end of go() hands everything back
+//at once. A tick that needs more than the current block gets more blocks, and the next reset() swaps them
+//all for one block as big as the most ever used, so once a game settles down the arena stops touching the
+//heap. There's one per thread, like the world, so forks simulated in parallel don't share one.
+class FrameArena {
+	static const size_t ALIGNMENT = 16;
+	vector<char*> blocks;
+	vector<size_t> blockSizes;
+	size_t used;//of the last block
+	size_t usedThisTick;//of all blocks
+	size_t highWaterMark;
+	int blockAllocations;
+
+	void addBlock(size_t size) {
+		blocks.push_back((char*)allocateTagged(size, MEMTAG_TEMPORARIES));
+		blockSizes.push_back(size);
+		used = 0;
+		blockAllocations++;
+	}
+	void freeBlocks() {
+		for (int i=0; i<blocks.size(); i++) {
+			freeTagged(blocks[i]);
+		}
+		blocks.clear();
+		blockSizes.clear();
+	}
+	FrameArena(const FrameArena&);
+	FrameArena &operator=(const FrameArena&);
+public:
+	FrameArena() {
+		used = usedThisTick = highWaterMark = 0;
+		blockAllocations = 0;
+	}
+	~FrameArena() {
+		freeBlocks();
+	}
+	void *allocate(size_t size) {
+		size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+		if (blocks.empty() || used + size > blockSizes.back())
+			addBlock(max(size, blocks.empty() ? (size_t)FRAMEARENA_INITIAL_SIZE : 2*blockSizes.back()));
+		void *memory = blocks.back() + used;
+		used += size;
+		usedThisTick += size;
+		highWaterMark = max(highWaterMark, usedThisTick);
+		return memory;
+	}
+	void reset() {
+		if (blocks.size() > 1) {
+			freeBlocks();
+			addBlock(highWaterMark);
+		}
+		used = usedThisTick = 0;
+	}
+	size_t getHighWaterMark() {
+		return highWaterMark;
+	}
+	//Heap allocations the arena has made, ever
+	int getBlockAllocations() {
+		return blockAllocations;
+	}
+};
+
+thread_local FrameArena frameArena;
+
+//Allocator for containers in this thread's frame arena. Freeing does nothing; the memory comes back when
+//the arena is reset.
+template <class T>
+struct FrameAllocator {
+	typedef T value_type;
+	FrameAllocator() {}
+	template <class U>
+	FrameAllocator(const FrameAllocator<U>&) {}
+	T *allocate(size_t count) {
+		return (T*)frameArena.allocate(count * sizeof(T));
+	}
+	void deallocate(T*, size_t) {}
+};
+template <class T, class U>
+bool operator==(const FrameAllocator<T>&, const FrameAllocator<U>&) {return true;}
+template <class T, class U>
+bool operator!=(const FrameAllocator<T>&, const FrameAllocator<U>&) {return false;}
+
+//A vector that must be gone by the end of the tick
+template <class T>
+using FrameVector = vector<T, FrameAllocator<T>>;
+
 struct Resources {
 	float mass;
 	float energy;
 	Resources(float _mass, float _energy) : mass(_mass), energy(_energy) {}
 };
 
+class Building;
+class Mob;
+class MassPile;
+//Deaths are recorded as they happen, and the world's lists compacted at the end of the tick (see Lifecycle)
+void recordDeath(Building *building);
+void recordDeath(Mob *mob);
+void recordDeath(MassPile *massPile);
+
 class MassPile {
 protected:
 	sf::Vector2i gridPoint;
 	bool dead;
 	float mass;
 public:
+	static void *operator new(size_t size) {
+		return allocateTagged(size, MEMTAG_MASSPILES);
+	}
+	static void operator delete(void *memory) {
+		freeTagged(memory);
+	}
 	MassPile(sf::Vector2i _gridPoint, float _mass) {
 		gridPoint = _gridPoint;
 		mass = _mass;
 		dead = false;
 	}
+	sf::Vector2i getGridPoint() {
+		return gridPoint;
+	}
 	sf::Vector2f getPos() {
 		return grid.getRealPos(gridPoint) + sf::Vector2f(0.5, 0.5);
 	}
+	float getMass() {
+		return mass;
+	}
 	float tryDeductMass(float amount) {
 		float deducted;
 		if (mass >= amount) {
@@ -130,28 +1403,52 @@ public:
 	void go() {
 		
 	}
-	void draw(sf::RenderWindow *window) {
+	static void draw(RenderSnapshot *snapshot, sf::Vector2f pos) {
 		sf::Color color(255,255,0);
 		sf::Vertex triangle[] = {
-			sf::Vertex(toDrawPos(getPos() + sf::Vector2f(-6, 6)), color),
-			sf::Vertex(toDrawPos(getPos() + sf::Vector2f(0, -6)), color),
-			sf::Vertex(toDrawPos(getPos() + sf::Vector2f(6, 6)), color)
+			sf::Vertex(toDrawPos(pos + sf::Vector2f(-6, 6)), color),
+			sf::Vertex(toDrawPos(pos + sf::Vector2f(0, -6)), color),
+			sf::Vertex(toDrawPos(pos + sf::Vector2f(6, 6)), color)
 		};
-		window->draw(triangle, 3, sf::Triangles);
+		snapshot->draw(triangle, 3, sf::Triangles);
+	}
+	void draw(RenderSnapshot *snapshot) {
+		draw(snapshot, getPos());
 	}
 	bool isDead() {
 		return dead;
 	}
 	void die() {
+		if (dead)
+			return;
 		dead = true;
+		recordDeath(this);
+	}
+	void transfer(WorldArchive &archive);
+};
+
+//A mass pile in a dormant chunk (see WorldChunks): just what's needed to bring it back
+struct DormantMassPile {
+	sf::Vector2i gridPoint;
+	float mass;
+	DormantMassPile(sf::Vector2i _gridPoint, float _mass) : gridPoint(_gridPoint), mass(_mass) {}
+	sf::Vector2i getGridPoint() const {
+		return gridPoint;
+	}
+	sf::Vector2f getPos() const {
+		return grid.getRealPos(gridPoint) + sf::Vector2f(0.5, 0.5);
 	}
 };
 
-vector<boost::shared_ptr<MassPile>> massPiles;
+//The world state (massPiles, buildings, scheduler, mobs, players, frameNum and the caches built from them)
+//is thread_local, so a forked copy of the world (see forkWorld) can be simulated on another thread
+thread_local vector<boost::shared_ptr<MassPile>> massPiles;
 
 class Player;
 
-class Building {
+void markNetworkChanged(boost::shared_ptr<Player> player);
+
+class Building : public boost::enable_shared_from_this<Building> {
 protected:
 	boost::weak_ptr<Player> owner;
 	float health;
@@ -162,7 +1459,17 @@ protected:
 	bool ghost;
 	bool built;
 	bool dead;
+	int worldIndex;//in buildings, or -1 if it isn't in the world (a ghost or a stand-in)
+	unsigned int simOrder;//buildings run in the order they were added to the world
+	int wakeTick;//next tick the scheduler runs go(), or WAKETICK_NEVER
+	unsigned int streamId;//0 until first sent to a spectator
 public:
+	static void *operator new(size_t size) {
+		return allocateTagged(size, MEMTAG_BUILDINGS);
+	}
+	static void operator delete(void *memory) {
+		freeTagged(memory);
+	}
 	Building(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, int _width, bool _ghost) {
 		owner = _owner;
 		gridPoint = _gridPoint;
@@ -173,6 +1480,10 @@ public:
 		active = false;
 		built = false;
 		dead = false;
+		worldIndex = -1;
+		simOrder = 0;
+		wakeTick = WAKETICK_NEVER;
+		streamId = 0;
 	}
 	void setOwner(boost::weak_ptr<Player> _owner) {
 		owner = _owner;
@@ -180,17 +1491,25 @@ public:
 	boost::shared_ptr<Player> getOwner() {
 		return owner.lock();
 	}
+	int getOwnerId();
 	void magicallyComplete() {
 		massBuilt = getBuildMassTarget();
 		health = getMaxHealth();
 		active = true;
 		built = true;
 	}
+	virtual int getType() {return -1;}//one of the BUILDINGTYPE_ constants
+	//A copy that still refers to the original's owner, target etc. until a WorldCopier remaps them
+	virtual boost::shared_ptr<Building> clone() {return boost::shared_ptr<Building>(new Building(*this));}
 	virtual int getMaxHealth() {return 0;}
 	virtual Resources getBuildResourceDraw() {return Resources(0,0);}
 	virtual int getBuildMassTarget() {return 0;}
 	virtual float getEnergyDraw() {return 0;}
 	virtual float supplyEnergy(float supplyRatio) {return 0;}
+	//Same as calling supplyEnergy() once a tick for ticks ticks, for as long as getTicksUntilEnergyEvent() allows
+	virtual float supplyEnergyOverTicks(float supplyRatio, int ticks) {return supplyEnergy(supplyRatio) * ticks;}
+	//Fully supplied ticks until supplying energy changes what this building does, or WAKETICK_NEVER
+	virtual int getTicksUntilEnergyEvent() {return WAKETICK_NEVER;}
 	Resources build(float buildAmount) {
 		Resources requestedResourceDraw = getBuildResourceDraw();
 		float massBuiltThisFrame = requestedResourceDraw.mass * buildAmount;
@@ -219,6 +1538,15 @@ public:
 	bool isActive() {
 		return active;
 	}
+	float getHealth() {
+		return health;
+	}
+	void setHealth(float _health) {
+		health = _health;
+	}
+	float getMassBuilt() {
+		return massBuilt;
+	}
 	void setMassBuilt(float _massBuilt) {
 		massBuilt = _massBuilt;
 	}
@@ -228,6 +1556,9 @@ public:
 	sf::Vector2i getGridPoint() {
 		return gridPoint;
 	}
+	int getWidth() {
+		return width;
+	}
 	sf::Vector2f getCenterPos() {
 		sf::Vector2i bottomRightGridPoint(gridPoint.x + width, gridPoint.y + width);
 		return grid.getRealPos(gridPoint + bottomRightGridPoint) / 2.f;
@@ -235,41 +1566,82 @@ public:
 	sf::Vector2f getPos() {
 		return getCenterPos();
 	}
+	void getBounds(float *left, float *top, float *right, float *bottom) {
+		*left = getGridPoint().x * GRID_CELL_WIDTH;
+		*top = getGridPoint().y * GRID_CELL_WIDTH;
+		*right = *left + (width * GRID_CELL_WIDTH);
+		*bottom = *top + (width * GRID_CELL_WIDTH);
+	}
 	bool collidesWithPoint(sf::Vector2f point) {
-		float left = getGridPoint().x * GRID_CELL_WIDTH;
-		float top = getGridPoint().y * GRID_CELL_WIDTH;
-		float right = left + (width * GRID_CELL_WIDTH);
-		float bottom = top + (width * GRID_CELL_WIDTH);
+		float left, top, right, bottom;
+		getBounds(&left, &top, &right, &bottom);
 
 		return (point.x > left && point.x < right && point.y > top && point.y < bottom);
 	}
-	virtual void go() {}
-	void takeDamage(int damage) {
-		health -= damage;
-		if (health <= 0)
-			die();
+	//By default a building has nothing to do until something wakes it
+	virtual void go() {
+		sleepUntilWoken();
 	}
-	void drawBackground(sf::RenderWindow *window, sf::Color color) {
-		sf::Vertex backgroundQuad[] = {
-			sf::Vertex(toDrawPos(grid.getRealPos(gridPoint)), color),
-			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x+width, gridPoint.y))), color),
-			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x+width, gridPoint.y+width))), color),
-			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x, gridPoint.y+width))), color)
-		};
-		window->draw(backgroundQuad, 4, sf::Quads);
+	//go() runs again next tick unless it calls one of these
+	void sleepUntil(int tick) {
+		wakeTick = tick;
 	}
-	virtual void drawDesign(sf::RenderWindow *window) {}
-	void drawOutline(sf::RenderWindow *window, sf::Color color) {
-		sf::Vertex outline[] = {
+	void sleepUntilWoken() {
+		wakeTick = WAKETICK_NEVER;
+	}
+	int getWakeTick() {
+		return wakeTick;
+	}
+	void setWakeTick(int _wakeTick) {
+		wakeTick = _wakeTick;
+	}
+	bool isInWorld() {
+		return worldIndex >= 0;
+	}
+	int getWorldIndex() {
+		return worldIndex;
+	}
+	void setWorldIndex(int _worldIndex) {
+		worldIndex = _worldIndex;
+	}
+	unsigned int getSimOrder() {
+		return simOrder;
+	}
+	void setSimOrder(unsigned int _simOrder) {
+		simOrder = _simOrder;
+	}
+	unsigned int getStreamId() {
+		return streamId;
+	}
+	void setStreamId(unsigned int _streamId) {
+		streamId = _streamId;
+	}
+	void takeDamage(int damage) {
+		health -= damage;
+		if (health <= 0)
+			die();
+	}
+	void drawBackground(RenderSnapshot *snapshot, sf::Color color) {
+		sf::Vertex backgroundQuad[] = {
+			sf::Vertex(toDrawPos(grid.getRealPos(gridPoint)), color),
+			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x+width, gridPoint.y))), color),
+			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x+width, gridPoint.y+width))), color),
+			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x, gridPoint.y+width))), color)
+		};
+		snapshot->draw(backgroundQuad, 4, sf::Quads);
+	}
+	virtual void drawDesign(RenderSnapshot *snapshot) {}
+	void drawOutline(RenderSnapshot *snapshot, sf::Color color) {
+		sf::Vertex outline[] = {
 			sf::Vertex(toDrawPos(grid.getRealPos(gridPoint)), color),
 			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x+width, gridPoint.y))), color),
 			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x+width, gridPoint.y+width))), color),
 			sf::Vertex(toDrawPos(grid.getRealPos(sf::Vector2i(gridPoint.x, gridPoint.y+width))), color),
 			sf::Vertex(toDrawPos(grid.getRealPos(gridPoint)), color)
 		};
-		window->draw(outline, 5, sf::LinesStrip);
+		snapshot->draw(outline, 5, sf::LinesStrip);
 	}
-	void drawHealthBar(sf::RenderWindow *window) {
+	void drawHealthBar(RenderSnapshot *snapshot) {
 		float healthFraction = health / getMaxHealth();
 		sf::Color color;
 		if (healthFraction > 0.7) {
@@ -286,43 +1658,616 @@ public:
 			sf::Vertex(toDrawPos(grid.getRealPos(gridPoint) + sf::Vector2f(width*healthFraction*GRID_CELL_WIDTH, 4)), color),
 			sf::Vertex(toDrawPos(grid.getRealPos(gridPoint) + sf::Vector2f(1, 4)), color)
 		};
-		window->draw(healthBar, 4, sf::Quads);
+		snapshot->draw(healthBar, 4, sf::Quads);
 	}
-	void draw(sf::RenderWindow *window, sf::Color outlineColor) {
+	void draw(RenderSnapshot *snapshot, sf::Color outlineColor) {
 		if (!isGhost()) {
-			drawBackground(window, sf::Color(50,50,50));
+			drawBackground(snapshot, sf::Color(50,50,50));
 		}
-		drawOutline(window, outlineColor);
-		drawDesign(window); // defined in daughter classes
-		drawHealthBar(window);
+		drawOutline(snapshot, outlineColor);
+		drawDesign(snapshot); // defined in daughter classes
+		drawHealthBar(snapshot);
 	}
-	void draw(sf::RenderWindow *window) {
-		draw(window, sf::Color(150,150,255));
+	void draw(RenderSnapshot *snapshot) {
+		draw(snapshot, sf::Color(150,150,255));
 	}
-	void drawGhost(sf::RenderWindow *window) {
-		draw(window, sf::Color(150,150,150,255));
+	void drawGhost(RenderSnapshot *snapshot) {
+		draw(snapshot, sf::Color(150,150,150,255));
 	}
 	void die() {
+		if (dead)
+			return;
 		dead = true;
+		recordDeath(this);
 	}
 	bool isDead() {
 		return dead;
 	}
+	virtual void transfer(WorldArchive &archive);
 };
 
-vector<boost::shared_ptr<Building>> buildings;
-boost::shared_ptr<Building> cursorBuilding;
+thread_local vector<boost::shared_ptr<Building>> buildings;
+
+//The shortcuts the simulation takes to avoid work, which can be turned off so the divergence checker can
+//compare a run with them against one without
+struct SimulationShortcuts {
+	bool sleepingBuildings;//otherwise every building runs every tick
+	bool idleEconomy;//otherwise networks step their economy every tick
+	SimulationShortcuts() {
+		sleepingBuildings = true;
+		idleEconomy = true;
+	}
+};
+
+thread_local SimulationShortcuts simulationShortcuts;
+
+//Where each player is under enemy cannon fire
+thread_local ThreatField threatField;
+
+//Hierarchical timer wheel of building wake-ups. Level 0 has a slot per tick for the next 256 ticks,
+//level 1 a slot per 256 ticks for the next 64 of those, level 2 a slot per 16384 ticks for the next 64 of
+//those, and anything later waits in an overflow list. When a level wraps round, the matching slot of the
+//level above is cascaded down. An entry is stale (and dropped) if its building's wakeTick has changed.
+class TimerWheel {
+	struct Entry {
+		boost::weak_ptr<Building> building;
+		int tick;
+	};
+	static const int LEVEL0_SLOTS = 256;
+	static const int LEVEL_SLOTS = 64;
+	static const int LEVEL1_SHIFT = 8;
+	static const int LEVEL2_SHIFT = 14;
+	static const int WHEEL_SPAN = 1 << 20;
+
+	vector<Entry> level0[LEVEL0_SLOTS];
+	vector<Entry> level1[LEVEL_SLOTS];
+	vector<Entry> level2[LEVEL_SLOTS];
+	vector<Entry> overflow;
+	vector<Entry> cascading;
+	int currentTick;
+
+	void insert(const Entry &entry) {
+		int delta = entry.tick - currentTick;
+		if (delta < LEVEL0_SLOTS)
+			level0[entry.tick & (LEVEL0_SLOTS-1)].push_back(entry);
+		else if (delta < (LEVEL_SLOTS << LEVEL1_SHIFT))
+			level1[(entry.tick >> LEVEL1_SHIFT) & (LEVEL_SLOTS-1)].push_back(entry);
+		else if (delta < WHEEL_SPAN)
+			level2[(entry.tick >> LEVEL2_SHIFT) & (LEVEL_SLOTS-1)].push_back(entry);
+		else
+			overflow.push_back(entry);
+	}
+	void cascade(vector<Entry> &slot) {
+		cascading.swap(slot);
+		for (int i=0; i<cascading.size(); i++) {
+			insert(cascading[i]);
+		}
+		cascading.clear();
+	}
+public:
+	TimerWheel() {
+		currentTick = 0;
+	}
+	//tick must not be before the tick last passed to expire()
+	void schedule(boost::shared_ptr<Building> building, int tick) {
+		Entry entry;
+		entry.building = building;
+		entry.tick = max(tick, currentTick);
+		insert(entry);
+	}
+	//Moves the wheel on to tick (one tick after the last call) and appends the buildings due then
+	void expire(int tick, vector<boost::shared_ptr<Building>> &due) {
+		currentTick = tick;
+		if ((tick & (LEVEL0_SLOTS-1)) == 0) {
+			if ((tick & ((1 << LEVEL2_SHIFT)-1)) == 0) {
+				cascade(overflow);
+				cascade(level2[(tick >> LEVEL2_SHIFT) & (LEVEL_SLOTS-1)]);
+			}
+			cascade(level1[(tick >> LEVEL1_SHIFT) & (LEVEL_SLOTS-1)]);
+		}
+		vector<Entry> &slot = level0[tick & (LEVEL0_SLOTS-1)];
+		for (int i=0; i<slot.size(); i++) {
+			boost::shared_ptr<Building> building = slot[i].building.lock();
+			if (building && building->getWakeTick() == slot[i].tick)
+				due.push_back(building);
+		}
+		slot.clear();
+	}
+	//Point every entry at the WorldCopier's copy of its building
+	void remapReferences(WorldCopier &copier);
+	void transfer(WorldArchive &archive);
+};
+
+//Decides which buildings' go() runs each tick. A building runs on the tick after its last go() unless
+//that go() put it to sleep, either until a given tick or until an event (an enemy building appearing
+//in range, its weapon finishing charging, a mass pile appearing in range) wakes it.
+class Scheduler {
+	struct Waiter {
+		boost::weak_ptr<Building> building;
+		sf::Vector2f pos;
+		float range;
+	};
+
+	TimerWheel wheel;
+	int tick;
+	bool buildingsStarted;
+	unsigned int nextSimOrder;
+	vector<boost::shared_ptr<Building>> dueBuildings;
+	vector<Waiter> enemyWaiters;
+	vector<Waiter> massPileWaiters;
+
+	void addWaiter(vector<Waiter> &waiters, boost::shared_ptr<Building> building, float range) {
+		Waiter waiter;
+		waiter.building = building;
+		waiter.pos = building->getPos();
+		waiter.range = range;
+		waiters.push_back(waiter);
+	}
+	//Wakes waiters within range of pos, skipping those owned by ignoredOwner if it's given
+	void wakeWaiters(vector<Waiter> &waiters, sf::Vector2f pos, Player *ignoredOwner) {
+		for (int i=0; i<waiters.size(); i++) {
+			boost::shared_ptr<Building> building = waiters[i].building.lock();
+			if (building && !building->isDead()) {
+				if (ignoredOwner && building->getOwner().get() == ignoredOwner)
+					continue;
+				if (getMagnitude(waiters[i].pos - pos) >= waiters[i].range)
+					continue;
+				wake(building);
+			}
+			waiters[i] = waiters.back();
+			waiters.pop_back();
+			i--;
+		}
+	}
+public:
+	Scheduler() {
+		tick = 0;
+		buildingsStarted = false;
+		nextSimOrder = 0;
+	}
+	int getTick() {
+		return tick;
+	}
+	unsigned int takeSimOrder() {
+		return nextSimOrder++;
+	}
+	//The soonest tick a building can be run: this one if buildings haven't been run yet
+	int getNextRunnableTick() {
+		return buildingsStarted ? tick+1 : tick;
+	}
+	void wakeAt(boost::shared_ptr<Building> building, int wakeTick) {
+		wakeTick = max(wakeTick, getNextRunnableTick());
+		if (building->getWakeTick() <= wakeTick && building->getWakeTick() >= getNextRunnableTick())
+			return;//already due by then
+		building->setWakeTick(wakeTick);
+		wheel.schedule(building, wakeTick);
+	}
+	void wake(boost::shared_ptr<Building> building) {
+		wakeAt(building, getNextRunnableTick());
+	}
+	//Nothing needs waking if every building runs every tick anyway
+	void waitForEnemyInRange(boost::shared_ptr<Building> building, float range) {
+		if (simulationShortcuts.sleepingBuildings)
+			addWaiter(enemyWaiters, building, range);
+	}
+	void waitForMassPile(boost::shared_ptr<Building> building, float range) {
+		if (simulationShortcuts.sleepingBuildings)
+			addWaiter(massPileWaiters, building, range);
+	}
+	void notifyBuildingAdded(boost::shared_ptr<Building> building) {
+		//Only charged cannons wait for enemies, so none can be in range where no charged enemy cannon reaches
+		if (threatField.getThreat(building->getOwnerId(), building->getPos(), true) == 0)
+			return;
+		wakeWaiters(enemyWaiters, building->getPos(), building->getOwner().get());
+	}
+	void notifyMassPileAdded(sf::Vector2f pos) {
+		wakeWaiters(massPileWaiters, pos, NULL);
+	}
+	//Runs go() on every building due this tick, in the order they were added to the world
+	void runBuildings() {
+		buildingsStarted = true;
+		dueBuildings.clear();
+		wheel.expire(tick, dueBuildings);
+		if (!simulationShortcuts.sleepingBuildings)
+			dueBuildings.assign(buildings.begin(), buildings.end());
+		sort(dueBuildings.begin(), dueBuildings.end(),
+			 [](const boost::shared_ptr<Building> &a, const boost::shared_ptr<Building> &b) {return a->getSimOrder() < b->getSimOrder(); });
+		dueBuildings.erase(unique(dueBuildings.begin(), dueBuildings.end()), dueBuildings.end());
+
+		for (int i=0; i<dueBuildings.size(); i++) {
+			if (dueBuildings[i]->isDead())
+				continue;
+			dueBuildings[i]->sleepUntil(tick+1);
+			dueBuildings[i]->go();
+			if (dueBuildings[i]->getWakeTick() != WAKETICK_NEVER) {
+				dueBuildings[i]->setWakeTick(max(dueBuildings[i]->getWakeTick(), tick+1));
+				wheel.schedule(dueBuildings[i], dueBuildings[i]->getWakeTick());
+			}
+		}
+	}
+	int getBuildingsRunLastTick() {
+		return dueBuildings.size();
+	}
+	void endTick() {
+		tick++;
+		buildingsStarted = false;
+	}
+	void remapReferences(WorldCopier &copier);
+	void transfer(WorldArchive &archive);
+};
+
+thread_local Scheduler scheduler;
+
+//Bumped whenever buildings or massPiles gains or loses an entry
+thread_local int buildingsVersion = 0;
+thread_local int massPilesVersion = 0;
+
+//The world is split into chunks of CHUNK_CELLS x CHUNK_CELLS grid cells. A chunk is active while some
+//building is within CHUNK_ACTIVE_RANGE of it, which covers anything that could mine its piles, connect to
+//or shoot at what's in it. Only active chunks' mass piles are in massPiles, where they're simulated and
+//the miners and batch kernels find them; a dormant chunk keeps its piles as DormantMassPile records, and is
+//woken as soon as a building is added in range. Buildings (and so the mobs they fire) only ever sit in
+//active chunks, so a tick costs as much as the active regions, however big the map is. Chunks are only
+//created once something is in or near them.
+class WorldChunks {
+	struct Chunk {
+		int buildingsInRange;
+		bool dormant;
+		CopyOnWrite<vector<DormantMassPile>> massPiles;//empty while active
+		Chunk() {
+			buildingsInRange = 0;
+			dormant = true;
+		}
+	};
+	PagedMap<Chunk> chunks;
+	vector<long long> emptied;//chunks left with no building in range this tick
+	int activeChunkCount;
+	int dormantMassPileCount;
+
+	static long long getKey(int chunkX, int chunkY) {
+		return ((long long)chunkX << 32) | (unsigned int)chunkY;
+	}
+	static int getChunk(int gridCoordinate) {
+		return (int)floor((float)gridCoordinate / CHUNK_CELLS);
+	}
+	static long long getKey(sf::Vector2i gridPoint) {
+		return getKey(getChunk(gridPoint.x), getChunk(gridPoint.y));
+	}
+	//Calls f on every chunk within CHUNK_ACTIVE_RANGE of pos, creating them as needed
+	template <class Function>
+	void forChunksInRange(sf::Vector2f pos, Function f) {
+		float chunkWidth = CHUNK_CELLS * GRID_CELL_WIDTH;
+		for (int chunkY = floor((pos.y - CHUNK_ACTIVE_RANGE) / chunkWidth); chunkY <= floor((pos.y + CHUNK_ACTIVE_RANGE) / chunkWidth); chunkY++) {
+			for (int chunkX = floor((pos.x - CHUNK_ACTIVE_RANGE) / chunkWidth); chunkX <= floor((pos.x + CHUNK_ACTIVE_RANGE) / chunkWidth); chunkX++) {
+				//from pos to the closest point of the chunk
+				float dx = max(0.f, max(chunkX*chunkWidth - pos.x, pos.x - (chunkX+1)*chunkWidth));
+				float dy = max(0.f, max(chunkY*chunkWidth - pos.y, pos.y - (chunkY+1)*chunkWidth));
+				if (dx*dx + dy*dy <= CHUNK_ACTIVE_RANGE*CHUNK_ACTIVE_RANGE)
+					f(getKey(chunkX, chunkY), chunks[getKey(chunkX, chunkY)]);
+			}
+		}
+	}
+	void wake(Chunk &chunk) {
+		MemoryTagScope tag(MEMTAG_MASSPILES);
+		chunk.dormant = false;
+		activeChunkCount++;
+		const vector<DormantMassPile> &dormantMassPiles = chunk.massPiles.get();
+		dormantMassPileCount -= dormantMassPiles.size();
+		for (int i=0; i<dormantMassPiles.size(); i++) {
+			boost::shared_ptr<MassPile> massPile(new MassPile(dormantMassPiles[i].gridPoint, dormantMassPiles[i].mass));
+			massPiles.push_back(massPile);
+			scheduler.notifyMassPileAdded(massPile->getPos());
+		}
+		if (dormantMassPiles.size() > 0)
+			massPilesVersion++;
+		chunk.massPiles.clear();
+	}
+public:
+	WorldChunks() {
+		activeChunkCount = 0;
+		dormantMassPileCount = 0;
+	}
+	bool isActive(sf::Vector2i gridPoint) {
+		const Chunk *chunk = chunks.find(getKey(gridPoint));
+		return chunk && !chunk->dormant;
+	}
+	void addDormantMassPile(const DormantMassPile &massPile) {
+		chunks[getKey(massPile.gridPoint)].massPiles.edit().push_back(massPile);
+		dormantMassPileCount++;
+	}
+	//Every building in the buildings list keeps the chunks in range of it active
+	void addBuilding(Building *building) {
+		forChunksInRange(building->getCenterPos(), [this](long long key, Chunk &chunk) {
+			chunk.buildingsInRange++;
+			if (chunk.dormant)
+				wake(chunk);
+		});
+	}
+	void removeBuilding(Building *building) {
+		forChunksInRange(building->getCenterPos(), [this](long long key, Chunk &chunk) {
+			chunk.buildingsInRange--;
+			if (chunk.buildingsInRange == 0)
+				emptied.push_back(key);
+		});
+	}
+	//At the end of a tick, puts the chunks that no longer have a building in range to sleep
+	void sleepEmptied() {
+		MemoryTagScope tag(MEMTAG_MASSPILES);
+		bool slept = false;
+		for (int i=0; i<emptied.size(); i++) {
+			Chunk &chunk = chunks[emptied[i]];
+			if (chunk.buildingsInRange == 0 && !chunk.dormant) {
+				chunk.dormant = true;
+				activeChunkCount--;
+				slept = true;
+			}
+		}
+		emptied.clear();
+		if (!slept)
+			return;
+
+		int kept = 0;
+		for (int i=0; i<massPiles.size(); i++) {
+			Chunk &chunk = chunks[getKey(massPiles[i]->getGridPoint())];
+			if (chunk.dormant) {
+				chunk.massPiles.edit().push_back(DormantMassPile(massPiles[i]->getGridPoint(), massPiles[i]->getMass()));
+				dormantMassPileCount++;
+			}
+			else {
+				massPiles[kept++] = massPiles[i];
+			}
+		}
+		if (kept != massPiles.size()) {
+			massPiles.resize(kept);
+			massPilesVersion++;
+		}
+	}
+	//Adds the dormant mass piles in chunks overlapping the rectangle (in pixels) to found, in a fixed order.
+	//Only reads, so chunks shared with a fork stay shared.
+	void findDormantMassPiles(float left, float top, float right, float bottom, vector<const DormantMassPile*> &found) const {
+		float chunkWidth = CHUNK_CELLS * GRID_CELL_WIDTH;
+		for (int chunkY = floor(top / chunkWidth); chunkY <= floor(bottom / chunkWidth); chunkY++) {
+			for (int chunkX = floor(left / chunkWidth); chunkX <= floor(right / chunkWidth); chunkX++) {
+				const Chunk *chunk = chunks.find(getKey(chunkX, chunkY));
+				if (!chunk)
+					continue;
+				const vector<DormantMassPile> &dormantMassPiles = chunk->massPiles.get();
+				for (int i=0; i<dormantMassPiles.size(); i++) {
+					found.push_back(&dormantMassPiles[i]);
+				}
+			}
+		}
+	}
+	//Only the chunks overlapping the rectangle (in pixels) are looked at, however big the map is
+	void drawDormantMassPiles(RenderSnapshot *snapshot, float left, float top, float right, float bottom) const {
+		vector<const DormantMassPile*> found;
+		findDormantMassPiles(left, top, right, bottom, found);
+		for (int i=0; i<found.size(); i++) {
+			MassPile::draw(snapshot, found[i]->getPos());
+		}
+	}
+	int getChunkCount() {
+		return chunks.size();
+	}
+	int getActiveChunkCount() {
+		return activeChunkCount;
+	}
+	int getDormantMassPileCount() {
+		return dormantMassPileCount;
+	}
+	void transfer(WorldArchive &archive);
+};
+
+thread_local WorldChunks worldChunks;
+
+//Where buildings, ghosts and mass piles (dormant or not) are. A ghost's cells stay filled when it becomes
+//a building, until it dies.
+thread_local OccupancyMap occupancy;
+
+//Keeps threatField up to date if building is a cannon
+void updateThreat(Building *building);
+
+//Structure-of-arrays copies of the buildings list (in the same order) for the batch kernels. Buildings
+//don't move, so it only changes with the list: adding and removing buildings keep it in step, and it's
+//only rebuilt after anything else changes the list (a world swap, say).
+struct BuildingArrays {
+	vector<float> xs, ys;//centres
+	vector<float> lefts, tops, rights, bottoms;
+	vector<int> owners;
+	int version;
+	BuildingArrays() {
+		version = -1;
+	}
+	void set(int i, Building *building) {
+		sf::Vector2f center = building->getCenterPos();
+		xs[i] = center.x;
+		ys[i] = center.y;
+		building->getBounds(&lefts[i], &tops[i], &rights[i], &bottoms[i]);
+		owners[i] = building->getOwnerId();
+	}
+	void resize(int size) {
+		xs.resize(size);
+		ys.resize(size);
+		lefts.resize(size);
+		tops.resize(size);
+		rights.resize(size);
+		bottoms.resize(size);
+		owners.resize(size);
+	}
+	//Moves the last entry into i and drops the last, as the buildings list does
+	void moveLastTo(int i) {
+		int last = xs.size() - 1;
+		xs[i] = xs[last];
+		ys[i] = ys[last];
+		lefts[i] = lefts[last];
+		tops[i] = tops[last];
+		rights[i] = rights[last];
+		bottoms[i] = bottoms[last];
+		owners[i] = owners[last];
+		resize(last);
+	}
+};
+
+thread_local BuildingArrays buildingArrays;
+
+BuildingArrays &getBuildingArrays() {
+	if (buildingArrays.version != buildingsVersion) {
+		buildingArrays.resize(buildings.size());
+		for (int i=0; i<buildings.size(); i++) {
+			buildingArrays.set(i, buildings[i].get());
+		}
+		buildingArrays.version = buildingsVersion;
+	}
+	return buildingArrays;
+}
+
+
+//Add a building to the world so it is simulated (unless it's a stand-in that mustn't be), and wake anything
+//waiting for it
+void addBuilding(boost::shared_ptr<Building> building, bool simulated = true) {
+	MemoryTagScope tag(MEMTAG_BUILDINGS);
+	building->setSimOrder(scheduler.takeSimOrder());
+	bool arraysCurrent = (buildingArrays.version == buildingsVersion);
+	building->setWorldIndex(buildings.size());
+	buildings.push_back(building);
+	buildingsVersion++;
+	if (arraysCurrent) {
+		buildingArrays.resize(buildings.size());
+		buildingArrays.set(buildings.size() - 1, building.get());
+		buildingArrays.version = buildingsVersion;
+	}
+	worldChunks.addBuilding(building.get());
+	occupancy.fill(building->getGridPoint(), building->getWidth());
+	updateThreat(building.get());//if it was added already complete
+	if (simulated)
+		scheduler.wake(building);
+	scheduler.notifyBuildingAdded(building);
+}
+
+//Mass piles in dormant chunks are stored there until the chunk wakes
+void addMassPile(boost::shared_ptr<MassPile> massPile) {
+	MemoryTagScope tag(MEMTAG_MASSPILES);
+	occupancy.fill(massPile->getGridPoint(), 1);
+	if (!worldChunks.isActive(massPile->getGridPoint())) {
+		worldChunks.addDormantMassPile(DormantMassPile(massPile->getGridPoint(), massPile->getMass()));
+		return;
+	}
+	massPiles.push_back(massPile);
+	massPilesVersion++;
+	scheduler.notifyMassPileAdded(massPile->getPos());
+}
+
+//Same for massPiles
+struct MassPileArrays {
+	vector<float> xs, ys;
+	int version;
+	MassPileArrays() {
+		version = -1;
+	}
+};
+
+thread_local MassPileArrays massPileArrays;
+
+MassPileArrays &getMassPileArrays() {
+	if (massPileArrays.version != massPilesVersion) {
+		massPileArrays.xs.resize(massPiles.size());
+		massPileArrays.ys.resize(massPiles.size());
+		for (int i=0; i<massPiles.size(); i++) {
+			massPileArrays.xs[i] = massPiles[i]->getPos().x;
+			massPileArrays.ys[i] = massPiles[i]->getPos().y;
+		}
+		massPileArrays.version = massPilesVersion;
+	}
+	return massPileArrays;
+}
+
+//Unordered list of buildings with O(1) membership tests and removal (swap with last, then pop). Their
+//positions are kept alongside as arrays for the batch kernels; buildings don't move.
+template <class BuildingClass>
+class BuildingSetOf {
+	vector<boost::shared_ptr<BuildingClass>> items;
+	unordered_map<BuildingClass*, int> indices;
+	vector<float> xs, ys;
+public:
+	int size() {
+		return items.size();
+	}
+	const float *getXs() {
+		return xs.data();
+	}
+	const float *getYs() {
+		return ys.data();
+	}
+	const boost::shared_ptr<BuildingClass> &operator[](int i) {
+		return items[i];
+	}
+	const vector<boost::shared_ptr<BuildingClass>> *getVector() {
+		return &items;
+	}
+	bool contains(const boost::shared_ptr<BuildingClass> &building) {
+		return indices.count(building.get()) > 0;
+	}
+	void insert(const boost::shared_ptr<BuildingClass> &building) {
+		if (contains(building))
+			return;
+		indices[building.get()] = items.size();
+		items.push_back(building);
+		xs.push_back(building->getPos().x);
+		ys.push_back(building->getPos().y);
+	}
+	//Returns whether it was there
+	bool erase(BuildingClass *building) {
+		typename unordered_map<BuildingClass*, int>::iterator it = indices.find(building);
+		if (it == indices.end())
+			return false;
+		int index = it->second;
+		indices.erase(it);
+		if (index != items.size()-1) {
+			items[index] = items.back();
+			indices[items[index].get()] = index;
+			xs[index] = xs.back();
+			ys[index] = ys.back();
+		}
+		items.pop_back();
+		xs.pop_back();
+		ys.pop_back();
+		return true;
+	}
+	bool erase(const boost::shared_ptr<BuildingClass> &building) {
+		return erase(building.get());
+	}
+	void clear() {
+		items.clear();
+		indices.clear();
+		xs.clear();
+		ys.clear();
+	}
+	void remapReferences(WorldCopier &copier);
+	void transfer(WorldArchive &archive);
+};
+
+typedef BuildingSetOf<Building> BuildingSet;
 
 class Mob {
 protected:
 	sf::Vector2f pos;
 	bool dead;
 	boost::weak_ptr<Player> owner;
+	unsigned int streamId;//0 until first sent to a spectator
+	int worldIndex;//in mobs, or -1 if it isn't in the world
 public:
+	static void *operator new(size_t size) {
+		return allocateTagged(size, MEMTAG_MOBS);
+	}
+	static void operator delete(void *memory) {
+		freeTagged(memory);
+	}
 	Mob(sf::Vector2f _pos) {
 		dead = false;
 		pos = _pos;
 		owner.reset();
+		streamId = 0;
+		worldIndex = -1;
 	}
 	void setOwner(boost::shared_ptr<Player> _owner) {
 		owner = _owner;
@@ -333,17 +2278,46 @@ public:
 	sf::Vector2f getPos() {
 		return pos;
 	}
+	void setPos(sf::Vector2f _pos) {
+		pos = _pos;
+	}
+	unsigned int getStreamId() {
+		return streamId;
+	}
+	void setStreamId(unsigned int _streamId) {
+		streamId = _streamId;
+	}
+	int getWorldIndex() {
+		return worldIndex;
+	}
+	void setWorldIndex(int _worldIndex) {
+		worldIndex = _worldIndex;
+	}
+	virtual boost::shared_ptr<Mob> clone() {return boost::shared_ptr<Mob>(new Mob(*this));}
+	virtual void transfer(WorldArchive &archive);
 	virtual void go() {}
-	virtual void draw(sf::RenderWindow *window) {}
+	virtual void draw(RenderSnapshot *snapshot) {}
 	void die() {
+		if (dead)
+			return;
 		dead = true;
+		if (worldIndex >= 0)
+			recordDeath(this);
 	}
 	bool isDead() {
 		return dead;
 	}
 };
 
-vector<boost::shared_ptr<Mob>> mobs;
+thread_local vector<boost::shared_ptr<Mob>> mobs;
+
+void addMob(boost::shared_ptr<Mob> mob) {
+	mob->setWorldIndex(mobs.size());
+	mobs.push_back(mob);
+}
+
+class EnergyBullet;
+thread_local vector<EnergyBullet*> bulletsToCollide;
 
 class EnergyBullet : public Mob {
 	sf::Vector2f targetPos;
@@ -353,46 +2327,49 @@ public:
 		targetPos = _targetPos;
 		setOwner(_owner);
 	}
+	boost::shared_ptr<Mob> clone() {
+		return boost::shared_ptr<Mob>(new EnergyBullet(*this));
+	}
+	void transfer(WorldArchive &archive);
 	void go() {
 		sf::Vector2f prevPos = pos;
 
 		float currentDistance = getMagnitude(pos - targetPos);
+		if (currentDistance == 0) {//arrived last tick; carrying on would divide by zero
+			die();
+			return;
+		}
 		float distanceToTravel = min(currentDistance, ENERGYBULLET_SPEED);
 		sf::Vector2f unitDirVector = (targetPos - pos) * 1.f/currentDistance;
 		pos += unitDirVector * distanceToTravel;
 
-		for (int i=0; i<buildings.size(); i++) {
-			if (getOwner().get() == buildings[i]->getOwner().get())
-				continue;//No friendly fire!
-
-			if (buildings[i]->collidesWithPoint(pos)) {
-				buildings[i]->takeDamage(ENERGYBULLET_DAMAGE);
-				die();
-				break;
-			}
-		}
+		//Hits are worked out for all bullets at once, after they've all moved (see resolveBulletCollisions)
+		bulletsToCollide.push_back(this);
 
 		if (pos == prevPos)
 			die();
 	}
-	void draw(sf::RenderWindow *window) {
-		sf::CircleShape circle(2);
-		circle.setFillColor(sf::Color(255,0,0));
-		circle.setPosition(toDrawPos(getPos()));
-		window->draw(circle);
+	sf::Vector2f getTargetPos() {
+		return targetPos;
+	}
+	void draw(RenderSnapshot *snapshot) {
+		snapshot->drawCircle(toDrawPos(getPos()), 2, sf::Color(255,0,0));
 	}
 };
 
+//The buildings in set closer to pos than maxRange that are BuildingClasses (and active, if mustBeActive), in
+//set order. The range test runs over the set's position arrays, so only the buildings in range are looked at.
 template <class BuildingClass>
-vector<boost::shared_ptr<BuildingClass>> findNearbyBuildings(vector<boost::shared_ptr<Building>> *buildingVector, sf::Vector2f pos, int maxRange, bool mustBeActive) {
-	vector<boost::shared_ptr<BuildingClass>> nearbyBuildings;
-	for (int i=0; i<buildingVector->size(); i++) {
-		if (mustBeActive && !((*buildingVector)[i]->isActive()))
+FrameVector<boost::shared_ptr<BuildingClass>> findNearbyBuildings(BuildingSet &set, sf::Vector2f pos, int maxRange, bool mustBeActive) {
+	FrameVector<int> inRange(set.size());
+	int inRangeCount = findPointsWithinRange(set.getXs(), set.getYs(), set.size(), pos, maxRange, inRange.data());
+	FrameVector<boost::shared_ptr<BuildingClass>> nearbyBuildings;
+	for (int i=0; i<inRangeCount; i++) {
+		const boost::shared_ptr<Building> &building = set[inRange[i]];
+		if (mustBeActive && !building->isActive())
 			continue;
-		boost::shared_ptr<BuildingClass> specifiedBuilding = boost::dynamic_pointer_cast<BuildingClass, Building>((*buildingVector)[i]);
-		if (getMagnitude((*buildingVector)[i]->getPos() - pos) < maxRange && (specifiedBuilding)) {
+		if (boost::shared_ptr<BuildingClass> specifiedBuilding = boost::dynamic_pointer_cast<BuildingClass, Building>(building))
 			nearbyBuildings.push_back(specifiedBuilding);
-		}
 	}
 	return nearbyBuildings;
 }
@@ -412,13 +2389,16 @@ protected:
 	float massHeld;
 public:
 	Miner(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, bool _ghost)
-		: Building(_owner, _gridPoint, 2, _ghost) {
+		: Building(_owner, _gridPoint, MINER_WIDTH, _ghost) {
 		massHeld = 0;
 	}
+	int getType() {return BUILDINGTYPE_MINER;}
+	boost::shared_ptr<Building> clone() {return boost::shared_ptr<Building>(new Miner(*this));}
+	void transfer(WorldArchive &archive);
 	int getMaxHealth() {return MINER_MAXHEALTH;}
 	Resources getBuildResourceDraw() {return Resources(MINER_BUILD_MASSDRAW, MINER_BUILD_ENERGYDRAW);}
 	int getBuildMassTarget() {return MINER_MASSCOST;}
-	float getEnergyDraw() {return MINER_ENERGYDRAW but not all the time...;}
+	float getEnergyDraw() {return hasLivePile() ? MINER_ENERGYDRAW : 0;}
 	float supplyEnergy(float supplyRatio) {return 0;}
 	void setTarget(boost::shared_ptr<MassPile> newTarget) {
 		targetedMassPile = newTarget;
@@ -426,53 +2406,58 @@ public:
 	boost::shared_ptr<MassPile> getTarget() {
 		return targetedMassPile.lock();
 	}
+	//A dead pile can be kept alive by another world sharing it, so whether its pointer has expired says nothing
+	bool hasLivePile() {
+		boost::shared_ptr<MassPile> massPile = targetedMassPile.lock();
+		return massPile && !massPile->isDead();
+	}
 	void targetClosestMassPile() {
-		boost::shared_ptr<MassPile> closestPile;
-		float closestPileDistance;
-		for (int i=0; i<massPiles.size(); i++) {
-			float distanceToPile = getMagnitude(getPos() - massPiles[i]->getPos());
-			if (distanceToPile > MINER_RANGE) {
-				continue;
-			}
-
-			if ((!closestPile) || distanceToPile < closestPileDistance) {
-				closestPile = massPiles[i];
-				closestPileDistance = distanceToPile;
-			}
-		}
-		if (closestPile)
-			targetedMassPile = closestPile;
+		MassPileArrays &piles = getMassPileArrays();
+		int closestPile = findNearestPointWithinRange(piles.xs.data(), piles.ys.data(), NULL, 0, piles.xs.size(), getPos(), MINER_RANGE, true);
+		if (closestPile >= 0)
+			targetedMassPile = massPiles[closestPile];
 	}
 	void go() {
 		boost::shared_ptr<MassPile> massPile = targetedMassPile.lock();
+		if (massPile && massPile->isDead()) {
+			targetedMassPile.reset();
+			massPile.reset();
+			markNetworkChanged(getOwner());//no longer draws energy
+		}
 		if (!massPile) {
 			targetClosestMassPile();
 			massPile = targetedMassPile.lock();
+			if (massPile)
+				markNetworkChanged(getOwner());//mining draws energy
 		}
 		if (massPile) {
-			if (massPile->isDead()) {
-				targetedMassPile.reset();
-			}
-			else {
+			if (!massPile->isDead())
 				massHeld += massPile->tryDeductMass(MINER_MINE_RATE);
-			}
+		}
+		else {
+			//Nothing to mine until a pile appears in range
+			scheduler.waitForMassPile(shared_from_this(), MINER_RANGE);
+			sleepUntilWoken();
 		}
 	}
+	float getMassHeld() {
+		return massHeld;
+	}
 	float withdrawAllMass() {
 		float toReturn = massHeld;
 		massHeld = 0;
 		return toReturn;
 	}
-	void drawDesign(sf::RenderWindow *window) {
+	void drawDesign(RenderSnapshot *snapshot) {
 		sf::Color color(255,255,0);
 		sf::Vertex triangle[] = {
 			sf::Vertex(toDrawPos(getPos() + sf::Vector2f(-6, 6)), color),
 			sf::Vertex(toDrawPos(getPos() + sf::Vector2f(0, -6)), color),
 			sf::Vertex(toDrawPos(getPos() + sf::Vector2f(6, 6)), color)
 		};
-		window->draw(triangle, 3, sf::LinesStrip);
+		snapshot->draw(triangle, 3, sf::LinesStrip);
 	}
-	void drawTargetLine(sf::RenderWindow *window) {
+	void drawTargetLine(RenderSnapshot *snapshot) {
 		boost::shared_ptr<MassPile> massPile = targetedMassPile.lock();
 		if (!massPile)
 			return;
@@ -481,18 +2466,24 @@ public:
 			sf::Vertex(toDrawPos(getPos()), sf::Color(255,0,0)),
 			sf::Vertex(toDrawPos(massPile->getPos()), sf::Color(255,255,0))
 		};
-		window->draw(line, 2, sf::Lines);
+		snapshot->draw(line, 2, sf::Lines);
 	}
 };
 
 class Generator : public EnergyProviderBaseClass {
 public:
 	Generator(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, bool _ghost)
-		: EnergyProviderBaseClass(_owner, _gridPoint, 2, _ghost),
-		  Building(_owner, _gridPoint, 2, _ghost) {}
+		: EnergyProviderBaseClass(_owner, _gridPoint, GENERATOR_WIDTH, _ghost),
+		  Building(_owner, _gridPoint, GENERATOR_WIDTH, _ghost) {}
 	float getEnergyProvided() {
 		return GENERATOR_ENERGY_PROVIDED;
 	}
+	int getType() {
+		return BUILDINGTYPE_GENERATOR;
+	}
+	boost::shared_ptr<Building> clone() {
+		return boost::shared_ptr<Building>(new Generator(*this));
+	}
 	int getMaxHealth() {
 		return GENERATOR_MAXHEALTH;
 	}
@@ -502,7 +2493,7 @@ public:
 	int getBuildMassTarget() {
 		return GENERATOR_MASSCOST;
 	}
-	void drawDesign(sf::RenderWindow *window) {
+	void drawDesign(RenderSnapshot *snapshot) {
 		sf::Color arrowColor(255,255,0);
 		sf::Vertex upArrow[] = {
 			sf::Vertex(toDrawPos(getCenterPos() + sf::Vector2f(-3, 3)), arrowColor),
@@ -510,7 +2501,7 @@ public:
 			sf::Vertex(toDrawPos(getCenterPos() + sf::Vector2f(3, 3)), arrowColor),
 			sf::Vertex(toDrawPos(getCenterPos() + sf::Vector2f(0, -3)), arrowColor),
 		};
-		window->draw(upArrow, 4, sf::Lines);
+		snapshot->draw(upArrow, 4, sf::Lines);
 	}
 };
 
@@ -519,40 +2510,33 @@ protected:
 	unsigned int distanceScore;
 public:
 	//boost::weak_ptr<Network> network;
-	vector<boost::weak_ptr<Building>> connectedBuildings;
 	NodeBaseClass(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, int _width, bool _ghost)
-		: Building(_owner, _gridPoint, _width, _ghost) {}
+		: Building(_owner, _gridPoint, _width, _ghost) {
+			distanceScore = DISTANCESCORE_UNREACHABLE;
+	}
 	void setDistanceScore(unsigned int _score) {
 		distanceScore = _score;
 	}
 	unsigned int getDistanceScore() {
 		return distanceScore;
 	}
+	void transfer(WorldArchive &archive);
 	virtual void go() {
 		Building::go();
-
-		connectedBuildings.erase(remove_if(connectedBuildings.begin(), connectedBuildings.end(),
-										   [](boost::weak_ptr<Building> b) {return (b.expired() || b.lock()->isDead());}),
-										   connectedBuildings.end());
-	}
-	void drawConnections(sf::RenderWindow *window, sf::Color color) {
-		for (int i=0; i<connectedBuildings.size(); i++) {
-			if (boost::shared_ptr<Building> connectedBuilding = connectedBuildings[i].lock()) {
-				sf::Vertex line[] = {
-					sf::Vertex(toDrawPos(getCenterPos())),
-					sf::Vertex(toDrawPos(connectedBuilding->getCenterPos()))
-				};
-				window->draw(line, 2, sf::Lines);
-			}
-		}
 	}
 };
 
 class Node : public NodeBaseClass {
 public:
 	Node(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, bool _ghost)
-		: NodeBaseClass(_owner, _gridPoint, 1, _ghost),
-		  Building(_owner, _gridPoint, 1, _ghost) {}
+		: NodeBaseClass(_owner, _gridPoint, NODE_WIDTH, _ghost),
+		  Building(_owner, _gridPoint, NODE_WIDTH, _ghost) {}
+	int getType() {
+		return BUILDINGTYPE_NODE;
+	}
+	boost::shared_ptr<Building> clone() {
+		return boost::shared_ptr<Building>(new Node(*this));
+	}
 	int getMaxHealth() {
 		return NODE_MAXHEALTH;
 	}
@@ -565,19 +2549,12 @@ public:
 	virtual void go() {
 		NodeBaseClass::go();
 	}
-	void drawDesign(sf::RenderWindow *window) {
-		if (isActive()) {
-			sf::Text text;
-			text.setFont(font);
-			text.setCharacterSize(12);
-			text.setColor(sf::Color::Yellow);
-			text.setPosition(toDrawPos(getCenterPos()).x, toDrawPos(getCenterPos()).y-30);
-
+	void drawDesign(RenderSnapshot *snapshot) {
+		if (isActive() && getDistanceScore() != DISTANCESCORE_UNREACHABLE) {
 			stringstream s;
 			s << getDistanceScore();
 
-			text.setString(s.str());
-			window->draw(text);
+			snapshot->drawLabel(s.str(), toDrawPos(getCenterPos()) + sf::Vector2f(0, -30), sf::Color::Yellow);
 		}
 	}
 };
@@ -586,10 +2563,28 @@ class AttackerBaseClass : public virtual Building {
 protected:
 	boost::weak_ptr<Building> target;
 	float chargedEnergy;
+	bool inThreatField, chargedInThreatField;//as threatField has us
 public:
 	AttackerBaseClass(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, int _width, bool _ghost)
 		: Building(_owner, _gridPoint, _width, _ghost) {
 			chargedEnergy = 0;
+			inThreatField = chargedInThreatField = false;
+	}
+	//Brings threatField up to date with whether we're active and alive, and whether we're charged. Called
+	//whenever either might have changed.
+	void updateThreat() {
+		bool inField = isActive() && !isDead();
+		bool charged = inField && weaponIsReady();
+		if (inField == inThreatField && charged == chargedInThreatField)
+			return;
+		threatField.update(getOwnerId(), getPos(), getAttackRange(), (int)inField - inThreatField, (int)charged - chargedInThreatField);
+		inThreatField = inField;
+		chargedInThreatField = charged;
+	}
+	//For ThreatField::rebuild(), which has just put us in the field as we are
+	void setInThreatField() {
+		inThreatField = true;
+		chargedInThreatField = weaponIsReady();
 	}
 	void setTarget(boost::weak_ptr<Building> _target) {
 		target = _target;
@@ -597,6 +2592,7 @@ public:
 	boost::shared_ptr<Building> getTarget() {
 		return target.lock();
 	}
+	void transfer(WorldArchive &archive);
 	float getChargedEnergy() {return chargedEnergy;}
 	virtual int getAttackRange() {return 0;}
 	virtual float getMaxRechargeEnergyDraw() {return 0;}
@@ -614,7 +2610,12 @@ public:
 		float availableEnergy = getMaxRechargeEnergyDraw() * supplyRatio;
 		float energyUncharged = getMaxEnergyCharge() - chargedEnergy;
 		float addedEnergy = min(energyUncharged, availableEnergy);
+		bool wasReady = weaponIsReady();
 		chargedEnergy += addedEnergy;
+		if (!wasReady && weaponIsReady()) {
+			scheduler.wake(shared_from_this());
+			updateThreat();
+		}
 		return addedEnergy;
 	}
 	bool weaponIsReady() {
@@ -622,26 +2623,21 @@ public:
 	}
 	void dischargeWeapon() {
 		chargedEnergy -= getWeaponShotEnergyCost();
+		markNetworkChanged(getOwner());//we're drawing energy again
+		updateThreat();
+	}
+	int getRechargeTicksUntilReady() {
+		if (weaponIsReady() || getMaxRechargeEnergyDraw() <= 0)
+			return WAKETICK_NEVER;
+		return ceil((getWeaponShotEnergyCost() - chargedEnergy) / getMaxRechargeEnergyDraw());
 	}
 	bool targetClosestEnemy() {
-		vector<boost::shared_ptr<Building>> nearbyBuildings = findNearbyBuildings<Building>(&buildings, getCenterPos(), getAttackRange(), false);
-
-		float closestTargetDistance;
-		boost::shared_ptr<Building> closestTarget;
-		for (int i=0; i<nearbyBuildings.size(); i++) {
-			//ignore if it's not an enemy building (also filters out the reference to itself that findNearbyBuildings will return
-			if (nearbyBuildings[i]->getOwner().get() == getOwner().get())
-				continue;
-
-			float distance = getMagnitude(this->getCenterPos() - nearbyBuildings[i]->getCenterPos());
-			if (closestTarget.get() == NULL || distance < closestTargetDistance) {
-				closestTarget = nearbyBuildings[i];
-				closestTargetDistance = distance;
-			}
-		}
+		//ignores buildings with our owner (which also filters out ourselves)
+		BuildingArrays &arrays = getBuildingArrays();
+		int closestTarget = findNearestPointWithinRange(arrays.xs.data(), arrays.ys.data(), arrays.owners.data(), getOwnerId(), arrays.xs.size(), getCenterPos(), getAttackRange(), false);
 
-		if (closestTarget.get() != NULL) {
-			target = boost::weak_ptr<Building>(closestTarget);
+		if (closestTarget >= 0) {
+			target = boost::weak_ptr<Building>(buildings[closestTarget]);
 			return true;
 		}
 		else
@@ -652,12 +2648,59 @@ public:
 	}
 };
 
+void updateThreat(Building *building) {
+	if (AttackerBaseClass *attacker = dynamic_cast<AttackerBaseClass*>(building))
+		attacker->updateThreat();
+}
+
+void ThreatField::rebuild(const vector<boost::shared_ptr<Building>> &buildings, int threadCount) {
+	clear();
+	vector<AttackerBaseClass*> cannons;
+	for (int i=0; i<buildings.size(); i++) {
+		AttackerBaseClass *cannon = dynamic_cast<AttackerBaseClass*>(buildings[i].get());
+		if (cannon && cannon->isActive() && !cannon->isDead() && cannon->getOwnerId() >= 0) {
+			cannons.push_back(cannon);
+			if (cannon->getOwnerId() >= owners.size())
+				owners.resize(cannon->getOwnerId() + 1);
+		}
+	}
+	//Each layer is independent, so each is one task: the whole field, then each owner's
+	atomic<int> nextLayer(0);
+	auto buildLayers = [&]() {
+		MemoryTagScope tag(MEMTAG_BUILDINGS);
+		for (int layer = nextLayer++; layer <= (int)owners.size(); layer = nextLayer++) {
+			Layer &target = (layer == 0) ? all : owners[layer - 1];
+			for (int i=0; i<cannons.size(); i++) {
+				if (layer == 0 || cannons[i]->getOwnerId() == layer - 1)
+					update(target, getPoint(cannons[i]->getPos()), cannons[i]->getAttackRange(), 1, cannons[i]->weaponIsReady() ? 1 : 0);
+			}
+		}
+	};
+	vector<thread> threads;
+	for (int i=1; i<min(threadCount, (int)owners.size() + 1); i++) {
+		threads.push_back(thread(buildLayers));
+	}
+	buildLayers();
+	for (int i=0; i<threads.size(); i++) {
+		threads[i].join();
+	}
+	for (int i=0; i<cannons.size(); i++) {
+		cannons[i]->setInThreatField();
+	}
+}
+
 class EnergyCannon : public AttackerBaseClass {
 public:
 	EnergyCannon(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, bool _ghost)
-		: AttackerBaseClass(_owner, _gridPoint, 2, _ghost),
-		  Building(_owner, _gridPoint, 2, _ghost)
+		: AttackerBaseClass(_owner, _gridPoint, ENERGYCANNON_WIDTH, _ghost),
+		  Building(_owner, _gridPoint, ENERGYCANNON_WIDTH, _ghost)
 		{}
+	int getType() {
+		return BUILDINGTYPE_ENERGYCANNON;
+	}
+	boost::shared_ptr<Building> clone() {
+		return boost::shared_ptr<Building>(new EnergyCannon(*this));
+	}
 	int getMaxHealth() {
 		return ENERGYCANNON_MAXHEALTH;
 	}
@@ -673,6 +2716,12 @@ public:
 	float supplyEnergy(float supplyRatio) {
 		return supplyRechargeEnergy(supplyRatio);
 	}
+	float supplyEnergyOverTicks(float supplyRatio, int ticks) {
+		return supplyRechargeEnergy(supplyRatio * ticks);
+	}
+	int getTicksUntilEnergyEvent() {
+		return getRechargeTicksUntilReady();
+	}
 	int getAttackRange() {
 		return ENERGYCANNON_ATTACKRANGE;
 	}
@@ -686,19 +2735,31 @@ public:
 		return ENERGYCANNON_SHOT_ENERGYCOST;
 	}
 	void go() {
+		//Nothing to do until the network has charged us (supplyRechargeEnergy wakes us)
+		if (!weaponIsReady()) {
+			sleepUntilWoken();
+			return;
+		}
+
 		attackerGo();
 
 		//Fire if we have a target
 		if (boost::shared_ptr<Building> targetPtr = target.lock()) {
-			if (weaponIsReady()) {
-				dischargeWeapon();
+			dischargeWeapon();
 
-				sf::Vector2f targetPos = target.lock()->getPos();
-				mobs.push_back(boost::shared_ptr<EnergyBullet>(new EnergyBullet(getPos(), getOwner(), targetPos)));
-			}
+			sf::Vector2f targetPos = target.lock()->getPos();
+			addMob(boost::shared_ptr<EnergyBullet>(new EnergyBullet(getPos(), getOwner(), targetPos)));
+
+			if (!weaponIsReady())
+				sleepUntilWoken();
+		}
+		else {
+			//Charged but nothing to shoot at; sleep until an enemy building turns up in range
+			scheduler.waitForEnemyInRange(shared_from_this(), getAttackRange());
+			sleepUntilWoken();
 		}
 	}
-	void drawDesign(sf::RenderWindow *window) {
+	void drawDesign(RenderSnapshot *snapshot) {
 		if (isActive()) {
 			boost::shared_ptr<Building> possibleTarget = target.lock();
 
@@ -708,19 +2769,12 @@ public:
 					aimer[1] = sf::Vertex(toDrawPos(possibleTarget->getPos()), sf::Color(255,0,0,50));
 				else
 					aimer[1] = sf::Vertex(toDrawPos(getCenterPos() + sf::Vector2f(0, -5)), sf::Color(255,0,0,50));
-			window->draw(aimer, 2, sf::Lines);
-
-			sf::Text text;
-			text.setFont(font);
-			text.setCharacterSize(12);
-			text.setColor(sf::Color::Red);
-			text.setPosition(toDrawPos(getCenterPos()).x, toDrawPos(getCenterPos()).y-30);
+			snapshot->draw(aimer, 2, sf::Lines);
 
 			stringstream s;
 			s << getChargedEnergy();
 
-			text.setString(s.str());
-			window->draw(text);
+			snapshot->drawLabel(s.str(), toDrawPos(getCenterPos()) + sf::Vector2f(0, -30), sf::Color::Red);
 		}
 	}
 };
@@ -730,7 +2784,7 @@ class Nexus : public NodeBaseClass, public EnergyProviderBaseClass {
 	float massStored;
 public:
 	Nexus(boost::weak_ptr<Player> _owner, sf::Vector2i _gridPoint, bool _ghost)
-		: NodeBaseClass(_owner, _gridPoint, 3, _ghost),
+		: NodeBaseClass(_owner, _gridPoint, NEXUS_WIDTH, _ghost),
 		  EnergyProviderBaseClass(_owner, _gridPoint, 3, _ghost),
 		  Building(_owner, _gridPoint, 3, _ghost) {
 			massStored = 0;
@@ -748,6 +2802,13 @@ public:
 		}
 		return false;
 	}
+	int getType() {
+		return BUILDINGTYPE_NEXUS;
+	}
+	boost::shared_ptr<Building> clone() {
+		return boost::shared_ptr<Building>(new Nexus(*this));
+	}
+	void transfer(WorldArchive &archive);
 	int getMaxHealth() {
 		return NEXUS_MAXHEALTH;
 	}
@@ -763,7 +2824,7 @@ public:
 	void go() {
 		NodeBaseClass::go();
 	}
-	void drawDesign(sf::RenderWindow *window) {
+	void drawDesign(RenderSnapshot *snapshot) {
 		sf::Color diamondColor(255,0,255);
 		sf::Vertex diamond[] = {
 			sf::Vertex(toDrawPos(getCenterPos() + sf::Vector2f( 0,-6)), diamondColor),
@@ -772,156 +2833,893 @@ public:
 			sf::Vertex(toDrawPos(getCenterPos() + sf::Vector2f(-3, 0)), diamondColor),
 			sf::Vertex(toDrawPos(getCenterPos() + sf::Vector2f( 0,-6)), diamondColor)
 		};
-		window->draw(diamond, 5, sf::LinesStrip);
+		snapshot->draw(diamond, 5, sf::LinesStrip);
 	}
 };
 
-class Network {
-	boost::weak_ptr<Player> owner;
-	vector<boost::shared_ptr<Building>> connectedBuildings;
-	boost::shared_ptr<Nexus> nexus;
-	vector<boost::shared_ptr<NodeBaseClass>> activeNodes;
-public:
-	float energyAvailable, energyRequested, energySpent, energyProfit;
-	float massAvailable, massRequested, massSpent;
-	Network(boost::weak_ptr<Player> _owner, boost::shared_ptr<Nexus> _nexus) {
-		owner = _owner;
-		nexus = _nexus;
-
-		assert(nexus->isActive());
-		activeNodes.push_back(nexus);
-		connectedBuildings.push_back(nexus);
+//Connections between nodes and the buildings they reach, stored as compressed sparse rows of entity
+//indices: the neighbours of entity i are columns[rowStarts[i]] .. columns[rowStarts[i+1]-1].
+//nodeRowStarts/nodeColumns hold the same thing restricted to node-to-node connections.
+//New connections and deaths only mark the graph dirty; the rows are rebuilt in one batch the next
+//time they're read.
+class ConnectionGraph {
+	vector<boost::shared_ptr<Building>> entities;
+	vector<boost::shared_ptr<NodeBaseClass>> entityNodes;//NULL where the entity isn't a node
+	unordered_map<Building*, int> indices;
+
+	vector<pair<int, int>> edges;
+	unordered_set<long long> edgeKeys;
+
+	vector<int> rowStarts, columns;
+	vector<int> nodeRowStarts, nodeColumns;
+	bool dirty;
+
+	static long long getEdgeKey(int a, int b) {
+		if (a > b) swap(a, b);
+		return ((long long)a << 32) | b;
+	}
+	void removeDeadEntities() {
+		vector<int> newIndices(entities.size(), -1);
+		int entityCount = 0;
+		for (int i=0; i<entities.size(); i++) {
+			if (entities[i]->isDead())
+				continue;
+			newIndices[i] = entityCount;
+			entities[entityCount] = entities[i];
+			entityNodes[entityCount] = entityNodes[i];
+			entityCount++;
+		}
+		if (entityCount == entities.size())
+			return;
+		entities.resize(entityCount);
+		entityNodes.resize(entityCount);
 
-		nexus->setDistanceScore(0);
+		indices.clear();
+		for (int i=0; i<entities.size(); i++) {
+			indices[entities[i].get()] = i;
+		}
 
-		energyAvailable = energySpent = massAvailable = massSpent = energyProfit = 0;
+		int edgeCount = 0;
+		edgeKeys.clear();
+		for (int i=0; i<edges.size(); i++) {
+			int a = newIndices[edges[i].first];
+			int b = newIndices[edges[i].second];
+			if (a < 0 || b < 0)
+				continue;
+			edges[edgeCount++] = make_pair(a, b);
+			edgeKeys.insert(getEdgeKey(a, b));
+		}
+		edges.resize(edgeCount);
 	}
-	void reactToDestroyedNode(boost::shared_ptr<NodeBaseClass> destroyedNode) {
-		vector<boost::shared_ptr<NodeBaseClass>> oldActiveNodes = activeNodes;
-
-		vector<boost::shared_ptr<NodeBaseClass>> newActiveNodes;
-		
-		vector<boost::shared_ptr<NodeBaseClass>> networkEdge;
-		vector<boost::shared_ptr<NodeBaseClass>> previousEdge;
-
-		//Add all nodes closer than or as close to nexus to new lists
-		//Also build networkEdge list
-		for (int i=0; i<oldActiveNodes.size(); i++) {
-			if (oldActiveNodes[i]->getDistanceScore() <= destroyedNode->getDistanceScore()) {
-				newActiveNodes.push_back(oldActiveNodes[i]);
-				if (oldActiveNodes[i]->getDistanceScore() == destroyedNode->getDistanceScore()) {
-					networkEdge.push_back(oldActiveNodes[i]);
-				}
-				else {
-					previousEdge.push_back(oldActiveNodes[i]);
-				}
-				//oldActiveNodes[i].reset();
-			}
+	//Counting sort of the (undirected) edge list into rows
+	void buildRows(vector<int> &starts, vector<int> &cols, bool nodesOnly) {
+		starts.assign(entities.size()+1, 0);
+		for (int i=0; i<edges.size(); i++) {
+			if (nodesOnly && !(entityNodes[edges[i].first] && entityNodes[edges[i].second]))
+				continue;
+			starts[edges[i].first+1]++;
+			starts[edges[i].second+1]++;
 		}
-
-		//iteratively add new nodes to network
-		int nextEdgeScore = destroyedNode->getDistanceScore() + 1;
-		while (networkEdge.size() > 0) {
-			vector<boost::shared_ptr<NodeBaseClass>> nextEdge;
-			for (int i=0; i<networkEdge.size(); i++) {
-				for (int j=0; j<networkEdge[i]->connectedBuildings.size(); j++) {
-					boost::shared_ptr<NodeBaseClass> connectedNode = boost::dynamic_pointer_cast<NodeBaseClass, Building>(networkEdge[i]->connectedBuildings[j].lock());
-
-					//Ignore if not a node or if weak_ptr had expired
-					if (!connectedNode) {
-						continue;
-					}
-					//Ignore if in networkEdge
-					if (find(networkEdge.begin(), networkEdge.end(), connectedNode) != networkEdge.end()) {
-						continue;
-					}
-					//Ignore if in previousEdge
-					if (find(previousEdge.begin(), previousEdge.end(), connectedNode) != previousEdge.end()) {
-						continue;
-					}
-					//Ignore if already added to nextEdge
-					if (find(nextEdge.begin(), nextEdge.end(), connectedNode) != nextEdge.end()) {
-						continue;
-					}
-
-					//connectedNode must now point to a node not yet in our lists
-					connectedNode->setDistanceScore(nextEdgeScore);
-					nextEdge.push_back(connectedNode);
-					newActiveNodes.push_back(connectedNode);
-				}
-			}
-			previousEdge = networkEdge;
-			networkEdge = nextEdge;
-			nextEdgeScore++;
+		for (int i=0; i<entities.size(); i++) {
+			starts[i+1] += starts[i];
 		}
-
-		vector<boost::shared_ptr<Building>> newConnectedBuildings;
-
-		//Now find all connected buildings
-		for (int i=0; i<newActiveNodes.size(); i++) {
-			newConnectedBuildings.push_back(newActiveNodes[i]);
-			for (int j=0; j<newActiveNodes[i]->connectedBuildings.size(); j++) {
-				boost::shared_ptr<Building> newBuilding = newActiveNodes[i]->connectedBuildings[j].lock();
-				
-				if (!newBuilding)//weak_ptr expired
-					continue;
-				if (boost::dynamic_pointer_cast<NodeBaseClass, Building>(newBuilding))//if it's a node, ignore (we add all nodes one loop out)
-					continue;
-
-				if (find(newConnectedBuildings.begin(), newConnectedBuildings.end(), newBuilding) == newConnectedBuildings.end()) {//if not already in list
-					newConnectedBuildings.push_back(newBuilding);
-				}
-			}
+		cols.resize(starts.back());
+		vector<int> cursors(starts.begin(), starts.end()-1);
+		for (int i=0; i<edges.size(); i++) {
+			if (nodesOnly && !(entityNodes[edges[i].first] && entityNodes[edges[i].second]))
+				continue;
+			cols[cursors[edges[i].first]++] = edges[i].second;
+			cols[cursors[edges[i].second]++] = edges[i].first;
 		}
-
-		//Finally assign new lists to class members
-		connectedBuildings = newConnectedBuildings;
-		activeNodes = newActiveNodes;
 	}
+public:
+	ConnectionGraph() {
+		rowStarts.push_back(0);
+		nodeRowStarts.push_back(0);
+		dirty = false;
+	}
+	int addEntity(boost::shared_ptr<Building> building) {
+		unordered_map<Building*, int>::iterator it = indices.find(building.get());
+		if (it != indices.end())
+			return it->second;
+
+		MemoryTagScope tag(MEMTAG_NODEGRAPH);
+		int index = entities.size();
+		indices[building.get()] = index;
+		entities.push_back(building);
+		entityNodes.push_back(boost::dynamic_pointer_cast<NodeBaseClass, Building>(building));
+		dirty = true;
+		return index;
+	}
+	void connect(boost::shared_ptr<Building> a, boost::shared_ptr<Building> b) {
+		int indexA = addEntity(a);
+		int indexB = addEntity(b);
+		if (indexA == indexB)
+			return;
+		MemoryTagScope tag(MEMTAG_NODEGRAPH);
+		if (!edgeKeys.insert(getEdgeKey(indexA, indexB)).second)
+			return;//already connected
+		edges.push_back(make_pair(indexA, indexB));
+		dirty = true;
+	}
+	//Call when an entity in the graph has died
+	void markDirty() {
+		dirty = true;
+	}
+	void rebuild() {
+		if (!dirty)
+			return;
+		MemoryTagScope tag(MEMTAG_NODEGRAPH);
+		removeDeadEntities();
+		buildRows(rowStarts, columns, false);
+		buildRows(nodeRowStarts, nodeColumns, true);
+		dirty = false;
+	}
+	//The accessors below expect the rows to be up to date, i.e. rebuild() to have been called
+	int getEntityCount() {
+		return entities.size();
+	}
+	int getIndex(Building *building) {
+		unordered_map<Building*, int>::iterator it = indices.find(building);
+		return (it == indices.end()) ? -1 : it->second;
+	}
+	//False for entities added since the last rebuild, which have no row yet
+	bool hasRow(int index) {
+		return index >= 0 && index+1 < rowStarts.size();
+	}
+	const boost::shared_ptr<Building> &getEntity(int index) {
+		return entities[index];
+	}
+	const boost::shared_ptr<NodeBaseClass> &getNode(int index) {
+		return entityNodes[index];
+	}
+	const int *neighboursBegin(int index) {
+		return columns.data() + rowStarts[index];
+	}
+	const int *neighboursEnd(int index) {
+		return columns.data() + rowStarts[index+1];
+	}
+	const int *nodeNeighboursBegin(int index) {
+		return nodeColumns.data() + nodeRowStarts[index];
+	}
+	const int *nodeNeighboursEnd(int index) {
+		return nodeColumns.data() + nodeRowStarts[index+1];
+	}
+	void draw(RenderSnapshot *snapshot) {
+		for (int i=0; i<edges.size(); i++) {
+			Building *a = entities[edges[i].first].get();
+			Building *b = entities[edges[i].second].get();
+			if (a->isDead() || b->isDead())
+				continue;
+			sf::Vertex line[] = {
+				sf::Vertex(toDrawPos(a->getCenterPos())),
+				sf::Vertex(toDrawPos(b->getCenterPos()))
+			};
+			snapshot->draw(line, 2, sf::Lines);
+		}
+	}
+	void remapReferences(WorldCopier &copier);
+	void transfer(WorldArchive &archive);
+};
+
+//Keeps every active node's distanceScore equal to its hop distance from the root (the nexus) over the
+//graph's node-to-node rows, updating only the part of the network a batch of changes can affect.
+//Removals follow Ramalingam-Reps: a node whose score could rise is checked for a remaining neighbour one
+//hop closer to the root, those without one are marked affected, and only the affected nodes are re-scored.
+//Once more than 1/DISTANCESCORE_RESCORE_DIVISOR of the graph is affected, checking node by node costs more
+//than a BFS, so the BFS is run instead. Insertions relax outwards from the new nodes. Every edge is one
+//hop, so the queue is a bucket per score rather than a heap: scores queued while settling never go below
+//the one being settled, so pushing and popping are O(1). The buckets and the epoch-stamped marks are
+//reused between updates, so nothing needs clearing.
+class DistanceScoreMaintainer {
+	vector<vector<int>> buckets;//entity indices queued, by score
+	unsigned int lowestBucket;//nothing queued scores lower
+	int queuedCount;
+	vector<int> affectedNodes;
+	vector<int> bfsQueue;
+	vector<unsigned int> affectedEpochs;
+	vector<unsigned int> checkedEpochs;
+	unsigned int epoch;
+
+	void push(unsigned int score, int index) {
+		if (score >= buckets.size())
+			buckets.resize(score + 1);
+		buckets[score].push_back(index);
+		lowestBucket = min(lowestBucket, score);
+		queuedCount++;
+	}
+	//The lowest score queued and its entity. Entities with the same score come out in any order.
+	pair<unsigned int, int> pop() {
+		while (buckets[lowestBucket].empty()) {
+			lowestBucket++;
+		}
+		pair<unsigned int, int> top(lowestBucket, buckets[lowestBucket].back());
+		buckets[lowestBucket].pop_back();
+		if (--queuedCount == 0)
+			lowestBucket = DISTANCESCORE_UNREACHABLE;
+		return top;
+	}
+	void clearQueue() {
+		while (queuedCount > 0) {
+			pop();
+		}
+	}
+	static bool isScorable(NodeBaseClass *node) {
+		return node->isActive() && !node->isDead();
+	}
+	bool isAffected(int index) {
+		return affectedEpochs[index] == epoch;
+	}
+	//Lowest score reachable from index through a neighbour that isn't waiting to be re-scored
+	unsigned int getBestScoreFromNeighbours(ConnectionGraph &graph, int index) {
+		unsigned int bestScore = DISTANCESCORE_UNREACHABLE;
+		for (const int *n = graph.nodeNeighboursBegin(index); n != graph.nodeNeighboursEnd(index); n++) {
+			NodeBaseClass *neighbour = graph.getNode(*n).get();
+			if (!isScorable(neighbour) || isAffected(*n) || neighbour->getDistanceScore() == DISTANCESCORE_UNREACHABLE)
+				continue;
+			bestScore = min(bestScore, neighbour->getDistanceScore() + 1);
+		}
+		return bestScore;
+	}
+	//Settle the queue, lowering scores outwards. Returns true if a node that was unreachable became reachable.
+	bool relax(ConnectionGraph &graph, bool affectedOnly) {
+		bool reachabilityChanged = false;
+		while (queuedCount > 0) {
+			pair<unsigned int, int> top = pop();
+			if (graph.getNode(top.second)->getDistanceScore() != top.first)
+				continue;//stale entry
+			unsigned int nextScore = top.first + 1;
+			for (const int *n = graph.nodeNeighboursBegin(top.second); n != graph.nodeNeighboursEnd(top.second); n++) {
+				NodeBaseClass *neighbour = graph.getNode(*n).get();
+				if (!isScorable(neighbour) || (affectedOnly && !isAffected(*n)))
+					continue;
+				if (neighbour->getDistanceScore() > nextScore) {
+					if (neighbour->getDistanceScore() == DISTANCESCORE_UNREACHABLE && !isAffected(*n))
+						reachabilityChanged = true;
+					neighbour->setDistanceScore(nextScore);
+					push(nextScore, *n);
+				}
+			}
+		}
+		return reachabilityChanged;
+	}
+	//Instead of re-scoring affected nodes one by one: a BFS from the root over the nodes that had a path to it
+	//before the removals (so not over the nodes being inserted). Returns true if one of them has lost its path.
+	bool rescoreReachable(ConnectionGraph &graph, int rootIndex) {
+		clearQueue();
+		epoch++;
+		bfsQueue.clear();
+		if (rootIndex >= 0) {
+			checkedEpochs[rootIndex] = epoch;
+			graph.getNode(rootIndex)->setDistanceScore(0);
+			bfsQueue.push_back(rootIndex);
+		}
+		for (int head=0; head<bfsQueue.size(); head++) {
+			unsigned int nextScore = graph.getNode(bfsQueue[head])->getDistanceScore() + 1;
+			for (const int *n = graph.nodeNeighboursBegin(bfsQueue[head]); n != graph.nodeNeighboursEnd(bfsQueue[head]); n++) {
+				NodeBaseClass *neighbour = graph.getNode(*n).get();
+				if (checkedEpochs[*n] == epoch || !isScorable(neighbour) || neighbour->getDistanceScore() == DISTANCESCORE_UNREACHABLE)
+					continue;
+				checkedEpochs[*n] = epoch;
+				neighbour->setDistanceScore(nextScore);
+				bfsQueue.push_back(*n);
+			}
+		}
+		bool pathLost = false;
+		for (int i=0; i<graph.getEntityCount(); i++) {
+			NodeBaseClass *node = graph.getNode(i).get();
+			if (node && checkedEpochs[i] != epoch && isScorable(node) && node->getDistanceScore() != DISTANCESCORE_UNREACHABLE) {
+				node->setDistanceScore(DISTANCESCORE_UNREACHABLE);
+				pathLost = true;
+			}
+		}
+		return pathLost;
+	}
+public:
+	DistanceScoreMaintainer() {
+		lowestBucket = DISTANCESCORE_UNREACHABLE;
+		queuedCount = 0;
+		epoch = 0;
+	}
+	//graph must have been rebuilt since the changes. rootIndex is -1 if the root is gone.
+	//removedNeighbours are the surviving nodes that were connected to removed nodes; insertedNodes are
+	//newly activated nodes. Returns true if any node other than the inserted ones gained or lost a path
+	//to the root, or an inserted one has none.
+	template <class IndexVector>
+	bool update(ConnectionGraph &graph, int rootIndex, const IndexVector &removedNeighbours, const IndexVector &insertedNodes) {
+		epoch++;
+		affectedEpochs.resize(graph.getEntityCount(), 0);
+		checkedEpochs.resize(graph.getEntityCount(), 0);
+		affectedNodes.clear();
+
+		bool reachabilityChanged = false;
+		bool rescoredAll = false;
+
+		//Removals: find the nodes that have lost every neighbour one hop closer to the root, in order of
+		//score so a node's closer neighbours have always been decided before it is checked
+		for (int i=0; i<removedNeighbours.size(); i++) {
+			NodeBaseClass *node = graph.getNode(removedNeighbours[i]).get();
+			if (isScorable(node) && node->getDistanceScore() != DISTANCESCORE_UNREACHABLE)
+				push(node->getDistanceScore(), removedNeighbours[i]);
+		}
+		while (queuedCount > 0) {
+			pair<unsigned int, int> top = pop();
+			if (checkedEpochs[top.second] == epoch || top.second == rootIndex)
+				continue;
+			checkedEpochs[top.second] = epoch;
+
+			bool supported = false;
+			for (const int *n = graph.nodeNeighboursBegin(top.second); n != graph.nodeNeighboursEnd(top.second); n++) {
+				NodeBaseClass *neighbour = graph.getNode(*n).get();
+				if (isScorable(neighbour) && !isAffected(*n) && neighbour->getDistanceScore() + 1 == top.first) {
+					supported = true;
+					break;
+				}
+			}
+			if (supported)
+				continue;
+
+			affectedEpochs[top.second] = epoch;
+			affectedNodes.push_back(top.second);
+			if (affectedNodes.size() * DISTANCESCORE_RESCORE_DIVISOR > graph.getEntityCount()) {
+				reachabilityChanged = rescoreReachable(graph, rootIndex);
+				rescoredAll = true;
+				break;
+			}
+			//Anything this node was supporting needs checking too
+			for (const int *n = graph.nodeNeighboursBegin(top.second); n != graph.nodeNeighboursEnd(top.second); n++) {
+				NodeBaseClass *neighbour = graph.getNode(*n).get();
+				if (isScorable(neighbour) && neighbour->getDistanceScore() == top.first + 1 && checkedEpochs[*n] != epoch)
+					push(top.first + 1, *n);
+			}
+		}
+
+		//Re-score the affected nodes from their unaffected neighbours, then among themselves
+		for (int i=0; i<affectedNodes.size() && !rescoredAll; i++) {
+			unsigned int score = getBestScoreFromNeighbours(graph, affectedNodes[i]);
+			graph.getNode(affectedNodes[i])->setDistanceScore(score);
+			if (score != DISTANCESCORE_UNREACHABLE)
+				push(score, affectedNodes[i]);
+		}
+		relax(graph, true);
+		for (int i=0; i<affectedNodes.size() && !rescoredAll; i++) {
+			if (graph.getNode(affectedNodes[i])->getDistanceScore() == DISTANCESCORE_UNREACHABLE)
+				reachabilityChanged = true;
+		}
+
+		//Insertions: score the new nodes from their neighbours and relax outwards from them
+		epoch++;//nothing is affected any more
+		for (int i=0; i<insertedNodes.size(); i++) {
+			NodeBaseClass *node = graph.getNode(insertedNodes[i]).get();
+			unsigned int score = (insertedNodes[i] == rootIndex) ? 0 : getBestScoreFromNeighbours(graph, insertedNodes[i]);
+			if (score < node->getDistanceScore()) {
+				node->setDistanceScore(score);
+				push(score, insertedNodes[i]);
+			}
+		}
+		if (relax(graph, false))
+			reachabilityChanged = true;
+		for (int i=0; i<insertedNodes.size(); i++) {
+			if (graph.getNode(insertedNodes[i])->getDistanceScore() == DISTANCESCORE_UNREACHABLE)
+				reachabilityChanged = true;
+		}
+
+		return reachabilityChanged;
+	}
+	//Plain BFS from the root over every active node, for checking and benchmarking update()
+	void recomputeAll(ConnectionGraph &graph, int rootIndex) {
+		vector<int> queue;
+		for (int i=0; i<graph.getEntityCount(); i++) {
+			if (graph.getNode(i))
+				graph.getNode(i)->setDistanceScore(DISTANCESCORE_UNREACHABLE);
+		}
+		if (rootIndex < 0)
+			return;
+		graph.getNode(rootIndex)->setDistanceScore(0);
+		queue.push_back(rootIndex);
+		for (int head=0; head<queue.size(); head++) {
+			unsigned int nextScore = graph.getNode(queue[head])->getDistanceScore() + 1;
+			for (const int *n = graph.nodeNeighboursBegin(queue[head]); n != graph.nodeNeighboursEnd(queue[head]); n++) {
+				NodeBaseClass *neighbour = graph.getNode(*n).get();
+				if (isScorable(neighbour) && neighbour->getDistanceScore() == DISTANCESCORE_UNREACHABLE) {
+					neighbour->setDistanceScore(nextScore);
+					queue.push_back(*n);
+				}
+			}
+		}
+	}
+};
+
+//The order a network's unbuilt buildings are started in, lowest first
+int getConstructionPriority(int buildingType) {
+	switch (buildingType) {
+	case BUILDINGTYPE_ENERGYCANNON:
+		return 0;//defence can't wait
+	case BUILDINGTYPE_GENERATOR:
+	case BUILDINGTYPE_MINER:
+		return 1;//then the economy
+	default:
+		return 2;
+	}
+}
+
+//A network's unbuilt buildings. At most maxActiveBuilds are under construction at once, started by
+//priority and then in the order they were queued, so each gets its share of mass sooner; the rest wait in
+//a heap without being looked at, so construction costs the same each tick however big the build plan is.
+//A building that dies while waiting is dropped when it reaches the front.
+class ConstructionQueue {
+	struct Entry {
+		int priority;
+		unsigned int order;
+		boost::shared_ptr<Building> building;
+		//The heap keeps the greatest at the front, so that's the one to start next
+		bool operator<(const Entry &other) const {
+			return (priority != other.priority) ? priority > other.priority : order > other.order;
+		}
+	};
+	vector<Entry> waiting;//a heap
+	vector<Entry> active;
+	unsigned int nextOrder;
+	int maxActiveBuilds;
+
+	static bool isFinished(const Entry &entry) {
+		return entry.building->isBuilt() || entry.building->isDead();
+	}
+public:
+	ConstructionQueue() {
+		nextOrder = 0;
+		maxActiveBuilds = CONSTRUCTION_MAX_ACTIVE_BUILDS;
+	}
+	void setMaxActiveBuilds(int _maxActiveBuilds) {
+		maxActiveBuilds = max(_maxActiveBuilds, 1);
+	}
+	int getMaxActiveBuilds() {
+		return maxActiveBuilds;
+	}
+	void push(boost::shared_ptr<Building> building) {
+		Entry entry;
+		entry.priority = getConstructionPriority(building->getType());
+		entry.order = nextOrder++;
+		entry.building = building;
+		waiting.push_back(entry);
+		push_heap(waiting.begin(), waiting.end());
+	}
+	//Starts waiting buildings until maxActiveBuilds are under construction
+	void startBuilds() {
+		while (active.size() < maxActiveBuilds && waiting.size() > 0) {
+			pop_heap(waiting.begin(), waiting.end());
+			if (!waiting.back().building->isDead())
+				active.push_back(waiting.back());
+			waiting.pop_back();
+		}
+	}
+	int getActiveCount() {
+		return active.size();
+	}
+	const boost::shared_ptr<Building> &getActive(int i) {
+		return active[i].building;
+	}
+	//Drops buildings that have been built or have died from those under construction
+	void removeFinished() {
+		active.erase(remove_if(active.begin(), active.end(), isFinished), active.end());
+	}
+	//Including any that have died waiting
+	int size() {
+		return active.size() + waiting.size();
+	}
+	//Makes the queue hold just the buildings in unbuilt: those already queued keep their place, and the
+	//rest are queued behind them in the order given
+	void assign(const FrameVector<boost::shared_ptr<Building>> &unbuilt) {
+		unordered_set<Building*> wanted, queued;
+		for (int i=0; i<unbuilt.size(); i++) {
+			wanted.insert(unbuilt[i].get());
+		}
+		auto unwanted = [&](const Entry &entry) {return wanted.count(entry.building.get()) == 0; };
+		active.erase(remove_if(active.begin(), active.end(), unwanted), active.end());
+		waiting.erase(remove_if(waiting.begin(), waiting.end(), unwanted), waiting.end());
+		make_heap(waiting.begin(), waiting.end());
+		for (int i=0; i<active.size(); i++) {
+			queued.insert(active[i].building.get());
+		}
+		for (int i=0; i<waiting.size(); i++) {
+			queued.insert(waiting[i].building.get());
+		}
+		for (int i=0; i<unbuilt.size(); i++) {
+			if (queued.count(unbuilt[i].get()) == 0)
+				push(unbuilt[i]);
+		}
+	}
+	void remapReferences(WorldCopier &copier);
+	void transfer(WorldArchive &archive);
+};
+
+class Network {
+	boost::weak_ptr<Player> owner;
+	BuildingSet connectedBuildings;//that are built
+	ConstructionQueue construction;//the rest
+	boost::shared_ptr<Nexus> nexus;
+	BuildingSetOf<NodeBaseClass> activeNodes;
+	ConnectionGraph connections;
+	DistanceScoreMaintainer distanceScores;
+	//Nodes that finished building last go(), to be scored along with this go()'s dead nodes
+	vector<boost::shared_ptr<NodeBaseClass>> completedNodes;
+	//Ghosts that have been connected to an active node since the last go(), waiting to be unghosted
+	vector<boost::weak_ptr<Building>> ghostActivationQueue;
+	//The economy is stepped every tick while anything is changing. Once a network is idle (everything
+	//built, energy demand met) it is stepped every ECONOMY_IDLE_TICK_INTERVAL ticks instead, integrating
+	//the ticks in between, until markChanged() is called or a consumer is about to change behaviour.
+	bool changed;
+	int lastEconomyTick;
+	int nextEconomyTick;
+	//The owner's buildings that have died since the last go(), to be taken out of the lists above
+	vector<boost::shared_ptr<Building>> deadBuildings;
+	void integrateIdleTicks(int ticks);
+public:
+	static void *operator new(size_t size) {
+		return allocateTagged(size, MEMTAG_NETWORKS);
+	}
+	static void operator delete(void *memory) {
+		freeTagged(memory);
+	}
+	float energyAvailable, energyRequested, energySpent, energyProfit;
+	float massAvailable, massRequested, massSpent;
+	//Empty, for transfer() to read a network into
+	Network() {}
+	Network(boost::weak_ptr<Player> _owner, boost::shared_ptr<Nexus> _nexus) {
+		owner = _owner;
+		nexus = _nexus;
+
+		assert(nexus->isActive());
+		activeNodes.insert(nexus);
+		connectedBuildings.insert(nexus);
+		connections.addEntity(nexus);
+
+		nexus->setDistanceScore(0);
+
+		changed = true;
+		lastEconomyTick = nextEconomyTick = scheduler.getTick();
+
+		energyAvailable = energySpent = massAvailable = massSpent = energyProfit = 0;
+	}
+	//Rebuild activeNodes, connectedBuildings and the construction queue from the graph after nodes have been
+	//cut off from (or reconnected to) the nexus
+	void rebuildMembership() {
+		FrameVector<char> added(connections.getEntityCount(), false);
+		FrameVector<boost::shared_ptr<Building>> unbuilt;
+
+		activeNodes.clear();
+		connectedBuildings.clear();
+		for (int i=0; i<connections.getEntityCount(); i++) {
+			const boost::shared_ptr<NodeBaseClass> &node = connections.getNode(i);
+			if (node && node->isActive() && node->getDistanceScore() != DISTANCESCORE_UNREACHABLE) {
+				added[i] = true;
+				activeNodes.insert(node);
+				connectedBuildings.insert(node);
+			}
+		}
+		for (int i=0; i<activeNodes.size(); i++) {
+			int nodeIndex = connections.getIndex(activeNodes[i].get());
+			for (const int *n = connections.neighboursBegin(nodeIndex); n != connections.neighboursEnd(nodeIndex); n++) {
+				if (added[*n])
+					continue;
+				const boost::shared_ptr<Building> &building = connections.getEntity(*n);
+				if (building->isGhost())//joins through the ghost activation queue
+					continue;
+				if (connections.getNode(*n) && building->isActive())//an active node we didn't add is cut off
+					continue;
+				added[*n] = true;
+				if (building->isBuilt())
+					connectedBuildings.insert(building);
+				else
+					unbuilt.push_back(building);
+			}
+		}
+		construction.assign(unbuilt);
+	}
+	//Bring distance scores up to date with this tick's dead nodes and the nodes completed last tick
+	void reactToDestroyedNodes(const FrameVector<boost::shared_ptr<NodeBaseClass>> &deadNodes) {
+		//Find the surviving neighbours of the dead nodes while the rows still include them
+		FrameVector<boost::shared_ptr<NodeBaseClass>> deadNodeNeighbours;
+		for (int i=0; i<deadNodes.size(); i++) {
+			int index = connections.getIndex(deadNodes[i].get());
+			if (!connections.hasRow(index))
+				continue;
+			for (const int *n = connections.nodeNeighboursBegin(index); n != connections.nodeNeighboursEnd(index); n++) {
+				if (!connections.getNode(*n)->isDead())
+					deadNodeNeighbours.push_back(connections.getNode(*n));
+			}
+		}
+		if (deadNodes.size() > 0)
+			connections.markDirty();
+		connections.rebuild();
+
+		FrameVector<int> removedNeighbours;
+		removedNeighbours.reserve(deadNodeNeighbours.size());
+		for (int i=0; i<deadNodeNeighbours.size(); i++) {
+			removedNeighbours.push_back(connections.getIndex(deadNodeNeighbours[i].get()));
+		}
+		FrameVector<int> insertedNodes;
+		insertedNodes.reserve(completedNodes.size());
+		for (int i=0; i<completedNodes.size(); i++) {
+			int index = connections.getIndex(completedNodes[i].get());
+			if (index >= 0)
+				insertedNodes.push_back(index);
+		}
+		completedNodes.clear();
+
+		MemoryTagScope tag(MEMTAG_NODEGRAPH);
+		if (distanceScores.update(connections, connections.getIndex(nexus.get()), removedNeighbours, insertedNodes))
+			rebuildMembership();
+	}
+	void connect(boost::shared_ptr<NodeBaseClass> node, boost::shared_ptr<Building> building) {
+		connections.connect(node, building);
+	}
+	void drawConnections(RenderSnapshot *snapshot) {
+		connections.draw(snapshot);
+	}
+	void queueGhostActivation(boost::shared_ptr<Building> ghostBuilding) {
+		ghostActivationQueue.push_back(ghostBuilding);
+		markChanged();
+	}
+	//Drop back to stepping the economy every tick
+	void markChanged() {
+		changed = true;
+	}
+	void buildingDied(Building *building) {
+		deadBuildings.push_back(building->shared_from_this());
+		markChanged();
+	}
+	void setMaxActiveBuilds(int maxActiveBuilds) {
+		construction.setMaxActiveBuilds(maxActiveBuilds);
+	}
+	//Activates and connects a node that has just been built (and is already in connectedBuildings); it's
+	//scored on the next go()
+	void connectCompletedNode(boost::shared_ptr<NodeBaseClass> node);
 	void go();
+	void remapReferences(WorldCopier &copier);
+	void transfer(WorldArchive &archive);
 };
 
 class Player {
 public:
-	vector<boost::shared_ptr<Building>> ownedBuildings;
-	vector<boost::shared_ptr<Building>> ghostBuildings;
+	int id;
+	BuildingSet ownedBuildings;
+	BuildingSet ghostBuildings;
 	boost::shared_ptr<Network> network;
+	CoverageMap coverage;//of the active nodes in ownedBuildings
+	Player(int _id) {
+		id = _id;
+	}
+	//Everything but the id
+	void transfer(WorldArchive &archive);
 };
 
-vector<boost::shared_ptr<Player>> players;
+int Building::getOwnerId() {
+	boost::shared_ptr<Player> player = getOwner();
+	return player ? player->id : -1;
+}
+
+//Damage the first enemy building (in buildings order) under each bullet that moved this tick
+void resolveBulletCollisions() {
+	static thread_local vector<float> bulletXs, bulletYs;
+	static thread_local vector<int> bulletOwners, hits;
+
+	BuildingArrays &arrays = getBuildingArrays();
+	bulletXs.resize(bulletsToCollide.size());
+	bulletYs.resize(bulletsToCollide.size());
+	bulletOwners.resize(bulletsToCollide.size());
+	hits.resize(bulletsToCollide.size());
+	for (int i=0; i<bulletsToCollide.size(); i++) {
+		bulletXs[i] = bulletsToCollide[i]->getPos().x;
+		bulletYs[i] = bulletsToCollide[i]->getPos().y;
+		boost::shared_ptr<Player> owner = bulletsToCollide[i]->getOwner();
+		bulletOwners[i] = owner ? owner->id : -1;
+	}
+
+	findFirstBoxesContainingPoints(bulletXs.data(), bulletYs.data(), bulletOwners.data(), bulletsToCollide.size(),
+								   arrays.lefts.data(), arrays.tops.data(), arrays.rights.data(), arrays.bottoms.data(), arrays.owners.data(), arrays.xs.size(),
+								   hits.data());
+
+	for (int i=0; i<bulletsToCollide.size(); i++) {
+		if (hits[i] >= 0) {
+			buildings[hits[i]]->takeDamage(ENERGYBULLET_DAMAGE);
+			bulletsToCollide[i]->die();
+		}
+	}
+	bulletsToCollide.clear();
+}
+
+thread_local vector<boost::shared_ptr<Player>> players;
 
-vector<boost::shared_ptr<NodeBaseClass>> getActiveNodesWithinRange(boost::shared_ptr<Player> player, sf::Vector2f pos) {
-	return findNearbyBuildings<NodeBaseClass>(&(player->ownedBuildings), pos, NODE_CONNECTION_MAXLENGTH, true);
+FrameVector<boost::shared_ptr<NodeBaseClass>> getActiveNodesWithinRange(boost::shared_ptr<Player> player, sf::Vector2f pos) {
+	FrameVector<boost::shared_ptr<NodeBaseClass>> nodes;
+	player->coverage.findCoveringNodes(pos, nodes);
+	return nodes;
 }
 
 void registerNewGhostBuilding(boost::shared_ptr<Player> player, boost::shared_ptr<Building> ghostBuilding) {
 	//find nearby active nodes and connect them to the ghostBuilding
-	vector<boost::shared_ptr<NodeBaseClass>> nodes = getActiveNodesWithinRange(player, ghostBuilding->getPos());
+	FrameVector<boost::shared_ptr<NodeBaseClass>> nodes = getActiveNodesWithinRange(player, ghostBuilding->getPos());
+	if (nodes.size() == 0 || !player->network)
+		return;
 	for (int i=0; i<nodes.size(); i++) {
-		nodes[i]->connectedBuildings.push_back(ghostBuilding);
+		player->network->connect(nodes[i], ghostBuilding);
+	}
+	//It's now attached to the network, so let the network unghost it on its next go()
+	player->network->queueGhostActivation(ghostBuilding);
+}
+
+void markNetworkChanged(boost::shared_ptr<Player> player) {
+	if (player && player->network)
+		player->network->markChanged();
+}
+
+void CoverageMap::add(const boost::shared_ptr<NodeBaseClass> &node) {
+	TileNode tileNode;
+	tileNode.node = node;
+	tileNode.point = getPoint(node->getPos());
+	tileNode.simOrder = node->getSimOrder();
+	update(tileNode, 1);
+}
+
+//Entity deaths. die() records each death once, as it happens, and the owner's network is told straight
+//away; the world's lists are compacted in one batch at the end of the tick, and only when something has
+//died, rather than every list being swept every tick. Dead buildings and mobs know their index in their
+//list, and are swapped with the last entry and popped; buildingArrays follows along, so targeting isn't
+//rebuilt. Buildings go from the highest index down, so the order the list is left in (which is the order
+//buildings are targeted, collided with and hashed in) depends only on which died, not on the order they
+//died in. Mass piles rarely die, so theirs is compacted in a single pass on ticks where one has.
+class Lifecycle {
+	vector<Building*> deadBuildings;//still held by buildings until compact()
+	vector<Mob*> deadMobs;//still held by mobs until compact()
+	int deadMassPileCount;
+public:
+	Lifecycle() {
+		deadMassPileCount = 0;
+	}
+	void recordDeath(Building *building) {
+		boost::shared_ptr<Player> owner = building->getOwner();
+		if (!building->isInWorld()) {
+			markNetworkChanged(owner);
+			return;
+		}
+		deadBuildings.push_back(building);
+		if (owner && owner->network)
+			owner->network->buildingDied(building);
+	}
+	void recordDeath(Mob *mob) {
+		deadMobs.push_back(mob);
+	}
+	void recordDeath(MassPile *massPile) {
+		deadMassPileCount++;
+	}
+	//Must be called at the end of the tick
+	void compact() {
+		if (deadBuildings.size() > 0) {
+			sort(deadBuildings.begin(), deadBuildings.end(),
+				 [](Building *a, Building *b) {return a->getWorldIndex() > b->getWorldIndex(); });
+			bool arraysCurrent = (buildingArrays.version == buildingsVersion);
+			for (int i=0; i<deadBuildings.size(); i++) {
+				//Held until we're done with it, as the lists below may have the last references
+				boost::shared_ptr<Building> building = buildings[deadBuildings[i]->getWorldIndex()];
+				worldChunks.removeBuilding(building.get());
+				occupancy.empty(building->getGridPoint(), building->getWidth());
+				boost::shared_ptr<Player> owner = building->getOwner();
+				NodeBaseClass *node = dynamic_cast<NodeBaseClass*>(building.get());
+				if (owner && node && node->isActive())
+					owner->coverage.remove(node, node->getPos());
+				updateThreat(building.get());
+				if (owner)
+					owner->ownedBuildings.erase(building);
+
+				int index = building->getWorldIndex();
+				buildings[index] = buildings.back();
+				buildings[index]->setWorldIndex(index);
+				buildings.pop_back();
+				if (arraysCurrent)
+					buildingArrays.moveLastTo(index);
+				building->setWorldIndex(-1);
+			}
+			buildingsVersion++;
+			if (arraysCurrent)
+				buildingArrays.version = buildingsVersion;
+			deadBuildings.clear();
+		}
+
+		for (int i=0; i<deadMobs.size(); i++) {
+			int index = deadMobs[i]->getWorldIndex();
+			mobs[index] = mobs.back();
+			mobs[index]->setWorldIndex(index);
+			mobs.pop_back();
+		}
+		deadMobs.clear();
+
+		if (deadMassPileCount > 0) {
+			massPiles.erase(remove_if(massPiles.begin(), massPiles.end(),
+							[](boost::shared_ptr<MassPile> m) {
+								if (!m->isDead())
+									return false;
+								occupancy.empty(m->getGridPoint(), 1);
+								return true;
+							}),
+							massPiles.end());
+			massPilesVersion++;
+			deadMassPileCount = 0;
+		}
+	}
+};
+
+thread_local Lifecycle lifecycle;
+
+void recordDeath(Building *building) {
+	lifecycle.recordDeath(building);
+}
+void recordDeath(Mob *mob) {
+	lifecycle.recordDeath(mob);
+}
+void recordDeath(MassPile *massPile) {
+	lifecycle.recordDeath(massPile);
+}
+
+//Catch up on ticks skipped while idle: every energy request was fully met throughout, and nothing
+//reached the point where being supplied changes what it does
+void Network::integrateIdleTicks(int ticks) {
+	for (int i=0; i<connectedBuildings.size(); i++) {
+		if (connectedBuildings[i]->isActive())
+			connectedBuildings[i]->supplyEnergyOverTicks(1.0, ticks);
+	}
+}
+
+void Network::connectCompletedNode(boost::shared_ptr<NodeBaseClass> node) {
+	boost::shared_ptr<Player> networkOwner = owner.lock();
+	activeNodes.insert(node);
+	connections.addEntity(node);
+	networkOwner->coverage.add(node);
+
+	//Add connections to nearby buildings and ghostBuildings
+	FrameVector<boost::shared_ptr<Building>> nearbyRealBuildings = findNearbyBuildings<Building>(networkOwner->ownedBuildings, node->getPos(), NODE_CONNECTION_MAXLENGTH, false);
+	FrameVector<boost::shared_ptr<Building>> nearbyGhostBuildings = findNearbyBuildings<Building>(networkOwner->ghostBuildings, node->getPos(), NODE_CONNECTION_MAXLENGTH, false);
+
+	for (int j=0; j<nearbyRealBuildings.size(); j++) {
+		if (nearbyRealBuildings[j].get() == node.get()) continue;
+
+		connections.connect(node, nearbyRealBuildings[j]);
+	}
+
+	//The ghosts this node reaches can be unghosted next tick
+	for (int j=0; j<nearbyGhostBuildings.size(); j++) {
+		connections.connect(node, nearbyGhostBuildings[j]);
+		queueGhostActivation(nearbyGhostBuildings[j]);
 	}
+
+	completedNodes.push_back(node);
 }
 
 void Network::go() {
-	//React to dead nodes, and delete dead nodes and dead buildings
-	//First log all dead nodes
-	vector<boost::shared_ptr<NodeBaseClass>> deadNodes;
-	for (int i=0; i<activeNodes.size(); i++) {
-		if (activeNodes[i]->isDead()) {
-			deadNodes.push_back(activeNodes[i]);
-		}
-	}
-	//Then delete all dead nodes and buildings from lists
-	activeNodes.erase(remove_if(activeNodes.begin(), activeNodes.end(),
-								[](boost::shared_ptr<NodeBaseClass> n) {return n->isDead(); }),
-								activeNodes.end());
-	connectedBuildings.erase(remove_if(connectedBuildings.begin(), connectedBuildings.end(),
-									   [](boost::shared_ptr<Building> b) {return b->isDead(); }),
-									   connectedBuildings.end());
-	//Now react to dead nodes
-	for (int i=0; i<deadNodes.size(); i++) {
-		reactToDestroyedNode(deadNodes[i]);
+	int tick = scheduler.getTick();
+	if (!changed && tick < nextEconomyTick && simulationShortcuts.idleEconomy)
+		return;
+	if (tick - lastEconomyTick > 1)
+		integrateIdleTicks(tick - lastEconomyTick - 1);
+	changed = false;
+	lastEconomyTick = tick;
+
+	//React to dead nodes, and delete dead nodes and dead buildings, if anything of ours has died
+	FrameVector<boost::shared_ptr<NodeBaseClass>> deadNodes;
+	if (deadBuildings.size() > 0) {
+		for (int i=0; i<deadBuildings.size(); i++) {
+			boost::shared_ptr<NodeBaseClass> node = boost::dynamic_pointer_cast<NodeBaseClass, Building>(deadBuildings[i]);
+			if (node && activeNodes.erase(node))
+				deadNodes.push_back(node);
+			if (connectedBuildings.erase(deadBuildings[i]))
+				connections.markDirty();
+		}
+		deadBuildings.clear();
+		construction.removeFinished();
 	}
+	//Now react to dead nodes (and score last tick's new nodes in the same pass)
+	if (deadNodes.size() > 0 || completedNodes.size() > 0)
+		reactToDestroyedNodes(deadNodes);
 
 	boost::shared_ptr<Player> networkOwner = owner.lock();
 
@@ -950,317 +3748,5481 @@ void Network::go() {
 
 	bool networkCanBuild = (massAvailable > 0);
 
-	//Unghost any buildings attached to active nodes.
-	for (int i=0; i<activeNodes.size(); i++) {
-		for (int j=0; j<activeNodes[i]->connectedBuildings.size(); j++) {
-			boost::shared_ptr<Building> possiblyGhostBuilding = activeNodes[i]->connectedBuildings[j].lock();
-			if (!possiblyGhostBuilding) continue; // This indicates the node's connection weak_ptr points to a destroyed building
+	//Unghost any buildings that were connected to an active node since the last go()
+	for (int i=0; i<ghostActivationQueue.size(); i++) {
+		boost::shared_ptr<Building> ghostBuilding = ghostActivationQueue[i].lock();
+		if (!ghostBuilding) continue; // The ghost was removed before we got to it
+		if (!ghostBuilding->isGhost()) continue; // Queued more than once (it was in range of several nodes)
+
+		ghostBuilding->unGhost();
+
+		networkOwner->ghostBuildings.erase(ghostBuilding);
+
+		addBuilding(ghostBuilding);//add to global buildings list
+		networkOwner->ownedBuildings.insert(ghostBuilding);//add to player's buildings list
+		construction.push(ghostBuilding);//queue it to be built
+	}
+	ghostActivationQueue.clear();
+
+	construction.startBuilds();
+	int unbuiltBuildings = construction.size();
+
+	energyRequested = 0;
+	massRequested = 0;
+	for (int i=0; i<connectedBuildings.size(); i++) {
+		if (connectedBuildings[i]->isActive())
+			energyRequested += connectedBuildings[i]->getEnergyDraw();
+	}
+	for (int i=0; networkCanBuild && i<construction.getActiveCount(); i++) {
+		Resources r = construction.getActive(i)->getBuildResourceDraw();
+		energyRequested += r.energy;
+		massRequested += r.mass;
+	}
+
+	float energySatisfaction = energyRequested>0 ? min(1.f, energyAvailable/energyRequested) : 1.0;
+	float massSatisfaction = (networkCanBuild && massRequested>0) ? min(1.f, massAvailable/massRequested) : 1.0;
+
+	massSpent = 0;
+	energySpent = 0;
+
+	for (int i=0; i<connectedBuildings.size(); i++) {
+		if (connectedBuildings[i]->isActive())
+			energySpent += connectedBuildings[i]->supplyEnergy(energySatisfaction);
+	}
+	for (int i=0; networkCanBuild && i<construction.getActiveCount(); i++) {
+		boost::shared_ptr<Building> building = construction.getActive(i);
+		Resources spent = building->build(min(energySatisfaction, massSatisfaction));
+		massSpent += spent.mass;
+		energySpent += spent.energy;
+
+		if (building->isBuilt()) {
+			connectedBuildings.insert(building);
+			updateThreat(building.get());
+
+			//If the building was just built, activate and connect it if it's a node
+			if (boost::shared_ptr<NodeBaseClass> node = boost::dynamic_pointer_cast<NodeBaseClass, Building>(building))
+				connectCompletedNode(node);
+		}
+	}
+
+	//Rounding can make what was spent come to a little more than was available. (The withdrawal mustn't
+	//happen inside assert(), which compiles to nothing in release builds.)
+	massSpent = min(massSpent, massAvailable);
+	bool withdrawn = nexus->withdrawMass(massSpent);
+	assert(withdrawn);
+	construction.removeFinished();
+
+	energyProfit = energyIncome - energySpent;
+	//store or remove from storage
+
+	//Decide when the economy next needs stepping. Energy demand can only fall while idle (consumers fill
+	//up; anything that raises it calls markChanged()), so satisfaction stays at 1 until then.
+	bool idle = (unbuiltBuildings == 0 && energySatisfaction >= 1 && ghostActivationQueue.size() == 0 && completedNodes.size() == 0);
+	nextEconomyTick = tick + 1;
+	if (idle) {
+		int ticksUntilNextStep = ECONOMY_IDLE_TICK_INTERVAL;
+		for (int i=0; i<connectedBuildings.size(); i++) {
+			if (connectedBuildings[i]->isActive())
+				ticksUntilNextStep = min(ticksUntilNextStep, connectedBuildings[i]->getTicksUntilEnergyEvent());
+		}
+		nextEconomyTick = tick + max(ticksUntilNextStep, 1);
+	}
+}
+
+void setup() {
+	grid.setup(GRID_CELL_WIDTH);
+
+	font.loadFromFile("tahoma.ttf");
+}
+
+//Commands are the only way the render thread affects the simulation
+const int COMMAND_SELECT_PLAYER = 0;
+const int COMMAND_PLACE_BUILDING = 1;
+const int COMMAND_FIRE_BULLET = 2;
+
+struct Command {
+	int type;
+	int playerId;
+	int buildingType;
+	sf::Vector2i gridPoint;
+	sf::Vector2f pos;
+};
+
+SpscQueue<Command, 256> commandQueue;//render thread -> simulation thread
+TripleBuffer<RenderSnapshot> snapshots;//simulation thread -> render thread
+atomic<bool> simRunning(false);
+atomic<int> viewLeft(0), viewTop(0), viewRight(0), viewBottom(0);//what the render thread is showing
+
+bool isBuildingType(int buildingType);
+
+//Deterministic lockstep multiplayer. Every peer runs the whole simulation itself; the only thing sent is
+//each player's commands, tagged with the tick they run on. A command issued on tick t runs on tick
+//t+LOCKSTEP_INPUT_DELAY everywhere, which hides the round trip, and a peer only runs a tick once it has
+//every player's commands for it (an empty list counts). Peers connect to the host, which relays
+//everyone's messages to everyone else. Each message also carries a hash of the sender's state so that
+//desyncs are noticed on the tick they happen.
+class Lockstep {
+	static const int MESSAGE_WELCOME = 0;
+	static const int MESSAGE_INPUTS = 1;
+
+	struct PeerHash {
+		int tick;
+		int playerId;
+		unsigned int hash;
+	};
+
+	bool active;
+	bool host;
+	int localPlayerId;
+	int playerCount;
+	vector<boost::shared_ptr<sf::TcpSocket>> sockets;//host: one per client, client: just the host
+
+	vector<int> receivedThrough;//per player, the last tick we have their commands for
+	map<int, vector<Command>> commandsByTick;
+	vector<Command> localCommands;//issued since we last sent
+	int sentThrough;
+
+	unsigned int localHashes[LOCKSTEP_HASH_HISTORY];
+	int localHashedThrough;
+	vector<PeerHash> peerHashes;//received before we reached that tick ourselves
+	int desyncTick;
+	string error;
+
+	long long bytesSent;
+	long long bytesReceived;
+	sf::Clock sinceLastTick;//since a tick was last ready to run
+
+	void sendPacket(sf::TcpSocket *socket, sf::Packet &packet) {
+		sf::Socket::Status status;
+		do {
+			status = socket->send(packet);
+		} while (status == sf::Socket::Partial);
+		if (status != sf::Socket::Done)
+			error = "Lost connection to a peer";
+	}
+	void checkPeerHash(const PeerHash &peerHash) {
+		if (localHashes[peerHash.tick % LOCKSTEP_HASH_HISTORY] != peerHash.hash && desyncTick < 0) {
+			desyncTick = peerHash.tick;
+			cerr << "Desync with player " << peerHash.playerId << " at tick " << peerHash.tick << endl;
+		}
+	}
+	void handleInputs(sf::Packet &packet) {
+		sf::Uint8 playerId, commandCount;
+		sf::Uint32 tick, hash;
+		packet >> playerId >> tick >> hash >> commandCount;
+		if (!packet || playerId >= playerCount) {
+			error = "Malformed message from a peer";
+			return;
+		}
+
+		//Nothing is queued until the whole message has been read and checked
+		vector<Command> commands;
+		for (int i=0; i<commandCount; i++) {
+			sf::Uint8 type, buildingType;
+			Command command;
+			bool valid = true;
+			packet >> type;
+			command.type = type;
+			command.playerId = playerId;
+			if (type == COMMAND_PLACE_BUILDING) {
+				sf::Int16 x, y;
+				packet >> buildingType >> x >> y;
+				valid = isBuildingType(buildingType);
+				command.buildingType = buildingType;
+				command.gridPoint = sf::Vector2i(x, y);
+			}
+			else if (type == COMMAND_FIRE_BULLET) {
+				packet >> command.pos.x >> command.pos.y;
+			}
+			else {
+				valid = false;//selecting a player is never sent
+			}
+			if (!packet || !valid) {
+				error = "Malformed message from a peer";
+				return;
+			}
+			commands.push_back(command);
+		}
+		vector<Command> &tickCommands = commandsByTick[tick];
+		tickCommands.insert(tickCommands.end(), commands.begin(), commands.end());
+		receivedThrough[playerId] = tick;
+
+		PeerHash peerHash;
+		peerHash.tick = tick - LOCKSTEP_INPUT_DELAY;
+		peerHash.playerId = playerId;
+		peerHash.hash = hash;
+		if (peerHash.tick <= localHashedThrough)
+			checkPeerHash(peerHash);
+		else
+			peerHashes.push_back(peerHash);
+	}
+public:
+	Lockstep() {
+		active = false;
+		host = false;
+		localPlayerId = 0;
+		playerCount = 1;
+		sentThrough = LOCKSTEP_INPUT_DELAY - 1;
+		localHashedThrough = -1;
+		desyncTick = -1;
+		bytesSent = bytesReceived = 0;
+	}
+	bool isActive() {return active;}
+	int getLocalPlayerId() {return localPlayerId;}
+	int getPlayerCount() {return playerCount;}
+	int getDesyncTick() {return desyncTick;}
+	string getError() {return error;}
+	long long getBytesSent() {return bytesSent;}
+	long long getBytesReceived() {return bytesReceived;}
+
+	//Blocks until playerCount-1 clients have joined, then tells each of them the seed
+	bool startHost(int _playerCount, unsigned short port, unsigned int seed) {
+		sf::TcpListener listener;
+		if (listener.listen(port) != sf::Socket::Done)
+			return false;
+
+		playerCount = _playerCount;
+		localPlayerId = 0;
+		host = true;
+		cout << "Waiting for " << playerCount-1 << " players on port " << port << endl;
+		while (sockets.size() < playerCount-1) {
+			boost::shared_ptr<sf::TcpSocket> socket(new sf::TcpSocket());
+			if (listener.accept(*socket) != sf::Socket::Done)
+				return false;
+			sockets.push_back(socket);
+			cout << "Player " << sockets.size() << " joined" << endl;
+		}
+		for (int i=0; i<sockets.size(); i++) {
+			sf::Packet packet;
+			packet << (sf::Uint8)MESSAGE_WELCOME << (sf::Uint8)(i+1) << (sf::Uint8)playerCount << (sf::Uint32)seed;
+			sendPacket(sockets[i].get(), packet);
+			sockets[i]->setBlocking(false);
+		}
+		receivedThrough.assign(playerCount, LOCKSTEP_INPUT_DELAY - 1);
+		active = true;
+		sinceLastTick.restart();
+		return error.empty();
+	}
+	//Blocks until the host has told us our player id and the seed
+	bool join(string address, unsigned short port, unsigned int *seed) {
+		boost::shared_ptr<sf::TcpSocket> socket(new sf::TcpSocket());
+		if (socket->connect(sf::IpAddress(address), port) != sf::Socket::Done)
+			return false;
+
+		sf::Packet packet;
+		if (socket->receive(packet) != sf::Socket::Done)
+			return false;
+		sf::Uint8 type, playerId, count;
+		sf::Uint32 hostSeed;
+		packet >> type >> playerId >> count >> hostSeed;
+		if (!packet || type != MESSAGE_WELCOME)
+			return false;
 
-			if (possiblyGhostBuilding->isGhost()) {
-				possiblyGhostBuilding->unGhost();
+		localPlayerId = playerId;
+		playerCount = count;
+		*seed = hostSeed;
+		socket->setBlocking(false);
+		sockets.push_back(socket);
+		receivedThrough.assign(playerCount, LOCKSTEP_INPUT_DELAY - 1);
+		active = true;
+		sinceLastTick.restart();
+		return true;
+	}
+
+	void queueLocalCommand(Command command) {
+		command.playerId = localPlayerId;
+		localCommands.push_back(command);
+	}
+	//Sends our commands for tick, along with the hash of our state after tick-LOCKSTEP_INPUT_DELAY
+	void sendInputs(int tick, unsigned int stateHash) {
+		sf::Packet packet;
+		packet << (sf::Uint8)MESSAGE_INPUTS << (sf::Uint8)localPlayerId << (sf::Uint32)tick << (sf::Uint32)stateHash;
+		packet << (sf::Uint8)localCommands.size();
+		for (int i=0; i<localCommands.size(); i++) {
+			packet << (sf::Uint8)localCommands[i].type;
+			if (localCommands[i].type == COMMAND_PLACE_BUILDING)
+				packet << (sf::Uint8)localCommands[i].buildingType << (sf::Int16)localCommands[i].gridPoint.x << (sf::Int16)localCommands[i].gridPoint.y;
+			else if (localCommands[i].type == COMMAND_FIRE_BULLET)
+				packet << localCommands[i].pos.x << localCommands[i].pos.y;
+
+			commandsByTick[tick].push_back(localCommands[i]);
+		}
+		localCommands.clear();
 
-				networkOwner->ghostBuildings.erase(remove(networkOwner->ghostBuildings.begin(), networkOwner->ghostBuildings.end(), possiblyGhostBuilding), networkOwner->ghostBuildings.end());
+		for (int i=0; i<sockets.size(); i++) {
+			sendPacket(sockets[i].get(), packet);
+			bytesSent += packet.getDataSize();
+		}
+		receivedThrough[localPlayerId] = tick;
+		sentThrough = tick;
+	}
+	int getSentThrough() {
+		return sentThrough;
+	}
+	//Handles everything that has arrived, relaying it onwards if we're the host
+	void receive() {
+		for (int i=0; i<sockets.size(); i++) {
+			sf::Packet packet;
+			sf::Socket::Status status;
+			while ((status = sockets[i]->receive(packet)) == sf::Socket::Done) {
+				bytesReceived += packet.getDataSize();
+				if (host) {
+					for (int j=0; j<sockets.size(); j++) {
+						if (j != i)
+							sendPacket(sockets[j].get(), packet);
+					}
+				}
+				sf::Uint8 type;
+				packet >> type;
+				if (type == MESSAGE_INPUTS)
+					handleInputs(packet);
+				packet.clear();
+			}
+			if (status == sf::Socket::Disconnected || status == sf::Socket::Error)
+				error = "Lost connection to a peer";
+		}
+	}
+	bool isTickReady(int tick) {
+		for (int i=0; i<playerCount; i++) {
+			if (receivedThrough[i] < tick)
+				return false;
+		}
+		sinceLastTick.restart();
+		return true;
+	}
+	//While waiting for a tick: whether the match can't go on, because a peer has gone or hasn't sent its
+	//commands in LOCKSTEP_TIMEOUT_SECONDS. getError() says which.
+	bool hasStalled() {
+		if (error.empty() && sinceLastTick.getElapsedTime() > sf::seconds(LOCKSTEP_TIMEOUT_SECONDS)) {
+			stringstream message;
+			message << "No commands from a peer for " << LOCKSTEP_TIMEOUT_SECONDS << " seconds";
+			error = message.str();
+		}
+		return !error.empty();
+	}
+	//Every player's commands for tick, in player order so all peers run them identically
+	vector<Command> takeCommands(int tick) {
+		vector<Command> commands;
+		map<int, vector<Command>>::iterator it = commandsByTick.find(tick);
+		if (it != commandsByTick.end()) {
+			commands.swap(it->second);
+			commandsByTick.erase(it);
+		}
+		stable_sort(commands.begin(), commands.end(), [](const Command &a, const Command &b) {return a.playerId < b.playerId; });
+		return commands;
+	}
+	void recordStateHash(int tick, unsigned int hash) {
+		localHashes[tick % LOCKSTEP_HASH_HISTORY] = hash;
+		localHashedThrough = tick;
+
+		for (int i=0; i<peerHashes.size(); i++) {
+			if (peerHashes[i].tick <= tick) {
+				checkPeerHash(peerHashes[i]);
+				peerHashes[i] = peerHashes.back();
+				peerHashes.pop_back();
+				i--;
+			}
+		}
+	}
+	unsigned int getStateHash(int tick) {
+		return localHashes[tick % LOCKSTEP_HASH_HISTORY];
+	}
+};
+
+Lockstep lockstep;
+
+//Map generation. Mass piles are laid out as a Poisson disc set (no two closer than massPileSpacing) by
+//dart throwing into square cells as wide as the spacing, one pile at most to each, so only the eight
+//neighbouring cells can hold a pile that's too close (cells small enough that two piles could never share
+//one pack a little tighter, but there are twice as many of them to visit). The cells are grouped
+//into chunks, and the chunks coloured in a 2x2 pattern: chunks of one colour are at least a chunk apart, so
+//they're filled in parallel, each with random numbers seeded from its own position, and one colour after
+//another. The result depends only on the seed, not on the number of threads. Nexus sites are laid out on a
+//regular grid, and the area round each is cleared and given the same pattern of piles.
+
+//Random numbers that come out the same on every platform, unlike rand() (splitmix64)
+class MapRandom {
+	unsigned long long state;
+public:
+	MapRandom(unsigned long long seed) {
+		state = seed;
+	}
+	unsigned int next() {
+		unsigned long long z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return (unsigned int)((z ^ (z >> 31)) >> 32);
+	}
+};
+
+struct MapSettings {
+	unsigned int seed;
+	int width, height;//grid cells
+	float massPileSpacing;//least distance between mass piles, in grid cells
+	int nexusSites;
+	int threads;//0 for one per core
+	MapSettings() {
+		seed = 1;
+		width = MAP_DEFAULT_WIDTH;
+		height = MAP_DEFAULT_HEIGHT;
+		massPileSpacing = MAP_MASSPILE_SPACING;
+		nexusSites = 1;
+		threads = 0;
+	}
+};
+
+struct MapLayout {
+	vector<sf::Vector2i> massPiles;
+	vector<sf::Vector2i> nexusSites;
+};
+
+class MapGenerator {
+	enum {EMPTY_CELL = 0xFFFF};
+
+	MapSettings settings;
+	int cellWidth;//in grid cells; at least the spacing, so no pile rules out the whole of a neighbouring cell
+	vector<sf::Vector2i> neighbourCells;//offsets of the cells that can hold a pile too close to one in a cell, nearest first
+	vector<int> neighbourIndices;//the same offsets, as differences in index into cells
+	int border;//empty cells round the map, so neighbours never need bounds checks
+	int cellsAcross, cellsDown;
+	int stride;//cells across, with the border
+	int chunksAcross, chunksDown;
+	int minDistanceSquared;//integer squared distances at least this far apart are far enough
+	vector<unsigned short> cells;//each pile's offset in its cell, x in the low byte, or EMPTY_CELL
+	vector<int> chunkPileCounts;//then where each chunk's piles start in the layout
+
+	int getCellIndex(int cellX, int cellY) {
+		return (cellY + border)*stride + cellX + border;
+	}
+	sf::Vector2i getPile(int cellX, int cellY) {
+		unsigned short cell = cells[getCellIndex(cellX, cellY)];
+		return sf::Vector2i(cellX*cellWidth + (cell & 0xFF), cellY*cellWidth + (cell >> 8));
+	}
+	bool isTooClose(int offsetX, int offsetY) {
+		return offsetX*offsetX + offsetY*offsetY < minDistanceSquared;
+	}
+	//Positions are kept relative to the corner of the cell being filled
+	void fillChunk(int chunkX, int chunkY) {
+		MapRandom random(((unsigned long long)settings.seed << 32) ^ ((unsigned long long)chunkY * chunksAcross + chunkX));
+		vector<sf::Vector2i> nearbyPiles(neighbourCells.size());
+		int pileCount = 0;
+		for (int cellY=chunkY*MAP_CHUNK_CELLS; cellY<min(cellsDown, (chunkY+1)*MAP_CHUNK_CELLS); cellY++) {
+			for (int cellX=chunkX*MAP_CHUNK_CELLS; cellX<min(cellsAcross, (chunkX+1)*MAP_CHUNK_CELLS); cellX++) {
+				//Gather the piles that could be too close
+				int index = getCellIndex(cellX, cellY);
+				int nearbyCount = 0;
+				for (int i=0; i<neighbourIndices.size(); i++) {
+					unsigned short cell = cells[index + neighbourIndices[i]];
+					if (cell != EMPTY_CELL)
+						nearbyPiles[nearbyCount++] = sf::Vector2i(neighbourCells[i].x*cellWidth + (cell & 0xFF), neighbourCells[i].y*cellWidth + (cell >> 8));
+				}
+
+				for (int attempt=0; attempt<MAP_PLACEMENT_ATTEMPTS; attempt++) {
+					//Both offsets from one draw, scaled rather than taken modulo, which would mean two divisions
+					unsigned int bits = random.next();
+					int offsetX = ((bits >> 16) * cellWidth) >> 16, offsetY = ((bits & 0xFFFF) * cellWidth) >> 16;
+					if (cellX*cellWidth + offsetX >= settings.width || cellY*cellWidth + offsetY >= settings.height)
+						continue;
+					bool farEnough = true;
+					for (int i=0; i<nearbyCount && farEnough; i++) {
+						farEnough = !isTooClose(offsetX - nearbyPiles[i].x, offsetY - nearbyPiles[i].y);
+					}
+					if (!farEnough)
+						continue;
+					cells[index] = offsetX | (offsetY << 8);
+					pileCount++;
+					break;
+				}
+			}
+		}
+		chunkPileCounts[chunkY*chunksAcross + chunkX] = pileCount;
+	}
+	//Every thread'th chunk of a colour, starting from the thread'th
+	void fillChunks(int colour, int thread, int threadCount) {
+		int n = 0;
+		for (int chunkY=colour/2; chunkY<chunksDown; chunkY+=2) {
+			for (int chunkX=colour%2; chunkX<chunksAcross; chunkX+=2) {
+				if (n++ % threadCount == thread)
+					fillChunk(chunkX, chunkY);
+			}
+		}
+	}
+	//Writes each chunk's piles to where chunkPileCounts says they start
+	void collectChunks(vector<sf::Vector2i> &piles, int thread, int threadCount) {
+		for (int chunk=thread; chunk<chunksAcross*chunksDown; chunk+=threadCount) {
+			int chunkX = chunk % chunksAcross, chunkY = chunk / chunksAcross;
+			int pile = chunkPileCounts[chunk];
+			for (int cellY=chunkY*MAP_CHUNK_CELLS; cellY<min(cellsDown, (chunkY+1)*MAP_CHUNK_CELLS); cellY++) {
+				for (int cellX=chunkX*MAP_CHUNK_CELLS; cellX<min(cellsAcross, (chunkX+1)*MAP_CHUNK_CELLS); cellX++) {
+					if (cells[getCellIndex(cellX, cellY)] != EMPTY_CELL)
+						piles[pile++] = getPile(cellX, cellY);
+				}
+			}
+		}
+	}
+	//Runs job(thread, threadCount) on each of the threads
+	void runOnThreads(function<void(int, int)> job, int threadCount) {
+		vector<thread> threads;
+		for (int i=1; i<threadCount; i++) {
+			threads.push_back(thread(job, i, threadCount));
+		}
+		job(0, threadCount);
+		for (int i=0; i<threads.size(); i++) {
+			threads[i].join();
+		}
+	}
+	vector<sf::Vector2i> getNexusSites() {
+		vector<sf::Vector2i> sites;
+		if (settings.nexusSites <= 0)
+			return sites;
+		int columns = ceil(sqrt((float)settings.nexusSites * settings.width / settings.height));
+		int rows = (settings.nexusSites + columns - 1) / columns;
+		for (int i=0; i<settings.nexusSites; i++) {
+			sites.push_back(sf::Vector2i((2*(i%columns) + 1) * settings.width / (2*columns), (2*(i/columns) + 1) * settings.height / (2*rows)));
+		}
+		return sites;
+	}
+	void clearAround(sf::Vector2i site, float radius) {
+		int cellX = site.x / cellWidth, cellY = site.y / cellWidth;
+		int cellReach = ceil(radius / cellWidth) + 1;
+		for (int y=max(0, cellY-cellReach); y<=min(cellsDown-1, cellY+cellReach); y++) {
+			for (int x=max(0, cellX-cellReach); x<=min(cellsAcross-1, cellX+cellReach); x++) {
+				if (cells[getCellIndex(x, y)] != EMPTY_CELL && getMagnitude(getPile(x, y) - site) < radius) {
+					cells[getCellIndex(x, y)] = EMPTY_CELL;
+					chunkPileCounts[(y / MAP_CHUNK_CELLS)*chunksAcross + x / MAP_CHUNK_CELLS]--;
+				}
+			}
+		}
+	}
+public:
+	MapGenerator(const MapSettings &_settings) {
+		settings = _settings;
+		cellWidth = max(1, min(255, (int)ceil(settings.massPileSpacing)));
+		int reach = ceil(settings.massPileSpacing / cellWidth);
+		for (int y=-reach; y<=reach; y++) {
+			for (int x=-reach; x<=reach; x++) {
+				//Piles in cells this far apart are at least this far apart
+				sf::Vector2i gap(max(0, (abs(x)-1)*cellWidth + 1), max(0, (abs(y)-1)*cellWidth + 1));
+				if ((x != 0 || y != 0) && (float)(gap.x*gap.x + gap.y*gap.y) < settings.massPileSpacing * settings.massPileSpacing)
+					neighbourCells.push_back(sf::Vector2i(x, y));
+			}
+		}
+		sort(neighbourCells.begin(), neighbourCells.end(), [](const sf::Vector2i &a, const sf::Vector2i &b) {
+			return a.x*a.x + a.y*a.y < b.x*b.x + b.y*b.y || (a.x*a.x + a.y*a.y == b.x*b.x + b.y*b.y && (a.y < b.y || (a.y == b.y && a.x < b.x)));
+		});
+		border = reach;
+		cellsAcross = (settings.width + cellWidth - 1) / cellWidth;
+		cellsDown = (settings.height + cellWidth - 1) / cellWidth;
+		stride = cellsAcross + 2*border;
+		for (int i=0; i<neighbourCells.size(); i++) {
+			neighbourIndices.push_back(neighbourCells[i].y*stride + neighbourCells[i].x);
+		}
+		chunksAcross = (cellsAcross + MAP_CHUNK_CELLS - 1) / MAP_CHUNK_CELLS;
+		chunksDown = (cellsDown + MAP_CHUNK_CELLS - 1) / MAP_CHUNK_CELLS;
+		minDistanceSquared = ceil(settings.massPileSpacing * settings.massPileSpacing);
+	}
+	MapLayout generate() {
+		int threadCount = settings.threads > 0 ? settings.threads : max(1, (int)thread::hardware_concurrency());
+		cells.assign(stride*(cellsDown + 2*border), EMPTY_CELL);
+		chunkPileCounts.assign(chunksAcross*chunksDown, 0);
+		for (int colour=0; colour<4; colour++) {
+			runOnThreads([this, colour](int thread, int threadCount) {fillChunks(colour, thread, threadCount); }, threadCount);
+		}
+
+		MapLayout layout;
+		layout.nexusSites = getNexusSites();
+		for (int i=0; i<layout.nexusSites.size(); i++) {
+			clearAround(layout.nexusSites[i], MAP_START_PILE_DISTANCE + settings.massPileSpacing);
+		}
+
+		int pileCount = 0;
+		for (int i=0; i<chunkPileCounts.size(); i++) {
+			int count = chunkPileCounts[i];
+			chunkPileCounts[i] = pileCount;
+			pileCount += count;
+		}
+		layout.massPiles.resize(pileCount + layout.nexusSites.size()*MAP_START_PILES);
+		runOnThreads([this, &layout](int thread, int threadCount) {collectChunks(layout.massPiles, thread, threadCount); }, threadCount);
+
+		//The same piles round every site
+		for (int i=0; i<layout.nexusSites.size(); i++) {
+			for (int j=0; j<MAP_START_PILES; j++) {
+				float angle = (j + 0.5f) * 2 * 3.14159265f / MAP_START_PILES;
+				sf::Vector2i offset(roundToInt(cos(angle) * MAP_START_PILE_DISTANCE), roundToInt(sin(angle) * MAP_START_PILE_DISTANCE));
+				layout.massPiles[pileCount++] = layout.nexusSites[i] + offset;
+			}
+		}
+		return layout;
+	}
+};
+
+MapLayout generateMap(const MapSettings &settings) {
+	MemoryTagScope tag(MEMTAG_MASSPILES);
+	return MapGenerator(settings).generate();
+}
+
+//Adds the map's mass piles to this thread's world. Most go straight into dormant chunks, without ever
+//becoming MassPiles.
+void addMassPiles(const MapLayout &layout, float massPerPile) {
+	MemoryTagScope tag(MEMTAG_MASSPILES);
+	for (int i=0; i<layout.massPiles.size(); i++) {
+		if (worldChunks.isActive(layout.massPiles[i]))
+			addMassPile(boost::shared_ptr<MassPile>(new MassPile(layout.massPiles[i], massPerPile)));
+		else {
+			worldChunks.addDormantMassPile(DormantMassPile(layout.massPiles[i], massPerPile));
+			occupancy.fill(layout.massPiles[i], 1);
+		}
+	}
+}
+
+//Simulation thread state
+
+boost::shared_ptr<Player> selectedPlayer;
+unsigned int worldSeed = 1;//the same on every peer in a lockstep game
+
+//Creates this thread's world, with a nexus for each of the first startingPlayers players
+void start(unsigned int seed, int startingPlayers) {
+	srand(seed);
+	for (int i=0; i<9; i++) {
+		players.push_back(boost::shared_ptr<Player>(new Player(i)));
+	}
+
+	selectedPlayer = players.front();
+
+	MapSettings settings;
+	settings.seed = seed;
+	settings.nexusSites = startingPlayers;
+	MapLayout layout = generateMap(settings);
+
+	for (int i=0; i<startingPlayers; i++) {
+		boost::shared_ptr<Nexus> nexus = boost::shared_ptr<Nexus>(new Nexus(players[i], layout.nexusSites[i], false));
+		nexus->magicallyComplete();
+		nexus->depositMass(3000);
+
+		addBuilding(nexus);
+		players[i]->ownedBuildings.insert(nexus);
+		players[i]->coverage.add(nexus);
+
+		players[i]->network = boost::shared_ptr<Network>(new Network(players[i], nexus));
+	}
+
+	addMassPiles(layout, MAP_MASSPILE_MASS);
+}
+
+boost::shared_ptr<Building> createBuilding(int buildingType, boost::weak_ptr<Player> owner, sf::Vector2i gridPoint, bool ghost) {
+	MemoryTagScope tag(MEMTAG_BUILDINGS);
+	if (buildingType == BUILDINGTYPE_NEXUS) {
+		return boost::shared_ptr<Nexus>(new Nexus(owner, gridPoint, ghost));
+	}
+	else if (buildingType == BUILDINGTYPE_NODE) {
+		return boost::shared_ptr<Node>(new Node(owner, gridPoint, ghost));
+	}
+	else if (buildingType == BUILDINGTYPE_GENERATOR) {
+		return boost::shared_ptr<Generator>(new Generator(owner, gridPoint, ghost));
+	}
+	else if (buildingType == BUILDINGTYPE_MINER) {
+		return boost::shared_ptr<Miner>(new Miner(owner, gridPoint, ghost));
+	}
+	else if (buildingType == BUILDINGTYPE_ENERGYCANNON) {
+		return boost::shared_ptr<EnergyCannon>(new EnergyCannon(owner, gridPoint, ghost));
+	}
+	assert(false);
+	return boost::shared_ptr<Building>();
+}
+
+//The width createBuilding() would give a building of that type, without making one
+int getBuildingWidth(int buildingType) {
+	switch (buildingType) {
+	case BUILDINGTYPE_NEXUS:
+		return NEXUS_WIDTH;
+	case BUILDINGTYPE_NODE:
+		return NODE_WIDTH;
+	case BUILDINGTYPE_GENERATOR:
+		return GENERATOR_WIDTH;
+	case BUILDINGTYPE_MINER:
+		return MINER_WIDTH;
+	case BUILDINGTYPE_ENERGYCANNON:
+		return ENERGYCANNON_WIDTH;
+	}
+	assert(false);
+	return 0;
+}
+
+//Whether createBuilding() makes buildings of that type, for types read from outside the game
+bool isBuildingType(int buildingType) {
+	return buildingType >= BUILDINGTYPE_NEXUS && buildingType <= BUILDINGTYPE_ENERGYCANNON;
+}
+
+//Does nothing if the building would overlap a building, a ghost or a mass pile
+void placeBuilding(boost::shared_ptr<Player> player, int buildingType, sf::Vector2i gridPoint) {
+	MemoryTagScope tag(MEMTAG_BUILDINGS);
+	if (!occupancy.isFree(gridPoint, getBuildingWidth(buildingType)))
+		return;
+	boost::shared_ptr<Building> newBuilding = createBuilding(buildingType, player, gridPoint, true);
+
+	if (boost::shared_ptr<Nexus> newNexus = boost::dynamic_pointer_cast<Nexus, Building>(newBuilding)) {
+		//check if this player already has a nexus
+		bool hasNexus = false;
+		for (int i=0; i<player->ownedBuildings.size(); i++) {
+			if (boost::dynamic_pointer_cast<Nexus, Building>(player->ownedBuildings[i])) {
+				hasNexus = true;
+				break;
+			}
+		}
+
+		if (!hasNexus) {
+			newNexus->unGhost();
+			newNexus->magicallyComplete();
+
+			addBuilding(newNexus);
+			player->ownedBuildings.insert(newNexus);
+			player->coverage.add(newNexus);
+
+			player->network = boost::shared_ptr<Network>(new Network(player, newNexus));
+		}
+	}
+	if (newBuilding->isGhost()) {//a new Nexus is placed directly
+		occupancy.fill(gridPoint, newBuilding->getWidth());
+		player->ghostBuildings.insert(newBuilding);
+		registerNewGhostBuilding(player, newBuilding);
+	}
+}
+
+void executeCommand(const Command &command) {
+	if (command.playerId < 0 || command.playerId >= players.size())
+		return;
+	boost::shared_ptr<Player> player = players[command.playerId];
+
+	if (command.type == COMMAND_SELECT_PLAYER) {
+		selectedPlayer = player;
+	}
+	else if (command.type == COMMAND_PLACE_BUILDING) {
+		placeBuilding(player, command.buildingType, command.gridPoint);
+	}
+	else if (command.type == COMMAND_FIRE_BULLET) {
+		addMob(boost::shared_ptr<EnergyBullet>(new EnergyBullet(command.pos, player, sf::Vector2f(100,100))));
+	}
+}
+
+thread_local int frameNum(0);
+
+const char *TICKPHASE_NAMES[TICKPHASE_COUNT] = {"buildings", "networks", "mobs", "bullets", "masspiles", "cleanup"};
+
+//How long each part of one go() took
+struct TickProfile {
+	double phaseMilliseconds[TICKPHASE_COUNT];
+	TickProfile() {
+		for (int i=0; i<TICKPHASE_COUNT; i++) {
+			phaseMilliseconds[i] = 0;
+		}
+	}
+};
+
+//go() fills this in if it's set, and otherwise doesn't look at the clock
+thread_local TickProfile *tickProfile = NULL;
+
+//Times go()'s phases into tickProfile: each end() closes the phase that started at the last one
+class PhaseTimer {
+	chrono::high_resolution_clock::time_point start;
+public:
+	PhaseTimer() {
+		if (tickProfile)
+			start = chrono::high_resolution_clock::now();
+	}
+	void end(int phase) {
+		if (!tickProfile)
+			return;
+		chrono::high_resolution_clock::time_point now = chrono::high_resolution_clock::now();
+		tickProfile->phaseMilliseconds[phase] = chrono::duration<double, milli>(now - start).count();
+		start = now;
+	}
+};
+
+void go() {
+	PhaseTimer phases;
+	MemoryTagScope tag(MEMTAG_BUILDINGS);
+	scheduler.runBuildings();
+	phases.end(TICKPHASE_BUILDINGS);
+	tag.set(MEMTAG_NETWORKS);
+	for (int i=0; i<players.size(); i++) {
+		if (players[i]->network)
+			players[i]->network->go();
+	}
+	phases.end(TICKPHASE_NETWORKS);
+
+	tag.set(MEMTAG_MOBS);
+	for (int i=0; i<mobs.size(); i++) {
+		mobs[i]->go();
+	}
+	phases.end(TICKPHASE_MOBS);
+	resolveBulletCollisions();
+	phases.end(TICKPHASE_BULLETS);
+
+	tag.set(MEMTAG_MASSPILES);
+	for (int i=0; i<massPiles.size(); i++) {
+		massPiles[i]->go();
+	}
+	phases.end(TICKPHASE_MASSPILES);
+
+	//remove anything that's dead
+	lifecycle.compact();
+	worldChunks.sleepEmptied();
+	tag.set(MEMTAG_BUILDINGS);
+	scheduler.endTick();
+	frameArena.reset();
+	sampleMemoryPeaks();
+	frameNum++;
+	phases.end(TICKPHASE_CLEANUP);
+}
+
+//World forking, for look-ahead simulations. forkWorld() deep copies this thread's players, buildings, mobs and
+//active mass piles, in time proportional to how many there are (about a millisecond per thousand buildings),
+//however little the fork goes on to change. Only the bulk of a big map (the occupancy map's tiles and the
+//dormant chunks' mass piles) is shared through CopyOnWrite, so that part only costs a pointer per tile or
+//chunk, and whichever world changes a shared piece first copies it. Entities aren't shared: they're changed
+//in place through shared_ptrs all over the simulation, so sharing them would take every write going through
+//an accessor that knows about forks. A fork is for a look-ahead or an occasional checkpoint, not something
+//to take every tick. Nothing the fork changes is visible to the original, so it can be simulated on another
+//thread.
+
+//Copies entities, keeping track of the copy made of each so every reference ends up pointing at the copy.
+//copy() only clones an entity and queues it; remapAll() then points the queued copies' references at other
+//copies (cloning those in turn), so long chains of references don't recurse.
+class WorldCopier {
+	unordered_map<Building*, boost::shared_ptr<Building>> buildingCopies;
+	unordered_map<Player*, boost::shared_ptr<Player>> playerCopies;
+	unordered_map<MassPile*, boost::shared_ptr<MassPile>> massPileCopies;
+	vector<boost::shared_ptr<Building>> buildingsToRemap;
+	vector<boost::shared_ptr<Player>> playersToRemap;
+
+	void remapBuilding(boost::shared_ptr<Building> building) {
+		building->setOwner(copy(building->getOwner()));
+		if (boost::shared_ptr<Miner> miner = boost::dynamic_pointer_cast<Miner, Building>(building))
+			miner->setTarget(copy(miner->getTarget()));
+		if (boost::shared_ptr<AttackerBaseClass> attacker = boost::dynamic_pointer_cast<AttackerBaseClass, Building>(building))
+			attacker->setTarget(copy(attacker->getTarget()));
+	}
+	void remapPlayer(boost::shared_ptr<Player> player) {
+		player->ownedBuildings.remapReferences(*this);
+		player->ghostBuildings.remapReferences(*this);
+		player->coverage.remapReferences(*this);
+		if (player->network) {
+			player->network = boost::shared_ptr<Network>(new Network(*player->network));
+			player->network->remapReferences(*this);
+		}
+	}
+public:
+	boost::shared_ptr<Building> copy(const boost::shared_ptr<Building> &building) {
+		if (!building)
+			return building;
+		boost::shared_ptr<Building> &buildingCopy = buildingCopies[building.get()];
+		if (!buildingCopy) {
+			buildingCopy = building->clone();
+			buildingsToRemap.push_back(buildingCopy);
+		}
+		return buildingCopy;
+	}
+	template <class BuildingClass>
+	boost::shared_ptr<BuildingClass> copy(const boost::shared_ptr<BuildingClass> &building) {
+		return boost::dynamic_pointer_cast<BuildingClass, Building>(copy(boost::shared_ptr<Building>(building)));
+	}
+	boost::shared_ptr<Player> copy(const boost::shared_ptr<Player> &player) {
+		if (!player)
+			return player;
+		boost::shared_ptr<Player> &playerCopy = playerCopies[player.get()];
+		if (!playerCopy) {
+			playerCopy = boost::shared_ptr<Player>(new Player(*player));
+			playersToRemap.push_back(playerCopy);
+		}
+		return playerCopy;
+	}
+	boost::shared_ptr<MassPile> copy(const boost::shared_ptr<MassPile> &massPile) {
+		if (!massPile)
+			return massPile;
+		boost::shared_ptr<MassPile> &massPileCopy = massPileCopies[massPile.get()];
+		if (!massPileCopy)
+			massPileCopy = boost::shared_ptr<MassPile>(new MassPile(*massPile));
+		return massPileCopy;
+	}
+	//Nothing refers to a mob, so it's never met twice
+	boost::shared_ptr<Mob> copy(const boost::shared_ptr<Mob> &mob) {
+		boost::shared_ptr<Mob> mobCopy = mob->clone();
+		mobCopy->setOwner(copy(mobCopy->getOwner()));
+		return mobCopy;
+	}
+	template <class T>
+	boost::weak_ptr<T> copy(const boost::weak_ptr<T> &entity) {
+		return copy(entity.lock());
+	}
+	template <class Ref>
+	void copyAll(vector<Ref> &refs) {
+		for (int i=0; i<refs.size(); i++) {
+			refs[i] = copy(refs[i]);
+		}
+	}
+	void remapAll() {
+		while (buildingsToRemap.size() > 0 || playersToRemap.size() > 0) {
+			if (buildingsToRemap.size() > 0) {
+				boost::shared_ptr<Building> building = buildingsToRemap.back();
+				buildingsToRemap.pop_back();
+				remapBuilding(building);
+			}
+			else {
+				boost::shared_ptr<Player> player = playersToRemap.back();
+				playersToRemap.pop_back();
+				remapPlayer(player);
+			}
+		}
+	}
+};
+
+void TimerWheel::remapReferences(WorldCopier &copier) {
+	for (int i=0; i<LEVEL0_SLOTS; i++) {
+		for (int j=0; j<level0[i].size(); j++) {
+			level0[i][j].building = copier.copy(level0[i][j].building);
+		}
+	}
+	for (int i=0; i<LEVEL_SLOTS; i++) {
+		for (int j=0; j<level1[i].size(); j++) {
+			level1[i][j].building = copier.copy(level1[i][j].building);
+		}
+		for (int j=0; j<level2[i].size(); j++) {
+			level2[i][j].building = copier.copy(level2[i][j].building);
+		}
+	}
+	for (int i=0; i<overflow.size(); i++) {
+		overflow[i].building = copier.copy(overflow[i].building);
+	}
+}
+
+void Scheduler::remapReferences(WorldCopier &copier) {
+	wheel.remapReferences(copier);
+	copier.copyAll(dueBuildings);
+	for (int i=0; i<enemyWaiters.size(); i++) {
+		enemyWaiters[i].building = copier.copy(enemyWaiters[i].building);
+	}
+	for (int i=0; i<massPileWaiters.size(); i++) {
+		massPileWaiters[i].building = copier.copy(massPileWaiters[i].building);
+	}
+}
+
+void CoverageMap::remapReferences(WorldCopier &copier) {
+	for (unordered_map<long long, Tile>::iterator tile = tiles.begin(); tile != tiles.end(); tile++) {
+		for (int i=0; i<tile->second.nodes.size(); i++) {
+			tile->second.nodes[i].node = copier.copy(tile->second.nodes[i].node);
+		}
+	}
+}
+
+template <class BuildingClass>
+void BuildingSetOf<BuildingClass>::remapReferences(WorldCopier &copier) {
+	copier.copyAll(items);
+	indices.clear();
+	for (int i=0; i<items.size(); i++) {
+		indices[items[i].get()] = i;
+	}
+}
+
+void ConnectionGraph::remapReferences(WorldCopier &copier) {
+	copier.copyAll(entities);
+	copier.copyAll(entityNodes);
+	indices.clear();
+	for (int i=0; i<entities.size(); i++) {
+		indices[entities[i].get()] = i;
+	}
+}
+
+void ConstructionQueue::remapReferences(WorldCopier &copier) {
+	for (int i=0; i<waiting.size(); i++) {
+		waiting[i].building = copier.copy(waiting[i].building);
+	}
+	for (int i=0; i<active.size(); i++) {
+		active[i].building = copier.copy(active[i].building);
+	}
+}
+
+void Network::remapReferences(WorldCopier &copier) {
+	owner = copier.copy(owner);
+	connectedBuildings.remapReferences(copier);
+	construction.remapReferences(copier);
+	nexus = copier.copy(nexus);
+	activeNodes.remapReferences(copier);
+	copier.copyAll(deadBuildings);
+	connections.remapReferences(copier);
+	copier.copyAll(completedNodes);
+	copier.copyAll(ghostActivationQueue);
+}
+
+//Everything that makes up a world, for holding one that isn't this thread's. Worlds are moved or swapped,
+//never copied: a copy would share every entity with the original. forkWorld() makes a real copy.
+struct World {
+	vector<boost::shared_ptr<Player>> players;
+	vector<boost::shared_ptr<Building>> buildings;
+	vector<boost::shared_ptr<Mob>> mobs;
+	vector<boost::shared_ptr<MassPile>> massPiles;
+	WorldChunks worldChunks;
+	OccupancyMap occupancy;
+	ThreatField threatField;
+	Lifecycle lifecycle;//with no deaths pending, between ticks
+	Scheduler scheduler;
+	int frameNum;
+	World() {
+		frameNum = 0;
+	}
+	World(World &&) = default;
+	World &operator=(World &&) = default;
+	World(const World &) = delete;
+	World &operator=(const World &) = delete;
+};
+
+//Must be called between ticks
+World forkWorld() {
+	WorldCopier copier;
+	World fork;
+	for (int i=0; i<players.size(); i++) {
+		fork.players.push_back(copier.copy(players[i]));
+	}
+	for (int i=0; i<buildings.size(); i++) {
+		fork.buildings.push_back(copier.copy(buildings[i]));
+	}
+	for (int i=0; i<mobs.size(); i++) {
+		fork.mobs.push_back(copier.copy(mobs[i]));
+	}
+	for (int i=0; i<massPiles.size(); i++) {
+		fork.massPiles.push_back(copier.copy(massPiles[i]));
+	}
+	fork.worldChunks = worldChunks;
+	fork.occupancy = occupancy;
+	fork.threatField = threatField;
+	fork.scheduler = scheduler;
+	fork.scheduler.remapReferences(copier);
+	copier.remapAll();
+	fork.frameNum = frameNum;
+	return fork;
+}
+
+//Exchanges this thread's world with world
+void swapWorld(World &world) {
+	players.swap(world.players);
+	buildings.swap(world.buildings);
+	mobs.swap(world.mobs);
+	massPiles.swap(world.massPiles);
+	swap(worldChunks, world.worldChunks);
+	swap(occupancy, world.occupancy);
+	swap(threatField, world.threatField);
+	swap(lifecycle, world.lifecycle);
+	swap(scheduler, world.scheduler);
+	swap(frameNum, world.frameNum);
+	//The cached arrays belong to the old world
+	buildingsVersion++;
+	massPilesVersion++;
+}
+
+//A look-ahead from a forked world: change is applied to it, it's simulated for ticks ticks, then evaluate
+//scores it. Both are called on the thread simulating the fork, with the fork as that thread's world.
+struct WhatIf {
+	World world;
+	function<void()> change;
+	function<double()> evaluate;
+	int ticks;
+	double result;
+	WhatIf() {
+		ticks = 0;
+		result = 0;
+	}
+};
+
+//Leaves whatIf.world as it is after the look-ahead, and this thread's own world untouched
+void runWhatIf(WhatIf &whatIf) {
+	swapWorld(whatIf.world);
+	if (whatIf.change)
+		whatIf.change();
+	for (int i=0; i<whatIf.ticks; i++) {
+		go();
+	}
+	if (whatIf.evaluate)
+		whatIf.result = whatIf.evaluate();
+	swapWorld(whatIf.world);
+}
+
+//Runs each what-if on its own thread
+void runWhatIfs(vector<WhatIf> &whatIfs) {
+	vector<thread> threads;
+	for (int i=0; i<whatIfs.size(); i++) {
+		threads.push_back(thread(runWhatIf, ref(whatIfs[i])));
+	}
+	for (int i=0; i<threads.size(); i++) {
+		threads[i].join();
+	}
+}
+
+//Saved worlds, so a watchdog bundle (see Watchdog) can be replayed offline. Every class holding world state
+//has a transfer() that passes each of its members through a WorldArchive, which either writes it or reads
+//it back, so saving and loading go through the same code and can't get out of step. Entities are written
+//once each and referred to by number: the numbered buildings, mass piles and players first, then their
+//contents (buildings before players, whose sets need their buildings' positions), then the thread_local
+//lists. Floats are written as their bits, so a loaded world plays on exactly as the saved one would have.
+//Whatever can be worked out from the rest (indices, position arrays, the threat field, the distance score
+//bookkeeping) is rebuilt rather than saved.
+class WorldArchive {
+	bool reading;
+	bool failed;
+	istream *in;
+	ostream *out;
+	vector<boost::shared_ptr<Building>> buildingTable;
+	vector<boost::shared_ptr<MassPile>> massPileTable;
+	vector<boost::shared_ptr<Player>> playerTable;
+	unordered_map<Building*, int> buildingIds;
+	unordered_map<MassPile*, int> massPileIds;
+	unordered_map<Player*, int> playerIds;
+
+	template <class T>
+	void number(T &x) {
+		if (!reading) {
+			*out << x << ' ';
+			return;
+		}
+		if (!failed && !(*in >> x))
+			failed = true;
+		if (failed)
+			x = T();
+	}
+	//-1 for NULL. When writing, an entity met for the first time is given the next number.
+	template <class Entity>
+	void entityRef(boost::shared_ptr<Entity> &entity, vector<boost::shared_ptr<Entity>> &table, unordered_map<Entity*, int> &ids) {
+		int id = -1;
+		if (!reading && entity) {
+			auto inserted = ids.insert(make_pair(entity.get(), (int)table.size()));
+			if (inserted.second)
+				table.push_back(entity);
+			id = inserted.first->second;
+		}
+		number(id);
+		if (!reading)
+			return;
+		if (id < -1 || id >= (int)table.size())
+			fail();
+		entity = (id >= 0 && !failed) ? table[id] : boost::shared_ptr<Entity>();
+	}
+	void transferWorld();
+public:
+	WorldArchive(ostream &_out) {
+		reading = failed = false;
+		in = NULL;
+		out = &_out;
+	}
+	WorldArchive(istream &_in) {
+		reading = true;
+		failed = false;
+		in = &_in;
+		out = NULL;
+	}
+	bool isReading() {
+		return reading;
+	}
+	void fail() {
+		failed = true;
+	}
+	void value(int &x) {number(x);}
+	void value(unsigned int &x) {number(x);}
+	void value(long long &x) {number(x);}
+	void value(unsigned long long &x) {number(x);}
+	void value(bool &x) {number(x);}
+	void value(float &x) {
+		unsigned int bits;
+		memcpy(&bits, &x, sizeof(bits));
+		number(bits);
+		memcpy(&x, &bits, sizeof(bits));
+	}
+	void value(sf::Vector2i &v) {
+		value(v.x);
+		value(v.y);
+	}
+	void value(sf::Vector2f &v) {
+		value(v.x);
+		value(v.y);
+	}
+	//How many of something follow; 0 once reading has failed
+	int count(int n) {
+		number(n);
+		if (n < 0 || n > SAVEDWORLD_MAX_COUNT) {
+			fail();
+			n = 0;
+		}
+		return failed ? 0 : n;
+	}
+	//A word marking what comes next, checked when reading
+	void label(const char *name) {
+		if (!reading) {
+			*out << '\n' << name << ' ';
+			return;
+		}
+		string word;
+		if (!failed && !(*in >> word && word == name))
+			failed = true;
+	}
+	template <class T>
+	void values(vector<T> &xs) {
+		xs.resize(count(xs.size()));
+		for (int i=0; i<xs.size(); i++) {
+			value(xs[i]);
+		}
+	}
+	void ref(boost::shared_ptr<Building> &building) {
+		entityRef(building, buildingTable, buildingIds);
+	}
+	void ref(boost::shared_ptr<MassPile> &massPile) {
+		entityRef(massPile, massPileTable, massPileIds);
+	}
+	void ref(boost::shared_ptr<Player> &player) {
+		entityRef(player, playerTable, playerIds);
+	}
+	template <class BuildingClass>
+	void ref(boost::shared_ptr<BuildingClass> &building) {
+		boost::shared_ptr<Building> base = building;
+		ref(base);
+		building = boost::dynamic_pointer_cast<BuildingClass, Building>(base);
+		if (base && !building)
+			fail();//the wrong kind of building
+	}
+	template <class T>
+	void ref(boost::weak_ptr<T> &entity) {
+		boost::shared_ptr<T> strong = entity.lock();
+		ref(strong);
+		entity = strong;
+	}
+	template <class Ref>
+	void refs(vector<Ref> &xs) {
+		xs.resize(count(xs.size()));
+		for (int i=0; i<xs.size(); i++) {
+			ref(xs[i]);
+		}
+	}
+	//This thread's world, which must be between ticks
+	void save();
+	//Into this thread's world, which must be empty. False if what's read isn't a saved world, leaving the
+	//world half read.
+	bool load();
+};
+
+void WorldArchive::transferWorld() {
+	label("world");
+	refs(players);
+	refs(buildings);
+	mobs.resize(count(mobs.size()));
+	for (int i=0; i<mobs.size(); i++) {
+		int kind = dynamic_cast<EnergyBullet*>(mobs[i].get()) ? 1 : 0;
+		value(kind);
+		if (reading && kind == 0)
+			mobs[i] = boost::shared_ptr<Mob>(new Mob(sf::Vector2f()));
+		else if (reading && kind == 1)
+			mobs[i] = boost::shared_ptr<Mob>(new EnergyBullet(sf::Vector2f(), boost::shared_ptr<Player>(), sf::Vector2f()));
+		else if (reading) {
+			fail();
+			continue;
+		}
+		mobs[i]->transfer(*this);
+	}
+	refs(massPiles);
+	worldChunks.transfer(*this);
+	occupancy.transfer(*this);
+	scheduler.transfer(*this);
+	value(frameNum);
+}
+
+void WorldArchive::save() {
+	ostream *target = out;
+	stringstream world, bodies[3];
+	out = &world;
+	transferWorld();
+	//Writing one entity can number more, so keep going until every numbered one is written
+	int buildingsWritten = 0, massPilesWritten = 0, playersWritten = 0;
+	while (buildingsWritten < buildingTable.size() || massPilesWritten < massPileTable.size() || playersWritten < playerTable.size()) {
+		if (buildingsWritten < buildingTable.size()) {
+			out = &bodies[0];
+			label("building");
+			buildingTable[buildingsWritten++]->transfer(*this);
+		}
+		else if (massPilesWritten < massPileTable.size()) {
+			out = &bodies[1];
+			label("masspile");
+			massPileTable[massPilesWritten++]->transfer(*this);
+		}
+		else {
+			out = &bodies[2];
+			label("player");
+			playerTable[playersWritten++]->transfer(*this);
+		}
+	}
+
+	out = target;
+	label("buildings");
+	count(buildingTable.size());
+	for (int i=0; i<buildingTable.size(); i++) {
+		int type = buildingTable[i]->getType();
+		value(type);
+	}
+	label("masspiles");
+	count(massPileTable.size());
+	label("players");
+	count(playerTable.size());
+	for (int i=0; i<playerTable.size(); i++) {
+		value(playerTable[i]->id);
+	}
+	for (int i=0; i<3; i++) {
+		*out << bodies[i].str();
+	}
+	*out << world.str();
+	label("end");
+	*out << endl;
+}
+
+bool WorldArchive::load() {
+	label("buildings");
+	buildingTable.resize(count(0));
+	for (int i=0; i<buildingTable.size(); i++) {
+		int type;
+		value(type);
+		if (!isBuildingType(type)) {
+			fail();
+			return false;
+		}
+		buildingTable[i] = createBuilding(type, boost::weak_ptr<Player>(), sf::Vector2i(), false);
+	}
+	label("masspiles");
+	massPileTable.resize(count(0));
+	for (int i=0; i<massPileTable.size(); i++) {
+		massPileTable[i] = boost::shared_ptr<MassPile>(new MassPile(sf::Vector2i(), 0));
+	}
+	label("players");
+	playerTable.resize(count(0));
+	for (int i=0; i<playerTable.size(); i++) {
+		int id;
+		value(id);
+		playerTable[i] = boost::shared_ptr<Player>(new Player(id));
+	}
+
+	for (int i=0; i<buildingTable.size() && !failed; i++) {
+		label("building");
+		buildingTable[i]->transfer(*this);
+	}
+	for (int i=0; i<massPileTable.size() && !failed; i++) {
+		label("masspile");
+		massPileTable[i]->transfer(*this);
+	}
+	for (int i=0; i<playerTable.size() && !failed; i++) {
+		label("player");
+		playerTable[i]->transfer(*this);
+	}
+	transferWorld();
+	label("end");
+	if (failed)
+		return false;
+
+	threatField.rebuild(buildings, 1);
+	buildingsVersion++;
+	massPilesVersion++;
+	return true;
+}
+
+void Building::transfer(WorldArchive &archive) {
+	archive.ref(owner);
+	archive.value(health);
+	archive.value(gridPoint);
+	archive.value(width);
+	archive.value(massBuilt);
+	archive.value(active);
+	archive.value(ghost);
+	archive.value(built);
+	archive.value(dead);
+	archive.value(worldIndex);
+	archive.value(simOrder);
+	archive.value(wakeTick);
+}
+
+void Miner::transfer(WorldArchive &archive) {
+	Building::transfer(archive);
+	archive.ref(targetedMassPile);
+	archive.value(massHeld);
+}
+
+void NodeBaseClass::transfer(WorldArchive &archive) {
+	Building::transfer(archive);
+	archive.value(distanceScore);
+}
+
+void AttackerBaseClass::transfer(WorldArchive &archive) {
+	Building::transfer(archive);
+	archive.ref(target);
+	archive.value(chargedEnergy);
+	archive.value(inThreatField);
+	archive.value(chargedInThreatField);
+}
+
+void Nexus::transfer(WorldArchive &archive) {
+	NodeBaseClass::transfer(archive);
+	archive.value(massStored);
+}
+
+void MassPile::transfer(WorldArchive &archive) {
+	archive.value(gridPoint);
+	archive.value(dead);
+	archive.value(mass);
+}
+
+void Mob::transfer(WorldArchive &archive) {
+	archive.value(pos);
+	archive.value(dead);
+	archive.ref(owner);
+	archive.value(worldIndex);
+}
+
+void EnergyBullet::transfer(WorldArchive &archive) {
+	Mob::transfer(archive);
+	archive.value(targetPos);
+}
+
+void Player::transfer(WorldArchive &archive) {
+	ownedBuildings.transfer(archive);
+	ghostBuildings.transfer(archive);
+	coverage.transfer(archive);
+	bool hasNetwork = (network != NULL);
+	archive.value(hasNetwork);
+	if (archive.isReading())
+		network = hasNetwork ? boost::shared_ptr<Network>(new Network()) : boost::shared_ptr<Network>();
+	if (network)
+		network->transfer(archive);
+}
+
+template <class BuildingClass>
+void BuildingSetOf<BuildingClass>::transfer(WorldArchive &archive) {
+	vector<boost::shared_ptr<BuildingClass>> saved = items;
+	archive.refs(saved);
+	if (!archive.isReading())
+		return;
+	clear();
+	for (int i=0; i<saved.size(); i++) {
+		if (saved[i])
+			insert(saved[i]);
+		else
+			archive.fail();
+	}
+}
+
+//Just the nodes, in simOrder: adding them back gives the same counts, and the order of a tile's nodes
+//doesn't matter as findCoveringNodes() sorts them
+void CoverageMap::transfer(WorldArchive &archive) {
+	vector<boost::shared_ptr<NodeBaseClass>> nodes;
+	unordered_set<NodeBaseClass*> found;
+	for (unordered_map<long long, Tile>::iterator tile = tiles.begin(); tile != tiles.end(); tile++) {
+		for (int i=0; i<tile->second.nodes.size(); i++) {
+			if (found.insert(tile->second.nodes[i].node.get()).second)
+				nodes.push_back(tile->second.nodes[i].node);
+		}
+	}
+	sort(nodes.begin(), nodes.end(), [](const boost::shared_ptr<NodeBaseClass> &a, const boost::shared_ptr<NodeBaseClass> &b) {
+		return a->getSimOrder() < b->getSimOrder();
+	});
+	archive.refs(nodes);
+	if (!archive.isReading())
+		return;
+	clear();
+	for (int i=0; i<nodes.size(); i++) {
+		if (nodes[i])
+			add(nodes[i]);
+		else
+			archive.fail();
+	}
+}
+
+//The rows are saved as they are, since while the graph is dirty they're what the last rebuild() left
+void ConnectionGraph::transfer(WorldArchive &archive) {
+	archive.refs(entities);
+	int edgeCount = archive.count(edges.size());
+	edges.resize(edgeCount);
+	for (int i=0; i<edgeCount; i++) {
+		archive.value(edges[i].first);
+		archive.value(edges[i].second);
+	}
+	archive.values(rowStarts);
+	archive.values(columns);
+	archive.values(nodeRowStarts);
+	archive.values(nodeColumns);
+	archive.value(dirty);
+	if (!archive.isReading())
+		return;
+	entityNodes.resize(entities.size());
+	indices.clear();
+	for (int i=0; i<entities.size(); i++) {
+		entityNodes[i] = boost::dynamic_pointer_cast<NodeBaseClass, Building>(entities[i]);
+		indices[entities[i].get()] = i;
+	}
+	edgeKeys.clear();
+	for (int i=0; i<edges.size(); i++) {
+		if (edges[i].first < 0 || edges[i].first >= entities.size() || edges[i].second < 0 || edges[i].second >= entities.size())
+			archive.fail();
+		edgeKeys.insert(getEdgeKey(edges[i].first, edges[i].second));
+	}
+}
+
+void ConstructionQueue::transfer(WorldArchive &archive) {
+	vector<Entry> *lists[2] = {&waiting, &active};
+	for (int l=0; l<2; l++) {
+		vector<Entry> &entries = *lists[l];
+		entries.resize(archive.count(entries.size()));
+		for (int i=0; i<entries.size(); i++) {
+			archive.value(entries[i].priority);
+			archive.value(entries[i].order);
+			archive.ref(entries[i].building);
+			if (!entries[i].building)
+				archive.fail();
+		}
+	}
+	archive.value(nextOrder);
+	archive.value(maxActiveBuilds);
+}
+
+//distanceScores starts afresh, which scores the same: it only keeps buffers between updates
+void Network::transfer(WorldArchive &archive) {
+	archive.ref(owner);
+	connectedBuildings.transfer(archive);
+	construction.transfer(archive);
+	archive.ref(nexus);
+	activeNodes.transfer(archive);
+	connections.transfer(archive);
+	archive.refs(completedNodes);
+	archive.refs(ghostActivationQueue);
+	archive.value(changed);
+	archive.value(lastEconomyTick);
+	archive.value(nextEconomyTick);
+	archive.refs(deadBuildings);
+	archive.value(energyAvailable);
+	archive.value(energyRequested);
+	archive.value(energySpent);
+	archive.value(energyProfit);
+	archive.value(massAvailable);
+	archive.value(massRequested);
+	archive.value(massSpent);
+}
+
+void TimerWheel::transfer(WorldArchive &archive) {
+	auto transferSlot = [&](vector<Entry> &slot) {
+		slot.resize(archive.count(slot.size()));
+		for (int i=0; i<slot.size(); i++) {
+			archive.ref(slot[i].building);
+			archive.value(slot[i].tick);
+		}
+	};
+	for (int i=0; i<LEVEL0_SLOTS; i++) {
+		transferSlot(level0[i]);
+	}
+	for (int i=0; i<LEVEL_SLOTS; i++) {
+		transferSlot(level1[i]);
+		transferSlot(level2[i]);
+	}
+	transferSlot(overflow);
+	archive.value(currentTick);
+}
+
+void Scheduler::transfer(WorldArchive &archive) {
+	wheel.transfer(archive);
+	archive.value(tick);
+	archive.value(buildingsStarted);
+	archive.value(nextSimOrder);
+	archive.refs(dueBuildings);
+	vector<Waiter> *lists[2] = {&enemyWaiters, &massPileWaiters};
+	for (int l=0; l<2; l++) {
+		vector<Waiter> &waiters = *lists[l];
+		waiters.resize(archive.count(waiters.size()));
+		for (int i=0; i<waiters.size(); i++) {
+			archive.ref(waiters[i].building);
+			archive.value(waiters[i].pos);
+			archive.value(waiters[i].range);
+		}
+	}
+}
+
+void WorldChunks::transfer(WorldArchive &archive) {
+	vector<long long> keys;
+	chunks.forEach([&](long long key, const Chunk &chunk) {
+		keys.push_back(key);
+	});
+	archive.values(keys);
+	for (int i=0; i<keys.size(); i++) {
+		Chunk chunk;//shares its mass piles with the saved one, so nothing is unshared by writing
+		if (const Chunk *saved = chunks.find(keys[i]))
+			chunk = *saved;
+		archive.value(chunk.buildingsInRange);
+		archive.value(chunk.dormant);
+		vector<DormantMassPile> dormantMassPiles = chunk.massPiles.get();
+		int massPileCount = archive.count(dormantMassPiles.size());
+		dormantMassPiles.resize(massPileCount, DormantMassPile(sf::Vector2i(), 0));
+		for (int j=0; j<massPileCount; j++) {
+			archive.value(dormantMassPiles[j].gridPoint);
+			archive.value(dormantMassPiles[j].mass);
+		}
+		if (archive.isReading() && massPileCount > 0)
+			chunk.massPiles.edit() = dormantMassPiles;
+		if (archive.isReading())
+			chunks[keys[i]] = chunk;
+	}
+	archive.values(emptied);
+	archive.value(activeChunkCount);
+	archive.value(dormantMassPileCount);
+}
+
+void OccupancyMap::transfer(WorldArchive &archive) {
+	vector<long long> keys;
+	tiles.forEach([&](long long key, const Tile &tile) {
+		keys.push_back(key);
+	});
+	archive.values(keys);
+	for (int i=0; i<keys.size(); i++) {
+		Tile tile;
+		if (const Tile *saved = tiles.find(keys[i]))
+			tile = *saved;
+		for (int row=0; row<TILE_CELLS; row++) {
+			archive.value(tile.rows[row]);
+		}
+		if (archive.isReading())
+			tiles[keys[i]] = tile;
+	}
+}
+
+//Writes this thread's world to out. Must be called between ticks.
+void saveWorld(ostream &out) {
+	WorldArchive archive(out);
+	archive.save();
+}
+
+//Reads a world saveWorld() wrote into this thread's world, which must be empty. False if it's malformed.
+bool loadWorld(istream &in) {
+	WorldArchive archive(in);
+	return archive.load();
+}
+
+//Computer players. A bot looks at its network every BOT_THINK_INTERVAL ticks and places buildings with the
+//same commands the UI sends: cannons facing enemies near its border, generators when energy is short, miners
+//on mass piles it can reach, and otherwise nodes to expand, each within NODE_CONNECTION_MAXLENGTH of one of
+//its active nodes so the network picks it up. Bots have their own random numbers, so they play the same
+//way every run.
+class Bot {
+	int playerId;
+	unsigned int randomState;
+
+	int getRandom(int n) {
+		randomState ^= randomState << 13;
+		randomState ^= randomState >> 17;
+		randomState ^= randomState << 5;
+		return randomState % n;
+	}
+	//Whether a building placed there would fit, be powered by one of our nodes, and (unless it's a cannon,
+	//which is there to fight) be out of range of enemy cannons
+	bool isGoodSpot(boost::shared_ptr<Player> player, int buildingType, sf::Vector2i gridPoint) {
+		int width = getBuildingWidth(buildingType);
+		sf::Vector2f centerPos = grid.getRealPos(gridPoint + gridPoint + sf::Vector2i(width, width)) / 2.f;//as Building::getCenterPos()
+		if (buildingType != BUILDINGTYPE_ENERGYCANNON && threatField.getThreat(playerId, centerPos, false) > 0)
+			return false;
+		return occupancy.isFree(gridPoint, width) && player->coverage.isCovered(centerPos);
+	}
+	//Places a building of buildingType around pos, nudging it if that spot is taken, unpowered or under fire
+	bool place(boost::shared_ptr<Player> player, int buildingType, sf::Vector2f pos, vector<Command> &commands) {
+		for (int attempt=0; attempt<BOT_PLACEMENT_ATTEMPTS; attempt++) {
+			sf::Vector2i gridPoint = grid.getClosestGridPoint(pos) + sf::Vector2i(getRandom(2*attempt+1) - attempt, getRandom(2*attempt+1) - attempt);
+			if (!isGoodSpot(player, buildingType, gridPoint))
+				continue;
+			Command command;
+			command.type = COMMAND_PLACE_BUILDING;
+			command.playerId = playerId;
+			command.buildingType = buildingType;
+			command.gridPoint = gridPoint;
+			commands.push_back(command);
+			return true;
+		}
+		return false;
+	}
+	//distance from from towards to, but no further than to
+	static sf::Vector2f getStepTowards(sf::Vector2f from, sf::Vector2f to, float distance) {
+		float totalDistance = getMagnitude(to - from);
+		if (totalDistance <= distance)
+			return to;
+		return from + (to - from) * (distance / totalDistance);
+	}
+public:
+	Bot(int _playerId, unsigned int seed) {
+		playerId = _playerId;
+		randomState = seed ? seed : 1;
+	}
+	int getPlayerId() {
+		return playerId;
+	}
+	//Adds this think's commands to commands
+	void think(vector<Command> &commands) {
+		boost::shared_ptr<Player> player = players[playerId];
+		if (!player->network)
+			return;
+
+		vector<boost::shared_ptr<NodeBaseClass>> activeNodes;
+		int unbuiltBuildings = 0;
+		bool hasNexus = false;
+		for (int i=0; i<player->ownedBuildings.size(); i++) {
+			boost::shared_ptr<Building> building = player->ownedBuildings[i];
+			if (!building->isBuilt())
+				unbuiltBuildings++;
+			if (building->getType() == BUILDINGTYPE_NEXUS)
+				hasNexus = true;
+			boost::shared_ptr<NodeBaseClass> node = boost::dynamic_pointer_cast<NodeBaseClass, Building>(building);
+			if (node && node->isActive() && node->getDistanceScore() != DISTANCESCORE_UNREACHABLE)
+				activeNodes.push_back(node);
+		}
+		if (!hasNexus || activeNodes.size() == 0 || unbuiltBuildings >= BOT_MAX_UNBUILT)
+			return;
+
+		//The enemy building closest to our network, and the node closest to it
+		boost::shared_ptr<Building> closestEnemy;
+		boost::shared_ptr<NodeBaseClass> borderNode;
+		float closestEnemyDistance = ENERGYCANNON_ATTACKRANGE + NODE_CONNECTION_MAXLENGTH;
+		BuildingArrays &arrays = getBuildingArrays();
+		for (int i=0; i<activeNodes.size(); i++) {
+			int enemy = findNearestPointWithinRange(arrays.xs.data(), arrays.ys.data(), arrays.owners.data(), playerId, arrays.xs.size(), activeNodes[i]->getPos(), closestEnemyDistance, false);
+			if (enemy >= 0) {
+				closestEnemyDistance = getMagnitude(buildings[enemy]->getPos() - activeNodes[i]->getPos());
+				closestEnemy = buildings[enemy];
+				borderNode = activeNodes[i];
+			}
+		}
+		if (closestEnemy) {
+			int cannonsFacingEnemy = 0;
+			for (int i=0; i<player->ownedBuildings.size(); i++) {
+				if (player->ownedBuildings[i]->getType() == BUILDINGTYPE_ENERGYCANNON &&
+					getMagnitude(player->ownedBuildings[i]->getPos() - closestEnemy->getPos()) < ENERGYCANNON_ATTACKRANGE)
+					cannonsFacingEnemy++;
+			}
+			if (cannonsFacingEnemy < BOT_CANNONS_PER_BORDER) {
+				sf::Vector2f pos = getStepTowards(borderNode->getPos(), closestEnemy->getPos(), NODE_CONNECTION_MAXLENGTH/2);
+				if (place(player, BUILDINGTYPE_ENERGYCANNON, pos, commands))
+					return;
+			}
+		}
+
+		boost::shared_ptr<NodeBaseClass> node = activeNodes[getRandom(activeNodes.size())];
+
+		if (player->network->energyRequested > player->network->energyAvailable) {
+			if (place(player, BUILDINGTYPE_GENERATOR, node->getPos(), commands))
+				return;
+		}
+
+		//The closest mass pile that none of our miners can reach, whether or not its chunk is active
+		vector<sf::Vector2f> pilePositions;
+		for (int i=0; i<massPiles.size(); i++) {
+			if (!massPiles[i]->isDead())
+				pilePositions.push_back(massPiles[i]->getPos());
+		}
+		float left = activeNodes[0]->getPos().x, top = activeNodes[0]->getPos().y, right = left, bottom = top;
+		for (int i=1; i<activeNodes.size(); i++) {
+			left = min(left, activeNodes[i]->getPos().x);
+			top = min(top, activeNodes[i]->getPos().y);
+			right = max(right, activeNodes[i]->getPos().x);
+			bottom = max(bottom, activeNodes[i]->getPos().y);
+		}
+		vector<const DormantMassPile*> dormantMassPiles;
+		worldChunks.findDormantMassPiles(left - BOT_MASS_SEARCH_RANGE, top - BOT_MASS_SEARCH_RANGE, right + BOT_MASS_SEARCH_RANGE, bottom + BOT_MASS_SEARCH_RANGE, dormantMassPiles);
+		for (int i=0; i<dormantMassPiles.size(); i++) {
+			pilePositions.push_back(dormantMassPiles[i]->getPos());
+		}
+
+		bool foundPile = false;
+		sf::Vector2f closestPile;
+		boost::shared_ptr<NodeBaseClass> closestPileNode;
+		float closestPileDistance = BOT_MASS_SEARCH_RANGE;
+		for (int i=0; i<pilePositions.size(); i++) {
+			bool claimed = false;
+			for (int j=0; j<player->ownedBuildings.size(); j++) {
+				if (player->ownedBuildings[j]->getType() == BUILDINGTYPE_MINER &&
+					getMagnitude(player->ownedBuildings[j]->getPos() - pilePositions[i]) < MINER_RANGE) {
+					claimed = true;
+					break;
+				}
+			}
+			if (claimed)
+				continue;
+			for (int j=0; j<activeNodes.size(); j++) {
+				float distance = getMagnitude(pilePositions[i] - activeNodes[j]->getPos());
+				if (distance < closestPileDistance) {
+					foundPile = true;
+					closestPileDistance = distance;
+					closestPile = pilePositions[i];
+					closestPileNode = activeNodes[j];
+				}
+			}
+		}
+		if (foundPile) {
+			//Put a miner beside the pile if the node reaches it, otherwise a node on the way there
+			sf::Vector2f pos = getStepTowards(closestPileNode->getPos(), closestPile, BOT_EXPANSION_DISTANCE);
+			int buildingType = (pos == closestPile) ? BUILDINGTYPE_MINER : BUILDINGTYPE_NODE;
+			if (buildingType == BUILDINGTYPE_MINER)
+				pos = getStepTowards(closestPile, closestPileNode->getPos(), MINER_RANGE/2);
+			if (place(player, buildingType, pos, commands))
+				return;
+		}
+
+		float angle = getRandom(360) * 3.14159265f / 180;
+		place(player, BUILDINGTYPE_NODE, node->getPos() + sf::Vector2f(cos(angle), sin(angle)) * BOT_EXPANSION_DISTANCE, commands);
+	}
+};
+
+//Spectator streaming. Spectators don't run the simulation: the server sends each one the entities inside
+//its view rectangle, quantized, as a delta against the last snapshot that spectator acknowledged. Entities
+//are bucketed into a coarse grid once per send, so the cost per spectator is proportional to what it can
+//see rather than to the size of the world.
+
+struct StreamEntity {
+	static const int KIND_BULLET = 5;//after the BUILDINGTYPE_ constants
+	static const int KIND_MASSPILE = 6;
+
+	static const int FIELD_KIND = 1;//kind and owner, which never change
+	static const int FIELD_POS = 2;
+	static const int FIELD_HEALTH = 4;
+	static const int FIELD_PROGRESS = 8;
+	static const int FIELD_FLAGS = 16;
+	static const int FIELD_ALL = 31;
+
+	static const int FLAG_GHOST = 1;
+	static const int FLAG_BUILT = 2;
+	static const int FLAG_ACTIVE = 4;
+
+	unsigned int id;
+	sf::Uint8 kind;
+	sf::Uint8 owner;//player id, or 255 for none
+	sf::Int32 x, y;//grid point, or quarter pixels for bullets, which pass 16 bits past 8191 pixels
+	sf::Uint8 health;//fraction of max health, out of 255
+	sf::Uint8 progress;//fraction built, out of 255
+	sf::Uint8 flags;
+
+	sf::Vector2f getRealPos() const {
+		if (kind == KIND_BULLET)
+			return sf::Vector2f(x/4.f, y/4.f);
+		return grid.getRealPos(sf::Vector2i(x, y));
+	}
+	int getChangedFields(const StreamEntity &base) const {
+		int fields = 0;
+		if (kind != base.kind || owner != base.owner) fields |= FIELD_KIND;
+		if (x != base.x || y != base.y) fields |= FIELD_POS;
+		if (health != base.health) fields |= FIELD_HEALTH;
+		if (progress != base.progress) fields |= FIELD_PROGRESS;
+		if (flags != base.flags) fields |= FIELD_FLAGS;
+		return fields;
+	}
+	void write(sf::Packet &packet, int fields) const {
+		packet << (sf::Uint32)id << (sf::Uint8)fields;
+		if (fields & FIELD_KIND) packet << kind << owner;
+		if (fields & FIELD_POS) packet << x << y;
+		if (fields & FIELD_HEALTH) packet << health;
+		if (fields & FIELD_PROGRESS) packet << progress;
+		if (fields & FIELD_FLAGS) packet << flags;
+	}
+	//Returns which fields were read, or -1 if the packet ran out
+	int read(sf::Packet &packet) {
+		sf::Uint32 newId;
+		sf::Uint8 fields;
+		packet >> newId >> fields;
+		id = newId;
+		if (fields & FIELD_KIND) packet >> kind >> owner;
+		if (fields & FIELD_POS) packet >> x >> y;
+		if (fields & FIELD_HEALTH) packet >> health;
+		if (fields & FIELD_PROGRESS) packet >> progress;
+		if (fields & FIELD_FLAGS) packet >> flags;
+		return packet ? fields : -1;
+	}
+	void copyFields(const StreamEntity &from, int fields) {
+		if (fields & FIELD_KIND) {kind = from.kind; owner = from.owner;}
+		if (fields & FIELD_POS) {x = from.x; y = from.y;}
+		if (fields & FIELD_HEALTH) health = from.health;
+		if (fields & FIELD_PROGRESS) progress = from.progress;
+		if (fields & FIELD_FLAGS) flags = from.flags;
+	}
+};
+
+struct StreamSnapshot {
+	unsigned int id;
+	vector<StreamEntity> entities;//sorted by id
+};
+
+StreamEntity quantizeBuilding(Building *building) {
+	StreamEntity entity;
+	entity.kind = building->getType();
+	entity.owner = (building->getOwnerId() >= 0) ? building->getOwnerId() : 255;
+	entity.x = building->getGridPoint().x;
+	entity.y = building->getGridPoint().y;
+	entity.health = (building->getMaxHealth() > 0) ? 255 * max(0.f, min(1.f, building->getHealth() / building->getMaxHealth())) : 0;
+	entity.progress = (building->getBuildMassTarget() > 0) ? 255 * max(0.f, min(1.f, building->getMassBuilt() / building->getBuildMassTarget())) : 255;
+	entity.flags = (building->isGhost() ? StreamEntity::FLAG_GHOST : 0) | (building->isBuilt() ? StreamEntity::FLAG_BUILT : 0) | (building->isActive() ? StreamEntity::FLAG_ACTIVE : 0);
+	return entity;
+}
+
+StreamEntity quantizeMob(Mob *mob) {
+	StreamEntity entity;
+	entity.kind = StreamEntity::KIND_BULLET;
+	entity.owner = 255;
+	entity.x = roundToInt(mob->getPos().x * 4);
+	entity.y = roundToInt(mob->getPos().y * 4);
+	entity.health = entity.progress = entity.flags = 0;
+	return entity;
+}
+
+template <class MassPileClass>
+StreamEntity quantizeMassPile(MassPileClass *massPile) {
+	StreamEntity entity;
+	entity.kind = StreamEntity::KIND_MASSPILE;
+	entity.owner = 255;
+	entity.x = massPile->getGridPoint().x;
+	entity.y = massPile->getGridPoint().y;
+	entity.health = entity.progress = entity.flags = 0;
+	return entity;
+}
+
+//Runs on the simulation thread, alongside the game
+class SpectatorServer {
+	struct Spectator {
+		boost::shared_ptr<sf::TcpSocket> socket;
+		int viewLeft, viewTop, viewRight, viewBottom;
+		unsigned int ackedId;//0 until the first snapshot is acknowledged
+		vector<StreamSnapshot> history;//sent since ackedId, oldest first
+	};
+
+	bool active;
+	sf::TcpListener listener;
+	vector<Spectator> spectators;
+	unsigned int nextSnapshotId;
+	unsigned int nextStreamId;
+
+	vector<StreamEntity> entities;//everything, rebuilt each send
+	unordered_map<long long, vector<int>> cells;//indices into entities, by SPECTATOR_CELL_WIDTH cell
+	//Mass piles' ids, by grid point, so a pile keeps its id while its chunk sleeps and wakes. Kept here,
+	//since they're nothing to do with the world.
+	unordered_map<long long, unsigned int> massPileStreamIds;
+
+	long long bytesSent;
+	int snapshotsSent;
+
+	static long long getCellKey(int cellX, int cellY) {
+		return ((long long)cellX << 32) | (unsigned int)cellY;
+	}
+	static int getCell(float pos) {
+		return (int)floor(pos / SPECTATOR_CELL_WIDTH);
+	}
+	unsigned int getMassPileStreamId(sf::Vector2i gridPoint) {
+		unsigned int &id = massPileStreamIds[getCellKey(gridPoint.x, gridPoint.y)];
+		if (id == 0)
+			id = nextStreamId++;
+		return id;
+	}
+	void addEntity(const StreamEntity &entity) {
+		sf::Vector2f pos = entity.getRealPos();
+		cells[getCellKey(getCell(pos.x), getCell(pos.y))].push_back(entities.size());
+		entities.push_back(entity);
+	}
+	template <class T>
+	void addEntity(T *object, StreamEntity entity) {
+		if (object->getStreamId() == 0)
+			object->setStreamId(nextStreamId++);
+		entity.id = object->getStreamId();
+		addEntity(entity);
+	}
+	void gatherEntities() {
+		entities.clear();
+		cells.clear();
+		for (int i=0; i<buildings.size(); i++) {
+			addEntity(buildings[i].get(), quantizeBuilding(buildings[i].get()));
+		}
+		for (int i=0; i<players.size(); i++) {
+			for (int j=0; j<players[i]->ghostBuildings.size(); j++) {
+				addEntity(players[i]->ghostBuildings[j].get(), quantizeBuilding(players[i]->ghostBuildings[j].get()));
+			}
+		}
+		for (int i=0; i<mobs.size(); i++) {
+			addEntity(mobs[i].get(), quantizeMob(mobs[i].get()));
+		}
+		for (int i=0; i<massPiles.size(); i++) {
+			StreamEntity entity = quantizeMassPile(massPiles[i].get());
+			entity.id = getMassPileStreamId(massPiles[i]->getGridPoint());
+			addEntity(entity);
+		}
+	}
+	//Entities are bucketed by their top left corner, so the view is widened by the biggest building
+	vector<StreamEntity> getVisibleEntities(const Spectator &spectator) {
+		const int margin = 3*GRID_CELL_WIDTH;
+		vector<StreamEntity> visible;
+		for (int cellY = getCell(spectator.viewTop - margin); cellY <= getCell(spectator.viewBottom); cellY++) {
+			for (int cellX = getCell(spectator.viewLeft - margin); cellX <= getCell(spectator.viewRight); cellX++) {
+				unordered_map<long long, vector<int>>::iterator cell = cells.find(getCellKey(cellX, cellY));
+				if (cell == cells.end()) continue;
+
+				for (int i=0; i<cell->second.size(); i++) {
+					const StreamEntity &entity = entities[cell->second[i]];
+					sf::Vector2f pos = entity.getRealPos();
+					if (pos.x >= spectator.viewLeft - margin && pos.x <= spectator.viewRight && pos.y >= spectator.viewTop - margin && pos.y <= spectator.viewBottom)
+						visible.push_back(entity);
+				}
+			}
+		}
+		//Dormant chunks' mass piles are only looked at when they might be in view
+		vector<const DormantMassPile*> dormantMassPiles;
+		worldChunks.findDormantMassPiles(spectator.viewLeft, spectator.viewTop, spectator.viewRight, spectator.viewBottom, dormantMassPiles);
+		for (int i=0; i<dormantMassPiles.size(); i++) {
+			StreamEntity entity = quantizeMassPile(dormantMassPiles[i]);
+			sf::Vector2f pos = entity.getRealPos();
+			if (pos.x < spectator.viewLeft || pos.x > spectator.viewRight || pos.y < spectator.viewTop || pos.y > spectator.viewBottom)
+				continue;
+			entity.id = getMassPileStreamId(dormantMassPiles[i]->getGridPoint());
+			visible.push_back(entity);
+		}
+		sort(visible.begin(), visible.end(), [](const StreamEntity &a, const StreamEntity &b) {return a.id < b.id; });
+		return visible;
+	}
+	void sendSnapshot(Spectator &spectator, int tick) {
+		static const vector<StreamEntity> noEntities;
+		const vector<StreamEntity> *base = &noEntities;
+		unsigned int baseId = 0;
+		for (int i=0; i<spectator.history.size(); i++) {
+			if (spectator.history[i].id == spectator.ackedId) {
+				base = &spectator.history[i].entities;
+				baseId = spectator.ackedId;
+			}
+		}
+
+		StreamSnapshot snapshot;
+		snapshot.id = nextSnapshotId++;
+		snapshot.entities = getVisibleEntities(spectator);
+
+		//Both lists are sorted by id, so one merge finds what was removed, added and changed
+		vector<unsigned int> removed;
+		sf::Packet changes;
+		sf::Uint32 changeCount = 0;
+		int i = 0, j = 0;
+		while (i < base->size() || j < snapshot.entities.size()) {
+			if (j == snapshot.entities.size() || (i < base->size() && (*base)[i].id < snapshot.entities[j].id)) {
+				removed.push_back((*base)[i].id);
+				i++;
+			}
+			else if (i == base->size() || snapshot.entities[j].id < (*base)[i].id) {
+				snapshot.entities[j].write(changes, StreamEntity::FIELD_ALL);
+				changeCount++;
+				j++;
+			}
+			else {
+				int fields = snapshot.entities[j].getChangedFields((*base)[i]);
+				if (fields) {
+					snapshot.entities[j].write(changes, fields);
+					changeCount++;
+				}
+				i++;
+				j++;
+			}
+		}
+
+		sf::Packet packet;
+		packet << (sf::Uint32)snapshot.id << (sf::Uint32)baseId << (sf::Uint32)tick << (sf::Uint32)removed.size();
+		for (int k=0; k<removed.size(); k++) {
+			packet << (sf::Uint32)removed[k];
+		}
+		packet << changeCount;
+		packet.append(changes.getData(), changes.getDataSize());
+
+		sf::Socket::Status status;
+		do {
+			status = spectator.socket->send(packet);
+		} while (status == sf::Socket::Partial);
+		bytesSent += packet.getDataSize();
+		snapshotsSent++;
+
+		spectator.history.push_back(snapshot);
+		if (spectator.history.size() > SPECTATOR_HISTORY)
+			spectator.history.erase(spectator.history.begin());
+	}
+	//Reads acknowledgements and view changes. Returns false if the spectator has gone.
+	bool receiveFrom(Spectator &spectator) {
+		sf::Packet packet;
+		sf::Socket::Status status;
+		while ((status = spectator.socket->receive(packet)) == sf::Socket::Done) {
+			sf::Uint32 ackedId;
+			sf::Int32 left, top, right, bottom;
+			packet >> ackedId >> left >> top >> right >> bottom;
+			if (!packet)
+				return false;
+			spectator.ackedId = ackedId;
+			spectator.viewLeft = left;
+			spectator.viewTop = top;
+			spectator.viewRight = right;
+			spectator.viewBottom = bottom;
+
+			//Anything older than the acknowledged snapshot will never be a base again
+			while (spectator.history.size() > 0 && spectator.history.front().id < ackedId) {
+				spectator.history.erase(spectator.history.begin());
+			}
+			packet.clear();
+		}
+		return status == sf::Socket::NotReady;
+	}
+public:
+	SpectatorServer() {
+		active = false;
+		nextSnapshotId = 1;
+		nextStreamId = 1;
+		bytesSent = 0;
+		snapshotsSent = 0;
+	}
+	bool start(unsigned short port) {
+		if (listener.listen(port) != sf::Socket::Done)
+			return false;
+		listener.setBlocking(false);
+		active = true;
+		return true;
+	}
+	bool isActive() {return active;}
+	int getSpectatorCount() {return spectators.size();}
+	long long getBytesSent() {return bytesSent;}
+	int getSnapshotsSent() {return snapshotsSent;}
+
+	void update(int tick) {
+		if (!active) return;
+
+		boost::shared_ptr<sf::TcpSocket> socket(new sf::TcpSocket());
+		while (listener.accept(*socket) == sf::Socket::Done) {
+			socket->setBlocking(false);
+			Spectator spectator;
+			spectator.socket = socket;
+			spectator.viewLeft = spectator.viewTop = spectator.viewRight = spectator.viewBottom = 0;
+			spectator.ackedId = 0;
+			spectators.push_back(spectator);
+			socket = boost::shared_ptr<sf::TcpSocket>(new sf::TcpSocket());
+		}
+
+		for (int i=0; i<spectators.size(); i++) {
+			if (!receiveFrom(spectators[i])) {
+				spectators.erase(spectators.begin() + i);
+				i--;
+			}
+		}
+
+		if (tick % SPECTATOR_SEND_INTERVAL != 0 || spectators.size() == 0) return;
+
+		gatherEntities();
+		for (int i=0; i<spectators.size(); i++) {
+			sendSnapshot(spectators[i], tick);
+		}
+	}
+};
+
+SpectatorServer spectatorServer;
+
+//Runs on the spectator's simulation thread in place of the simulation. Keeps stand-in entities for
+//whatever the server has sent, so they can draw themselves as usual.
+class SpectatorClient {
+	struct Proxy {
+		int kind;
+		boost::shared_ptr<Building> building;
+		boost::shared_ptr<Mob> mob;
+		boost::shared_ptr<MassPile> massPile;
+	};
+
+	bool active;
+	sf::TcpSocket socket;
+	vector<StreamSnapshot> history;//applied, oldest first
+	unordered_map<unsigned int, Proxy> proxies;
+	int tick;
+	long long bytesReceived;
+	int snapshotsReceived;
+
+	//Builds the snapshot the server described from the base it chose. Returns false if it's unusable.
+	bool applySnapshot(sf::Packet &packet) {
+		sf::Uint32 id, baseId, serverTick, removedCount, changeCount;
+		packet >> id >> baseId >> serverTick >> removedCount;
+
+		static const vector<StreamEntity> noEntities;
+		const vector<StreamEntity> *base = &noEntities;
+		if (baseId != 0) {
+			base = 0;
+			for (int i=0; i<history.size(); i++) {
+				if (history[i].id == baseId)
+					base = &history[i].entities;
+			}
+			if (!base)
+				return false;
+		}
+
+		vector<unsigned int> removed(removedCount);
+		for (int i=0; i<removedCount; i++) {
+			packet >> removed[i];
+		}
+		packet >> changeCount;
+
+		//Removals and changes are sorted by id like the base, so they're merged into it in one pass
+		StreamSnapshot snapshot;
+		snapshot.id = id;
+		int i = 0, r = 0;
+		for (int c=0; c<=changeCount; c++) {
+			bool haveChange = (c < changeCount);
+			StreamEntity change;
+			int fields = 0;
+			if (haveChange) {
+				fields = change.read(packet);
+				if (fields < 0)
+					return false;
+			}
+			while (i < base->size() && (!haveChange || (*base)[i].id < change.id)) {
+				if (r < removed.size() && removed[r] == (*base)[i].id)
+					r++;
+				else
+					snapshot.entities.push_back((*base)[i]);
+				i++;
+			}
+			if (!haveChange)
+				break;
+			if (i < base->size() && (*base)[i].id == change.id) {
+				StreamEntity entity = (*base)[i];
+				entity.copyFields(change, fields);
+				snapshot.entities.push_back(entity);
+				i++;
+			}
+			else if (fields == StreamEntity::FIELD_ALL) {
+				snapshot.entities.push_back(change);
+			}
+			else {
+				return false;
+			}
+		}
+
+		tick = serverTick;
+		history.push_back(snapshot);
+		if (history.size() > SPECTATOR_HISTORY)
+			history.erase(history.begin());
+		return true;
+	}
+	Proxy createProxy(const StreamEntity &entity) {
+		Proxy proxy;
+		proxy.kind = entity.kind;
+		if (entity.kind == StreamEntity::KIND_BULLET)
+			proxy.mob = boost::shared_ptr<Mob>(new EnergyBullet(entity.getRealPos(), boost::shared_ptr<Player>(), entity.getRealPos()));
+		else if (entity.kind == StreamEntity::KIND_MASSPILE)
+			proxy.massPile = boost::shared_ptr<MassPile>(new MassPile(sf::Vector2i(entity.x, entity.y), 0));
+		else
+			proxy.building = createBuilding(entity.kind, boost::shared_ptr<Player>(), sf::Vector2i(entity.x, entity.y), entity.flags & StreamEntity::FLAG_GHOST);
+		return proxy;
+	}
+public:
+	SpectatorClient() {
+		active = false;
+		tick = 0;
+		bytesReceived = 0;
+		snapshotsReceived = 0;
+	}
+	bool connect(string address, unsigned short port) {
+		if (socket.connect(sf::IpAddress(address), port) != sf::Socket::Done)
+			return false;
+		socket.setBlocking(false);
+		active = true;
+		return true;
+	}
+	bool isActive() {return active;}
+
+	//Applies whatever has arrived and acknowledges the newest snapshot along with the current view.
+	//Returns true if there's something new to draw.
+	bool receive(int viewLeft, int viewTop, int viewRight, int viewBottom) {
+		bool applied = false;
+		sf::Packet packet;
+		while (socket.receive(packet) == sf::Socket::Done) {
+			bytesReceived += packet.getDataSize();
+			snapshotsReceived++;
+			if (applySnapshot(packet))
+				applied = true;
+			packet.clear();
+		}
+		if (!applied)
+			return false;
+
+		sf::Packet ack;
+		ack << (sf::Uint32)history.back().id << (sf::Int32)viewLeft << (sf::Int32)viewTop << (sf::Int32)viewRight << (sf::Int32)viewBottom;
+		sf::Socket::Status status;
+		do {
+			status = socket.send(ack);
+		} while (status == sf::Socket::Partial);
+		return true;
+	}
+	void buildSnapshot(RenderSnapshot *snapshot) {
+		MemoryTagScope tag(MEMTAG_RENDERING);
+		snapshot->clear();
+		snapshot->tick = tick;
+		if (history.size() == 0) return;
+
+		const vector<StreamEntity> &entities = history.back().entities;
+		unordered_map<unsigned int, Proxy> previousProxies;
+		previousProxies.swap(proxies);
+		for (int i=0; i<entities.size(); i++) {
+			const StreamEntity &entity = entities[i];
+			unordered_map<unsigned int, Proxy>::iterator it = previousProxies.find(entity.id);
+			Proxy proxy = (it != previousProxies.end() && it->second.kind == entity.kind) ? it->second : createProxy(entity);
+			proxies[entity.id] = proxy;
+
+			if (proxy.building) {
+				if (proxy.building->isGhost() && !(entity.flags & StreamEntity::FLAG_GHOST))
+					proxy.building->unGhost();
+				proxy.building->setGridPoint(sf::Vector2i(entity.x, entity.y));
+				proxy.building->setHealth(entity.health / 255.f * proxy.building->getMaxHealth());
+				proxy.building->setMassBuilt(entity.progress / 255.f * proxy.building->getBuildMassTarget());
+				if (entity.flags & StreamEntity::FLAG_GHOST)
+					proxy.building->draw(snapshot, sf::Color(170,170,170));
+				else
+					proxy.building->draw(snapshot);
+			}
+			else if (proxy.mob) {
+				proxy.mob->setPos(entity.getRealPos());
+				proxy.mob->draw(snapshot);
+			}
+			else if (proxy.massPile) {
+				proxy.massPile->draw(snapshot);
+			}
+		}
+
+		stringstream s;
+		s << "Spectating tick " << tick << ", " << entities.size() << " entities in view" << endl;
+		if (snapshotsReceived > 0)
+			s << "Bytes per snapshot: " << bytesReceived/snapshotsReceived << endl;
+		s << endl;
+		snapshot->hudText = s.str();
+	}
+};
+
+SpectatorClient spectatorClient;
+
+//Records the world into snapshot, for the render thread to draw
+void buildSnapshot(RenderSnapshot *snapshot) {
+	MemoryTagScope tag(MEMTAG_RENDERING);
+	snapshot->clear();
+	snapshot->tick = frameNum;
+
+	//draw connections
+	for (int i=0; i<players.size(); i++) {
+		if (players[i]->network)
+			players[i]->network->drawConnections(snapshot);
+	}
+	for (int i=0; i<buildings.size(); i++) {
+		if (boost::shared_ptr<Miner> miner = boost::dynamic_pointer_cast<Miner, Building>(buildings[i])) {
+			miner->drawTargetLine(snapshot);
+		}
+	}
+	for (int i=0; i<buildings.size(); i++) {
+		buildings[i]->draw(snapshot);
+	}
+	for (int i=0; i<selectedPlayer->ghostBuildings.size(); i++) {
+		selectedPlayer->ghostBuildings[i]->draw(snapshot, sf::Color(170,170,170));
+	}
+	for (int i=0; i<mobs.size(); i++) {
+		mobs[i]->draw(snapshot);
+	}
+	for (int i=0; i<massPiles.size(); i++) {
+		massPiles[i]->draw(snapshot);
+	}
+	worldChunks.drawDormantMassPiles(snapshot, viewLeft - GRID_CELL_WIDTH, viewTop - GRID_CELL_WIDTH, viewRight + GRID_CELL_WIDTH, viewBottom + GRID_CELL_WIDTH);
+	occupancy.copyRegion(grid.getClosestGridPoint(sf::Vector2i(viewLeft, viewTop)) - sf::Vector2i(3, 3),
+						 grid.getClosestGridPoint(sf::Vector2i(viewRight, viewBottom)), snapshot->occupancy);
+	selectedPlayer->coverage.copyRegion(sf::Vector2f(viewLeft, viewTop), sf::Vector2f(viewRight, viewBottom), snapshot->coverage);
+
+	//debug info
+	stringstream s;
+
+	s << "Buildings awake: " << scheduler.getBuildingsRunLastTick() << " / " << buildings.size() << endl;
+	s << "Chunks active: " << worldChunks.getActiveChunkCount() << " / " << worldChunks.getChunkCount() << endl;
+	s << "Frame arena: " << frameArena.getHighWaterMark()/1024 << " KB high water, " << frameArena.getBlockAllocations() << " heap blocks" << endl << endl;
+
+	s << "Memory:" << endl;
+	describeMemoryUsage(s);
+	s << endl;
+
+	if (lockstep.isActive()) {
+		s << "Lockstep: player " << lockstep.getLocalPlayerId() << " of " << lockstep.getPlayerCount() << ", tick " << frameNum << endl;
+		if (frameNum > 0)
+			s << "Bytes per tick: " << lockstep.getBytesSent()/frameNum << " sent, " << lockstep.getBytesReceived()/frameNum << " received" << endl;
+		if (lockstep.getDesyncTick() >= 0)
+			s << "DESYNC at tick " << lockstep.getDesyncTick() << endl;
+		if (!lockstep.getError().empty())
+			s << lockstep.getError() << endl;
+		s << endl;
+	}
+
+	if (spectatorServer.isActive()) {
+		s << "Spectators: " << spectatorServer.getSpectatorCount() << endl;
+		if (spectatorServer.getSnapshotsSent() > 0)
+			s << "Bytes per snapshot: " << spectatorServer.getBytesSent()/spectatorServer.getSnapshotsSent() << endl;
+		s << endl;
+	}
+
+	if (selectedPlayer->network) {
+		s << "Network:" << endl << endl;
+
+		s << "Energy available: " << selectedPlayer->network->energyAvailable << endl;
+		s << "Energy requested: " << selectedPlayer->network->energyRequested << endl;
+		s << "Energy profit: " << selectedPlayer->network->energyProfit << endl;
+
+		s << "Mass available: " << selectedPlayer->network->massAvailable << endl;
+		s << "Mass spent: " << selectedPlayer->network->massSpent << endl;
+
+		s << endl << endl;
+	}
+
+	snapshot->hudText = s.str();
+}
+
+//Deterministic state hashing, for spotting lockstep desyncs and for the divergence checker. Every entity
+//is hashed separately so a divergence can be pinned on one, in a canonical order: buildings, mobs and
+//mass piles in list order (buildings identified by simOrder), then players by id. Mass piles in
+//dormant chunks can't change, so they're left out. The fields of each kind of entity are listed once, in
+//visitEntity(), for both hashing and printing. Lockstep peers run identical code, so their floats are
+//hashed bit for bit; only the checker, comparing configurations that may sum in another order, hashes
+//them in fixed point. Each hash covers the whole world, so it costs a pass over every entity.
+
+const int HASHED_BUILDING = 0;
+const int HASHED_MOB = 1;
+const int HASHED_MASSPILE = 2;
+const int HASHED_PLAYER = 3;
+
+struct EntityHash {
+	int kind;//one of the HASHED_ constants
+	unsigned int id;//simOrder for buildings, list index for mobs and mass piles, id for players
+	unsigned int hash;
+};
+
+struct FieldHasher {
+	unsigned int hash;
+	bool exactFloats;//otherwise they're rounded to fixed point
+	FieldHasher(bool _exactFloats) {
+		hash = HASH_SEED;
+		exactFloats = _exactFloats;
+	}
+	void operator()(const char *name, int value) {hash = hashValue(hash, value);}
+	void operator()(const char *name, unsigned int value) {hash = hashValue(hash, value);}
+	void operator()(const char *name, bool value) {hash = hashValue(hash, value);}
+	void operator()(const char *name, float value) {hash = exactFloats ? hashValue(hash, value) : hashFixedPoint(hash, value);}
+};
+
+struct FieldPrinter {
+	stringstream text;
+	template <class T>
+	void operator()(const char *name, T value) {
+		text << " " << name << "=" << value;
+	}
+};
+
+template <class Visitor>
+void visitEntity(Building *building, Visitor &visit) {
+	visit("type", building->getType());
+	visit("owner", building->getOwnerId());
+	visit("x", building->getGridPoint().x);
+	visit("y", building->getGridPoint().y);
+	visit("health", building->getHealth());
+	visit("massBuilt", building->getMassBuilt());
+	visit("active", building->isActive());
+	visit("built", building->isBuilt());
+	visit("ghost", building->isGhost());
+	visit("dead", building->isDead());
+	if (NodeBaseClass *node = dynamic_cast<NodeBaseClass*>(building))
+		visit("distanceScore", node->getDistanceScore());
+	if (AttackerBaseClass *attacker = dynamic_cast<AttackerBaseClass*>(building))
+		visit("chargedEnergy", attacker->getChargedEnergy());
+	if (Miner *miner = dynamic_cast<Miner*>(building))
+		visit("massHeld", miner->getMassHeld());
+	if (Nexus *nexus = dynamic_cast<Nexus*>(building))
+		visit("massStored", nexus->getMassStored());
+}
+
+template <class Visitor>
+void visitEntity(Mob *mob, Visitor &visit) {
+	boost::shared_ptr<Player> owner = mob->getOwner();
+	visit("owner", owner ? owner->id : -1);
+	visit("x", mob->getPos().x);
+	visit("y", mob->getPos().y);
+	visit("dead", mob->isDead());
+	if (EnergyBullet *bullet = dynamic_cast<EnergyBullet*>(mob)) {
+		visit("targetX", bullet->getTargetPos().x);
+		visit("targetY", bullet->getTargetPos().y);
+	}
+}
+
+template <class Visitor>
+void visitEntity(MassPile *massPile, Visitor &visit) {
+	visit("x", massPile->getGridPoint().x);
+	visit("y", massPile->getGridPoint().y);
+	visit("mass", massPile->getMass());
+}
+
+template <class Visitor>
+void visitEntity(Player *player, Visitor &visit) {
+	visit("buildings", (int)player->ownedBuildings.size());
+	visit("ghosts", (int)player->ghostBuildings.size());
+	if (Network *network = player->network.get()) {
+		visit("energyAvailable", network->energyAvailable);
+		visit("energyRequested", network->energyRequested);
+		visit("energySpent", network->energySpent);
+		visit("energyProfit", network->energyProfit);
+		visit("massAvailable", network->massAvailable);
+		visit("massRequested", network->massRequested);
+		visit("massSpent", network->massSpent);
+	}
+}
+
+template <class Entity>
+void addEntityHash(vector<EntityHash> &entities, int kind, unsigned int id, Entity *entity, bool exactFloats) {
+	FieldHasher hasher(exactFloats);
+	visitEntity(entity, hasher);
+	EntityHash entityHash = {kind, id, hasher.hash};
+	entities.push_back(entityHash);
+}
+
+//Hashes every entity in this thread's world
+void hashEntities(vector<EntityHash> &entities, bool exactFloats) {
+	entities.clear();
+	for (int i=0; i<buildings.size(); i++) {
+		addEntityHash(entities, HASHED_BUILDING, buildings[i]->getSimOrder(), buildings[i].get(), exactFloats);
+	}
+	for (int i=0; i<mobs.size(); i++) {
+		addEntityHash(entities, HASHED_MOB, i, mobs[i].get(), exactFloats);
+	}
+	for (int i=0; i<massPiles.size(); i++) {
+		addEntityHash(entities, HASHED_MASSPILE, i, massPiles[i].get(), exactFloats);
+	}
+	for (int i=0; i<players.size(); i++) {
+		addEntityHash(entities, HASHED_PLAYER, players[i]->id, players[i].get(), exactFloats);
+	}
+}
+
+//Floats are hashed bit for bit, as lockstep, replays and forks want, unless exactFloats is false
+unsigned int hashWorldState(bool exactFloats = true) {
+	static thread_local vector<EntityHash> entities;
+	hashEntities(entities, exactFloats);
+	unsigned int hash = hashValue(HASH_SEED, frameNum);
+	for (int i=0; i<entities.size(); i++) {
+		hash = hashValue(hash, entities[i].kind);
+		hash = hashValue(hash, entities[i].id);
+		hash = hashValue(hash, entities[i].hash);
+	}
+	return hash;
+}
+
+//The fields of an entity in this thread's world, for reporting a divergence
+string describeEntity(int kind, unsigned int id) {
+	FieldPrinter printer;
+	bool found = false;
+	if (kind == HASHED_BUILDING) {
+		printer.text << "building " << id << ":";
+		for (int i=0; i<buildings.size(); i++) {
+			if (buildings[i]->getSimOrder() == id) {
+				visitEntity(buildings[i].get(), printer);
+				found = true;
+			}
+		}
+	}
+	else if (kind == HASHED_MOB) {
+		printer.text << "mob " << id << ":";
+		if (id < mobs.size()) {
+			visitEntity(mobs[id].get(), printer);
+			found = true;
+		}
+	}
+	else if (kind == HASHED_MASSPILE) {
+		printer.text << "mass pile " << id << ":";
+		if (id < massPiles.size()) {
+			visitEntity(massPiles[id].get(), printer);
+			found = true;
+		}
+	}
+	else {
+		printer.text << "player " << id << ":";
+		for (int i=0; i<players.size(); i++) {
+			if (players[i]->id == id) {
+				visitEntity(players[i].get(), printer);
+				found = true;
+			}
+		}
+	}
+	if (!found)
+		printer.text << " not in this world";
+	return printer.text.str();
+}
+
+double getMillisecondsSince(chrono::high_resolution_clock::time_point start) {
+	return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+//Telemetry: "noderush --telemetry <file> ..." records every player's economy, entity counts and tick
+//timings, a row per tick, for offline analysis. The file is written through memory maps, so recording a
+//tick is only storing its values. The layout, in native byte order with every value 4 bytes:
+//	a header TELEMETRY_MAP_ALIGNMENT bytes long: a TelemetryHeader followed by columnCount TelemetryColumns
+//	blocks blockBytes long, each holding blockTicks ticks: column 0's values for them, then column 1's...
+//Ticks are staged as rows and written out to the columns TELEMETRY_STAGED_TICKS at a time. The header's
+//tickCount is updated as they are, so the file can be read while a game is still going, or after it
+//crashed, up to the last ticks written out. Values past tickCount in the last block are zero.
+
+string telemetryPath;//empty unless recording
+
+struct TelemetryHeader {
+	char magic[8];//"NRTELEM1"
+	sf::Int32 columnCount;
+	sf::Int32 blockTicks;
+	long long blockBytes;
+	long long tickCount;
+};
+
+struct TelemetryColumn {
+	char name[TELEMETRY_NAME_LENGTH];//null terminated
+	char type;//'i' for a 32-bit int, 'f' for a 32-bit float
+	char padding[15];
+};
+
+//How long the parts of the last tick took
+struct TelemetryTiming {
+	float inputMilliseconds;//running commands, and in a headless game bots thinking
+	float goMilliseconds;
+};
+
+//A file written through memory maps of parts of it, which grows as parts past its end are mapped
+class MappedFile {
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int file;
+	long long size;
+#endif
+	MappedFile(const MappedFile&);
+	MappedFile &operator=(const MappedFile&);
+public:
+	MappedFile() {
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+#else
+		file = -1;
+		size = 0;
+#endif
+	}
+	~MappedFile() {
+		close();
+	}
+	//Creates the file, or empties it if it exists
+	bool create(string path) {
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		return file != INVALID_HANDLE_VALUE;
+#else
+		file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		size = 0;
+		return file >= 0;
+#endif
+	}
+	//offset must be a multiple of TELEMETRY_MAP_ALIGNMENT. Returns NULL if it couldn't be mapped.
+	char *map(long long offset, size_t length) {
+#ifdef _WIN32
+		long long end = offset + length;
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, NULL);
+		if (!mapping)
+			return NULL;
+		char *view = (char*)MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, length);
+		CloseHandle(mapping);//the view keeps it open
+		return view;
+#else
+		if (offset + (long long)length > size) {
+			if (ftruncate(file, offset + length) != 0)
+				return NULL;
+			size = offset + length;
+		}
+		void *view = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, file, offset);
+		return (view == MAP_FAILED) ? NULL : (char*)view;
+#endif
+	}
+	void unmap(char *view, size_t length) {
+#ifdef _WIN32
+		UnmapViewOfFile(view);
+#else
+		munmap(view, length);
+#endif
+	}
+	void close() {
+#ifdef _WIN32
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (file >= 0)
+			::close(file);
+		file = -1;
+#endif
+	}
+};
+
+//The columns, listed once for both naming them and recording them. player is -1 for columns about the
+//whole world, otherwise an index into players.
+template <class Visitor>
+void visitTelemetry(const TelemetryTiming &timing, Visitor &visit) {
+	int ghosts = 0;
+	for (int i=0; i<players.size(); i++) {
+		ghosts += players[i]->ghostBuildings.size();
+	}
+	long long heapBytes = 0;
+	for (int i=0; i<MEMTAG_COUNT; i++) {
+		heapBytes += getLiveHeapBytes(i);
+	}
+	visit("tick", -1, frameNum);
+	visit("inputMilliseconds", -1, timing.inputMilliseconds);
+	visit("goMilliseconds", -1, timing.goMilliseconds);
+	visit("buildings", -1, (int)buildings.size());
+	visit("ghosts", -1, ghosts);
+	visit("mobs", -1, (int)mobs.size());
+	visit("massPiles", -1, (int)massPiles.size());
+	visit("dormantMassPiles", -1, worldChunks.getDormantMassPileCount());
+	visit("activeChunks", -1, worldChunks.getActiveChunkCount());
+	visit("heapKilobytes", -1, (int)(heapBytes / 1024));
+	for (int i=0; i<players.size(); i++) {
+		Network *network = players[i]->network.get();
+		visit("buildings", i, (int)players[i]->ownedBuildings.size());
+		visit("energyAvailable", i, network ? network->energyAvailable : 0.f);
+		visit("energyRequested", i, network ? network->energyRequested : 0.f);
+		visit("energySpent", i, network ? network->energySpent : 0.f);
+		visit("energyProfit", i, network ? network->energyProfit : 0.f);
+		visit("massAvailable", i, network ? network->massAvailable : 0.f);
+		visit("massRequested", i, network ? network->massRequested : 0.f);
+		visit("massSpent", i, network ? network->massSpent : 0.f);
+	}
+}
+
+struct TelemetryColumnNamer {
+	vector<TelemetryColumn> columns;
+	void add(const char *name, int player, char type) {
+		stringstream fullName;
+		if (player >= 0)
+			fullName << "player" << player << ".";
+		fullName << name;
+		TelemetryColumn column;
+		memset(&column, 0, sizeof(column));
+		strncpy(column.name, fullName.str().c_str(), TELEMETRY_NAME_LENGTH-1);
+		column.type = type;
+		columns.push_back(column);
+	}
+	void operator()(const char *name, int player, int value) {add(name, player, 'i');}
+	void operator()(const char *name, int player, float value) {add(name, player, 'f');}
+};
+
+struct TelemetryRowWriter {
+	sf::Int32 *value;//the first column's, in this tick's row
+	void operator()(const char *name, int player, int v) {
+		*value++ = v;
+	}
+	void operator()(const char *name, int player, float v) {
+		memcpy(value++, &v, 4);
+	}
+};
+
+//Records this thread's world. The players list must not change while it's open. record() only stages a
+//row; batches of staged rows are written out to the columns on a writer thread, so the page faults of
+//touching fresh pages of the file land there rather than on the simulation. Batches go round: filled by
+//record(), queued for the writer, written out, and handed back.
+class TelemetryRecorder {
+	MappedFile file;
+	TelemetryHeader *header;//mapped for as long as the file is open
+	char *block;//the block being filled, only touched by the writer thread
+	long long blockBytes;
+	long long blockCount;
+	int tickInBlock;
+	int columnCount;
+	vector<vector<sf::Int32>> batches;//TELEMETRY_STAGED_TICKS rows each
+	vector<int> batchTicks;
+	SpscQueue<int, TELEMETRY_BATCHES> fullBatches;
+	SpscQueue<int, TELEMETRY_BATCHES> emptyBatches;
+	int currentBatch;
+	int stagedTicks;//in currentBatch
+	long long ticksRecorded;
+	thread writer;
+	atomic<bool> stopping;
+	atomic<bool> failed;
+	double recordTime;
+	string error;
+
+	bool mapNextBlock() {
+		if (block)
+			file.unmap(block, blockBytes);
+		block = file.map(TELEMETRY_MAP_ALIGNMENT + blockCount*blockBytes, blockBytes);
+		if (!block)
+			return false;
+		blockCount++;
+		tickInBlock = 0;
+		return true;
+	}
+	//Copies a batch's rows into the block's columns
+	bool writeBatch(int batch) {
+		const vector<sf::Int32> &rows = batches[batch];
+		int ticks = batchTicks[batch];
+		if (tickInBlock == TELEMETRY_BLOCK_TICKS && !mapNextBlock())
+			return false;
+		for (int c=0; c<columnCount; c++) {
+			sf::Int32 *column = (sf::Int32*)(block + (long long)c*TELEMETRY_BLOCK_TICKS*4) + tickInBlock;
+			for (int t=0; t<ticks; t++) {
+				column[t] = rows[t*columnCount + c];
+			}
+		}
+		tickInBlock += ticks;
+		header->tickCount += ticks;
+		return true;
+	}
+	void runWriter() {
+		while (true) {
+			bool stop = stopping;//read first, so an empty queue after it really is the end
+			int batch;
+			if (fullBatches.pop(batch)) {
+				if (!failed && !writeBatch(batch))
+					failed = true;
+				emptyBatches.push(batch);
+			}
+			else if (stop)
+				return;
+			else
+				sf::sleep(sf::milliseconds(1));
+		}
+	}
+	void queueBatch() {
+		batchTicks[currentBatch] = stagedTicks;
+		fullBatches.push(currentBatch);
+		stagedTicks = 0;
+	}
+public:
+	TelemetryRecorder() : stopping(false), failed(false) {
+		header = NULL;
+		block = NULL;
+		blockBytes = blockCount = 0;
+		tickInBlock = 0;
+		columnCount = 0;
+		currentBatch = stagedTicks = 0;
+		ticksRecorded = 0;
+		recordTime = 0;
+	}
+	~TelemetryRecorder() {
+		close();
+	}
+	bool open(string path) {
+		close();
+		TelemetryColumnNamer namer;
+		visitTelemetry(TelemetryTiming(), namer);
+		if (sizeof(TelemetryHeader) + namer.columns.size()*sizeof(TelemetryColumn) > TELEMETRY_MAP_ALIGNMENT) {
+			error = "too many telemetry columns";
+			return false;
+		}
+		if (!file.create(path)) {
+			error = "couldn't create " + path;
+			return false;
+		}
+		header = (TelemetryHeader*)file.map(0, TELEMETRY_MAP_ALIGNMENT);
+		long long columnBytes = namer.columns.size() * TELEMETRY_BLOCK_TICKS * 4;
+		blockBytes = (columnBytes + TELEMETRY_MAP_ALIGNMENT - 1) / TELEMETRY_MAP_ALIGNMENT * TELEMETRY_MAP_ALIGNMENT;
+		if (!header || !mapNextBlock()) {
+			error = "couldn't map " + path;
+			close();
+			return false;
+		}
+		memcpy(header->magic, "NRTELEM1", 8);
+		header->columnCount = namer.columns.size();
+		header->blockTicks = TELEMETRY_BLOCK_TICKS;
+		header->blockBytes = blockBytes;
+		header->tickCount = 0;
+		memcpy(header + 1, namer.columns.data(), namer.columns.size()*sizeof(TelemetryColumn));
+
+		columnCount = namer.columns.size();
+		batches.assign(TELEMETRY_BATCHES, vector<sf::Int32>(columnCount * TELEMETRY_STAGED_TICKS));
+		batchTicks.assign(TELEMETRY_BATCHES, 0);
+		currentBatch = stagedTicks = 0;
+		for (int i=1; i<TELEMETRY_BATCHES; i++) {
+			emptyBatches.push(i);
+		}
+		ticksRecorded = 0;
+		recordTime = 0;
+		stopping = failed = false;
+		writer = thread(&TelemetryRecorder::runWriter, this);
+		return true;
+	}
+	bool isOpen() {
+		return header != NULL;
+	}
+	//Call once per tick, after go()
+	void record(const TelemetryTiming &timing) {
+		if (!header)
+			return;
+		if (failed) {
+			close();
+			error = "couldn't map telemetry block";
+			return;
+		}
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		TelemetryRowWriter row;
+		row.value = &batches[currentBatch][stagedTicks*columnCount];
+		visitTelemetry(timing, row);
+		stagedTicks++;
+		ticksRecorded++;
+		if (stagedTicks == TELEMETRY_STAGED_TICKS) {
+			queueBatch();
+			while (!emptyBatches.pop(currentBatch)) {//the writer is TELEMETRY_BATCHES behind
+				sf::sleep(sf::milliseconds(1));
+			}
+		}
+		recordTime += getMillisecondsSince(start);
+	}
+	//Writes out whatever is staged
+	void close() {
+		if (writer.joinable()) {
+			if (stagedTicks > 0)
+				queueBatch();
+			stopping = true;
+			writer.join();
+		}
+		int batch;
+		while (emptyBatches.pop(batch)) {}
+		if (block)
+			file.unmap(block, blockBytes);
+		if (header)
+			file.unmap((char*)header, TELEMETRY_MAP_ALIGNMENT);
+		block = NULL;
+		header = NULL;
+		blockCount = 0;
+		file.close();
+	}
+	long long getTickCount() {
+		return ticksRecorded;
+	}
+	//Mean time record() has taken on the simulation thread, timing included
+	double getMicrosecondsPerTick() {
+		return (ticksRecorded > 0) ? recordTime * 1000 / ticksRecorded : 0;
+	}
+	string getError() {
+		return error;
+	}
+};
+
+//Only ever used by the simulation thread (or a headless run)
+TelemetryRecorder telemetry;
+
+//"noderush --telemetry-read <file>" lists a telemetry file's columns with their ranges, as a check of the
+//format; anything else reading one only needs the layout described above
+int readTelemetry(string path) {
+	ifstream in(path.c_str(), ios::binary);
+	TelemetryHeader header;
+	if (!in.read((char*)&header, sizeof(header)) || memcmp(header.magic, "NRTELEM1", 8) != 0) {
+		cerr << path << " isn't a telemetry file" << endl;
+		return 1;
+	}
+	vector<TelemetryColumn> columns(header.columnCount);
+	in.read((char*)columns.data(), columns.size()*sizeof(TelemetryColumn));
+	cout << header.tickCount << " ticks, " << header.columnCount << " columns" << endl;
+
+	vector<char> values(TELEMETRY_BLOCK_TICKS * 4);
+	for (int c=0; c<columns.size(); c++) {
+		double low = 0, high = 0, sum = 0;
+		for (long long t=0; t<header.tickCount; t += header.blockTicks) {
+			int count = min((long long)header.blockTicks, header.tickCount - t);
+			in.seekg(TELEMETRY_MAP_ALIGNMENT + (t / header.blockTicks)*header.blockBytes + (long long)c*header.blockTicks*4);
+			if (!in.read(values.data(), count*4)) {
+				cerr << path << " is shorter than its header says" << endl;
+				return 1;
+			}
+			for (int i=0; i<count; i++) {
+				double value = (columns[c].type == 'i') ? ((sf::Int32*)values.data())[i] : ((float*)values.data())[i];
+				low = (t+i == 0) ? value : min(low, value);
+				high = (t+i == 0) ? value : max(high, value);
+				sum += value;
+			}
+		}
+		cout << "  " << columns[c].name << ": " << low << " to " << high;
+		if (header.tickCount > 0)
+			cout << ", mean " << sum / header.tickCount;
+		cout << endl;
+	}
+	return 0;
+}
+
+float watchdogBudget = 0;//milliseconds a go() may take before the watchdog captures it, or 0 for no watchdog
+
+struct LoggedCommand {
+	int tick;
+	Command command;
+};
+
+//Plays this thread's world on to just before go() on tick, running each logged command on the tick it was run.
+//Commands from before the world's current tick are skipped.
+void playUpTo(int tick, const vector<LoggedCommand> &commands) {
+	int next = 0;
+	while (next < commands.size() && commands[next].tick < frameNum) {
+		next++;
+	}
+	while (true) {
+		while (next < commands.size() && commands[next].tick == frameNum) {
+			executeCommand(commands[next++].command);
+		}
+		if (frameNum >= tick)
+			break;
+		go();
+	}
+}
+
+//Phase times from rerunning one tick
+struct TickReplay {
+	vector<vector<double>> phases;//milliseconds, by phase and then run
+	vector<double> totals;
+	bool reproduced;//whether the first run reached the state hash the game did
+};
+
+//Runs go() WATCHDOG_REPLAY_RUNS times, each on a fresh copy of this thread's world, which is left as it was
+TickReplay replayTick(unsigned int hash) {
+	TickReplay replay;
+	replay.phases.resize(TICKPHASE_COUNT);
+	replay.reproduced = false;
+	for (int r=0; r<WATCHDOG_REPLAY_RUNS; r++) {
+		World run = forkWorld();
+		swapWorld(run);
+		TickProfile profile;
+		tickProfile = &profile;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		go();
+		replay.totals.push_back(getMillisecondsSince(start));
+		tickProfile = NULL;
+		for (int i=0; i<TICKPHASE_COUNT; i++) {
+			replay.phases[i].push_back(profile.phaseMilliseconds[i]);
+		}
+		if (r == 0)
+			replay.reproduced = (hashWorldState() == hash);
+		swapWorld(run);//back to the world before the tick
+	}
+	return replay;
+}
+
+//"fastest / median"
+string describeTimes(vector<double> times) {
+	sort(times.begin(), times.end());
+	stringstream description;
+	description << times.front() << " / " << times[times.size()/2];
+	return description.str();
+}
+
+//Watches for go() calls that take longer than a budget and writes a diagnostic bundle for each, to
+//slowtick-<tick>.txt. Every WATCHDOG_CHECKPOINT_TICKS ticks it forks the world as a checkpoint, and it keeps
+//only the commands run since then, so it holds a bounded amount however long the game runs. A fork copies
+//every player, building, mob and active mass pile (see forkWorld), about a millisecond per thousand
+//buildings, on the simulation thread between ticks; that isn't in any tick's time, so it's timed on its own
+//and reported. The simulation is deterministic (lockstep relies on it), so the checkpoint played on with
+//those commands is the world as it was before any later tick. When a tick overruns, the simulation thread
+//hands the checkpoint and the commands to a thread of its own and takes a fresh checkpoint, so a slow tick
+//costs one fork like any other checkpoint. That thread rebuilds the world from before the slow tick,
+//reruns the tick WATCHDOG_REPLAY_RUNS times (each from a fresh copy) to time its phases and check it
+//reaches the state the game did, and writes the bundle, ending with the world before the tick saved (see
+//saveWorld) so "--replay" can rerun it anywhere. That thread is the one to watch under a profiler. The
+//bundle also has the tick's phase times in the game, the entity counts, the timings of the last
+//WATCHDOG_RECENT_TICKS ticks, and the commands since the checkpoint. Each line up to the world starts with
+//what it holds.
+class Watchdog {
+	struct RecentTick {
+		int tick;
+		double inputMilliseconds, goMilliseconds;
+	};
+	//What the bundle's thread needs, taken on the simulation thread just after the slow tick
+	struct Capture {
+		int tick;
+		World checkpoint;
+		vector<LoggedCommand> commands;
+		unsigned int hash;//after the tick
+		string path;
+		string text;//everything the simulation thread knows, for the top of the bundle
+	};
+	float budget;
+	string origin;//how the world was created
+	World checkpoint;
+	int checkpointTick;
+	int checkpointCount;
+	double checkpointMilliseconds, slowestCheckpointMilliseconds;//the last fork and the slowest
+	vector<LoggedCommand> commands;//since the checkpoint
+	vector<RecentTick> recentTicks;//a ring
+	int recentTickCount;
+	TickProfile profile;
+	int slowTicks, bundlesStarted;
+	atomic<int> bundlesWritten;
+	vector<thread> writers;
+
+	void takeCheckpoint() {
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		checkpoint = forkWorld();
+		checkpointMilliseconds = getMillisecondsSince(start);
+		slowestCheckpointMilliseconds = max(slowestCheckpointMilliseconds, checkpointMilliseconds);
+		checkpointCount++;
+		checkpointTick = frameNum;
+		commands.clear();
+	}
+	void capture(int tick, double inputMilliseconds, double goMilliseconds);
+	void writeBundle(boost::shared_ptr<Capture> capture);
+public:
+	Watchdog() : bundlesWritten(0) {
+		budget = 0;
+		checkpointTick = checkpointCount = 0;
+		checkpointMilliseconds = slowestCheckpointMilliseconds = 0;
+		recentTickCount = slowTicks = bundlesStarted = 0;
+	}
+	~Watchdog() {
+		finish();
+	}
+	//origin is "game <seed> <players>" (see start()) or "headless <bots> <spacing>" (see createBotWorld()), and
+	//the world must be as it was created
+	void start(float _budget, string _origin) {
+		budget = _budget;
+		origin = _origin;
+		takeCheckpoint();
+	}
+	//Waits for any bundles still being written
+	void finish() {
+		for (int i=0; i<writers.size(); i++) {
+			writers[i].join();
+		}
+		writers.clear();
+	}
+	bool isActive() {
+		return budget > 0;
+	}
+	//For every command run, as it's run. Selecting a player changes nothing in the world (and the global
+	//selectedPlayer isn't the bundle thread's to change), so it isn't kept.
+	void recordCommand(const Command &command) {
+		if (!isActive() || command.type == COMMAND_SELECT_PLAYER)
+			return;
+		LoggedCommand logged;
+		logged.tick = frameNum;
+		logged.command = command;
+		commands.push_back(logged);
+	}
+	//Just before go()
+	void beginTick() {
+		if (!isActive())
+			return;
+		profile = TickProfile();
+		tickProfile = &profile;
+	}
+	//Just after go(), with the time spent running commands beforehand and the time go() took
+	void endTick(double inputMilliseconds, double goMilliseconds) {
+		if (!isActive())
+			return;
+		tickProfile = NULL;
+		RecentTick recent;
+		recent.tick = frameNum - 1;
+		recent.inputMilliseconds = inputMilliseconds;
+		recent.goMilliseconds = goMilliseconds;
+		if (recentTicks.size() < WATCHDOG_RECENT_TICKS)
+			recentTicks.push_back(recent);
+		else
+			recentTicks[recentTickCount % WATCHDOG_RECENT_TICKS] = recent;
+		recentTickCount++;
+
+		if (goMilliseconds > budget) {
+			slowTicks++;
+			if (bundlesStarted < WATCHDOG_MAX_BUNDLES)
+				capture(frameNum - 1, inputMilliseconds, goMilliseconds);//takes a checkpoint
+		}
+		if (frameNum - checkpointTick >= WATCHDOG_CHECKPOINT_TICKS || commands.size() >= WATCHDOG_MAX_COMMANDS)
+			takeCheckpoint();
+	}
+	int getSlowTicks() {
+		return slowTicks;
+	}
+	int getCheckpointCount() {
+		return checkpointCount;
+	}
+	double getSlowestCheckpointMilliseconds() {
+		return slowestCheckpointMilliseconds;
+	}
+	int getBundlesWritten() {
+		return bundlesWritten;
+	}
+};
+
+void Watchdog::capture(int tick, double inputMilliseconds, double goMilliseconds) {
+	bundlesStarted++;
+	boost::shared_ptr<Capture> capture(new Capture());
+	capture->tick = tick;
+	capture->commands = commands;
+	capture->hash = hashWorldState();
+	stringstream path;
+	path << "slowtick-" << tick << ".txt";
+	capture->path = path.str();
+
+	stringstream out;
+	out << "noderush slow tick" << endl;
+	out << "tick " << tick << endl;
+	out << "budget " << budget << endl;
+	out << "go " << goMilliseconds << endl;
+	out << "input " << inputMilliseconds << endl;
+	for (int i=0; i<TICKPHASE_COUNT; i++) {
+		out << "phase " << TICKPHASE_NAMES[i] << " " << profile.phaseMilliseconds[i] << endl;
+	}
+
+	int ghosts = 0, networks = 0;
+	for (int i=0; i<players.size(); i++) {
+		ghosts += players[i]->ghostBuildings.size();
+		networks += (players[i]->network != NULL);
+	}
+	out << "count buildings " << buildings.size() << endl;
+	out << "count ghosts " << ghosts << endl;
+	out << "count mobs " << mobs.size() << endl;
+	out << "count masspiles " << massPiles.size() << endl;
+	out << "count networks " << networks << endl;
+	out << "count activechunks " << worldChunks.getActiveChunkCount() << endl;
+	out << "hash " << capture->hash << endl;
+
+	out << "origin " << origin << endl;
+	out << "checkpoint " << checkpointTick << endl;
+	out << "checkpointfork " << checkpointMilliseconds << endl;
+	int oldest = (recentTickCount > WATCHDOG_RECENT_TICKS) ? recentTickCount % WATCHDOG_RECENT_TICKS : 0;
+	for (int i=0; i<recentTicks.size(); i++) {
+		const RecentTick &recent = recentTicks[(oldest + i) % recentTicks.size()];
+		out << "recent " << recent.tick << " " << recent.inputMilliseconds << " " << recent.goMilliseconds << endl;
+	}
+	out.precision(9);//enough to give the commands' floats back exactly
+	for (int i=0; i<commands.size(); i++) {
+		const Command &command = commands[i].command;
+		out << "command " << commands[i].tick << " " << command.type << " " << command.playerId << " " << command.buildingType << " "
+			<< command.gridPoint.x << " " << command.gridPoint.y << " " << command.pos.x << " " << command.pos.y << endl;
+	}
+	capture->text = out.str();
+
+	swap(capture->checkpoint, checkpoint);
+	writers.push_back(thread(&Watchdog::writeBundle, this, capture));
+	takeCheckpoint();
+}
+
+//On a thread of its own, with the checkpoint as its world
+void Watchdog::writeBundle(boost::shared_ptr<Capture> capture) {
+	swapWorld(capture->checkpoint);
+	playUpTo(capture->tick, capture->commands);
+	TickReplay replay = replayTick(capture->hash);
+	stringstream savedWorld;
+	saveWorld(savedWorld);
+	World empty;
+	swapWorld(empty);
+
+	ofstream out(capture->path.c_str());
+	if (!out) {
+		cerr << "Tick " << capture->tick << " was slow, but " << capture->path << " couldn't be written" << endl;
+		return;
+	}
+	out << capture->text;
+	out << "replay reproduced " << replay.reproduced << endl;
+	for (int i=0; i<TICKPHASE_COUNT; i++) {
+		out << "replay phase " << TICKPHASE_NAMES[i] << " " << describeTimes(replay.phases[i]) << endl;
+	}
+	out << "replay go " << describeTimes(replay.totals) << endl;
+	out << "world" << endl;
+	out << savedWorld.str();
+	bundlesWritten++;
+	cerr << "Tick " << capture->tick << " took longer than " << budget << " ms: wrote " << capture->path
+		 << (replay.reproduced ? "" : ", but the replay DIDN'T reach the state the game did") << endl;
+}
+
+//Only ever used by the simulation thread (or a headless run)
+Watchdog watchdog;
+
+//"noderush --replay <bundle>" reruns a watchdog's slow tick WATCHDOG_REPLAY_RUNS times, each from a fresh copy
+//of the world before it (saved at the end of the bundle), reporting the phase times
+int replaySlowTick(string path) {
+	ifstream in(path.c_str());
+	string line, heading;
+	getline(in, line);
+	if (line != "noderush slow tick") {
+		cerr << path << " isn't a slow tick bundle" << endl;
+		return 1;
+	}
+	int tick = -1;
+	double recordedTotal = 0;
+	unsigned int hash = 0;
+	vector<double> recordedPhases(TICKPHASE_COUNT, 0);
+	bool hasWorld = false;
+	while (!hasWorld && getline(in, line)) {
+		stringstream fields(line);
+		fields >> heading;
+		if (heading == "tick")
+			fields >> tick;
+		else if (heading == "go")
+			fields >> recordedTotal;
+		else if (heading == "hash")
+			fields >> hash;
+		else if (heading == "phase") {
+			string name;
+			double milliseconds;
+			fields >> name >> milliseconds;
+			for (int i=0; i<TICKPHASE_COUNT; i++) {
+				if (name == TICKPHASE_NAMES[i])
+					recordedPhases[i] = milliseconds;
+			}
+		}
+		else if (heading == "world")
+			hasWorld = true;
+	}
+	grid.setup(GRID_CELL_WIDTH);
+	if (tick < 0 || !hasWorld || !loadWorld(in)) {
+		cerr << path << " doesn't say which tick was slow or doesn't end with the world before it" << endl;
+		return 1;
+	}
+	cout << "loaded the world before tick " << tick << ": " << buildings.size() << " buildings, " << mobs.size() << " mobs, "
+		 << massPiles.size() << " mass piles" << endl;
+
+	TickReplay replay = replayTick(hash);
+	cout << "tick " << tick << " replayed " << WATCHDOG_REPLAY_RUNS << " times, "
+		 << (replay.reproduced ? "reaching the same state as the game" : "NOT reaching the state the game did") << endl;
+	for (int i=0; i<TICKPHASE_COUNT; i++) {
+		cout << "  " << TICKPHASE_NAMES[i] << ": " << recordedPhases[i] << " ms in the game, " << describeTimes(replay.phases[i]) << " ms replayed (fastest / median)" << endl;
+	}
+	cout << "  go(): " << recordedTotal << " ms in the game, " << describeTimes(replay.totals) << " ms replayed (fastest / median)" << endl;
+	return replay.reproduced ? 0 : 1;
+}
+
+//The simulation thread. Ticks at 60Hz independently of rendering, applying queued commands at the start
+//of each tick and publishing a snapshot at the end of it. In a lockstep game the commands are sent to
+//the other peers instead, and a tick only runs once everyone's commands for it have arrived.
+void runSimulation() {
+	start(worldSeed, lockstep.getPlayerCount());
+	selectedPlayer = players[lockstep.getLocalPlayerId()];
+	if (!telemetryPath.empty() && !telemetry.open(telemetryPath))
+		cerr << "Not recording telemetry: " << telemetry.getError() << endl;
+	if (watchdogBudget > 0) {
+		stringstream origin;
+		origin << "game " << worldSeed << " " << lockstep.getPlayerCount();
+		watchdog.start(watchdogBudget, origin.str());
+	}
+
+	sf::Clock tickClock;
+	if (lockstep.isActive())
+		lockstep.recordStateHash(frameNum, hashWorldState());
+
+	while (simRunning) {
+		TelemetryTiming timing;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		Command command;
+		while (commandQueue.pop(command)) {
+			if (lockstep.isActive() && command.type != COMMAND_SELECT_PLAYER)
+				lockstep.queueLocalCommand(command);
+			else {
+				executeCommand(command);
+				watchdog.recordCommand(command);
+			}
+		}
+
+		if (lockstep.isActive()) {
+			if (lockstep.getSentThrough() < frameNum + LOCKSTEP_INPUT_DELAY)
+				lockstep.sendInputs(frameNum + LOCKSTEP_INPUT_DELAY, lockstep.getStateHash(frameNum));
+			lockstep.receive();
+			if (!lockstep.isTickReady(frameNum)) {
+				if (lockstep.hasStalled()) {
+					//End the match, leaving its last state and the reason on screen
+					cerr << "Match ended at tick " << frameNum << ": " << lockstep.getError() << endl;
+					buildSnapshot(&snapshots.getBack());
+					snapshots.publish();
+					break;
+				}
+				sf::sleep(sf::milliseconds(1));
+				continue;
+			}
+
+			vector<Command> commands = lockstep.takeCommands(frameNum);
+			for (int i=0; i<commands.size(); i++) {
+				executeCommand(commands[i]);
+				watchdog.recordCommand(commands[i]);
+			}
+		}
+		timing.inputMilliseconds = getMillisecondsSince(start);
+
+		watchdog.beginTick();
+		start = chrono::high_resolution_clock::now();
+		go();
+		timing.goMilliseconds = getMillisecondsSince(start);
+		watchdog.endTick(timing.inputMilliseconds, timing.goMilliseconds);
+		telemetry.record(timing);
+
+		if (lockstep.isActive())
+			lockstep.recordStateHash(frameNum, hashWorldState());
+		spectatorServer.update(frameNum);
+
+		buildSnapshot(&snapshots.getBack());
+		snapshots.publish();
+
+		if (tickClock.getElapsedTime() < MAX_FRAME_TIME) {
+			sf::sleep(MAX_FRAME_TIME - tickClock.getElapsedTime());
+		}
+		tickClock.restart();
+	}
+	watchdog.finish();
+}
+
+//The spectator's counterpart to runSimulation()
+void runSpectator() {
+	while (simRunning) {
+		if (spectatorClient.receive(viewLeft, viewTop, viewRight, viewBottom)) {
+			spectatorClient.buildSnapshot(&snapshots.getBack());
+			snapshots.publish();
+		}
+		else {
+			sf::sleep(sf::milliseconds(1));
+		}
+	}
+}
+
+//Render thread state. The cursor building is never added to the world; it's only drawn.
+
+sf::RenderWindow window;//opened in main(), so benchmarks can run without one
+
+int mode;
+int buildType;
+int selectedPlayerId;
+boost::shared_ptr<Building> cursorBuilding;
+RenderSnapshot cursorSnapshot;
+sf::Vector2f cameraOffset;//only spectators can move the camera
+
+//Pans a spectator's camera, and tells the spectator thread what's in view
+void updateCamera() {
+	if (spectatorClient.isActive()) {
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::Left)) cameraOffset.x -= SPECTATOR_PAN_SPEED;
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::Right)) cameraOffset.x += SPECTATOR_PAN_SPEED;
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::Up)) cameraOffset.y -= SPECTATOR_PAN_SPEED;
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::Down)) cameraOffset.y += SPECTATOR_PAN_SPEED;
+	}
+	viewLeft = cameraOffset.x;
+	viewTop = cameraOffset.y;
+	viewRight = cameraOffset.x + window.getSize().x;
+	viewBottom = cameraOffset.y + window.getSize().y;
+}
+
+void changeMode(int newMode) {
+	if (newMode == MODE_BUILD) {
+		window.setMouseCursorVisible(false);
+		cursorBuilding = createBuilding(BUILDINGTYPE_NEXUS, boost::shared_ptr<Player>(), sf::Vector2i(0,0), true);
+	}
+	else {
+		window.setMouseCursorVisible(true);
+	}
+	mode = newMode;
+}
+
+void changeBuildType(int newBuildType) {
+	cursorBuilding = createBuilding(newBuildType, boost::shared_ptr<Player>(), cursorBuilding->getGridPoint(), true);
+	buildType = newBuildType;
+}
+
+void pushCommand(int type, sf::Vector2i gridPoint, sf::Vector2f pos) {
+	Command command;
+	command.type = type;
+	command.playerId = selectedPlayerId;
+	command.buildingType = buildType;
+	command.gridPoint = gridPoint;
+	command.pos = pos;
+	commandQueue.push(command);
+}
+
+float framerate=0;
+
+void draw() {
+	MemoryTagScope tag(MEMTAG_RENDERING);
+	RenderSnapshot &snapshot = snapshots.getFront();
+	sf::View worldView = window.getDefaultView();
+	worldView.move(cameraOffset);
+	window.setView(worldView);
+	snapshot.render(&window);
+
+	if (mode == MODE_BUILD) {
+		//update cursorBuilding's position
+		sf::Vector2i gridPoint = grid.getClosestGridPoint(sf::Mouse::getPosition(window));
+		cursorBuilding->setGridPoint(gridPoint);
+
+		cursorSnapshot.clear();
+		bool fits = snapshot.occupancy.isFree(gridPoint, cursorBuilding->getWidth());
+		bool powered = snapshot.coverage.isCovered(cursorBuilding->getCenterPos());
+		cursorBuilding->draw(&cursorSnapshot, !fits ? sf::Color(160,40,40) : powered ? sf::Color(100,140,100) : sf::Color(100,100,100));
+		cursorSnapshot.render(&window);
+	}
+	window.setView(window.getDefaultView());
+
+	//draw debug info
+	sf::Text text;
+	text.setFont(font);
+	text.setCharacterSize(12);
+	text.setColor(sf::Color::White);
+
+	stringstream s;
+
+	if (framerate < 20)
+		s << "frame " << framerate << endl << endl;
+	else
+		s << "frame " << ceil(framerate) << endl << endl;
+
+	s << snapshot.hudText;
+
+	text.setString(s.str());
+	text.setPosition(10,10);
+	window.draw(text);
+}
+
+//Benchmarks, run headless with "noderush --bench"
+
+//Counts the active nodes whose score differs from a full BFS
+int countWrongDistanceScores(ConnectionGraph &graph, DistanceScoreMaintainer &maintainer, int rootIndex) {
+	vector<unsigned int> incrementalScores;
+	for (int i=0; i<graph.getEntityCount(); i++) {
+		incrementalScores.push_back(graph.getNode(i)->getDistanceScore());
+	}
+	maintainer.recomputeAll(graph, rootIndex);
+	int wrong = 0;
+	for (int i=0; i<graph.getEntityCount(); i++) {
+		if (graph.getNode(i)->isActive() && graph.getNode(i)->getDistanceScore() != incrementalScores[i])
+			wrong++;
+	}
+	return wrong;
+}
+
+//How long recomputeAll() takes on graph as it is, leaving the scores as they were (if they were right)
+double timeFullDistanceScoring(ConnectionGraph &graph, DistanceScoreMaintainer &maintainer, int rootIndex) {
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	maintainer.recomputeAll(graph, rootIndex);
+	return getMillisecondsSince(start);
+}
+
+//A side x side grid of nodes, each connected to its four neighbours, with the nexus in a corner. A wall
+//down the middle is left unbuilt except for one gap, then completed in a single batch; afterwards 1% of
+//the nodes are destroyed in a single batch, then a single node, and a node is built in its place. Each
+//update is timed against a full BFS of the graph it leaves; the graph's rebuild() is timed apart, since
+//the network needs it either way.
+void benchmarkDistanceScores(int side) {
+	ConnectionGraph graph;
+	DistanceScoreMaintainer maintainer;
+	vector<boost::shared_ptr<NodeBaseClass>> nodes;
+	vector<int> wall;
+
+	for (int y=0; y<side; y++) {
+		for (int x=0; x<side; x++) {
+			boost::shared_ptr<NodeBaseClass> node;
+			if (x == 0 && y == 0)
+				node = boost::shared_ptr<NodeBaseClass>(new Nexus(boost::weak_ptr<Player>(), sf::Vector2i(x,y), false));
+			else
+				node = boost::shared_ptr<NodeBaseClass>(new Node(boost::weak_ptr<Player>(), sf::Vector2i(x,y), false));
+			if (x == side/2 && y != side-1)
+				wall.push_back(nodes.size());
+			else
+				node->magicallyComplete();
+			nodes.push_back(node);
+			graph.addEntity(node);
+		}
+	}
+	for (int y=0; y<side; y++) {
+		for (int x=0; x<side; x++) {
+			if (x+1 < side) graph.connect(nodes[y*side + x], nodes[y*side + x+1]);
+			if (y+1 < side) graph.connect(nodes[y*side + x], nodes[(y+1)*side + x]);
+		}
+	}
+	graph.rebuild();
+	maintainer.recomputeAll(graph, 0);
+
+	for (int i=0; i<wall.size(); i++) {
+		nodes[wall[i]]->magicallyComplete();
+	}
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	maintainer.update(graph, 0, vector<int>(), wall);
+	double insertTime = getMillisecondsSince(start);
+	int insertErrors = countWrongDistanceScores(graph, maintainer, 0);
+	double insertFullTime = timeFullDistanceScoring(graph, maintainer, 0);
+
+	vector<boost::shared_ptr<NodeBaseClass>> deadNodeNeighbours;
+	int deadNodeCount = 0;
+	for (int i=1; i<nodes.size(); i++) {
+		if (rand()%100 != 0)
+			continue;
+		nodes[i]->die();
+		deadNodeCount++;
+		for (const int *n = graph.nodeNeighboursBegin(i); n != graph.nodeNeighboursEnd(i); n++) {
+			deadNodeNeighbours.push_back(graph.getNode(*n));
+		}
+	}
+	start = chrono::high_resolution_clock::now();
+	graph.markDirty();
+	graph.rebuild();
+	double rebuildTime = getMillisecondsSince(start);
+	vector<int> removedNeighbours;
+	for (int i=0; i<deadNodeNeighbours.size(); i++) {
+		if (!deadNodeNeighbours[i]->isDead())
+			removedNeighbours.push_back(graph.getIndex(deadNodeNeighbours[i].get()));
+	}
+	start = chrono::high_resolution_clock::now();
+	maintainer.update(graph, 0, removedNeighbours, vector<int>());
+	double removeTime = getMillisecondsSince(start);
+	int removeErrors = countWrongDistanceScores(graph, maintainer, 0);
+	double removeFullTime = timeFullDistanceScoring(graph, maintainer, 0);
+
+	//One node in the middle of the grid destroyed, then rebuilt as a new node
+	boost::shared_ptr<NodeBaseClass> middle = nodes[(side/2 + 1)*side + side/4];
+	while (middle->isDead()) {
+		middle = nodes[graph.nodeNeighboursBegin(graph.getIndex(nodes[side*side - 1].get()))[0]];
+	}
+	vector<boost::shared_ptr<NodeBaseClass>> middleNeighbours;
+	for (const int *n = graph.nodeNeighboursBegin(graph.getIndex(middle.get())); n != graph.nodeNeighboursEnd(graph.getIndex(middle.get())); n++) {
+		middleNeighbours.push_back(graph.getNode(*n));
+	}
+	middle->die();
+	graph.markDirty();
+	graph.rebuild();
+	removedNeighbours.clear();
+	for (int i=0; i<middleNeighbours.size(); i++) {
+		removedNeighbours.push_back(graph.getIndex(middleNeighbours[i].get()));
+	}
+	start = chrono::high_resolution_clock::now();
+	maintainer.update(graph, 0, removedNeighbours, vector<int>());
+	double singleRemoveTime = getMillisecondsSince(start);
+	int singleRemoveErrors = countWrongDistanceScores(graph, maintainer, 0);
+	double singleRemoveFullTime = timeFullDistanceScoring(graph, maintainer, 0);
+
+	boost::shared_ptr<NodeBaseClass> replacement(new Node(boost::weak_ptr<Player>(), middle->getGridPoint(), false));
+	replacement->magicallyComplete();
+	for (int i=0; i<middleNeighbours.size(); i++) {
+		graph.connect(replacement, middleNeighbours[i]);
+	}
+	graph.rebuild();
+	start = chrono::high_resolution_clock::now();
+	maintainer.update(graph, 0, vector<int>(), vector<int>(1, graph.getIndex(replacement.get())));
+	double singleInsertTime = getMillisecondsSince(start);
+	int singleInsertErrors = countWrongDistanceScores(graph, maintainer, 0);
+	double singleInsertFullTime = timeFullDistanceScoring(graph, maintainer, 0);
+
+	//The wall destroyed, gap and all, cutting the far half of the grid off: too many nodes are affected to
+	//check one by one, so this is the fallback to a BFS
+	vector<boost::shared_ptr<NodeBaseClass>> cutNeighbours;
+	for (int y=0; y<side; y++) {
+		boost::shared_ptr<NodeBaseClass> cut = nodes[y*side + side/2];
+		if (cut->isDead())
+			continue;
+		for (const int *n = graph.nodeNeighboursBegin(graph.getIndex(cut.get())); n != graph.nodeNeighboursEnd(graph.getIndex(cut.get())); n++) {
+			cutNeighbours.push_back(graph.getNode(*n));
+		}
+		cut->die();
+	}
+	graph.markDirty();
+	graph.rebuild();
+	removedNeighbours.clear();
+	for (int i=0; i<cutNeighbours.size(); i++) {
+		if (!cutNeighbours[i]->isDead())
+			removedNeighbours.push_back(graph.getIndex(cutNeighbours[i].get()));
+	}
+	start = chrono::high_resolution_clock::now();
+	maintainer.update(graph, 0, removedNeighbours, vector<int>());
+	double cutTime = getMillisecondsSince(start);
+	int cutErrors = countWrongDistanceScores(graph, maintainer, 0);
+	double cutFullTime = timeFullDistanceScoring(graph, maintainer, 0);
+
+	cout << "distance scores, " << nodes.size() << " nodes, update vs full BFS (graph rebuild " << rebuildTime << " ms apart):" << endl;
+	cout << "  batch insert " << wall.size() << " nodes        " << insertTime << " vs " << insertFullTime << " ms, " << insertErrors << " wrong" << endl;
+	cout << "  batch remove " << deadNodeCount << " nodes        " << removeTime << " vs " << removeFullTime << " ms, " << removeErrors << " wrong" << endl;
+	cout << "  remove 1 node                 " << singleRemoveTime << " vs " << singleRemoveFullTime << " ms, " << singleRemoveErrors << " wrong" << endl;
+	cout << "  insert 1 node                 " << singleInsertTime << " vs " << singleInsertFullTime << " ms, " << singleInsertErrors << " wrong" << endl;
+	cout << "  cut the grid in half          " << cutTime << " vs " << cutFullTime << " ms, " << cutErrors << " wrong" << endl;
+}
+
+float getRandomFloat(float max) {
+	return (rand() / (float)RAND_MAX) * max;
+}
+
+//Range filtering, nearest-neighbour search and bullet-vs-building collision through the batch kernels,
+//against the scalar getMagnitude()/collidesWithPoint() loops they replaced
+void benchmarkBatchKernels(int count) {
+	const int QUERIES = 1000;
+	const float WORLD_WIDTH = 10000;
+	const float RANGE = 400;
+
+	vector<float> xs, ys;
+	vector<int> owners;
+	vector<sf::Vector2f> positions;
+	for (int i=0; i<count; i++) {
+		xs.push_back(getRandomFloat(WORLD_WIDTH));
+		ys.push_back(getRandomFloat(WORLD_WIDTH));
+		owners.push_back(rand()%10);
+		positions.push_back(sf::Vector2f(xs.back(), ys.back()));
+	}
+	vector<sf::Vector2f> queries;
+	for (int q=0; q<QUERIES; q++) {
+		queries.push_back(sf::Vector2f(getRandomFloat(WORLD_WIDTH), getRandomFloat(WORLD_WIDTH)));
+	}
+	vector<int> indices(count);
+
+	//Range filter
+	long long scalarFound = 0, kernelFound = 0;
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (int q=0; q<QUERIES; q++) {
+		for (int i=0; i<count; i++) {
+			if (getMagnitude(positions[i] - queries[q]) < RANGE)
+				scalarFound++;
+		}
+	}
+	double scalarFilterTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	for (int q=0; q<QUERIES; q++) {
+		kernelFound += findPointsWithinRange(xs.data(), ys.data(), count, queries[q], RANGE, indices.data());
+	}
+	double kernelFilterTime = getMillisecondsSince(start);
+
+	//Nearest enemy
+	int nearestMismatches = 0;
+	vector<int> scalarNearest;
+	start = chrono::high_resolution_clock::now();
+	for (int q=0; q<QUERIES; q++) {
+		int closest = -1;
+		float closestDistance = 0;
+		for (int i=0; i<count; i++) {
+			if (owners[i] == 0)
+				continue;
+			float distance = getMagnitude(positions[i] - queries[q]);
+			if (distance < RANGE && (closest < 0 || distance < closestDistance)) {
+				closest = i;
+				closestDistance = distance;
+			}
+		}
+		scalarNearest.push_back(closest);
+	}
+	double scalarNearestTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	for (int q=0; q<QUERIES; q++) {
+		if (findNearestPointWithinRange(xs.data(), ys.data(), owners.data(), 0, count, queries[q], RANGE, false) != scalarNearest[q])
+			nearestMismatches++;
+	}
+	double kernelNearestTime = getMillisecondsSince(start);
+
+	//Bullets against buildings, a 2x2 building at each point
+	vector<boost::shared_ptr<Building>> boxes;
+	vector<float> lefts(count), tops(count), rights(count), bottoms(count);
+	for (int i=0; i<count; i++) {
+		boxes.push_back(boost::shared_ptr<Building>(new Generator(boost::weak_ptr<Player>(), grid.getClosestGridPoint(positions[i]), false)));
+		boxes[i]->getBounds(&lefts[i], &tops[i], &rights[i], &bottoms[i]);
+	}
+	vector<float> bulletXs, bulletYs;
+	vector<int> bulletOwners;
+	for (int q=0; q<QUERIES; q++) {
+		//aim half the bullets at a building
+		sf::Vector2f bulletPos = (q%2 == 0) ? boxes[rand()%count]->getCenterPos() : queries[q];
+		bulletXs.push_back(bulletPos.x);
+		bulletYs.push_back(bulletPos.y);
+		bulletOwners.push_back(rand()%10);
+	}
+	vector<int> scalarHits, kernelHits(QUERIES);
+	start = chrono::high_resolution_clock::now();
+	for (int q=0; q<QUERIES; q++) {
+		int hit = -1;
+		for (int i=0; i<count; i++) {
+			if (owners[i] == bulletOwners[q])
+				continue;
+			if (boxes[i]->collidesWithPoint(sf::Vector2f(bulletXs[q], bulletYs[q]))) {
+				hit = i;
+				break;
+			}
+		}
+		scalarHits.push_back(hit);
+	}
+	double scalarCollisionTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	findFirstBoxesContainingPoints(bulletXs.data(), bulletYs.data(), bulletOwners.data(), QUERIES,
+								   lefts.data(), tops.data(), rights.data(), bottoms.data(), owners.data(), count, kernelHits.data());
+	double kernelCollisionTime = getMillisecondsSince(start);
+	int collisionMismatches = 0;
+	for (int q=0; q<QUERIES; q++) {
+		if (scalarHits[q] != kernelHits[q])
+			collisionMismatches++;
+	}
+
+	cout << "batch kernels, " << count << " entities x " << QUERIES << " queries (scalar / kernel):" << endl;
+	cout << "  range filter      " << scalarFilterTime << " / " << kernelFilterTime << " ms, " << (scalarFound - kernelFound) << " differ" << endl;
+	cout << "  nearest in range  " << scalarNearestTime << " / " << kernelNearestTime << " ms, " << nearestMismatches << " differ" << endl;
+	cout << "  bullet collision  " << scalarCollisionTime << " / " << kernelCollisionTime << " ms, " << collisionMismatches << " differ" << endl;
+}
+
+//Generates the same huge map with different numbers of threads, checking the layouts are identical, that no
+//two piles are closer than the spacing, and how evenly mass is spread round the nexus sites
+void benchmarkMapGenerator(int width, int height, float spacing, int sites) {
+	MapSettings settings;
+	settings.seed = 12345;
+	settings.width = width;
+	settings.height = height;
+	settings.massPileSpacing = spacing;
+	settings.nexusSites = sites;
+
+	cout << "map generator, " << width << "x" << height << " cells, spacing " << spacing << ":" << endl;
+	MapLayout reference;
+	int maxThreads = max(4, (int)thread::hardware_concurrency());
+	for (int threads=1; threads<=maxThreads; threads*=2) {
+		settings.threads = threads;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		MapLayout layout = generateMap(settings);
+		double time = getMillisecondsSince(start);
+		if (threads == 1)
+			reference = layout;
+		bool same = (layout.massPiles == reference.massPiles && layout.nexusSites == reference.nexusSites);
+		cout << "  " << threads << " threads   " << time << " ms, " << layout.massPiles.size() << " mass piles, " << (same ? "same" : "DIFFERENT") << endl;
+	}
+
+	//Sweep along x for piles too close together
+	vector<sf::Vector2i> piles = reference.massPiles;
+	piles.resize(piles.size() - sites*MAP_START_PILES);//the piles round the sites are only kept apart from the others
+	sort(piles.begin(), piles.end(), [](const sf::Vector2i &a, const sf::Vector2i &b) {return a.x < b.x || (a.x == b.x && a.y < b.y); });
+	int tooClose = 0;
+	for (int i=0; i<piles.size(); i++) {
+		for (int j=i+1; j<piles.size() && piles[j].x - piles[i].x < spacing; j++) {
+			if (getMagnitude(piles[j] - piles[i]) < spacing)
+				tooClose++;
+		}
+	}
+
+	//Mass piles within a fixed distance of each site
+	float minNearbyPiles = reference.massPiles.size(), maxNearbyPiles = 0;
+	for (int i=0; i<reference.nexusSites.size(); i++) {
+		int nearbyPiles = 0;
+		for (int j=0; j<reference.massPiles.size(); j++) {
+			if (getMagnitude(reference.massPiles[j] - reference.nexusSites[i]) < MAP_START_PILE_DISTANCE + spacing)
+				nearbyPiles++;
+		}
+		minNearbyPiles = min(minNearbyPiles, (float)nearbyPiles);
+		maxNearbyPiles = max(maxNearbyPiles, (float)nearbyPiles);
+	}
+	cout << "  " << tooClose << " pairs closer than the spacing; " << sites << " nexus sites with " << minNearbyPiles << " to " << maxNearbyPiles << " piles close by" << endl;
+}
+
+//Creates this thread's world with two players' bases close enough to fight, and ghosts placed round each nexus
+//(as many as fit)
+void createContestedWorld(int ghostsPerPlayer) {
+	start(1, 1);
+	placeBuilding(players[1], BUILDINGTYPE_NEXUS, sf::Vector2i(45,15));
+	const int types[] = {BUILDINGTYPE_ENERGYCANNON, BUILDINGTYPE_GENERATOR, BUILDINGTYPE_MINER, BUILDINGTYPE_NODE, BUILDINGTYPE_NODE};
+	for (int p=0; p<2; p++) {
+		boost::shared_ptr<Nexus> nexus = boost::dynamic_pointer_cast<Nexus, Building>(players[p]->ownedBuildings[0]);
+		nexus->depositMass(1000000);
+		for (int i=0; i<ghostsPerPlayer; i++) {
+			placeBuilding(players[p], types[i%5], nexus->getGridPoint() + sf::Vector2i(rand()%41 - 20, rand()%41 - 20));
+		}
+	}
+}
+
+//A contested world simulated for a while so some ghosts are built and the cannons are firing. Then one
+//what-if per building destroyed is run from forks of that world, one after another and then in parallel,
+//and an unchanged fork is checked against the original played on.
+void benchmarkWorldForks(int ghostsPerPlayer, int whatIfCount, int ticks) {
+	createContestedWorld(ghostsPerPlayer);
+	for (int i=0; i<ticks; i++) {
+		go();
+	}
+	whatIfCount = min(whatIfCount, (int)buildings.size() - 2);//never the nexuses
+
+	unsigned int hashBeforeFork = hashWorldState();
+	int forkedEntities = players.size() + buildings.size() + mobs.size() + massPiles.size();
+	for (int i=0; i<players.size(); i++) {
+		forkedEntities += players[i]->ghostBuildings.size();
+	}
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	World unchanged = forkWorld();
+	double forkTime = getMillisecondsSince(start);
+	int forkDisturbedOriginal = (hashWorldState() != hashBeforeFork);
+
+	vector<WhatIf> sequential(whatIfCount), parallel(whatIfCount);
+	for (int k=0; k<whatIfCount; k++) {
+		sequential[k].world = forkWorld();
+		parallel[k].world = forkWorld();
+		sequential[k].change = parallel[k].change = [k]() {buildings[2+k]->die(); };
+		sequential[k].evaluate = parallel[k].evaluate = []() {return (double)hashWorldState(); };
+		sequential[k].ticks = parallel[k].ticks = ticks;
+	}
+	start = chrono::high_resolution_clock::now();
+	for (int k=0; k<whatIfCount; k++) {
+		runWhatIf(sequential[k]);
+	}
+	double sequentialTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	runWhatIfs(parallel);
+	double parallelTime = getMillisecondsSince(start);
+	int whatIfMismatches = 0;
+	for (int k=0; k<whatIfCount; k++) {
+		if (sequential[k].result != parallel[k].result)
+			whatIfMismatches++;
+	}
+
+	WhatIf unchangedWhatIf;
+	swap(unchangedWhatIf.world, unchanged);
+	unchangedWhatIf.evaluate = []() {return (double)hashWorldState(); };
+	unchangedWhatIf.ticks = ticks;
+	runWhatIf(unchangedWhatIf);
+	for (int i=0; i<ticks; i++) {
+		go();
+	}
+	int unchangedForkDiffers = (unchangedWhatIf.result != hashWorldState());
+
+	int ghosts = players[0]->ghostBuildings.size() + players[1]->ghostBuildings.size();
+	cout << "world forks, " << buildings.size() << " buildings + " << ghosts << " ghosts:" << endl;
+	cout << "  fork                          " << forkTime << " ms (" << forkTime * 1000 / forkedEntities << " us per entity), " << forkDisturbedOriginal << " differ" << endl;
+	cout << "  " << whatIfCount << " what-ifs x " << ticks << " ticks   " << sequentialTime << " / " << parallelTime << " ms (sequential / parallel), " << whatIfMismatches << " differ" << endl;
+	cout << "  unchanged fork vs original    " << unchangedForkDiffers << " differ" << endl;
+
+	World empty;
+	swapWorld(empty);
+}
+
+//The contested world with more and more map beside it, out of range of every building. Only the active
+//chunks are simulated, and forks share the dormant ones, so the extra map shouldn't change how long a tick
+//or a fork takes.
+void benchmarkWorldSize(int ghostsPerPlayer, int ticks) {
+	const int extraSides[] = {0, 500, 2000, 8000};
+	cout << "world size, contested world + extra map, " << ticks << " ticks:" << endl;
+	for (int i=0; i<4; i++) {
+		createContestedWorld(ghostsPerPlayer);
+		MapSettings settings;
+		settings.width = settings.height = extraSides[i];
+		settings.nexusSites = 0;
+		MapLayout layout = generateMap(settings);
+		for (int j=0; j<layout.massPiles.size(); j++) {
+			layout.massPiles[j].x += MAP_DEFAULT_WIDTH + 2*CHUNK_CELLS;
+		}
+		addMassPiles(layout, MAP_MASSPILE_MASS);
+
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		for (int t=0; t<ticks; t++) {
+			go();
+		}
+		double time = getMillisecondsSince(start);
+		start = chrono::high_resolution_clock::now();
+		World fork = forkWorld();
+		double forkTime = getMillisecondsSince(start);
+		cout << "  " << extraSides[i] << "x" << extraSides[i] << " cells   " << time/ticks << " ms/tick, " << forkTime << " ms/fork, " << massPiles.size() << " active + "
+			 << worldChunks.getDormantMassPileCount() << " dormant mass piles, " << worldChunks.getActiveChunkCount() << " / " << worldChunks.getChunkCount() << " chunks active" << endl;
+
+		World empty;
+		swapWorld(empty);
+	}
+}
+
+//Footprint checks at random spots round a contested world's bases, through the occupancy map and through a
+//scan of every building, ghost and mass pile (what checking would cost without it), which should agree. Then
+//as many ghosts are placed in one batch.
+void benchmarkPlacement(int ghostsPerPlayer, int placements) {
+	createContestedWorld(ghostsPerPlayer);
+	const int types[] = {BUILDINGTYPE_ENERGYCANNON, BUILDINGTYPE_GENERATOR, BUILDINGTYPE_MINER, BUILDINGTYPE_NODE, BUILDINGTYPE_NODE};
+	const int spread = 60;
+	sf::Vector2i center = players[0]->ownedBuildings[0]->getGridPoint();
+	vector<boost::shared_ptr<Building>> candidates;
+	for (int i=0; i<placements; i++) {
+		sf::Vector2i gridPoint = center + sf::Vector2i(rand()%(2*spread+1) - spread, rand()%(2*spread+1) - spread);
+		candidates.push_back(createBuilding(types[i%5], players[0], gridPoint, true));
+	}
+
+	vector<boost::shared_ptr<Building>> others = buildings;
+	for (int i=0; i<players.size(); i++) {
+		others.insert(others.end(), players[i]->ghostBuildings.getVector()->begin(), players[i]->ghostBuildings.getVector()->end());
+	}
+	vector<sf::Vector2i> pileGridPoints;
+	for (int i=0; i<massPiles.size(); i++) {
+		pileGridPoints.push_back(massPiles[i]->getGridPoint());
+	}
+	vector<const DormantMassPile*> dormantMassPiles;
+	worldChunks.findDormantMassPiles((center.x - spread - 3) * GRID_CELL_WIDTH, (center.y - spread - 3) * GRID_CELL_WIDTH,
+									 (center.x + spread + 3) * GRID_CELL_WIDTH, (center.y + spread + 3) * GRID_CELL_WIDTH, dormantMassPiles);
+	for (int i=0; i<dormantMassPiles.size(); i++) {
+		pileGridPoints.push_back(dormantMassPiles[i]->getGridPoint());
+	}
+
+	vector<bool> mapFits(placements), scanFits(placements);
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (int i=0; i<placements; i++) {
+		mapFits[i] = occupancy.isFree(candidates[i]->getGridPoint(), candidates[i]->getWidth());
+	}
+	double mapTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	for (int i=0; i<placements; i++) {
+		float left, top, right, bottom;
+		candidates[i]->getBounds(&left, &top, &right, &bottom);
+		bool fits = true;
+		for (int j=0; j<others.size() && fits; j++) {
+			float otherLeft, otherTop, otherRight, otherBottom;
+			others[j]->getBounds(&otherLeft, &otherTop, &otherRight, &otherBottom);
+			fits = !(left < otherRight && otherLeft < right && top < otherBottom && otherTop < bottom);
+		}
+		sf::Vector2i gridPoint = candidates[i]->getGridPoint();
+		for (int j=0; j<pileGridPoints.size() && fits; j++) {
+			fits = !(pileGridPoints[j].x >= gridPoint.x && pileGridPoints[j].x < gridPoint.x + candidates[i]->getWidth() &&
+					 pileGridPoints[j].y >= gridPoint.y && pileGridPoints[j].y < gridPoint.y + candidates[i]->getWidth());
+		}
+		scanFits[i] = fits;
+	}
+	double scanTime = getMillisecondsSince(start);
+	int fitting = 0, disagreements = 0;
+	for (int i=0; i<placements; i++) {
+		fitting += mapFits[i];
+		disagreements += (mapFits[i] != scanFits[i]);
+	}
+
+	int ghostsBefore = players[0]->ghostBuildings.size();
+	start = chrono::high_resolution_clock::now();
+	for (int i=0; i<placements; i++) {
+		placeBuilding(players[0], candidates[i]->getType(), candidates[i]->getGridPoint());
+	}
+	double placeTime = getMillisecondsSince(start);
+
+	cout << "placement, " << others.size() << " buildings and ghosts, " << pileGridPoints.size() << " mass piles nearby:" << endl;
+	cout << "  " << placements << " footprint checks   " << mapTime << " / " << scanTime << " ms (occupancy map / scan), " << fitting << " fit, " << disagreements << " disagree" << endl;
+	cout << "  " << placements << " ghosts placed      " << placeTime << " ms, " << players[0]->ghostBuildings.size() - ghostsBefore << " fit" << endl;
+
+	World empty;
+	swapWorld(empty);
+}
+
+void createBotWorld(int botCount, int spacing);
+
+//Makes this thread's world a bot world, played for ticks ticks
+void playBots(int botCount, int ticks) {
+	createBotWorld(botCount, HEADLESS_DEFAULT_SPACING);
+	vector<Bot> bots;
+	for (int i=0; i<botCount; i++) {
+		bots.push_back(Bot(i, i+1));
+	}
+	vector<Command> commands;
+	for (int t=0; t<ticks; t++) {
+		commands.clear();
+		for (int i=0; i<bots.size(); i++) {
+			if ((frameNum + i) % BOT_THINK_INTERVAL == 0)
+				bots[i].think(commands);
+		}
+		for (int i=0; i<commands.size(); i++) {
+			executeCommand(commands[i]);
+		}
+		go();
+	}
+}
+
+//"Which nodes power this spot" at random spots round each bot's network, once bots have played for a while:
+//through the coverage map, and through a scan of the player's buildings (what it cost without one), which
+//should give the same nodes in the same order.
+void benchmarkCoverage(int botCount, int ticks, int lookups) {
+	playBots(botCount, ticks);
+
+	vector<boost::shared_ptr<Player>> lookupPlayers;
+	vector<sf::Vector2f> positions;
+	int activeNodes = 0, ownedBuildings = 0;
+	for (int i=0; i<players.size(); i++) {
+		ownedBuildings += players[i]->ownedBuildings.size();
+		for (int j=0; j<players[i]->ownedBuildings.size(); j++) {
+			activeNodes += (players[i]->ownedBuildings[j]->isActive() && dynamic_cast<NodeBaseClass*>(players[i]->ownedBuildings[j].get()));
+		}
+	}
+	for (int i=0; i<lookups; i++) {
+		boost::shared_ptr<Player> player = players[rand() % players.size()];
+		if (player->ownedBuildings.size() == 0)
+			continue;
+		sf::Vector2f around = player->ownedBuildings[rand() % player->ownedBuildings.size()]->getPos();
+		sf::Vector2i gridPoint = grid.getClosestGridPoint(around) + sf::Vector2i(rand()%41 - 20, rand()%41 - 20);
+		lookupPlayers.push_back(player);
+		positions.push_back(grid.getRealPos(gridPoint) + sf::Vector2f(rand()%2, rand()%2) * (GRID_CELL_WIDTH/2.f));
+	}
+	lookups = positions.size();
+
+	vector<bool> covered(lookups);
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (int i=0; i<lookups; i++) {
+		covered[i] = lookupPlayers[i]->coverage.isCovered(positions[i]);
+	}
+	double coveredTime = getMillisecondsSince(start);
+	vector<vector<boost::shared_ptr<NodeBaseClass>>> mapNodes(lookups), scanNodes(lookups);
+	start = chrono::high_resolution_clock::now();
+	for (int i=0; i<lookups; i++) {
+		lookupPlayers[i]->coverage.findCoveringNodes(positions[i], mapNodes[i]);
+	}
+	double mapTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	for (int i=0; i<lookups; i++) {
+		FrameVector<boost::shared_ptr<NodeBaseClass>> nodes = findNearbyBuildings<NodeBaseClass>(lookupPlayers[i]->ownedBuildings, positions[i], NODE_CONNECTION_MAXLENGTH, true);
+		scanNodes[i].assign(nodes.begin(), nodes.end());
+	}
+	double scanTime = getMillisecondsSince(start);
+	frameArena.reset();
+	int powered = 0, disagreements = 0;
+	for (int i=0; i<lookups; i++) {
+		powered += covered[i];
+		disagreements += (mapNodes[i] != scanNodes[i] || covered[i] != (scanNodes[i].size() > 0));
+	}
+
+	cout << "power coverage, " << botCount << " bots after " << ticks << " ticks, " << activeNodes << " active nodes of " << ownedBuildings << " buildings:" << endl;
+	cout << "  " << lookups << " lookups   " << coveredTime << " / " << mapTime << " / " << scanTime << " ms (powered / which nodes / scan), "
+		 << powered << " powered, " << disagreements << " disagree" << endl;
+
+	World empty;
+	swapWorld(empty);
+}
+
+//Enemy cannon threat once bots have played for a while: at random spots round each bot's network through
+//the threat field and through a scan of the cannons, over random regions through the tile summaries and
+//point by point, and the field rebuilt from scratch on one thread and on all of them, which should match
+//the one kept up to date as the game went.
+void benchmarkThreatField(int botCount, int ticks, int lookups) {
+	playBots(botCount, ticks);
+
+	vector<AttackerBaseClass*> cannons;
+	for (int i=0; i<buildings.size(); i++) {
+		AttackerBaseClass *cannon = dynamic_cast<AttackerBaseClass*>(buildings[i].get());
+		if (cannon && cannon->isActive())
+			cannons.push_back(cannon);
+	}
+	vector<int> lookupPlayers;
+	vector<sf::Vector2f> positions;
+	for (int i=0; i<lookups; i++) {
+		boost::shared_ptr<Player> player = players[rand() % players.size()];
+		if (player->ownedBuildings.size() == 0)
+			continue;
+		sf::Vector2f around = player->ownedBuildings[rand() % player->ownedBuildings.size()]->getPos();
+		sf::Vector2i gridPoint = grid.getClosestGridPoint(around) + sf::Vector2i(rand()%41 - 20, rand()%41 - 20);
+		lookupPlayers.push_back(player->id);
+		positions.push_back(grid.getRealPos(gridPoint) + sf::Vector2f(rand()%2, rand()%2) * (GRID_CELL_WIDTH/2.f));
+	}
+	lookups = positions.size();
+
+	vector<int> fieldThreats(lookups), scanThreats(lookups, 0);
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (int i=0; i<lookups; i++) {
+		fieldThreats[i] = threatField.getThreat(lookupPlayers[i], positions[i], false);
+	}
+	double fieldTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	for (int i=0; i<lookups; i++) {
+		for (int j=0; j<cannons.size(); j++) {
+			sf::Vector2f difference = cannons[j]->getPos() - positions[i];
+			float range = cannons[j]->getAttackRange();
+			if (cannons[j]->getOwnerId() != lookupPlayers[i] && difference.x*difference.x + difference.y*difference.y < range*range)
+				scanThreats[i]++;
+		}
+	}
+	double scanTime = getMillisecondsSince(start);
+	int threatened = 0, disagreements = 0;
+	for (int i=0; i<lookups; i++) {
+		threatened += (fieldThreats[i] > 0);
+		disagreements += (fieldThreats[i] != scanThreats[i]);
+	}
+
+	//Regions of 8x8 cells round the same spots
+	sf::Vector2f regionSize(8*GRID_CELL_WIDTH, 8*GRID_CELL_WIDTH);
+	vector<bool> summaryThreatened(lookups), pointThreatened(lookups, false);
+	start = chrono::high_resolution_clock::now();
+	for (int i=0; i<lookups; i++) {
+		summaryThreatened[i] = threatField.isRegionThreatened(lookupPlayers[i], positions[i] - regionSize/2.f, positions[i] + regionSize/2.f, false);
+	}
+	double summaryTime = getMillisecondsSince(start);
+	start = chrono::high_resolution_clock::now();
+	float halfSpacing = GRID_CELL_WIDTH/2.f;
+	for (int i=0; i<lookups; i++) {
+		for (float y=-regionSize.y/2; y<=regionSize.y/2 && !pointThreatened[i]; y+=halfSpacing) {
+			for (float x=-regionSize.x/2; x<=regionSize.x/2 && !pointThreatened[i]; x+=halfSpacing) {
+				pointThreatened[i] = threatField.getThreat(lookupPlayers[i], positions[i] + sf::Vector2f(x, y), false) > 0;
+			}
+		}
+	}
+	double pointTime = getMillisecondsSince(start);
+	int regionsThreatened = 0, regionDisagreements = 0;
+	for (int i=0; i<lookups; i++) {
+		regionsThreatened += summaryThreatened[i];
+		regionDisagreements += (summaryThreatened[i] != pointThreatened[i]);
+	}
+
+	ThreatField serial, parallel;
+	start = chrono::high_resolution_clock::now();
+	serial.rebuild(buildings, 1);
+	double serialTime = getMillisecondsSince(start);
+	int threadCount = max(1u, thread::hardware_concurrency());
+	start = chrono::high_resolution_clock::now();
+	parallel.rebuild(buildings, threadCount);
+	double parallelTime = getMillisecondsSince(start);
+
+	cout << "threat field, " << botCount << " bots after " << ticks << " ticks, " << cannons.size() << " active cannons:" << endl;
+	cout << "  " << lookups << " lookups   " << fieldTime << " / " << scanTime << " ms (field / scan), "
+		 << threatened << " threatened, " << disagreements << " disagree" << endl;
+	cout << "  " << lookups << " regions   " << summaryTime << " / " << pointTime << " ms (summaries / points), "
+		 << regionsThreatened << " threatened, " << regionDisagreements << " disagree" << endl;
+	cout << "  rebuild   " << serialTime << " / " << parallelTime << " ms (1 / " << threadCount << " threads), "
+		 << ((serial == threatField && parallel == threatField) ? "matches" : "DIFFERS FROM") << " the incremental field" << endl;
+
+	World empty;
+	swapWorld(empty);
+}
+
+//A big build plan round one nexus with a trickle of mass, built with every unbuilt building drawing on it at
+//once (as networks used to) and with the construction queue's default number of builds at a time
+void benchmarkConstruction(int plannedBuildings, int ticks, float massPerTick) {
+	cout << "construction, " << plannedBuildings << " buildings planned, " << massPerTick << " mass a tick, " << ticks << " ticks:" << endl;
+	int limits[] = {plannedBuildings, CONSTRUCTION_MAX_ACTIVE_BUILDS};
+	for (int l=0; l<2; l++) {
+		start(1, 1);
+		srand(1);
+		boost::shared_ptr<Player> player = players.front();
+		boost::shared_ptr<Nexus> nexus = boost::dynamic_pointer_cast<Nexus, Building>(player->ownedBuildings[0]);
+		player->network->setMaxActiveBuilds(limits[l]);
+		const int types[] = {BUILDINGTYPE_GENERATOR, BUILDINGTYPE_MINER, BUILDINGTYPE_NODE, BUILDINGTYPE_NODE};
+		for (int i=0; i<plannedBuildings; i++) {
+			placeBuilding(player, types[i%4], nexus->getGridPoint() + sf::Vector2i(rand()%41 - 20, rand()%41 - 20));
+		}
+
+		int firstBuiltTick = -1, built = 0;
+		double time = 0, worstTick = 0;
+		for (int t=0; t<ticks; t++) {
+			nexus->depositMass(massPerTick);
+			chrono::high_resolution_clock::time_point tickStart = chrono::high_resolution_clock::now();
+			go();
+			double tickTime = getMillisecondsSince(tickStart);
+			time += tickTime;
+			worstTick = max(worstTick, tickTime);
+			built = -1;//the nexus
+			for (int i=0; i<player->ownedBuildings.size(); i++) {
+				built += player->ownedBuildings[i]->isBuilt();
+			}
+			if (built > 0 && firstBuiltTick < 0)
+				firstBuiltTick = t;
+		}
+
+		cout << "  " << limits[l] << " at a time   first built on tick " << firstBuiltTick << ", " << built << " built, "
+			 << player->ownedBuildings.size() - 1 - built << " unbuilt, " << player->ghostBuildings.size() << " ghosts; "
+			 << time / ticks << " ms/tick (slowest " << worstTick << ")" << endl;
+
+		World empty;
+		swapWorld(empty);
+	}
+}
+
+int runBenchmarks() {
+	grid.setup(GRID_CELL_WIDTH);
+	srand(1);
+	benchmarkDistanceScores(100);
+	benchmarkDistanceScores(320);
+	benchmarkBatchKernels(1000);
+	benchmarkBatchKernels(100000);
+	benchmarkWorldForks(2000, 8, 300);
+	benchmarkWorldSize(2000, 300);
+	benchmarkPlacement(2000, 10000);
+	benchmarkCoverage(16, 6000, 10000);
+	benchmarkThreatField(16, 6000, 10000);
+	benchmarkConstruction(1000, 3000, 40);
+	benchmarkMapGenerator(25000, 25000, 12, 16);
+	return 0;
+}
+
+//Microbenchmarks, run headless with "noderush --microbench [--filter <text>] [--json <file>]". Each one
+//times a single primitive at several scales, for trying an optimisation in isolation. An operation is timed
+//over repeated samples after MICROBENCH_WARMUP_SAMPLES are thrown away; one that can be repeated without
+//setting up again is repeated within a sample until the sample is long enough to time well. The median
+//time per operation is reported with the fastest, the 90th percentile and the median absolute deviation,
+//which shrug off the odd sample slowed by something else. --json writes the results out too, for
+//tracking over time.
+class Microbenchmarks {
+	struct Result {
+		string name, variant;
+		long long scale;
+		int samples, operationsPerSample;
+		double fastest, median, percentile90, deviation;//nanoseconds per operation
+	};
+	vector<Result> results;
+	string filter;
+
+	static double getPercentile(const vector<double> &sorted, double fraction) {
+		return sorted[min((int)(fraction * sorted.size()), (int)sorted.size() - 1)];
+	}
+public:
+	long long sink;//results folded in so operations aren't optimised away
+
+	Microbenchmarks(string _filter) {
+		filter = _filter;
+		sink = 0;
+	}
+	bool wants(const string &name) {
+		return filter.empty() || name.find(filter) != string::npos;
+	}
+	//prepare() is run untimed before every sample; operation(n) does the operation n times. If it can't be
+	//repeated without preparing again, it's only ever asked for one.
+	void measure(const string &name, const string &variant, long long scale, function<void()> prepare, function<void(int)> operation, bool repeatable) {
+		int repetitions = 1;
+		while (repeatable) {
+			prepare();
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			operation(repetitions);
+			double milliseconds = getMillisecondsSince(start);
+			if (milliseconds >= MICROBENCH_SAMPLE_MILLISECONDS || repetitions >= (1 << 24))
+				break;
+			repetitions *= (milliseconds < MICROBENCH_SAMPLE_MILLISECONDS/16) ? 8 : 2;
+		}
+
+		vector<double> samples;
+		chrono::high_resolution_clock::time_point caseStart = chrono::high_resolution_clock::now();
+		for (int s=0; s<MICROBENCH_WARMUP_SAMPLES + MICROBENCH_MAX_SAMPLES; s++) {
+			if (samples.size() >= MICROBENCH_MIN_SAMPLES && getMillisecondsSince(caseStart) > MICROBENCH_CASE_MILLISECONDS)
+				break;
+			prepare();
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			operation(repetitions);
+			double milliseconds = getMillisecondsSince(start);
+			if (s >= MICROBENCH_WARMUP_SAMPLES)
+				samples.push_back(milliseconds * 1000000 / repetitions);
+		}
 
-				buildings.push_back(possiblyGhostBuilding);//add to global buildings list
-				networkOwner->ownedBuildings.push_back(possiblyGhostBuilding);//add to player's buildings list
-				connectedBuildings.push_back(possiblyGhostBuilding);//add to network's buildings list
-			}
+		sort(samples.begin(), samples.end());
+		Result result;
+		result.name = name;
+		result.variant = variant;
+		result.scale = scale;
+		result.samples = samples.size();
+		result.operationsPerSample = repetitions;
+		result.fastest = samples.front();
+		result.median = getPercentile(samples, 0.5);
+		result.percentile90 = getPercentile(samples, 0.9);
+		vector<double> deviations;
+		for (int i=0; i<samples.size(); i++) {
+			deviations.push_back(fabs(samples[i] - result.median));
+		}
+		sort(deviations.begin(), deviations.end());
+		result.deviation = getPercentile(deviations, 0.5);
+		results.push_back(result);
+
+		cout << "  " << variant << ", " << scale << ": " << (long long)result.median << " ns median (fastest " << (long long)result.fastest << ", 90% " << (long long)result.percentile90
+			 << ", deviation " << (int)(result.median > 0 ? 100 * result.deviation / result.median : 0) << "%), " << result.samples << " samples of " << repetitions << endl;
+	}
+	bool writeJson(const string &path) {
+		ofstream out(path.c_str());
+		out << "{\"unit\": \"ns\", \"results\": [" << endl;
+		for (int i=0; i<results.size(); i++) {
+			const Result &result = results[i];
+			out << "  {\"name\": \"" << result.name << "\", \"variant\": \"" << result.variant << "\", \"scale\": " << result.scale
+				<< ", \"samples\": " << result.samples << ", \"operationsPerSample\": " << result.operationsPerSample
+				<< ", \"fastest\": " << result.fastest << ", \"median\": " << result.median << ", \"p90\": " << result.percentile90
+				<< ", \"mad\": " << result.deviation << "}" << ((i+1 < results.size()) ? "," : "") << endl;
 		}
+		out << "]}" << endl;
+		return out.good();
 	}
+};
 
-	energyRequested = 0;
-	massRequested = 0;
-	for (int i=0; i<connectedBuildings.size(); i++) {
-		if (connectedBuildings[i]->isActive())
-			energyRequested += connectedBuildings[i]->getEnergyDraw();
-
-		if (networkCanBuild && !connectedBuildings[i]->isBuilt()) {
-			Resources r = connectedBuildings[i]->getBuildResourceDraw();
-			energyRequested += r.energy;
-			massRequested += r.mass;
-		}
+//For operations that use up the world they run in: each sample runs in a fresh fork of this thread's world
+class ForkPerSample {
+	World fork;
+	bool forked;
+public:
+	ForkPerSample() {
+		forked = false;
+	}
+	~ForkPerSample() {
+		finish();
 	}
+	void prepare() {
+		finish();
+		fork = forkWorld();
+		swapWorld(fork);
+		forked = true;
+	}
+	//Back to the original world
+	void finish() {
+		if (forked)
+			swapWorld(fork);
+		forked = false;
+	}
+};
 
-	float energySatisfaction = energyRequested>0 ? min(1.0, energyAvailable/energyRequested) : 1.0;
-	float massSatisfaction = (networkCanBuild && massRequested>0) ? min(1.0, massAvailable/massRequested) : 1.0;
+//Adds a player with a complete nexus and a network to this thread's world
+boost::shared_ptr<Player> addMicrobenchPlayer(sf::Vector2i nexusGridPoint) {
+	boost::shared_ptr<Player> player(new Player(players.size()));
+	players.push_back(player);
+	boost::shared_ptr<Nexus> nexus(new Nexus(player, nexusGridPoint, false));
+	nexus->magicallyComplete();
+	nexus->depositMass(1000000000);
+	addBuilding(nexus);
+	player->ownedBuildings.insert(nexus);
+	player->coverage.add(nexus);
+	player->network = boost::shared_ptr<Network>(new Network(player, nexus));
+	return player;
+}
 
-	massSpent = 0;
-	energySpent = 0;
+//Adds a complete node of player's to this thread's world and its network, connected to what's in range
+boost::shared_ptr<NodeBaseClass> addMicrobenchNode(boost::shared_ptr<Player> player, sf::Vector2i gridPoint) {
+	boost::shared_ptr<NodeBaseClass> node = boost::dynamic_pointer_cast<NodeBaseClass, Building>(createBuilding(BUILDINGTYPE_NODE, player, gridPoint, false));
+	node->magicallyComplete();
+	addBuilding(node);
+	player->ownedBuildings.insert(node);
+	player->network->connectCompletedNode(node);
+	return node;
+}
 
-	for (int i=0; i<connectedBuildings.size(); i++) {
-		if (connectedBuildings[i]->isActive()) {
-			energySpent += connectedBuildings[i]->supplyEnergy(energySatisfaction);
+//Scans of a building list for those within NODE_CONNECTION_MAXLENGTH of a point, with about 30 buildings in
+//range of each: of any kind, and only active nodes (among as many generators, a quarter of them unbuilt)
+void microbenchFindNearbyBuildings(Microbenchmarks &benchmarks, const vector<int> &scales) {
+	cout << "findNearbyBuildings:" << endl;
+	for (int s=0; s<scales.size(); s++) {
+		int side = sqrt(scales[s] / 30.f) * NODE_CONNECTION_MAXLENGTH * 1.8f / GRID_CELL_WIDTH;
+		BuildingSet list;
+		for (int i=0; i<scales[s]; i++) {
+			boost::shared_ptr<Building> building = createBuilding((i%2) ? BUILDINGTYPE_NODE : BUILDINGTYPE_GENERATOR, boost::weak_ptr<Player>(), sf::Vector2i(rand()%side, rand()%side), false);
+			if (i%4 != 0)
+				building->magicallyComplete();
+			list.insert(building);
 		}
-		else if (networkCanBuild && !connectedBuildings[i]->isBuilt()) {
-			Resources spent = connectedBuildings[i]->build(min(energySatisfaction, massSatisfaction));
-			massSpent += spent.mass;
-			energySpent += spent.energy;
+		vector<sf::Vector2f> queries;
+		for (int i=0; i<64; i++) {
+			queries.push_back(grid.getRealPos(sf::Vector2i(rand()%side, rand()%side)));
+		}
+		benchmarks.measure("findNearbyBuildings", "any", scales[s], []() {}, [&](int n) {
+			for (int i=0; i<n; i++) {
+				benchmarks.sink += findNearbyBuildings<Building>(list, queries[i%queries.size()], NODE_CONNECTION_MAXLENGTH, false).size();
+				frameArena.reset();
+			}
+		}, true);
+		benchmarks.measure("findNearbyBuildings", "active nodes", scales[s], []() {}, [&](int n) {
+			for (int i=0; i<n; i++) {
+				benchmarks.sink += findNearbyBuildings<NodeBaseClass>(list, queries[i%queries.size()], NODE_CONNECTION_MAXLENGTH, true).size();
+				frameArena.reset();
+			}
+		}, true);
+	}
+}
 
-			if (connectedBuildings[i]->isBuilt()) {
-				//If the building was just built, activate and connect it if it's a node
-				if (boost::shared_ptr<NodeBaseClass> node = boost::dynamic_pointer_cast<NodeBaseClass, Building>(connectedBuildings[i])) {
-					activeNodes.push_back(node);
-							
-					//Add connections to nearby buildings and ghostBuildings
-					vector<boost::shared_ptr<Building>> nearbyRealBuildings = findNearbyBuildings<Building>(&(networkOwner->ownedBuildings), node->getPos(), NODE_CONNECTION_MAXLENGTH, false);
-					vector<boost::shared_ptr<Building>> nearbyGhostBuildings = findNearbyBuildings<Building>(&(networkOwner->ghostBuildings), node->getPos(), NODE_CONNECTION_MAXLENGTH, false);
-					auto allNearbyBuildings = boost::join(nearbyRealBuildings, nearbyGhostBuildings);
-						
-					//look for the lowest nearby distanceScore to get local distanceScore
-					unsigned int lowestDistanceScore = 65535; // Max value for unsigned int
-					for (int j=0; j<allNearbyBuildings.size(); j++) {
-						if (allNearbyBuildings[j].get() == node.get()) continue;
-
-						node->connectedBuildings.push_back(boost::weak_ptr<Building>(allNearbyBuildings[j]));
-
-						if (boost::shared_ptr<NodeBaseClass> otherNode = boost::dynamic_pointer_cast<NodeBaseClass, Building>(allNearbyBuildings[j])) {
-								
-							if (otherNode->getDistanceScore() < lowestDistanceScore) {
-								lowestDistanceScore = otherNode->getDistanceScore();
-							}
-						}
-					}
-					node->setDistanceScore(lowestDistanceScore + 1);
-
-					//Now iterate through all connected nodes to update their score if it's now higher than it should be
-					vector<boost::shared_ptr<NodeBaseClass>> nodesUpdatedLastLoop;
-					nodesUpdatedLastLoop.push_back(node);
-					while (nodesUpdatedLastLoop.size() > 0) {
-						vector<boost::shared_ptr<NodeBaseClass>> nodesUpdatedThisLoop;
-						for (int j=0; j<nodesUpdatedLastLoop.size(); j++) {
-							for (int k=0; k<nodesUpdatedLastLoop[j]->connectedBuildings.size(); k++) {
-
-								//First make sure we haven't already updated this building
-								bool inList = false;
-								for (int l=0; l<nodesUpdatedThisLoop.size(); l++) {
-									if (nodesUpdatedLastLoop[j]->connectedBuildings[k].lock().get() == nodesUpdatedThisLoop[l].get()) {
-										inList = true;
-										break;
-									}
-								}
-								if (inList)
-									continue;
-
-								//If it's a node and the distance is > this node's distanceScore + 1, then recalculate distance score and add to nodesUpdatedThisLoop
-								if (boost::shared_ptr<NodeBaseClass> connectedNode = boost::dynamic_pointer_cast<NodeBaseClass, Building>(nodesUpdatedLastLoop[j]->connectedBuildings[k].lock())) {
-									if (connectedNode->getDistanceScore() > nodesUpdatedLastLoop[j]->getDistanceScore() + 1) {
-										connectedNode->setDistanceScore(nodesUpdatedLastLoop[j]->getDistanceScore() + 1);
-										nodesUpdatedThisLoop.push_back(connectedNode);
-									}
-								}
-							}
-						}
-						nodesUpdatedLastLoop = nodesUpdatedThisLoop;
-					}
+//One node destroyed, and the network's reaction (rescoring, and cutting off whatever lost its way to the
+//nexus), on three shapes of node graph with the nexus at one end or the middle: a chain, broken next to
+//the nexus so everything is cut off; a square grid, broken in the middle so the rest reroutes round it;
+//and a star of four chains, one of them broken at the nexus
+void microbenchDestroyedNodes(Microbenchmarks &benchmarks, const vector<int> &scales) {
+	cout << "Network::reactToDestroyedNodes:" << endl;
+	const int step = NODE_CONNECTION_MAXLENGTH * 0.8f / GRID_CELL_WIDTH;//neighbours connect, but not diagonals or the next but one
+	const char *shapes[] = {"chain", "grid", "star"};
+	for (int shape=0; shape<3; shape++) {
+		for (int s=0; s<scales.size(); s++) {
+			boost::shared_ptr<Player> player = addMicrobenchPlayer(sf::Vector2i(0, 0));
+			int side = ceil(sqrt((float)scales[s]));
+			boost::shared_ptr<NodeBaseClass> victim;
+			for (int i=1; i<scales[s]; i++) {
+				sf::Vector2i gridPoint;
+				if (shape == 0)
+					gridPoint = sf::Vector2i(i*step, 0);
+				else if (shape == 1)
+					gridPoint = sf::Vector2i((i%side)*step, (i/side)*step);
+				else {
+					sf::Vector2i arms[] = {sf::Vector2i(1,0), sf::Vector2i(0,1), sf::Vector2i(-1,0), sf::Vector2i(0,-1)};
+					gridPoint = arms[i%4] * (((i-1)/4 + 1) * step);
 				}
+				boost::shared_ptr<NodeBaseClass> node = addMicrobenchNode(player, gridPoint);
+				if ((shape == 1) ? (i == side/2*side + side/2) : (i == 1))
+					victim = node;
 			}
+			go();
+			go();
+			player->network->rebuildMembership();
+			int victimIndex = find(buildings.begin(), buildings.end(), victim) - buildings.begin();
+
+			ForkPerSample fork;
+			benchmarks.measure("reactToDestroyedNodes", shapes[shape], scales[s], [&]() {fork.prepare(); }, [&](int n) {
+				boost::shared_ptr<NodeBaseClass> node = boost::dynamic_pointer_cast<NodeBaseClass, Building>(buildings[victimIndex]);
+				node->die();
+				FrameVector<boost::shared_ptr<NodeBaseClass>> deadNodes;
+				deadNodes.push_back(node);
+				players[0]->network->reactToDestroyedNodes(deadNodes);
+				frameArena.reset();
+			}, false);
+			fork.finish();
+			World empty;
+			swapWorld(empty);
 		}
 	}
-
-	assert(nexus->withdrawMass(massSpent));
-
-	energyProfit = energyIncome - energySpent;
-	//store or remove from storage
 }
 
-void setup() {
-	grid.setup(GRID_CELL_WIDTH);
-
-	font.loadFromFile("tahoma.ttf");
+//One economy step of a network, with every building in range of a grid of nodes, for three mixes: mostly
+//energy providers (generators), mostly consumers (cannons, recharging as they're drained), and mostly
+//unbuilt buildings waiting in the construction queue
+void microbenchNetworkGo(Microbenchmarks &benchmarks, const vector<int> &scales) {
+	cout << "Network::go:" << endl;
+	const char *mixes[] = {"providers", "consumers", "unbuilt"};
+	const int mixPercentages[3][3] = {{70, 20, 10}, {10, 80, 10}, {10, 10, 80}};//generators, cannons, unbuilt
+	const int step = NODE_CONNECTION_MAXLENGTH * 0.8f / GRID_CELL_WIDTH;
+	for (int mix=0; mix<3; mix++) {
+		for (int s=0; s<scales.size(); s++) {
+			int side = 5 * sqrt((float)scales[s]);//grid cells; about one building per 25
+			boost::shared_ptr<Player> player = addMicrobenchPlayer(sf::Vector2i(side/2, side/2));
+			vector<boost::shared_ptr<AttackerBaseClass>> cannons;
+			for (int i=0; i<scales[s]; i++) {
+				int percentile = i % 100;
+				int type = (percentile < mixPercentages[mix][0]) ? BUILDINGTYPE_GENERATOR :
+						   (percentile < mixPercentages[mix][0] + mixPercentages[mix][1]) ? BUILDINGTYPE_ENERGYCANNON : BUILDINGTYPE_NODE;
+				sf::Vector2i gridPoint;
+				do {
+					gridPoint = sf::Vector2i(rand()%side, rand()%side);
+				} while (!occupancy.isFree(gridPoint, 2) || (gridPoint.x % step == 0 && gridPoint.y % step == 0));
+				boost::shared_ptr<Building> building = createBuilding(type, player, gridPoint, false);
+				if (percentile < mixPercentages[mix][0] + mixPercentages[mix][1])
+					building->magicallyComplete();
+				addBuilding(building);
+				player->ownedBuildings.insert(building);
+				if (boost::shared_ptr<AttackerBaseClass> cannon = boost::dynamic_pointer_cast<AttackerBaseClass, Building>(building))
+					cannons.push_back(cannon);
+			}
+			for (int y=0; y<=side; y+=step) {
+				for (int x=0; x<=side; x+=step) {
+					if (occupancy.isFree(sf::Vector2i(x, y), 1))
+						addMicrobenchNode(player, sf::Vector2i(x, y));
+				}
+			}
+			go();
+			go();
+			player->network->rebuildMembership();
+
+			benchmarks.measure("Network::go", mixes[mix], scales[s], []() {}, [&](int n) {
+				for (int i=0; i<n; i++) {
+					for (int j=i%8; j<cannons.size(); j+=8) {
+						if (cannons[j]->weaponIsReady())
+							cannons[j]->dischargeWeapon();
+					}
+					player->network->markChanged();
+					player->network->go();
+					frameArena.reset();
+				}
+			}, true);
+			World empty;
+			swapWorld(empty);
+		}
+	}
 }
 
-int mode;
-int buildType;
-
-boost::shared_ptr<Player> selectedPlayer;
-
-//sf::RenderWindow window(sf::VideoMode(1366, 768, 32), "noderush", sf::Style::Fullscreen);
-sf::RenderWindow window(sf::VideoMode(1920, 1080, 32), "noderush", sf::Style::Fullscreen);
+//A cloud of bullets in a fixed square strewn with enemy nodes, so it gets denser with scale: one tick of
+//the bullets moving, then of their hits being resolved
+void microbenchBullets(Microbenchmarks &benchmarks, const vector<int> &scales) {
+	cout << "EnergyBullet::go:" << endl;
+	const int side = 125;//grid cells
+	for (int s=0; s<scales.size(); s++) {
+		boost::shared_ptr<Player> shooter = addMicrobenchPlayer(sf::Vector2i(-20, -20));
+		boost::shared_ptr<Player> target = addMicrobenchPlayer(sf::Vector2i(side + 20, side + 20));
+		for (int y=0; y<side; y+=10) {
+			for (int x=0; x<side; x+=10) {
+				addMicrobenchNode(target, sf::Vector2i(x, y));
+			}
+		}
+		float width = side * GRID_CELL_WIDTH;
+		for (int i=0; i<scales[s]; i++) {
+			addMob(boost::shared_ptr<EnergyBullet>(new EnergyBullet(sf::Vector2f(getRandomFloat(width), getRandomFloat(width)), shooter,
+																	 sf::Vector2f(getRandomFloat(width), getRandomFloat(width)))));
+		}
+		go();
 
-void start() {
-	for (int i=0; i<9; i++) {
-		players.push_back(boost::shared_ptr<Player>(new Player()));
+		ForkPerSample fork;
+		benchmarks.measure("EnergyBullet::go", "move", scales[s], [&]() {fork.prepare(); }, [&](int n) {
+			for (int i=0; i<mobs.size(); i++) {
+				mobs[i]->go();
+			}
+			benchmarks.sink += bulletsToCollide.size();
+			bulletsToCollide.clear();
+		}, false);
+		benchmarks.measure("EnergyBullet::go", "collide", scales[s], [&]() {
+			fork.prepare();
+			for (int i=0; i<mobs.size(); i++) {
+				mobs[i]->go();
+			}
+		}, [&](int n) {
+			resolveBulletCollisions();
+		}, false);
+		fork.finish();
+		World empty;
+		swapWorld(empty);
 	}
+}
 
-	selectedPlayer = players.front();
+//Miners looking for the closest mass pile in a field of them, about one pile in each 50 pixel square
+void microbenchMinerTargeting(Microbenchmarks &benchmarks, const vector<int> &scales) {
+	cout << "Miner::targetClosestMassPile:" << endl;
+	for (int s=0; s<scales.size(); s++) {
+		int side = sqrt((float)scales[s]) * 50 / GRID_CELL_WIDTH;
+		for (int i=0; i<scales[s]; i++) {
+			massPiles.push_back(boost::shared_ptr<MassPile>(new MassPile(sf::Vector2i(rand()%side, rand()%side), MAP_MASSPILE_MASS)));
+		}
+		massPilesVersion++;
+		vector<boost::shared_ptr<Miner>> miners;
+		for (int i=0; i<64; i++) {
+			miners.push_back(boost::dynamic_pointer_cast<Miner, Building>(createBuilding(BUILDINGTYPE_MINER, boost::weak_ptr<Player>(), sf::Vector2i(rand()%side, rand()%side), false)));
+		}
+		benchmarks.measure("Miner::targetClosestMassPile", "field", scales[s], []() {}, [&](int n) {
+			for (int i=0; i<n; i++) {
+				miners[i%miners.size()]->targetClosestMassPile();
+				benchmarks.sink += (miners[i%miners.size()]->getTarget() != NULL);
+			}
+		}, true);
+		World empty;
+		swapWorld(empty);
+	}
+}
 
-	boost::shared_ptr<Nexus> nexus = boost::shared_ptr<Nexus>(new Nexus(players[0], sf::Vector2i(15,15), false));
-	nexus->magicallyComplete();
-	nexus->depositMass(3000);
+int runMicrobenchmarks(int argc, char **argv) {
+	string filter, jsonPath;
+	for (int i=0; i+1<argc; i+=2) {
+		if (string(argv[i]) == "--filter")
+			filter = argv[i+1];
+		else if (string(argv[i]) == "--json")
+			jsonPath = argv[i+1];
+	}
+	grid.setup(GRID_CELL_WIDTH);
+	srand(1);
+	Microbenchmarks benchmarks(filter);
+	int findScales[] = {1000, 10000, 100000, 1000000};
+	int graphScales[] = {256, 1024, 4096};
+	int networkScales[] = {256, 1024, 4096};
+	int bulletScales[] = {1000, 10000, 100000};
+	int pileScales[] = {1000, 10000, 100000, 1000000};
+	if (benchmarks.wants("findNearbyBuildings"))
+		microbenchFindNearbyBuildings(benchmarks, vector<int>(findScales, findScales + 4));
+	if (benchmarks.wants("reactToDestroyedNodes"))
+		microbenchDestroyedNodes(benchmarks, vector<int>(graphScales, graphScales + 3));
+	if (benchmarks.wants("Network::go"))
+		microbenchNetworkGo(benchmarks, vector<int>(networkScales, networkScales + 3));
+	if (benchmarks.wants("EnergyBullet::go"))
+		microbenchBullets(benchmarks, vector<int>(bulletScales, bulletScales + 3));
+	if (benchmarks.wants("Miner::targetClosestMassPile"))
+		microbenchMinerTargeting(benchmarks, vector<int>(pileScales, pileScales + 4));
+	if (!jsonPath.empty() && !benchmarks.writeJson(jsonPath)) {
+		cerr << "Couldn't write " << jsonPath << endl;
+		return 1;
+	}
+	return (benchmarks.sink == -1) ? 1 : 0;//never, but the compiler can't know
+}
 
-	buildings.push_back(nexus);
-	selectedPlayer->ownedBuildings.push_back(nexus);
+//Divergence checker, run headless with "noderush --check [ticks]". The same world is simulated under two
+//configurations that should give identical results, hashing the state (in fixed point) after every tick
+//and chaining each tick's hash onto the ones before, and the first tick and entity where they differ is
+//reported.
 
-	players[0]->network = boost::shared_ptr<Network>(new Network(players[0], nexus));
+struct SimulationConfig {
+	string name;
+	SimulationShortcuts shortcuts;
+	bool ownThread;//simulated on a thread of its own rather than the checker's
+	SimulationConfig(string _name) {
+		name = _name;
+		ownThread = false;
+	}
+};
 
-	mode = MODE_NULL;
-	buildType = BUILDINGTYPE_NEXUS;
+struct CheckRun {
+	World world;
+	SimulationConfig config;
+	int ticks;
+	vector<unsigned int> tickHashes;//hash of the state after each tick, chained onto the ticks before
+	vector<EntityHash> entities;//after the last tick
+	CheckRun(const SimulationConfig &_config, int _ticks) : config(_config) {
+		ticks = _ticks;
+	}
+};
 
-	for (int i=0; i<20; i++) {
-		massPiles.push_back(boost::shared_ptr<MassPile>(new MassPile(sf::Vector2i(rand()%100, rand()%100), 1000)));
+void simulateCheckRun(CheckRun &run) {
+	swapWorld(run.world);
+	SimulationShortcuts savedShortcuts = simulationShortcuts;
+	simulationShortcuts = run.config.shortcuts;
+	unsigned int hash = HASH_SEED;
+	for (int i=0; i<run.ticks; i++) {
+		go();
+		hash = hashValue(hash, hashWorldState(false));
+		run.tickHashes.push_back(hash);
 	}
+	hashEntities(run.entities, false);
+	simulationShortcuts = savedShortcuts;
+	swapWorld(run.world);
 }
 
-void changeMode(int newMode) {
-	if (newMode == MODE_BUILD) {
-		window.setMouseCursorVisible(false);
-		cursorBuilding = boost::shared_ptr<Building>(new Nexus(boost::shared_ptr<Player>(), sf::Vector2i(0,0), true));
-	}
-	else {
-		window.setMouseCursorVisible(true);
-	}
-	mode = newMode;
+//Simulates a fork of this thread's world
+void runCheck(CheckRun &run) {
+	run.world = forkWorld();
+	if (run.config.ownThread)
+		thread(simulateCheckRun, ref(run)).join();
+	else
+		simulateCheckRun(run);
 }
 
-void changeBuildType(int newBuildType) {
-	if (newBuildType == BUILDINGTYPE_NEXUS) {
-		cursorBuilding = boost::shared_ptr<Nexus>(new Nexus(boost::shared_ptr<Player>(), cursorBuilding->getGridPoint(), true));
+//Returns false if a and b diverge within ticks ticks of this thread's world
+bool checkDivergence(const SimulationConfig &a, const SimulationConfig &b, int ticks) {
+	cout << a.name << " vs " << b.name << ": ";
+	CheckRun runA(a, ticks), runB(b, ticks);
+	runCheck(runA);
+	runCheck(runB);
+	int divergedTick = -1;
+	for (int i=0; i<ticks; i++) {
+		if (runA.tickHashes[i] != runB.tickHashes[i]) {
+			divergedTick = i;
+			break;
+		}
 	}
-	else if (newBuildType == BUILDINGTYPE_NODE) {
-		cursorBuilding = boost::shared_ptr<Node>(new Node(boost::shared_ptr<Player>(), cursorBuilding->getGridPoint(), true));
+	if (divergedTick < 0) {
+		cout << "identical for " << ticks << " ticks" << endl;
+		return true;
 	}
-	else if (newBuildType == BUILDINGTYPE_GENERATOR) {
-		cursorBuilding = boost::shared_ptr<Generator>(new Generator(boost::shared_ptr<Player>(), cursorBuilding->getGridPoint(), true));
+
+	//Only tick hashes were kept, so play both up to the tick they diverged on again to find the entity
+	CheckRun replayA(a, divergedTick+1), replayB(b, divergedTick+1);
+	runCheck(replayA);
+	runCheck(replayB);
+	vector<EntityHash> &entitiesA = replayA.entities, &entitiesB = replayB.entities;
+	int entity = 0;
+	while (entity < entitiesA.size() && entity < entitiesB.size() && entitiesA[entity].kind == entitiesB[entity].kind &&
+		   entitiesA[entity].id == entitiesB[entity].id && entitiesA[entity].hash == entitiesB[entity].hash) {
+		entity++;
 	}
-	else if (newBuildType == BUILDINGTYPE_MINER) {
-		cursorBuilding = boost::shared_ptr<Miner>(new Miner(boost::shared_ptr<Player>(), cursorBuilding->getGridPoint(), true));
+	cout << "diverged on tick " << frameNum + divergedTick << endl;
+	if (entity >= entitiesA.size() && entity >= entitiesB.size()) {
+		cout << "  but no entity differs on replay" << endl;//the tick hashes collided, or the replay didn't repeat the run
+		return false;
 	}
-	else if (newBuildType == BUILDINGTYPE_ENERGYCANNON) {
-		cursorBuilding = boost::shared_ptr<EnergyCannon>(new EnergyCannon(boost::shared_ptr<Player>(), cursorBuilding->getGridPoint(), true));
+	const EntityHash &diverged = (entity < entitiesA.size()) ? entitiesA[entity] : entitiesB[entity];
+
+	swapWorld(replayA.world);
+	cout << "  " << a.name << ": " << describeEntity(diverged.kind, diverged.id) << endl;
+	swapWorld(replayA.world);
+	swapWorld(replayB.world);
+	cout << "  " << b.name << ": " << describeEntity(diverged.kind, diverged.id) << endl;
+	swapWorld(replayB.world);
+	return false;
+}
+
+int runChecks(int ticks) {
+	grid.setup(GRID_CELL_WIDTH);
+	createContestedWorld(500);
+
+	SimulationConfig standard("standard");
+	SimulationConfig everyBuilding("every building every tick");
+	everyBuilding.shortcuts.sleepingBuildings = false;
+	SimulationConfig everyEconomy("economy every tick");
+	everyEconomy.shortcuts.idleEconomy = false;
+	SimulationConfig otherThread("on another thread");
+	otherThread.ownThread = true;
+
+	int divergences = 0;
+	divergences += !checkDivergence(standard, everyBuilding, ticks);
+	divergences += !checkDivergence(standard, everyEconomy, ticks);
+	divergences += !checkDivergence(standard, otherThread, ticks);
+
+	World empty;
+	swapWorld(empty);
+	return (divergences > 0) ? 1 : 0;
+}
+
+//Headless runner, "noderush --headless [bots] [ticks] [spacing]". Bots play each other on a grid of bases
+//spacing cells apart, with the simulation running as fast as it can, and the time the ticks take is
+//reported, for profiling under sustained late-game load.
+
+//Creates this thread's world with a base for each bot
+void createBotWorld(int botCount, int spacing) {
+	MapSettings settings;
+	int columns = ceil(sqrt((float)botCount));
+	settings.width = columns * spacing;
+	settings.height = ((botCount + columns - 1) / columns) * spacing;
+	settings.massPileSpacing = spacing * BOT_MASS_PILE_SPACING;
+	settings.nexusSites = botCount;
+	MapLayout layout = generateMap(settings);
+
+	for (int i=0; i<botCount; i++) {
+		players.push_back(boost::shared_ptr<Player>(new Player(i)));
 	}
-	else {
-		assert(false);
+	for (int i=0; i<botCount; i++) {
+		placeBuilding(players[i], BUILDINGTYPE_NEXUS, layout.nexusSites[i]);
+		boost::dynamic_pointer_cast<Nexus, Building>(players[i]->ownedBuildings[0])->depositMass(BOT_STARTING_MASS);
 	}
-	buildType = newBuildType;
+	addMassPiles(layout, BOT_MASS_PILE_MASS);
 }
 
-void createNewCursorBuilding() {
-	if (buildType == BUILDINGTYPE_NEXUS) {
-		cursorBuilding = boost::shared_ptr<Nexus>(new Nexus(boost::shared_ptr<Player>(), sf::Vector2i(0,0), true));
+int runHeadless(int botCount, int ticks, int spacing) {
+	grid.setup(GRID_CELL_WIDTH);
+	createBotWorld(botCount, spacing);
+	vector<Bot> bots;
+	for (int i=0; i<botCount; i++) {
+		bots.push_back(Bot(i, i+1));
+	}
+
+	if (!telemetryPath.empty() && !telemetry.open(telemetryPath))
+		cerr << "Not recording telemetry: " << telemetry.getError() << endl;
+	if (watchdogBudget > 0) {
+		stringstream origin;
+		origin << "headless " << botCount << " " << spacing;
+		watchdog.start(watchdogBudget, origin.str());
+	}
+
+	vector<Command> commands;
+	double botTime = 0, simTime = 0, slowestTick = 0;
+	double intervalBotTime = 0, intervalSimTime = 0;
+	int commandCount = 0;
+	int lastArenaGrowthTick = -1;
+	for (int t=0; t<ticks; t++) {
+		//Bots take turns to think, so they don't all do it on the same tick
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		commands.clear();
+		for (int i=0; i<bots.size(); i++) {
+			if ((frameNum + i) % BOT_THINK_INTERVAL == 0)
+				bots[i].think(commands);
+		}
+		for (int i=0; i<commands.size(); i++) {
+			executeCommand(commands[i]);
+			watchdog.recordCommand(commands[i]);
+		}
+		commandCount += commands.size();
+		double botTickTime = getMillisecondsSince(start);
+
+		watchdog.beginTick();
+		start = chrono::high_resolution_clock::now();
+		int arenaBlocks = frameArena.getBlockAllocations();
+		go();
+		double simTickTime = getMillisecondsSince(start);
+		watchdog.endTick(botTickTime, simTickTime);
+		if (frameArena.getBlockAllocations() != arenaBlocks)
+			lastArenaGrowthTick = frameNum;
+		TelemetryTiming timing;
+		timing.inputMilliseconds = botTickTime;
+		timing.goMilliseconds = simTickTime;
+		telemetry.record(timing);
+
+		intervalBotTime += botTickTime;
+		intervalSimTime += simTickTime;
+		slowestTick = max(slowestTick, simTickTime);
+		if ((t+1) % HEADLESS_REPORT_INTERVAL == 0 || t+1 == ticks) {
+			int interval = (t % HEADLESS_REPORT_INTERVAL) + 1;
+			int ghosts = 0, playersLeft = 0;
+			for (int i=0; i<players.size(); i++) {
+				ghosts += players[i]->ghostBuildings.size();
+				for (int j=0; j<players[i]->ownedBuildings.size(); j++) {
+					if (players[i]->ownedBuildings[j]->getType() == BUILDINGTYPE_NEXUS) {
+						playersLeft++;
+						break;
+					}
+				}
+			}
+			cout << "tick " << frameNum << ": " << buildings.size() << " buildings, " << ghosts << " ghosts, " << mobs.size() << " mobs, "
+				 << worldChunks.getActiveChunkCount() << "/" << worldChunks.getChunkCount() << " chunks active, " << playersLeft << " players left; " << intervalSimTime/interval << " ms/tick simulating, " << intervalBotTime/interval << " ms/tick bots" << endl;
+			botTime += intervalBotTime;
+			simTime += intervalSimTime;
+			intervalBotTime = intervalSimTime = 0;
+		}
 	}
-	else if (buildType == BUILDINGTYPE_NODE) {
-		cursorBuilding = boost::shared_ptr<Node>(new Node(boost::shared_ptr<Player>(), sf::Vector2i(0,0), true));
+	cout << botCount << " bots, " << ticks << " ticks, " << commandCount << " commands: " << simTime/ticks << " ms/tick simulating (slowest "
+		 << slowestTick << "), " << botTime/ticks << " ms/tick bots" << endl;
+	cout << "frame arena: " << frameArena.getHighWaterMark() << " bytes high water, " << frameArena.getBlockAllocations() << " heap blocks, ";
+	if (lastArenaGrowthTick >= 0)
+		cout << "the last on tick " << lastArenaGrowthTick << endl;
+	else
+		cout << "none while ticking" << endl;
+	cout << "memory:" << endl;
+	describeMemoryUsage(cout);
+	if (telemetry.isOpen()) {
+		cout << "telemetry: " << telemetry.getTickCount() << " ticks recorded to " << telemetryPath << ", " << telemetry.getMicrosecondsPerTick() << " us/tick" << endl;
+		telemetry.close();
+	}
+	watchdog.finish();
+	if (watchdog.isActive())
+		cout << "watchdog: " << watchdog.getSlowTicks() << " ticks over " << watchdogBudget << " ms, " << watchdog.getBundlesWritten() << " bundles written, "
+			 << watchdog.getCheckpointCount() << " checkpoints (slowest " << watchdog.getSlowestCheckpointMilliseconds() << " ms, between ticks)" << endl;
+	return 0;
+}
+
+//Sharded simulation benchmark. The world is cut into vertical strips, each simulated by its own worker
+//process; "noderush --shard-bench <regions>" launches the workers and relays their traffic. Every tick a
+//worker tells each neighbour about its buildings within SHARD_GHOST_WIDTH of their border (replicas, which
+//are in the neighbour's buildings list for targeting and collisions but never run), hands over bullets
+//that have crossed the border, and reports damage its bullets did to the neighbour's replicas. No worker
+//starts tick t+1 until both neighbours' messages for it have arrived, so the result doesn't depend on
+//timing. Networks aren't sharded, but node connections are: a building connects to its owner's buildings
+//within NODE_CONNECTION_MAXLENGTH when one of the two is a node, replicas included, so edges across a
+//border are the ones a single process would find (SHARD_GHOST_WIDTH covers the connection range). In place
+//of an economy, each worker feeds its buildings that are connected to a live node.
+//
+//The benchmark checks every region count against the single region run. Connections must match it exactly;
+//the combat outcome can't, and the number of buildings that end differently is reported. A bullet hitting
+//a replica damages the real building a tick later, when the damage message arrives, and cannons pick
+//between equally close targets by buildings order, which depends on how the world was cut.
+
+const int SHARD_MESSAGE_CONFIG = 0;
+const int SHARD_MESSAGE_TICK = 1;
+const int SHARD_MESSAGE_DONE = 2;
+
+class ShardWorker {
+	int region;
+	int regionCount;
+	float regionLeft, regionRight;
+
+	sf::TcpSocket socket;//to the coordinator
+
+	vector<boost::shared_ptr<Building>> localBuildings;
+	unordered_map<unsigned int, boost::shared_ptr<Building>> localBuildingsById;
+	unordered_map<Building*, unsigned int> buildingIds;
+	unordered_map<unsigned int, boost::shared_ptr<Building>> replicas;
+	unordered_map<unsigned int, float> replicaHealthBeforeTick;
+	unordered_map<Building*, vector<boost::shared_ptr<Building>>> connections;//of each local building, local or replica
+
+	struct Outbox {
+		int neighbour;
+		unordered_map<unsigned int, float> sentHealth;//replicas the neighbour has, by id
+		sf::Packet bullets, replicaUpdates, replicaRemovals, damage;
+		sf::Uint32 bulletCount, replicaUpdateCount, replicaRemovalCount, damageCount;
+	};
+	vector<Outbox> outboxes;
+	vector<sf::Packet> earlyMessages;//a neighbour can be one tick ahead of us
+
+	int getRegionAt(float x) {
+		int worldWidth = SHARD_WORLD_WIDTH*GRID_CELL_WIDTH;
+		return max(0, min(regionCount-1, (int)floor(x * regionCount / worldWidth)));
+	}
+	Outbox *getOutbox(int neighbour) {
+		for (int i=0; i<outboxes.size(); i++) {
+			if (outboxes[i].neighbour == neighbour)
+				return &outboxes[i];
+		}
+		return 0;
+	}
+	void clearOutboxes() {
+		for (int i=0; i<outboxes.size(); i++) {
+			outboxes[i].bullets.clear();
+			outboxes[i].replicaUpdates.clear();
+			outboxes[i].replicaRemovals.clear();
+			outboxes[i].damage.clear();
+			outboxes[i].bulletCount = outboxes[i].replicaUpdateCount = outboxes[i].replicaRemovalCount = outboxes[i].damageCount = 0;
+		}
 	}
-	else if (buildType == BUILDINGTYPE_GENERATOR) {
-		cursorBuilding = boost::shared_ptr<Generator>(new Generator(boost::shared_ptr<Player>(), sf::Vector2i(0,0), true));
+	bool canConnect(Building *a, Building *b) {
+		if (a->getOwnerId() != b->getOwnerId())
+			return false;
+		if (a->getType() != BUILDINGTYPE_NODE && b->getType() != BUILDINGTYPE_NODE)
+			return false;
+		return getMagnitude(a->getCenterPos() - b->getCenterPos()) < NODE_CONNECTION_MAXLENGTH;
+	}
+	//Forgets connections to dead buildings, and says whether a live node is left
+	bool isConnectedToLiveNode(Building *building) {
+		vector<boost::shared_ptr<Building>> &connected = connections[building];
+		connected.erase(remove_if(connected.begin(), connected.end(),
+								  [](const boost::shared_ptr<Building> &b) {return b->isDead(); }),
+								  connected.end());
+		for (int i=0; i<connected.size(); i++) {
+			if (connected[i]->getType() == BUILDINGTYPE_NODE)
+				return true;
+		}
+		return false;
 	}
-	else if (buildType == BUILDINGTYPE_MINER) {
-		cursorBuilding = boost::shared_ptr<Miner>(new Miner(boost::shared_ptr<Player>(), sf::Vector2i(0,0), true));
+	//Order independent, so that it sums over regions to the same value whichever way the world is cut
+	unsigned int hashConnections() {
+		unsigned int sum = 0;
+		for (int i=0; i<localBuildings.size(); i++) {
+			vector<boost::shared_ptr<Building>> &connected = connections[localBuildings[i].get()];
+			vector<unsigned int> ids;
+			for (int j=0; j<connected.size(); j++) {
+				ids.push_back(buildingIds[connected[j].get()]);
+			}
+			sort(ids.begin(), ids.end());
+			unsigned int hash = hashValue(HASH_SEED, buildingIds[localBuildings[i].get()]);
+			for (int j=0; j<ids.size(); j++) {
+				hash = hashValue(hash, ids[j]);
+			}
+			sum += hash;
+		}
+		return sum;
 	}
-	else if (buildType == BUILDINGTYPE_ENERGYCANNON) {
-		cursorBuilding = boost::shared_ptr<EnergyCannon>(new EnergyCannon(boost::shared_ptr<Player>(), sf::Vector2i(0,0), true));
+	//The same world is generated in every worker, which keeps the part in its region
+	void generateWorld(unsigned int seed) {
+		for (int i=0; i<2; i++) {
+			players.push_back(boost::shared_ptr<Player>(new Player(i)));
+		}
+		srand(seed);
+		for (unsigned int id=1; id<=SHARD_BUILDINGS; id++) {
+			sf::Vector2i gridPoint(rand()%(SHARD_WORLD_WIDTH-2), rand()%(SHARD_WORLD_HEIGHT-2));
+			int owner = rand()%2;
+			int type = (rand()%5 < 2) ? BUILDINGTYPE_ENERGYCANNON : BUILDINGTYPE_NODE;
+			boost::shared_ptr<Building> building = createBuilding(type, players[owner], gridPoint, false);
+			if (getRegionAt(building->getCenterPos().x) != region)
+				continue;
+			building->magicallyComplete();
+			addBuilding(building);
+			localBuildings.push_back(building);
+			localBuildingsById[id] = building;
+			buildingIds[building.get()] = id;
+		}
+		for (int i=0; i<localBuildings.size(); i++) {
+			for (int j=i+1; j<localBuildings.size(); j++) {
+				if (!canConnect(localBuildings[i].get(), localBuildings[j].get())) continue;
+				connections[localBuildings[i].get()].push_back(localBuildings[j]);
+				connections[localBuildings[j].get()].push_back(localBuildings[i]);
+			}
+		}
 	}
-	else {
-		assert(false);
+	void sendTickMessages(int tick) {
+		for (int i=0; i<outboxes.size(); i++) {
+			Outbox &outbox = outboxes[i];
+			sf::Packet packet;
+			packet << (sf::Uint8)SHARD_MESSAGE_TICK << (sf::Uint8)region << (sf::Uint8)outbox.neighbour << (sf::Uint32)tick;
+			packet << outbox.bulletCount;
+			packet.append(outbox.bullets.getData(), outbox.bullets.getDataSize());
+			packet << outbox.replicaUpdateCount;
+			packet.append(outbox.replicaUpdates.getData(), outbox.replicaUpdates.getDataSize());
+			packet << outbox.replicaRemovalCount;
+			packet.append(outbox.replicaRemovals.getData(), outbox.replicaRemovals.getDataSize());
+			packet << outbox.damageCount;
+			packet.append(outbox.damage.getData(), outbox.damage.getDataSize());
+
+			sf::Socket::Status status;
+			do {
+				status = socket.send(packet);
+			} while (status == sf::Socket::Partial);
+		}
+		clearOutboxes();
 	}
-}
+	void applyTickMessage(sf::Packet &packet) {
+		sf::Uint32 count;
 
-int frameNum(0);
+		packet >> count;
+		for (int i=0; i<count; i++) {
+			sf::Vector2f pos, targetPos;
+			sf::Uint8 owner;
+			packet >> pos.x >> pos.y >> targetPos.x >> targetPos.y >> owner;
+			addMob(boost::shared_ptr<EnergyBullet>(new EnergyBullet(pos, players[owner], targetPos)));
+		}
 
-void go() {
-	if (mode == MODE_BUILD) {
-		//update cursorBuilding's position
-		sf::Vector2i gridPoint = grid.getClosestGridPoint(sf::Mouse::getPosition());
-		cursorBuilding->setGridPoint(gridPoint);
+		packet >> count;
+		for (int i=0; i<count; i++) {
+			sf::Uint32 id;
+			sf::Uint8 type, owner;
+			sf::Int16 x, y;
+			float health;
+			packet >> id >> type >> owner >> x >> y >> health;
+			boost::shared_ptr<Building> &replica = replicas[id];
+			if (!replica) {
+				replica = createBuilding(type, players[owner], sf::Vector2i(x, y), false);
+				replica->magicallyComplete();
+				buildingIds[replica.get()] = id;
+				addBuilding(replica, false);//never runs; its region runs the real one
+				for (int j=0; j<localBuildings.size(); j++) {
+					if (!localBuildings[j]->isDead() && canConnect(localBuildings[j].get(), replica.get()))
+						connections[localBuildings[j].get()].push_back(replica);
+				}
+			}
+			replica->setHealth(health);
+		}
+
+		packet >> count;
+		for (int i=0; i<count; i++) {
+			sf::Uint32 id;
+			packet >> id;
+			unordered_map<unsigned int, boost::shared_ptr<Building>>::iterator it = replicas.find(id);
+			if (it == replicas.end()) continue;
+			if (!it->second->isDead())
+				it->second->die();
+			buildingIds.erase(it->second.get());
+			replicas.erase(it);
+		}
+
+		packet >> count;
+		for (int i=0; i<count; i++) {
+			sf::Uint32 id;
+			float damage;
+			packet >> id >> damage;
+			unordered_map<unsigned int, boost::shared_ptr<Building>>::iterator it = localBuildingsById.find(id);
+			if (it != localBuildingsById.end() && !it->second->isDead())
+				it->second->takeDamage(damage);
+		}
 	}
+	//Blocks until both neighbours' messages for tick have arrived, then applies them in region order
+	bool receiveTickMessages(int tick) {
+		vector<sf::Packet> received(regionCount);
+		vector<sf::Packet> pending;
+		pending.swap(earlyMessages);
+		int remaining = outboxes.size();
+		while (remaining > 0) {
+			sf::Packet packet;
+			if (pending.size() > 0) {
+				packet = pending.back();
+				pending.pop_back();
+			}
+			else if (socket.receive(packet) != sf::Socket::Done)
+				return false;
+
+			sf::Packet header = packet;
+			sf::Uint8 type, from, to;
+			sf::Uint32 messageTick;
+			header >> type >> from >> to >> messageTick;
+			if (type != SHARD_MESSAGE_TICK || messageTick < tick || messageTick > tick+1 || from >= regionCount)
+				return false;
+			if (messageTick > tick) {
+				earlyMessages.push_back(packet);
+				continue;
+			}
+			received[from] = header;
+			remaining--;
+		}
+		for (int i=0; i<regionCount; i++) {
+			if (getOutbox(i))
+				applyTickMessage(received[i]);
+		}
+		return true;
+	}
+	//Queues everything the neighbours need to know about this tick
+	void collectBorderTraffic() {
+		//Damage done to replicas goes back to their owner
+		for (unordered_map<unsigned int, boost::shared_ptr<Building>>::iterator it = replicas.begin(); it != replicas.end(); it++) {
+			float damage = replicaHealthBeforeTick[it->first] - it->second->getHealth();
+			if (damage <= 0) continue;
+			Outbox *outbox = getOutbox(getRegionAt(it->second->getCenterPos().x));
+			outbox->damage << (sf::Uint32)it->first << damage;
+			outbox->damageCount++;
+		}
 
-	for (int i=0; i<buildings.size(); i++) {
-		buildings[i]->go();
+		//Bullets that have crossed a border move to that region
+		for (int i=0; i<mobs.size(); i++) {
+			EnergyBullet *bullet = dynamic_cast<EnergyBullet*>(mobs[i].get());
+			if (!bullet || bullet->isDead()) continue;
+			int bulletRegion = getRegionAt(bullet->getPos().x);
+			if (bulletRegion == region) continue;
+			Outbox *outbox = getOutbox(bulletRegion);
+			outbox->bullets << bullet->getPos().x << bullet->getPos().y << bullet->getTargetPos().x << bullet->getTargetPos().y << (sf::Uint8)bullet->getOwner()->id;
+			outbox->bulletCount++;
+			bullet->die();
+		}
+
+		//Local buildings near a border are replicated to the region on the other side
+		for (int i=0; i<outboxes.size(); i++) {
+			Outbox &outbox = outboxes[i];
+			float border = (outbox.neighbour < region) ? regionLeft : regionRight;
+			for (int j=0; j<localBuildings.size(); j++) {
+				boost::shared_ptr<Building> &building = localBuildings[j];
+				unsigned int id = buildingIds[building.get()];
+				unordered_map<unsigned int, float>::iterator sent = outbox.sentHealth.find(id);
+				if (building->isDead()) {
+					if (sent != outbox.sentHealth.end()) {
+						outbox.replicaRemovals << (sf::Uint32)id;
+						outbox.replicaRemovalCount++;
+						outbox.sentHealth.erase(sent);
+					}
+					continue;
+				}
+				if (fabs(building->getCenterPos().x - border) > SHARD_GHOST_WIDTH) continue;
+				if (sent != outbox.sentHealth.end() && sent->second == building->getHealth()) continue;
+
+				outbox.replicaUpdates << (sf::Uint32)id << (sf::Uint8)building->getType() << (sf::Uint8)building->getOwnerId();
+				outbox.replicaUpdates << (sf::Int16)building->getGridPoint().x << (sf::Int16)building->getGridPoint().y << building->getHealth();
+				outbox.replicaUpdateCount++;
+				outbox.sentHealth[id] = building->getHealth();
+			}
+		}
 	}
-	for (int i=0; i<players.size(); i++) {
-		if (players[i]->network)
-			players[i]->network->go();
+	unsigned int hashLocalState() {
+		unsigned int hash = HASH_SEED;
+		for (int i=0; i<localBuildings.size(); i++) {
+			hash = hashValue(hash, buildingIds[localBuildings[i].get()]);
+			hash = hashValue(hash, localBuildings[i]->isDead() ? 0.f : localBuildings[i]->getHealth());
+		}
+		for (int i=0; i<mobs.size(); i++) {
+			hash = hashValue(hash, mobs[i]->getPos().x);
+			hash = hashValue(hash, mobs[i]->getPos().y);
+		}
+		return hash;
 	}
+public:
+	int run(string address, unsigned short port) {
+		if (socket.connect(sf::IpAddress(address), port) != sf::Socket::Done)
+			return 1;
+
+		sf::Packet config;
+		sf::Uint8 type, configRegion, configRegionCount;
+		sf::Uint32 seed, ticks;
+		if (socket.receive(config) != sf::Socket::Done)
+			return 1;
+		config >> type >> configRegion >> configRegionCount >> seed >> ticks;
+		if (!config || type != SHARD_MESSAGE_CONFIG)
+			return 1;
+
+		region = configRegion;
+		regionCount = configRegionCount;
+		int worldWidth = SHARD_WORLD_WIDTH*GRID_CELL_WIDTH;
+		regionLeft = (float)worldWidth * region / regionCount;
+		regionRight = (float)worldWidth * (region+1) / regionCount;
+		for (int neighbour = region-1; neighbour <= region+1; neighbour += 2) {
+			if (neighbour < 0 || neighbour >= regionCount) continue;
+			Outbox outbox;
+			outbox.neighbour = neighbour;
+			outboxes.push_back(outbox);
+		}
+		clearOutboxes();
+
+		grid.setup(GRID_CELL_WIDTH);
+		generateWorld(seed);
+
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		collectBorderTraffic();
+		sendTickMessages(0);
+		unsigned int connectionsHash = 0;
+		for (int tick=0; tick<ticks; tick++) {
+			if (!receiveTickMessages(tick))
+				return 1;
+			if (tick == 0)
+				connectionsHash = hashConnections();//once the neighbours' replicas are in
+
+			for (unordered_map<unsigned int, boost::shared_ptr<Building>>::iterator it = replicas.begin(); it != replicas.end(); it++) {
+				replicaHealthBeforeTick[it->first] = it->second->getHealth();
+			}
+			for (int i=0; i<localBuildings.size(); i++) {
+				if (!localBuildings[i]->isDead() && localBuildings[i]->isActive() && isConnectedToLiveNode(localBuildings[i].get()))
+					localBuildings[i]->supplyEnergy(1);
+			}
 
-	for (int i=0; i<mobs.size(); i++) {
-		mobs[i]->go();
-	}
+			go();
 
-	for (int i=0; i<massPiles.size(); i++) {
-		massPiles[i]->go();
+			collectBorderTraffic();
+			for (int i=0; i<localBuildings.size(); i++) {
+				if (!localBuildings[i]->isDead()) continue;
+				localBuildingsById.erase(buildingIds[localBuildings[i].get()]);
+				connections.erase(localBuildings[i].get());
+			}
+			localBuildings.erase(remove_if(localBuildings.begin(), localBuildings.end(),
+								 [](boost::shared_ptr<Building> b) {return b->isDead(); }),
+								 localBuildings.end());
+			sendTickMessages(tick+1);
+		}
+		double elapsed = getMillisecondsSince(start);
+
+		sf::Packet done;
+		done << (sf::Uint8)SHARD_MESSAGE_DONE << (sf::Uint8)region << (sf::Uint32)hashLocalState() << (sf::Uint32)connectionsHash << (sf::Uint32)mobs.size() << elapsed;
+		done << (sf::Uint32)localBuildings.size();
+		for (int i=0; i<localBuildings.size(); i++) {
+			done << (sf::Uint32)buildingIds[localBuildings[i].get()] << localBuildings[i]->getHealth();
+		}
+		socket.send(done);
+		return 0;
 	}
+};
 
-	//remove anything that's dead
-	for (int i=0; i<players.size(); i++) {
-		players[i]->ownedBuildings.erase(remove_if(players[i]->ownedBuildings.begin(), players[i]->ownedBuildings.end(),
-										 [](boost::shared_ptr<Building> b) {return b->isDead(); }),
-										 players[i]->ownedBuildings.end());
-	}
-	buildings.erase(remove_if(buildings.begin(), buildings.end(),
-					[](boost::shared_ptr<Building> b) {return b->isDead(); }),
-					buildings.end());
-	mobs.erase(remove_if(mobs.begin(), mobs.end(),
-			   [](boost::shared_ptr<Mob> m) {return m->isDead(); }),
-			   mobs.end());
-	massPiles.erase(remove_if(massPiles.begin(), massPiles.end(),
-					[](boost::shared_ptr<MassPile> m) {return m->isDead(); }),
-					massPiles.end());
-	frameNum++;
+//Starts a worker process connecting back to us, without waiting for it
+void launchShardWorker(string executable, unsigned short port) {
+	stringstream command;
+#ifdef _WIN32
+	command << "start \"\" /B \"" << executable << "\" --shard-worker 127.0.0.1 " << port;
+#else
+	command << "\"" << executable << "\" --shard-worker 127.0.0.1 " << port << " &";
+#endif
+	system(command.str().c_str());
 }
 
-float framerate=0;
+//What a sharded run ended with, merged over the regions
+struct ShardRunResult {
+	unsigned int hash;//depends on the regions; only comparable between runs with the same region count
+	unsigned int connectionsHash;//the same whatever the region count
+	map<unsigned int, float> buildingHealth;//of the buildings left, by id
+};
 
-void draw() {
-	//draw connections
-	for (int i=0; i<buildings.size(); i++) {
-		if (boost::shared_ptr<NodeBaseClass> node = boost::dynamic_pointer_cast<NodeBaseClass, Building>(buildings[i])) {
-			node->drawConnections(&window, sf::Color(100, 100, 255));
-		}
-		if (boost::shared_ptr<Miner> miner = boost::dynamic_pointer_cast<Miner, Building>(buildings[i])) {
-			miner->drawTargetLine(&window);
-		}
+//Runs the benchmark world over regionCount worker processes, relaying their messages. Returns the ticks
+//per second achieved, or 0 if something went wrong.
+double runShardCoordinator(string executable, int regionCount, unsigned short port, int ticks, ShardRunResult *result) {
+	sf::TcpListener listener;
+	if (listener.listen(port) != sf::Socket::Done)
+		return 0;
+
+	vector<boost::shared_ptr<sf::TcpSocket>> workers;
+	for (int i=0; i<regionCount; i++) {
+		launchShardWorker(executable, port);
 	}
-	for (int i=0; i<buildings.size(); i++) {
-		buildings[i]->draw(&window);
+	while (workers.size() < regionCount) {
+		boost::shared_ptr<sf::TcpSocket> worker(new sf::TcpSocket());
+		if (listener.accept(*worker) != sf::Socket::Done)
+			return 0;
+		workers.push_back(worker);
+	}
+
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (int i=0; i<workers.size(); i++) {
+		sf::Packet config;
+		config << (sf::Uint8)SHARD_MESSAGE_CONFIG << (sf::Uint8)i << (sf::Uint8)regionCount << (sf::Uint32)1 << (sf::Uint32)ticks;
+		workers[i]->send(config);
+		workers[i]->setBlocking(false);
+	}
+
+	vector<unsigned int> hashes(regionCount);
+	vector<bool> workerFinished(regionCount, false);
+	result->connectionsHash = 0;
+	result->buildingHealth.clear();
+	int bulletsLeft = 0;
+	int finished = 0;
+	while (finished < regionCount) {
+		bool idle = true;
+		for (int i=0; i<workers.size(); i++) {
+			sf::Packet packet;
+			sf::Socket::Status status;
+			while ((status = workers[i]->receive(packet)) == sf::Socket::Done) {
+				idle = false;
+				sf::Uint8 type, from;
+				packet >> type >> from;
+				if (type == SHARD_MESSAGE_TICK) {
+					sf::Uint8 to;
+					packet >> to;
+					if (to >= regionCount)
+						return 0;
+					do {
+						status = workers[to]->send(packet);
+					} while (status == sf::Socket::Partial);
+				}
+				else if (type == SHARD_MESSAGE_DONE) {
+					sf::Uint32 hash, connectionsHash, bulletCount, buildingCount;
+					double elapsed;
+					packet >> hash >> connectionsHash >> bulletCount >> elapsed >> buildingCount;
+					for (int j=0; j<buildingCount; j++) {
+						sf::Uint32 id;
+						float health;
+						packet >> id >> health;
+						result->buildingHealth[id] = health;
+					}
+					if (!packet || from >= regionCount)
+						return 0;
+					hashes[from] = hash;
+					workerFinished[i] = true;
+					result->connectionsHash += connectionsHash;
+					bulletsLeft += bulletCount;
+					finished++;
+				}
+				packet.clear();
+			}
+			if ((status == sf::Socket::Disconnected || status == sf::Socket::Error) && !workerFinished[i])
+				return 0;
+		}
+		if (idle)
+			this_thread::yield();
 	}
-	for (int i=0; i<selectedPlayer->ghostBuildings.size(); i++) {
-		selectedPlayer->ghostBuildings[i]->draw(&window, sf::Color(170,170,170));
+	double seconds = getMillisecondsSince(start) / 1000;
+
+	result->hash = HASH_SEED;
+	for (int i=0; i<regionCount; i++) {
+		result->hash = hashValue(result->hash, hashes[i]);
 	}
-	for (int i=0; i<mobs.size(); i++) {
-		mobs[i]->draw(&window);
+	cout << "  " << regionCount << " regions: " << ticks/seconds << " ticks/s, " << result->buildingHealth.size() << " buildings and " << bulletsLeft << " bullets left, state hash " << result->hash << endl;
+	return ticks/seconds;
+}
+
+//How many buildings are left in only one of the runs, or with a different health
+int countBuildingsThatDiffer(const ShardRunResult &a, const ShardRunResult &b) {
+	int differ = 0;
+	for (map<unsigned int, float>::const_iterator it = a.buildingHealth.begin(); it != a.buildingHealth.end(); it++) {
+		map<unsigned int, float>::const_iterator other = b.buildingHealth.find(it->first);
+		if (other == b.buildingHealth.end() || other->second != it->second)
+			differ++;
 	}
-	for (int i=0; i<massPiles.size(); i++) {
-		massPiles[i]->draw(&window);
+	for (map<unsigned int, float>::const_iterator it = b.buildingHealth.begin(); it != b.buildingHealth.end(); it++) {
+		if (a.buildingHealth.find(it->first) == a.buildingHealth.end())
+			differ++;
 	}
+	return differ;
+}
 
-	if (mode == MODE_BUILD) {
-		cursorBuilding->draw(&window, sf::Color(100,100,100));
+//Scaling benchmark: the same world on 1, 2, 4... regions, each region count run twice to show that the
+//result is deterministic, and compared with the single region run, which is the single process result
+int runShardBenchmark(string executable, int maxRegions, int ticks) {
+	int maxUsefulRegions = (SHARD_WORLD_WIDTH*GRID_CELL_WIDTH) / SHARD_GHOST_WIDTH;//replicas only go to neighbours
+	cout << "sharded simulation, " << SHARD_BUILDINGS << " buildings, " << ticks << " ticks:" << endl;
+	double baseline = 0;
+	ShardRunResult singleRegion;
+	bool connectionsMatch = true;
+	unsigned short port = SHARD_DEFAULT_PORT;//a fresh port each run, as the last one may still be closing
+	for (int regionCount=1; regionCount <= min(maxRegions, maxUsefulRegions); regionCount *= 2) {
+		ShardRunResult first, second;
+		double ticksPerSecond = runShardCoordinator(executable, regionCount, port++, ticks, &first);
+		if (ticksPerSecond == 0 || runShardCoordinator(executable, regionCount, port++, ticks, &second) == 0) {
+			cerr << "Sharded run with " << regionCount << " regions failed" << endl;
+			return 1;
+		}
+		cout << "  ";
+		if (baseline == 0) {
+			baseline = ticksPerSecond;
+			singleRegion = first;
+		}
+		else {
+			bool match = (first.connectionsHash == singleRegion.connectionsHash);
+			connectionsMatch &= match;
+			cout << (match ? "connections match" : "connections DIFFER from") << " one region, " << countBuildingsThatDiffer(first, singleRegion)
+				 << " of " << singleRegion.buildingHealth.size() << " buildings end differently; ";
+		}
+		bool deterministic = (first.hash == second.hash && first.connectionsHash == second.connectionsHash);
+		cout << "speedup " << ticksPerSecond/baseline << (deterministic ? ", deterministic" : ", NOT deterministic") << endl;
 	}
+	return connectionsMatch ? 0 : 1;
+}
 
-	//draw debug info
-	sf::Text text;
-	text.setFont(font);
-	text.setCharacterSize(12);
-	text.setColor(sf::Color::White);
+int main (int argc, char **argv) {
+	//"--telemetry <file>" and "--watchdog <milliseconds>" can come before any of the modes below; they're
+	//taken out of the arguments
+	while (argc > 2 && (string(argv[1]) == "--telemetry" || string(argv[1]) == "--watchdog")) {
+		if (string(argv[1]) == "--telemetry")
+			telemetryPath = argv[2];
+		else
+			watchdogBudget = atof(argv[2]);
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc > 1 && string(argv[1]) == "--bench")
+		return runBenchmarks();
+	if (argc > 1 && string(argv[1]) == "--microbench")
+		return runMicrobenchmarks(argc - 2, argv + 2);
+	if (argc > 2 && string(argv[1]) == "--telemetry-read")
+		return readTelemetry(argv[2]);
+	if (argc > 2 && string(argv[1]) == "--replay")
+		return replaySlowTick(argv[2]);
+	if (argc > 1 && string(argv[1]) == "--check")
+		return runChecks((argc > 2) ? atoi(argv[2]) : CHECK_TICKS);
+	if (argc > 1 && string(argv[1]) == "--headless")
+		return runHeadless((argc > 2) ? atoi(argv[2]) : HEADLESS_DEFAULT_BOTS, (argc > 3) ? atoi(argv[3]) : HEADLESS_DEFAULT_TICKS,
+						   (argc > 4) ? atoi(argv[4]) : HEADLESS_DEFAULT_SPACING);
+	if (argc > 1 && string(argv[1]) == "--shard-bench")
+		return runShardBenchmark(argv[0], (argc > 2) ? atoi(argv[2]) : 8, (argc > 3) ? atoi(argv[3]) : SHARD_TICKS);
+	if (argc > 3 && string(argv[1]) == "--shard-worker")
+		return ShardWorker().run(argv[2], atoi(argv[3]));
+
+	//Lockstep multiplayer: "noderush --host <players> [port]" then "noderush --join <address> [port]" once
+	//per other player
+	if (argc > 2 && (string(argv[1]) == "--host" || string(argv[1]) == "--join")) {
+		unsigned short port = (argc > 3) ? atoi(argv[3]) : LOCKSTEP_DEFAULT_PORT;
+		unsigned int seed = time(NULL);
+		bool connected;
+		if (string(argv[1]) == "--host")
+			connected = lockstep.startHost(max(1, min(atoi(argv[2]), 9)), port, seed);
+		else
+			connected = lockstep.join(argv[2], port, &seed);
+		if (!connected) {
+			cerr << "Couldn't start a lockstep game on port " << port << endl;
+			return 1;
+		}
+		worldSeed = seed;//every peer must generate the same world
+	}
 
-	stringstream s;
+	//Spectating: "noderush --serve [port]" plays as usual and streams to spectators, who connect with
+	//"noderush --spectate <address> [port]"
+	if (argc > 1 && string(argv[1]) == "--serve") {
+		unsigned short port = (argc > 2) ? atoi(argv[2]) : SPECTATOR_DEFAULT_PORT;
+		if (!spectatorServer.start(port)) {
+			cerr << "Couldn't listen for spectators on port " << port << endl;
+			return 1;
+		}
+	}
+	else if (argc > 2 && string(argv[1]) == "--spectate") {
+		unsigned short port = (argc > 3) ? atoi(argv[3]) : SPECTATOR_DEFAULT_PORT;
+		if (!spectatorClient.connect(argv[2], port)) {
+			cerr << "Couldn't connect to " << argv[2] << " on port " << port << endl;
+			return 1;
+		}
+	}
 
-	if (framerate < 20)
-		s << "frame " << framerate << endl << endl;
+	if (lockstep.isActive() || spectatorServer.isActive() || spectatorClient.isActive())
+		window.create(sf::VideoMode(1280, 720, 32), "noderush", sf::Style::Default);
 	else
-		s << "frame " << ceil(framerate) << endl << endl;
-
-	if (selectedPlayer->network) {
-		s << "Network:" << endl << endl;
-
-		s << "Energy available: " << selectedPlayer->network->energyAvailable << endl;
-		s << "Energy requested: " << selectedPlayer->network->energyRequested << endl;
-		s << "Energy profit: " << selectedPlayer->network->energyProfit << endl;
+		//window.create(sf::VideoMode(1366, 768, 32), "noderush", sf::Style::Fullscreen);
+		window.create(sf::VideoMode(1920, 1080, 32), "noderush", sf::Style::Fullscreen);
+	setup();
 
-		s << "Mass available: " << selectedPlayer->network->massAvailable << endl;
-		s << "Mass spent: " << selectedPlayer->network->massSpent << endl;
+	mode = MODE_NULL;
+	buildType = BUILDINGTYPE_NEXUS;
+	selectedPlayerId = lockstep.getLocalPlayerId();
 
-		s << endl << endl;
+	simRunning = true;
+	thread simThread;
+	if (spectatorClient.isActive()) {
+		simThread = thread(runSpectator);
+	}
+	else {
+		simThread = thread(runSimulation);
 	}
-
-	text.setString(s.str());
-	text.setPosition(10,10);
-	window.draw(text);
-}
-
-int main (int argc, char **argv) {
-	setup();
-	start();
 
 	sf::Clock frameClock;
 
@@ -1269,6 +9231,12 @@ int main (int argc, char **argv) {
     while (window.isOpen()) {
 
         while (window.pollEvent(e)) {
+			if (spectatorClient.isActive()) {
+				//spectators can only look
+				if (e.type == sf::Event::Closed || (e.type == sf::Event::KeyPressed && e.key.code == sf::Keyboard::Escape))
+					window.close();
+				continue;
+			}
             switch (e.type) {
                 case sf::Event::Closed:
                     window.close();
@@ -1278,7 +9246,8 @@ int main (int argc, char **argv) {
 						if (e.text.unicode >= '0' && e.text.unicode <= '9') {
 							int num = e.text.unicode - '0';
 							
-							selectedPlayer = players[num];
+							selectedPlayerId = num;
+							pushCommand(COMMAND_SELECT_PLAYER, sf::Vector2i(), sf::Vector2f());
 						}
 					}
 					break;
@@ -1326,43 +9295,21 @@ int main (int argc, char **argv) {
 							changeMode(MODE_NULL);
 						}
 						else if (e.mouseButton.button == sf::Mouse::Left) {
-							cursorBuilding->setOwner(selectedPlayer);
-
-							if (boost::shared_ptr<Nexus> newNexus = boost::dynamic_pointer_cast<Nexus, Building>(cursorBuilding)) {
-								//check if this player already has a nexus
-								bool hasNexus = false;
-								for (int i=0; i<selectedPlayer->ownedBuildings.size(); i++) {
-									if (boost::dynamic_pointer_cast<Nexus, Building>(selectedPlayer->ownedBuildings[i])) {
-										hasNexus = true;
-										break;
-									}
-								}
-
-								if (!hasNexus) {
-									newNexus->unGhost();
-									newNexus->magicallyComplete();
-
-									buildings.push_back(newNexus);
-									selectedPlayer->ownedBuildings.push_back(newNexus);
-
-									selectedPlayer->network = boost::shared_ptr<Network>(new Network(selectedPlayer, newNexus));
-								}
-							}
-							selectedPlayer->ghostBuildings.push_back(cursorBuilding);
-							registerNewGhostBuilding(selectedPlayer, cursorBuilding);
-							createNewCursorBuilding();
+							if (mode == MODE_BUILD)
+								pushCommand(COMMAND_PLACE_BUILDING, cursorBuilding->getGridPoint(), sf::Vector2f());
 						}
 						else if (e.mouseButton.button == sf::Mouse::Middle) {
 							sf::Vector2f pos(e.mouseButton.x, e.mouseButton.y);
 
-							mobs.push_back(boost::shared_ptr<EnergyBullet>(new EnergyBullet(pos, selectedPlayer, sf::Vector2f(100,100))));
+							pushCommand(COMMAND_FIRE_BULLET, sf::Vector2i(), pos);
 						}
 					}
 					break;
             }
         }
 
-		go();
+		updateCamera();
+		snapshots.takeLatest();
 
         window.clear();
 
@@ -1378,5 +9325,8 @@ int main (int argc, char **argv) {
 
 		frameClock.restart();
     }
+
+	simRunning = false;
+	simThread.join();
     return 0;
 }
\ No newline at end of file